@@ -92,6 +92,8 @@ typedef struct
 static BOOLEAN WinDivertUse32Bit(void);
 static BOOLEAN WinDivertGetDriverFileName(LPWSTR sys_str);
 static SC_HANDLE WinDivertDriverInstall(VOID);
+static HANDLE WinDivertDeviceOpen(VOID);
+static BOOL WinDivertParamValid(WINDIVERT_PARAM param, UINT64 value);
 static BOOL WinDivertIoControl(HANDLE handle, DWORD code, UINT8 arg8,
     UINT64 arg, PVOID buf, UINT len, UINT *iolen);
 static BOOL WinDivertIoControlEx(HANDLE handle, DWORD code, UINT8 arg8,
@@ -117,6 +119,28 @@ static DWORD windivert_tls_idx;
  */
 static HMODULE module = NULL;
 
+/*
+ * Serializes driver installs.
+ */
+static SRWLOCK windivert_install_lock = SRWLOCK_INIT;
+
+/*
+ * Completion ports of handles that have run a receive engine.  A handle
+ * cannot be disassociated from a completion port, so the port is kept and
+ * reused by later engines until the handle is closed.
+ */
+struct windivert_port_s
+{
+    HANDLE handle;                      // WinDivert handle.
+    HANDLE port;                        // Associated completion port.
+    BOOL busy;                          // Port in use by an engine?
+    struct windivert_port_s *next;      // Next port.
+};
+typedef struct windivert_port_s *windivert_port_t;
+
+static windivert_port_t windivert_ports = NULL;
+static SRWLOCK windivert_ports_lock = SRWLOCK_INIT;
+
 /*
  * Dll Entry
  */
@@ -334,8 +358,10 @@ static BOOL WinDivertIoControl(HANDLE handle, DWORD code, UINT8 arg8,
         TlsSetValue(windivert_tls_idx, (LPVOID)event);
     }
 
+    // Setting the event's low-order bit keeps the completion off any
+    // completion port the handle is associated with (see the engine).
     memset(&overlapped, 0, sizeof(overlapped));
-    overlapped.hEvent = event;
+    overlapped.hEvent = (HANDLE)((ULONG_PTR)event | 1);
     if (!WinDivertIoControlEx(handle, code, arg8, arg, buf, len, iolen,
             &overlapped))
     {
@@ -353,283 +379,1575 @@ static BOOL WinDivertIoControl(HANDLE handle, DWORD code, UINT8 arg8,
 }
 
 /*
- * Perform an (overlapped) DeviceIoControl.
+ * Perform an (overlapped) DeviceIoControl.
+ */
+static BOOL WinDivertIoControlEx(HANDLE handle, DWORD code, UINT8 arg8,
+    UINT64 arg, PVOID buf, UINT len, UINT *iolen, LPOVERLAPPED overlapped)
+{
+    struct windivert_ioctl_s ioctl;
+    BOOL result;
+    DWORD iolen0;
+
+    ioctl.version = WINDIVERT_IOCTL_VERSION;
+    ioctl.magic   = WINDIVERT_IOCTL_MAGIC;
+    ioctl.arg8    = arg8;
+    ioctl.arg     = arg;
+    result = DeviceIoControl(handle, code, &ioctl, sizeof(ioctl), buf,
+        (DWORD)len, &iolen0, overlapped);
+    if (result && iolen != NULL)
+    {
+        *iolen = (UINT)iolen0;
+    }
+    return result;
+}
+
+/*
+ * Open the WinDivert device, installing the driver if it is missing.
+ */
+static HANDLE WinDivertDeviceOpen(VOID)
+{
+    HANDLE handle;
+    SC_HANDLE service;
+    DWORD err;
+
+    handle = CreateFile(L"\\\\.\\" WINDIVERT_DEVICE_NAME,
+        GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, INVALID_HANDLE_VALUE);
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+        return handle;
+    }
+    err = GetLastError();
+    if (err != ERROR_FILE_NOT_FOUND && err != ERROR_PATH_NOT_FOUND)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // Open failed because the device isn't installed; install it now.  Only
+    // one thread talks to the service manager, and the others retry the open
+    // once it is done.
+    AcquireSRWLockExclusive(&windivert_install_lock);
+    handle = CreateFile(L"\\\\.\\" WINDIVERT_DEVICE_NAME,
+        GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, INVALID_HANDLE_VALUE);
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+        goto WinDivertDeviceOpenExit;
+    }
+    SetLastError(0);
+    service = WinDivertDriverInstall();
+    if (service == NULL)
+    {
+        if (GetLastError() == 0)
+        {
+            SetLastError(ERROR_OPEN_FAILED);
+        }
+        goto WinDivertDeviceOpenExit;
+    }
+    handle = CreateFile(L"\\\\.\\" WINDIVERT_DEVICE_NAME,
+        GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, INVALID_HANDLE_VALUE);
+    err = GetLastError();
+
+    // Schedule the service to be deleted (once all handles are closed).
+    DeleteService(service);
+    CloseServiceHandle(service);
+    SetLastError(err);
+
+WinDivertDeviceOpenExit:
+    err = GetLastError();
+    ReleaseSRWLockExclusive(&windivert_install_lock);
+    SetLastError(err);
+    return handle;
+}
+
+/*
+ * Open a WinDivert handle.
+ */
+extern HANDLE WinDivertOpen(const char *filter, WINDIVERT_LAYER layer,
+    INT16 priority, UINT64 flags)
+{
+    return WinDivertOpenEx(filter, layer, priority, flags, NULL, 0);
+}
+
+/*
+ * Open a WinDivert handle with the given parameters set.
+ */
+extern HANDLE WinDivertOpenEx(const char *filter, WINDIVERT_LAYER layer,
+    INT16 priority, UINT64 flags, const WINDIVERT_PARAM_VALUE *params,
+    UINT paramsLen)
+{
+    windivert_ioctl_open_t config;
+    windivert_ioctl_filter_t object;
+    UINT obj_len, set_len, i;
+    ERROR comp_err;
+    HANDLE handle;
+    UINT32 priority32;
+
+    // Parameter checking.
+    if (!WINDIVERT_FLAGS_VALID(flags) || layer > WINDIVERT_LAYER_MAX ||
+        (params == NULL && paramsLen != 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+    priority32 = WINDIVERT_PRIORITY(priority);
+    if (priority32 < WINDIVERT_PRIORITY_MIN ||
+        priority32 > WINDIVERT_PRIORITY_MAX)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+    for (i = 0; i < paramsLen; i++)
+    {
+        if (!WinDivertParamValid(params[i].Param, params[i].Value))
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return INVALID_HANDLE_VALUE;
+        }
+    }
+
+    // The whole configuration is sent with the filter objects, so the
+    // handle is opened with a single request.
+    config = (windivert_ioctl_open_t)malloc(
+        sizeof(struct windivert_ioctl_open_s) +
+        WINDIVERT_FILTER_OBJECT_MAXSIZE);
+    if (config == NULL)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+    memset(config, 0, sizeof(struct windivert_ioctl_open_s));
+    config->flags    = flags;
+    config->layer    = (UINT32)layer;
+    config->priority = priority32;
+    for (i = 0; i < paramsLen; i++)
+    {
+        config->param_mask |= (1 << params[i].Param);
+        config->params[params[i].Param] = params[i].Value;
+    }
+
+    // Compile the filter:
+    object = (windivert_ioctl_filter_t)(config + 1);
+    handle = INVALID_HANDLE_VALUE;
+    comp_err = WinDivertCompileFilter(filter, (WINDIVERT_LAYER)layer, object,
+        &obj_len, &set_len);
+    if (IS_ERROR(comp_err))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        goto WinDivertOpenExit;
+    }
+
+#ifdef WINDIVERT_DEBUG
+    WinDivertFilterDump(object, obj_len);
+#endif
+
+    // Attempt to open the WinDivert device:
+    handle = WinDivertDeviceOpen();
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        goto WinDivertOpenExit;
+    }
+
+    // Configure the handle and start the filter:
+    if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_OPEN, 0,
+            (UINT64)obj_len, config, sizeof(struct windivert_ioctl_open_s) +
+            obj_len*sizeof(struct windivert_ioctl_filter_s) +
+            set_len*sizeof(struct windivert_ioctl_set_s), NULL))
+    {
+        goto WinDivertOpenError;
+    }
+
+    // Success!
+    goto WinDivertOpenExit;
+
+WinDivertOpenError:
+    CloseHandle(handle);
+    handle = INVALID_HANDLE_VALUE;
+
+WinDivertOpenExit:
+    free(config);
+    return handle;
+}
+
+/*
+ * Receive a WinDivert packet.
+ */
+extern BOOL WinDivertRecv(HANDLE handle, PVOID pPacket, UINT packetLen,
+    PWINDIVERT_ADDRESS addr, UINT *readlen)
+{
+    return WinDivertIoControl(handle, IOCTL_WINDIVERT_RECV, 0, (UINT64)addr,
+        pPacket, packetLen, readlen);
+}
+
+/*
+ * Receive a WinDivert packet.
+ */
+extern BOOL WinDivertRecvEx(HANDLE handle, PVOID pPacket, UINT packetLen,
+    UINT64 flags, PWINDIVERT_ADDRESS addr, UINT *readlen,
+    LPOVERLAPPED overlapped)
+{
+    if (!WINDIVERT_RECV_FLAGS_VALID(flags))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (overlapped == NULL)
+    {
+        return WinDivertIoControl(handle, IOCTL_WINDIVERT_RECV, (UINT8)flags,
+            (UINT64)addr, pPacket, packetLen, readlen);
+    }
+    else
+    {
+        return WinDivertIoControlEx(handle, IOCTL_WINDIVERT_RECV,
+            (UINT8)flags, (UINT64)addr, pPacket, packetLen, readlen,
+            overlapped);
+    }
+}
+
+/*
+ * Receive a batch of WinDivert packets.
+ */
+extern BOOL WinDivertRecvBatch(HANDLE handle, PVOID pBatch, UINT batchLen,
+    UINT *pCount, UINT *readlen)
+{
+    return WinDivertIoControl(handle, IOCTL_WINDIVERT_RECV_BATCH, 0,
+        (UINT64)pCount, pBatch, batchLen, readlen);
+}
+
+/*
+ * Receive a batch of WinDivert packets.
+ */
+extern BOOL WinDivertRecvBatchEx(HANDLE handle, PVOID pBatch, UINT batchLen,
+    UINT64 flags, UINT *pCount, UINT *readlen, LPOVERLAPPED overlapped)
+{
+    if (!WINDIVERT_RECV_FLAGS_VALID(flags))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (overlapped == NULL)
+    {
+        return WinDivertIoControl(handle, IOCTL_WINDIVERT_RECV_BATCH,
+            (UINT8)flags, (UINT64)pCount, pBatch, batchLen, readlen);
+    }
+    else
+    {
+        return WinDivertIoControlEx(handle, IOCTL_WINDIVERT_RECV_BATCH,
+            (UINT8)flags, (UINT64)pCount, pBatch, batchLen, readlen,
+            overlapped);
+    }
+}
+
+/*
+ * Send a WinDivert packet.
+ */
+extern BOOL WinDivertSend(HANDLE handle, PVOID pPacket, UINT packetLen,
+    PWINDIVERT_ADDRESS addr, UINT *writelen)
+{
+    return WinDivertIoControl(handle, IOCTL_WINDIVERT_SEND, 0, (UINT64)addr,
+        pPacket, packetLen, writelen);
+}
+
+/*
+ * Send a WinDivert packet.
+ */
+extern BOOL WinDivertSendEx(HANDLE handle, PVOID pPacket, UINT packetLen,
+    UINT64 flags, PWINDIVERT_ADDRESS addr, UINT *writelen,
+    LPOVERLAPPED overlapped)
+{
+    if (!WINDIVERT_SEND_FLAGS_VALID(flags))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (overlapped == NULL)
+    {
+        return WinDivertIoControl(handle, IOCTL_WINDIVERT_SEND, (UINT8)flags,
+            (UINT64)addr, pPacket, packetLen, writelen);
+    }
+    else
+    {
+        return WinDivertIoControlEx(handle, IOCTL_WINDIVERT_SEND,
+            (UINT8)flags, (UINT64)addr, pPacket, packetLen, writelen,
+            overlapped);
+    }
+}
+
+/*
+ * Send a batch of WinDivert packets.
+ */
+extern BOOL WinDivertSendBatch(HANDLE handle, PVOID pBatch, UINT batchLen,
+    UINT *writelen)
+{
+    return WinDivertIoControl(handle, IOCTL_WINDIVERT_SEND_BATCH, 0, 0,
+        pBatch, batchLen, writelen);
+}
+
+/*
+ * Send a batch of WinDivert packets.
+ */
+extern BOOL WinDivertSendBatchEx(HANDLE handle, PVOID pBatch, UINT batchLen,
+    UINT64 flags, UINT *writelen, LPOVERLAPPED overlapped)
+{
+    if (!WINDIVERT_SEND_FLAGS_VALID(flags))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (overlapped == NULL)
+    {
+        return WinDivertIoControl(handle, IOCTL_WINDIVERT_SEND_BATCH,
+            (UINT8)flags, 0, pBatch, batchLen, writelen);
+    }
+    else
+    {
+        return WinDivertIoControlEx(handle, IOCTL_WINDIVERT_SEND_BATCH,
+            (UINT8)flags, 0, pBatch, batchLen, writelen, overlapped);
+    }
+}
+
+/*
+ * Map shared RX and TX rings into a WinDivert handle.
+ */
+extern BOOL WinDivertRingMap(HANDLE handle, UINT slots, UINT slotLen,
+    PWINDIVERT_RING *pRxRing, PWINDIVERT_RING *pTxRing)
+{
+    struct windivert_ioctl_ring_s ring;
+    PWINDIVERT_RING rx_ring, tx_ring;
+    UINT64 size;
+    HANDLE event;
+    DWORD err;
+
+    if (pRxRing == NULL || pTxRing == NULL ||
+        slots < WINDIVERT_RING_SLOTS_MIN || slots > WINDIVERT_RING_SLOTS_MAX ||
+        (slots & (slots - 1)) != 0 ||
+        slotLen < WINDIVERT_RING_SLOT_LEN_MIN ||
+        slotLen > WINDIVERT_RING_SLOT_LEN_MAX ||
+        slotLen % sizeof(UINT64) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    size = WINDIVERT_RING_SIZE(slots, slotLen);
+    if (size > WINDIVERT_RING_SIZE_MAX)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    rx_ring = (PWINDIVERT_RING)VirtualAlloc(NULL, (SIZE_T)(2 * size),
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (rx_ring == NULL)
+    {
+        return FALSE;
+    }
+    event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (event == NULL)
+    {
+        err = GetLastError();
+        VirtualFree(rx_ring, 0, MEM_RELEASE);
+        SetLastError(err);
+        return FALSE;
+    }
+    tx_ring = (PWINDIVERT_RING)((UINT8 *)rx_ring + size);
+    rx_ring->Slots      = tx_ring->Slots      = slots;
+    rx_ring->SlotLength = tx_ring->SlotLength = slotLen;
+    rx_ring->Event      = (UINT64)event;
+
+    ring.addr     = (UINT64)rx_ring;
+    ring.event    = (UINT64)event;
+    ring.slots    = slots;
+    ring.slot_len = slotLen;
+    if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_MAP_RING, 0, 0, &ring,
+            sizeof(ring), NULL))
+    {
+        err = GetLastError();
+        CloseHandle(event);
+        VirtualFree(rx_ring, 0, MEM_RELEASE);
+        SetLastError(err);
+        return FALSE;
+    }
+    *pRxRing = rx_ring;
+    *pTxRing = tx_ring;
+    return TRUE;
+}
+
+/*
+ * Send all packets queued in the shared TX ring.
+ */
+extern BOOL WinDivertRingSend(HANDLE handle, UINT *pCount)
+{
+    UINT32 count;
+
+    if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_RING_SEND, 0, 0, &count,
+            sizeof(count), NULL))
+    {
+        return FALSE;
+    }
+    if (pCount != NULL)
+    {
+        *pCount = (UINT)count;
+    }
+    return TRUE;
+}
+
+/*
+ * Free shared rings.
+ */
+extern BOOL WinDivertRingFree(PWINDIVERT_RING rxRing)
+{
+    if (rxRing == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    CloseHandle((HANDLE)(ULONG_PTR)rxRing->Event);
+    return VirtualFree(rxRing, 0, MEM_RELEASE);
+}
+
+/*
+ * Return verdicts for held packets.
+ */
+extern BOOL WinDivertSetVerdict(HANDLE handle,
+    const WINDIVERT_VERDICT *pVerdicts, UINT count)
+{
+    if (pVerdicts == NULL || count == 0 || count > WINDIVERT_VERDICTS_MAX)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    return WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_VERDICT, 0, 0,
+        (PVOID)pVerdicts, count * sizeof(WINDIVERT_VERDICT), NULL);
+}
+
+/*
+ * Replace the filter of an open WinDivert handle.
+ */
+extern BOOL WinDivertSetFilter(HANDLE handle, const char *filter)
+{
+    windivert_ioctl_filter_t object;
+    UINT obj_len, set_len;
+    UINT64 layer;
+    ERROR comp_err;
+    BOOL result = FALSE;
+
+    // The filter is compiled for the layer the handle was opened with.
+    if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_GET_PARAM,
+            WINDIVERT_PARAM_LAYER, 0, &layer, sizeof(layer), NULL))
+    {
+        return FALSE;
+    }
+    object = (windivert_ioctl_filter_t)malloc(
+        WINDIVERT_FILTER_OBJECT_MAXSIZE);
+    if (object == NULL)
+    {
+        return FALSE;
+    }
+    comp_err = WinDivertCompileFilter(filter, (WINDIVERT_LAYER)layer, object,
+        &obj_len, &set_len);
+    if (IS_ERROR(comp_err))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        goto WinDivertSetFilterExit;
+    }
+
+#ifdef WINDIVERT_DEBUG
+    WinDivertFilterDump(object, obj_len);
+#endif
+
+    result = WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_FILTER, 0,
+        (UINT64)obj_len, object,
+        obj_len*sizeof(struct windivert_ioctl_filter_s) +
+        set_len*sizeof(struct windivert_ioctl_set_s), NULL);
+
+WinDivertSetFilterExit:
+    free(object);
+    return result;
+}
+
+/*
+ * Close a WinDivert handle.
+ */
+extern BOOL WinDivertClose(HANDLE handle)
+{
+    windivert_port_t *prev, port = NULL;
+    BOOL result;
+    DWORD err;
+
+    AcquireSRWLockExclusive(&windivert_ports_lock);
+    for (prev = &windivert_ports; *prev != NULL; prev = &(*prev)->next)
+    {
+        if ((*prev)->handle == handle)
+        {
+            port = *prev;
+            *prev = port->next;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&windivert_ports_lock);
+
+    result = CloseHandle(handle);
+    if (port != NULL)
+    {
+        err = GetLastError();
+        CloseHandle(port->port);
+        free(port);
+        SetLastError(err);
+    }
+    return result;
+}
+
+/*
+ * Test if a WinDivert parameter value is valid.
+ */
+static BOOL WinDivertParamValid(WINDIVERT_PARAM param, UINT64 value)
+{
+    switch ((int)param)
+    {
+        case WINDIVERT_PARAM_QUEUE_LEN:
+            if (value < WINDIVERT_PARAM_QUEUE_LEN_MIN ||
+                value > WINDIVERT_PARAM_QUEUE_LEN_MAX)
+            {
+                return FALSE;
+            }
+            break;
+        case WINDIVERT_PARAM_QUEUE_TIME:
+            if (value < WINDIVERT_PARAM_QUEUE_TIME_MIN ||
+                value > WINDIVERT_PARAM_QUEUE_TIME_MAX)
+            {
+                return FALSE;
+            }
+            break;
+        case WINDIVERT_PARAM_QUEUE_SIZE:
+            if (value < WINDIVERT_PARAM_QUEUE_SIZE_MIN ||
+                value > WINDIVERT_PARAM_QUEUE_SIZE_MAX)
+            {
+                return FALSE;
+            }
+            break;
+        case WINDIVERT_PARAM_QUEUE_MODE:
+            if (value > WINDIVERT_PARAM_QUEUE_MODE_MAX)
+            {
+                return FALSE;
+            }
+            break;
+        case WINDIVERT_PARAM_SNAPLEN:
+            if (value > WINDIVERT_PARAM_SNAPLEN_MAX)
+            {
+                return FALSE;
+            }
+            break;
+        case WINDIVERT_PARAM_OVERLOAD:
+            if (value > WINDIVERT_PARAM_OVERLOAD_MAX)
+            {
+                return FALSE;
+            }
+            break;
+        case WINDIVERT_PARAM_BATCH_COUNT:
+            if (value < WINDIVERT_PARAM_BATCH_COUNT_MIN ||
+                value > WINDIVERT_PARAM_BATCH_COUNT_MAX)
+            {
+                return FALSE;
+            }
+            break;
+        case WINDIVERT_PARAM_BATCH_TIME:
+            if (value < WINDIVERT_PARAM_BATCH_TIME_MIN ||
+                value > WINDIVERT_PARAM_BATCH_TIME_MAX)
+            {
+                return FALSE;
+            }
+            break;
+        case WINDIVERT_PARAM_SAMPLE_RATE:
+            if (value < WINDIVERT_PARAM_SAMPLE_RATE_MIN ||
+                value > WINDIVERT_PARAM_SAMPLE_RATE_MAX)
+            {
+                return FALSE;
+            }
+            break;
+        case WINDIVERT_PARAM_SAMPLE_MODE:
+            if (value > WINDIVERT_PARAM_SAMPLE_MODE_MAX)
+            {
+                return FALSE;
+            }
+            break;
+        case WINDIVERT_PARAM_RATE_LIMIT:
+            if (value > WINDIVERT_PARAM_RATE_LIMIT_MAX)
+            {
+                return FALSE;
+            }
+            break;
+        case WINDIVERT_PARAM_RATE_MODE:
+            if (value > WINDIVERT_PARAM_RATE_MODE_MAX)
+            {
+                return FALSE;
+            }
+            break;
+        default:
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Set a WinDivert parameter.
+ */
+extern BOOL WinDivertSetParam(HANDLE handle, WINDIVERT_PARAM param,
+    UINT64 value)
+{
+    if (!WinDivertParamValid(param, value))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    return WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_PARAM, (UINT8)param,
+        value, NULL, 0, NULL);
+}
+
+/*
+ * Get a WinDivert parameter.
+ */
+extern BOOL WinDivertGetParam(HANDLE handle, WINDIVERT_PARAM param,
+    UINT64 *pValue)
+{
+    switch ((int)param)
+    {
+        case WINDIVERT_PARAM_QUEUE_LEN: case WINDIVERT_PARAM_QUEUE_TIME:
+        case WINDIVERT_PARAM_QUEUE_SIZE: case WINDIVERT_PARAM_QUEUE_MODE:
+        case WINDIVERT_PARAM_SNAPLEN: case WINDIVERT_PARAM_OVERLOAD:
+        case WINDIVERT_PARAM_BATCH_COUNT: case WINDIVERT_PARAM_BATCH_TIME:
+        case WINDIVERT_PARAM_SAMPLE_RATE: case WINDIVERT_PARAM_SAMPLE_MODE:
+        case WINDIVERT_PARAM_RATE_LIMIT: case WINDIVERT_PARAM_RATE_MODE:
+            break;
+        default:
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+    }
+    return WinDivertIoControl(handle, IOCTL_WINDIVERT_GET_PARAM, (UINT8)param,
+        0, pValue, sizeof(UINT64), NULL);
+}
+
+/*
+ * Get a WinDivert handle's statistics.
+ */
+extern BOOL WinDivertGetStats(HANDLE handle, PWINDIVERT_STATS pStats)
+{
+    if (pStats == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    return WinDivertIoControl(handle, IOCTL_WINDIVERT_GET_STATS, 0, 0,
+        pStats, sizeof(WINDIVERT_STATS), NULL);
+}
+
+/*
+ * Asynchronous receive engine.
+ */
+#define WINDIVERT_ENGINE_KEY            1
+#define WINDIVERT_ENGINE_STOP_KEY       2
+#define WINDIVERT_ENGINE_SIZE_MAX       0x40000000
+
+struct windivert_engine_buf_s
+{
+    OVERLAPPED overlapped;              // Must be first.
+    UINT count;                         // Packets received.
+    UINT errors;                        // Consecutive receive errors.
+    PVOID data;                         // Batch buffer.
+};
+typedef struct windivert_engine_buf_s *windivert_engine_buf_t;
+
+struct windivert_engine_s
+{
+    HANDLE handle;                      // WinDivert handle.
+    HANDLE port;                        // Completion port.
+    HANDLE idle;                        // Set when no receive is posted.
+    SRWLOCK lock;                       // Orders posts against stop.
+    BOOL stop;                          // Engine is stopping.
+    volatile LONG posted;               // Buffers owned by the engine.
+    WINDIVERT_ENGINE_CALLBACK callback; // User callback.
+    PVOID context;                      // User callback context.
+    UINT buffer_len;                    // Length of each buffer.
+    UINT buffers;                       // Number of buffers.
+    UINT threads;                       // Number of threads.
+    windivert_engine_buf_t buf;         // Buffers.
+    PVOID data;                         // Buffer memory.
+    HANDLE thread[WINDIVERT_ENGINE_THREADS_MAX];
+};
+
+/*
+ * Return a buffer that will not be re-posted.
+ */
+static void WinDivertEngineRetire(PWINDIVERT_ENGINE engine)
+{
+    if (InterlockedDecrement(&engine->posted) == 0)
+    {
+        SetEvent(engine->idle);
+    }
+}
+
+/*
+ * (Re-)post a batch receive.
+ */
+static BOOL WinDivertEnginePost(PWINDIVERT_ENGINE engine,
+    windivert_engine_buf_t buf)
+{
+    BOOL result = FALSE;
+
+    AcquireSRWLockShared(&engine->lock);
+    if (!engine->stop)
+    {
+        memset(&buf->overlapped, 0, sizeof(buf->overlapped));
+        buf->count = 0;
+        result = WinDivertRecvBatchEx(engine->handle, buf->data,
+            engine->buffer_len, 0, &buf->count, NULL, &buf->overlapped);
+        result = (result || GetLastError() == ERROR_IO_PENDING);
+    }
+    ReleaseSRWLockShared(&engine->lock);
+    if (!result)
+    {
+        WinDivertEngineRetire(engine);
+    }
+    return result;
+}
+
+/*
+ * Engine thread.
+ */
+static DWORD WINAPI WinDivertEngineThread(LPVOID arg)
+{
+    PWINDIVERT_ENGINE engine = (PWINDIVERT_ENGINE)arg;
+    windivert_engine_buf_t buf;
+    LPOVERLAPPED overlapped;
+    ULONG_PTR key;
+    DWORD len, err;
+    BOOL result;
+
+    while (TRUE)
+    {
+        result = GetQueuedCompletionStatus(engine->port, &len, &key,
+            &overlapped, INFINITE);
+        if (overlapped == NULL)
+        {
+            if (!result || key == WINDIVERT_ENGINE_STOP_KEY)
+            {
+                return 0;
+            }
+            continue;
+        }
+
+        // Ignore completions of any other overlapped I/O on the handle.
+        buf = (windivert_engine_buf_t)overlapped;
+        if (key != WINDIVERT_ENGINE_KEY || buf < engine->buf ||
+            buf >= engine->buf + engine->buffers)
+        {
+            continue;
+        }
+
+        if (result)
+        {
+            buf->errors = 0;
+            engine->callback(engine->context, buf->data, (UINT)len,
+                buf->count);
+        }
+        else
+        {
+            // Cancelled or closed receives are retired.  Any other error is
+            // reported to the callback, and the receive is retried with an
+            // increasing back-off until it fails too many times in a row.
+            err = GetLastError();
+            if (err == ERROR_OPERATION_ABORTED ||
+                err == ERROR_INVALID_HANDLE)
+            {
+                WinDivertEngineRetire(engine);
+                continue;
+            }
+            SetLastError(err);
+            engine->callback(engine->context, NULL, 0, 0);
+            buf->errors++;
+            if (buf->errors >= WINDIVERT_ENGINE_ERRORS_MAX)
+            {
+                WinDivertEngineRetire(engine);
+                continue;
+            }
+            Sleep(1 << buf->errors);
+        }
+        WinDivertEnginePost(engine, buf);
+    }
+}
+
+/*
+ * Get the completion port of a handle for an engine, associating the handle
+ * with a new port on first use.
+ */
+static HANDLE WinDivertEnginePortAcquire(HANDLE handle)
+{
+    windivert_port_t port;
+    HANDLE result = NULL;
+
+    AcquireSRWLockExclusive(&windivert_ports_lock);
+    for (port = windivert_ports; port != NULL; port = port->next)
+    {
+        if (port->handle == handle)
+        {
+            break;
+        }
+    }
+    if (port != NULL)
+    {
+        if (port->busy)
+        {
+            // Engines on the same port would consume each other's
+            // completions.
+            SetLastError(ERROR_BUSY);
+            goto WinDivertEnginePortAcquireExit;
+        }
+        port->busy = TRUE;
+        result = port->port;
+        goto WinDivertEnginePortAcquireExit;
+    }
+
+    port = (windivert_port_t)malloc(sizeof(struct windivert_port_s));
+    if (port == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        goto WinDivertEnginePortAcquireExit;
+    }
+    port->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+    if (port->port == NULL)
+    {
+        free(port);
+        goto WinDivertEnginePortAcquireExit;
+    }
+    if (CreateIoCompletionPort(handle, port->port, WINDIVERT_ENGINE_KEY,
+            0) == NULL)
+    {
+        CloseHandle(port->port);
+        free(port);
+        goto WinDivertEnginePortAcquireExit;
+    }
+    port->handle = handle;
+    port->busy   = TRUE;
+    port->next   = windivert_ports;
+    windivert_ports = port;
+    result = port->port;
+
+WinDivertEnginePortAcquireExit:
+    ReleaseSRWLockExclusive(&windivert_ports_lock);
+    return result;
+}
+
+/*
+ * Return a handle's completion port; it stays associated with the handle
+ * until WinDivertClose().
+ */
+static void WinDivertEnginePortRelease(HANDLE handle)
+{
+    windivert_port_t port;
+
+    AcquireSRWLockExclusive(&windivert_ports_lock);
+    for (port = windivert_ports; port != NULL; port = port->next)
+    {
+        if (port->handle == handle)
+        {
+            port->busy = FALSE;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&windivert_ports_lock);
+}
+
+/*
+ * Stop engine threads and free engine resources.
+ */
+static void WinDivertEngineDestroy(PWINDIVERT_ENGINE engine)
+{
+    UINT i;
+
+    for (i = 0; i < engine->threads; i++)
+    {
+        PostQueuedCompletionStatus(engine->port, 0,
+            WINDIVERT_ENGINE_STOP_KEY, NULL);
+    }
+    if (engine->threads != 0)
+    {
+        WaitForMultipleObjects(engine->threads, engine->thread, TRUE,
+            INFINITE);
+    }
+    for (i = 0; i < engine->threads; i++)
+    {
+        CloseHandle(engine->thread[i]);
+    }
+    if (engine->port != NULL)
+    {
+        WinDivertEnginePortRelease(engine->handle);
+    }
+    if (engine->idle != NULL)
+    {
+        CloseHandle(engine->idle);
+    }
+    if (engine->data != NULL)
+    {
+        VirtualFree(engine->data, 0, MEM_RELEASE);
+    }
+    free(engine->buf);
+    free(engine);
+}
+
+/*
+ * Start an asynchronous receive engine on a WinDivert handle.
+ */
+extern PWINDIVERT_ENGINE WinDivertEngineCreate(HANDLE handle, UINT buffers,
+    UINT bufferLen, UINT threads, WINDIVERT_ENGINE_CALLBACK callback,
+    PVOID context)
+{
+    PWINDIVERT_ENGINE engine;
+    SYSTEM_INFO info;
+    UINT64 size;
+    UINT i, len;
+    DWORD err;
+
+    len = WINDIVERT_BATCH_ALIGN(bufferLen);
+    size = (UINT64)buffers * (UINT64)len;
+    if (callback == NULL || buffers == 0 ||
+        buffers > WINDIVERT_ENGINE_BUFFERS_MAX ||
+        bufferLen < sizeof(WINDIVERT_BATCH_HDR) ||
+        size > WINDIVERT_ENGINE_SIZE_MAX ||
+        threads > WINDIVERT_ENGINE_THREADS_MAX)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    if (threads == 0)
+    {
+        GetSystemInfo(&info);
+        threads = (UINT)info.dwNumberOfProcessors;
+        threads = (threads > WINDIVERT_ENGINE_THREADS_MAX?
+            WINDIVERT_ENGINE_THREADS_MAX: threads);
+    }
+
+    engine = (PWINDIVERT_ENGINE)malloc(sizeof(struct windivert_engine_s));
+    if (engine == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    memset(engine, 0, sizeof(struct windivert_engine_s));
+    engine->handle     = handle;
+    engine->callback   = callback;
+    engine->context    = context;
+    engine->buffer_len = bufferLen;
+    engine->buffers    = buffers;
+    InitializeSRWLock(&engine->lock);
+
+    // The buffer pool is a single allocation; each buffer stays owned by
+    // one posted receive for the engine's lifetime.
+    engine->buf = (windivert_engine_buf_t)malloc(buffers *
+        sizeof(struct windivert_engine_buf_s));
+    engine->data = VirtualAlloc(NULL, (SIZE_T)size, MEM_COMMIT | MEM_RESERVE,
+        PAGE_READWRITE);
+    if (engine->buf == NULL || engine->data == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        goto WinDivertEngineCreateError;
+    }
+    for (i = 0; i < buffers; i++)
+    {
+        engine->buf[i].data = (UINT8 *)engine->data + (SIZE_T)i * len;
+        engine->buf[i].errors = 0;
+    }
+
+    engine->idle = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (engine->idle == NULL)
+    {
+        goto WinDivertEngineCreateError;
+    }
+    engine->port = WinDivertEnginePortAcquire(handle);
+    if (engine->port == NULL)
+    {
+        goto WinDivertEngineCreateError;
+    }
+    for (; engine->threads < threads; engine->threads++)
+    {
+        engine->thread[engine->threads] = CreateThread(NULL, 0,
+            WinDivertEngineThread, (LPVOID)engine, 0, NULL);
+        if (engine->thread[engine->threads] == NULL)
+        {
+            goto WinDivertEngineCreateError;
+        }
+    }
+
+    // Post all receives:
+    engine->posted = (LONG)buffers;
+    for (i = 0; i < buffers; i++)
+    {
+        if (!WinDivertEnginePost(engine, engine->buf + i) && i == 0)
+        {
+            goto WinDivertEngineCreateError;
+        }
+    }
+    return engine;
+
+WinDivertEngineCreateError:
+    err = GetLastError();
+    WinDivertEngineDestroy(engine);
+    SetLastError(err);
+    return NULL;
+}
+
+/*
+ * Stop and free an asynchronous receive engine.
+ */
+extern BOOL WinDivertEngineFree(PWINDIVERT_ENGINE engine)
+{
+    UINT i;
+    DWORD err;
+
+    if (engine == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    err = GetLastError();
+
+    // No receive is posted after `stop' is set, so cancelling every buffer
+    // once is enough for all of them to be retired.
+    AcquireSRWLockExclusive(&engine->lock);
+    engine->stop = TRUE;
+    ReleaseSRWLockExclusive(&engine->lock);
+    for (i = 0; i < engine->buffers; i++)
+    {
+        CancelIoEx(engine->handle, &engine->buf[i].overlapped);
+    }
+    WaitForSingleObject(engine->idle, INFINITE);
+
+    WinDivertEngineDestroy(engine);
+    SetLastError(err);
+    return TRUE;
+}
+
+/*
+ * Capture-to-file (pcapng).
  */
-static BOOL WinDivertIoControlEx(HANDLE handle, DWORD code, UINT8 arg8,
-    UINT64 arg, PVOID buf, UINT len, UINT *iolen, LPOVERLAPPED overlapped)
+#define WINDIVERT_CAPTURE_ALIGN         4096    // Unbuffered write alignment.
+#define WINDIVERT_CAPTURE_BATCHES       8
+#define WINDIVERT_CAPTURE_BATCH_LEN     0x00040000
+#define WINDIVERT_CAPTURE_IFS_MAX       256
+
+#define PCAPNG_BLOCK_SHB                0x0A0D0D0A
+#define PCAPNG_BLOCK_IDB                0x00000001
+#define PCAPNG_BLOCK_EPB                0x00000006
+#define PCAPNG_MAGIC                    0x1A2B3C4D
+#define PCAPNG_LINKTYPE_RAW             101
+#define PCAPNG_OPT_END                  0
+#define PCAPNG_OPT_SHB_USERAPPL         4
+#define PCAPNG_OPT_IF_NAME              2
+#define PCAPNG_OPT_IF_TSRESOL           9
+#define PCAPNG_OPT_EPB_FLAGS            2
+#define PCAPNG_EPB_FLAG_INBOUND         0x01
+#define PCAPNG_EPB_FLAG_OUTBOUND        0x02
+#define PCAPNG_TSRESOL                  7       // 10^-7 s (FILETIME units)
+#define PCAPNG_EPOCH                    116444736000000000LL
+
+struct windivert_capture_buf_s
 {
-    struct windivert_ioctl_s ioctl;
-    BOOL result;
-    DWORD iolen0;
+    OVERLAPPED overlapped;              // Buffer's write.
+    BOOL pending;                       // Write in progress?
+    UINT8 *data;                        // Buffer memory (aligned).
+};
+typedef struct windivert_capture_buf_s *windivert_capture_buf_t;
 
-    ioctl.version = WINDIVERT_IOCTL_VERSION;
-    ioctl.magic   = WINDIVERT_IOCTL_MAGIC;
-    ioctl.arg8    = arg8;
-    ioctl.arg     = arg;
-    result = DeviceIoControl(handle, code, &ioctl, sizeof(ioctl), buf,
-        (DWORD)len, &iolen0, overlapped);
-    if (result && iolen != NULL)
+struct windivert_capture_s
+{
+    PWINDIVERT_ENGINE engine;           // Receive engine.
+    HANDLE file;                        // Current capture file.
+    UINT file_idx;                      // # files opened.
+    UINT64 offset;                      // File offset of current buffer.
+    UINT len;                           // Bytes in current buffer.
+    UINT cur;                           // Current buffer.
+    struct windivert_capture_buf_s buf[2];
+    PVOID data;                         // Buffer memory.
+    UINT buffer_len;                    // Length of each buffer.
+    UINT snap_len;                      // Max bytes per packet (0 = all).
+    UINT64 rotate_size;                 // Rotate size (0 = never).
+    UINT64 rotate_time;                 // Rotate time in ms (0 = never).
+    UINT64 open_time;                   // Tick count at file open.
+    INT64 qpc_base;                     // Counter at capture start.
+    INT64 qpc_freq;                     // Counter frequency.
+    INT64 time_base;                    // Time at capture start.
+    DWORD error;                        // First error.
+    UINT ifs_len;                       // # interfaces in this file.
+    UINT32 ifs[WINDIVERT_CAPTURE_IFS_MAX][2];
+    char path[MAX_PATH];                // Capture file path.
+};
+
+/*
+ * Record the first capture error.
+ */
+static void WinDivertCaptureError(PWINDIVERT_CAPTURE capture)
+{
+    if (capture->error == 0)
     {
-        *iolen = (UINT)iolen0;
+        capture->error = GetLastError();
+        capture->error = (capture->error == 0? ERROR_WRITE_FAULT:
+            capture->error);
     }
-    return result;
 }
 
 /*
- * Open a WinDivert handle.
+ * Wait for a buffer's write to complete.
  */
-extern HANDLE WinDivertOpen(const char *filter, WINDIVERT_LAYER layer,
-    INT16 priority, UINT64 flags)
+static void WinDivertCaptureWait(PWINDIVERT_CAPTURE capture,
+    windivert_capture_buf_t buf)
 {
-    struct windivert_ioctl_filter_s object[WINDIVERT_FILTER_MAXLEN];
-    UINT obj_len;
-    ERROR comp_err;
-    DWORD err;
-    HANDLE handle;
-    SC_HANDLE service;
-    UINT32 priority32;
+    DWORD len;
 
-    // Parameter checking.
-    if (!WINDIVERT_FLAGS_VALID(flags) || layer > WINDIVERT_LAYER_MAX)
+    if (buf->pending)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return INVALID_HANDLE_VALUE;
+        if (!GetOverlappedResult(capture->file, &buf->overlapped, &len,
+                TRUE))
+        {
+            WinDivertCaptureError(capture);
+        }
+        buf->pending = FALSE;
     }
-    priority32 = WINDIVERT_PRIORITY(priority);
-    if (priority32 < WINDIVERT_PRIORITY_MIN ||
-        priority32 > WINDIVERT_PRIORITY_MAX)
+}
+
+/*
+ * Write the current buffer at the current offset and switch buffers.  Only
+ * the last buffer of a file may be partial; it is zero padded to the write
+ * alignment and the file is truncated on close.
+ */
+static void WinDivertCaptureFlush(PWINDIVERT_CAPTURE capture)
+{
+    windivert_capture_buf_t buf = capture->buf + capture->cur;
+    UINT len = (capture->len + WINDIVERT_CAPTURE_ALIGN - 1) &
+        ~(WINDIVERT_CAPTURE_ALIGN - 1);
+
+    memset(buf->data + capture->len, 0, len - capture->len);
+    buf->overlapped.Internal     = 0;
+    buf->overlapped.InternalHigh = 0;
+    buf->overlapped.Offset       = (DWORD)capture->offset;
+    buf->overlapped.OffsetHigh   = (DWORD)(capture->offset >> 32);
+    if (WriteFile(capture->file, buf->data, len, NULL, &buf->overlapped) ||
+        GetLastError() == ERROR_IO_PENDING)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return INVALID_HANDLE_VALUE;
+        buf->pending = TRUE;
     }
-
-    // Compile the filter:
-    comp_err = WinDivertCompileFilter(filter, layer, object, &obj_len);
-    if (IS_ERROR(comp_err))
+    else
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return INVALID_HANDLE_VALUE;
+        WinDivertCaptureError(capture);
     }
+    capture->offset += len;
+    capture->len = 0;
 
-#ifdef WINDIVERT_DEBUG
-    WinDivertFilterDump(object, obj_len);
-#endif
+    // Double buffering: the other buffer's write must finish before it is
+    // refilled.
+    capture->cur ^= 1;
+    WinDivertCaptureWait(capture, capture->buf + capture->cur);
+}
 
-    // Attempt to open the WinDivert device:
-    handle = CreateFile(L"\\\\.\\" WINDIVERT_DEVICE_NAME,
-        GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, INVALID_HANDLE_VALUE);
-    if (handle == INVALID_HANDLE_VALUE)
+/*
+ * Append data to the capture file.
+ */
+static void WinDivertCaptureAppend(PWINDIVERT_CAPTURE capture,
+    const VOID *data, UINT len)
+{
+    const UINT8 *src = (const UINT8 *)data;
+    UINT n;
+
+    while (len != 0)
     {
-        err = GetLastError();
-        if (err != ERROR_FILE_NOT_FOUND && err != ERROR_PATH_NOT_FOUND)
+        n = capture->buffer_len - capture->len;
+        n = (n > len? len: n);
+        memcpy(capture->buf[capture->cur].data + capture->len, src, n);
+        capture->len += n;
+        src += n;
+        len -= n;
+        if (capture->len == capture->buffer_len)
         {
-            return INVALID_HANDLE_VALUE;
+            WinDivertCaptureFlush(capture);
         }
+    }
+}
 
-        // Open failed because the device isn't installed; install it now.
-        SetLastError(0);
-        service = WinDivertDriverInstall();
-        if (service == NULL)
-        {
-            if (GetLastError() == 0)
-            {
-                SetLastError(ERROR_OPEN_FAILED);
-            }
-            return INVALID_HANDLE_VALUE;
-        }
-        handle = CreateFile(L"\\\\.\\" WINDIVERT_DEVICE_NAME,
-            GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
-            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
-            INVALID_HANDLE_VALUE);
+/*
+ * Append a pcapng Section Header Block.
+ */
+static void WinDivertCaptureSection(PWINDIVERT_CAPTURE capture)
+{
+    static const char appl[] = "WinDivert";
+    UINT32 block[12];
+
+    memset(block, 0, sizeof(block));
+    block[0]  = PCAPNG_BLOCK_SHB;
+    block[1]  = sizeof(block);
+    block[2]  = PCAPNG_MAGIC;
+    block[3]  = 1;                      // Version 1.0
+    block[4]  = block[5] = 0xFFFFFFFF;  // Section length unspecified.
+    block[6]  = PCAPNG_OPT_SHB_USERAPPL | ((sizeof(appl) - 1) << 16);
+    memcpy(block + 7, appl, sizeof(appl) - 1);
+    block[10] = PCAPNG_OPT_END;
+    block[11] = sizeof(block);
+    WinDivertCaptureAppend(capture, block, sizeof(block));
+}
 
-        // Schedule the service to be deleted (once all handles are closed).
-        DeleteService(service);
-        CloseServiceHandle(service);
+/*
+ * Append a pcapng Interface Description Block.  The interface is named
+ * "IfIdx.SubIfIdx", or "any" for the catch-all interface 0.
+ */
+static void WinDivertCaptureInterface(PWINDIVERT_CAPTURE capture,
+    const UINT32 *ifs)
+{
+    UINT32 block[15], val;
+    char name[24], digits[10];
+    UINT i, j, k, len = 0;
 
-        if (handle == INVALID_HANDLE_VALUE)
-        {
-            return INVALID_HANDLE_VALUE;
-        }
+    if (ifs == NULL)
+    {
+        memcpy(name, "any", 3);
+        len = 3;
     }
-
-    // Set the layer:
-    if (layer != WINDIVERT_LAYER_DEFAULT)
+    for (k = 0; ifs != NULL && k < 2; k++)
     {
-        if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_LAYER, 0,
-                (UINT64)layer, NULL, 0, NULL))
+        for (i = 0, val = ifs[k]; i == 0 || val != 0; i++, val /= 10)
         {
-            CloseHandle(handle);
-            return INVALID_HANDLE_VALUE;
+            digits[i] = '0' + (char)(val % 10);
         }
-    }
-
-    // Set the flags:
-    if (flags != 0)
-    {
-        if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_FLAGS, 0,
-                (UINT64)flags, NULL, 0, NULL))
+        if (k != 0)
         {
-            CloseHandle(handle);
-            return INVALID_HANDLE_VALUE;
+            name[len++] = '.';
+        }
+        for (j = 0; j < i; j++)
+        {
+            name[len++] = digits[i - j - 1];
         }
     }
 
-    // Set the priority:
-    if (priority32 != WINDIVERT_PRIORITY_DEFAULT)
+    memset(block, 0, sizeof(block));
+    block[0] = PCAPNG_BLOCK_IDB;
+    block[2] = PCAPNG_LINKTYPE_RAW;
+    block[3] = capture->snap_len;
+    block[4] = PCAPNG_OPT_IF_NAME | (len << 16);
+    memcpy(block + 5, name, len);
+    i = 5 + (len + 3) / 4;
+    block[i++] = PCAPNG_OPT_IF_TSRESOL | (1 << 16);
+    block[i++] = PCAPNG_TSRESOL;
+    block[i++] = PCAPNG_OPT_END;
+    block[i] = (i + 1) * sizeof(UINT32);
+    block[1] = block[i];
+    WinDivertCaptureAppend(capture, block, block[i]);
+}
+
+/*
+ * The pcapng interface ID of a packet's interface; new interfaces are
+ * described on first use.
+ */
+static UINT32 WinDivertCaptureInterfaceId(PWINDIVERT_CAPTURE capture,
+    const WINDIVERT_ADDRESS *addr)
+{
+    UINT i;
+
+    for (i = 1; i < capture->ifs_len; i++)
     {
-        if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_PRIORITY, 0,
-                (UINT64)priority32, NULL, 0, NULL))
+        if (capture->ifs[i][0] == addr->IfIdx &&
+            capture->ifs[i][1] == addr->SubIfIdx)
         {
-            CloseHandle(handle);
-            return INVALID_HANDLE_VALUE;
+            return i;
         }
     }
-
-    // Start the filter:
-    if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_START_FILTER, 0, 0,
-            object, obj_len*sizeof(struct windivert_ioctl_filter_s), NULL))
+    if (capture->ifs_len >= WINDIVERT_CAPTURE_IFS_MAX)
     {
-        CloseHandle(handle);
-        return INVALID_HANDLE_VALUE;
+        return 0;
     }
-
-    // Success!
-    return handle;
+    capture->ifs[i][0] = addr->IfIdx;
+    capture->ifs[i][1] = addr->SubIfIdx;
+    WinDivertCaptureInterface(capture, capture->ifs[i]);
+    return capture->ifs_len++;
 }
 
 /*
- * Receive a WinDivert packet.
+ * Append a pcapng Enhanced Packet Block.
  */
-extern BOOL WinDivertRecv(HANDLE handle, PVOID pPacket, UINT packetLen,
-    PWINDIVERT_ADDRESS addr, UINT *readlen)
+static void WinDivertCaptureEPB(PWINDIVERT_CAPTURE capture,
+    const WINDIVERT_BATCH_HDR *hdr)
 {
-    return WinDivertIoControl(handle, IOCTL_WINDIVERT_RECV, 0, (UINT64)addr,
-        pPacket, packetLen, readlen);
+    static const UINT8 pad[4] = {0};
+    UINT32 block[7], trailer[4];
+    UINT cap_len, pad_len;
+    INT64 delta, ts;
+
+    cap_len = hdr->Length;
+    cap_len = (capture->snap_len != 0 && cap_len > capture->snap_len?
+        capture->snap_len: cap_len);
+    pad_len = (4 - (cap_len & 3)) & 3;
+
+    // Packet timestamps are performance counter values:
+    delta = hdr->Addr.Timestamp - capture->qpc_base;
+    ts = capture->time_base + (delta / capture->qpc_freq) * 10000000 +
+        ((delta % capture->qpc_freq) * 10000000) / capture->qpc_freq;
+
+    block[0] = PCAPNG_BLOCK_EPB;
+    block[1] = sizeof(block) + cap_len + pad_len + sizeof(trailer);
+    block[2] = WinDivertCaptureInterfaceId(capture, &hdr->Addr);
+    block[3] = (UINT32)((UINT64)ts >> 32);
+    block[4] = (UINT32)ts;
+    block[5] = cap_len;
+    block[6] = (hdr->Addr.Length > hdr->Length? hdr->Addr.Length:
+        hdr->Length);
+    trailer[0] = PCAPNG_OPT_EPB_FLAGS | (sizeof(UINT32) << 16);
+    trailer[1] = (hdr->Addr.Direction == WINDIVERT_DIRECTION_INBOUND?
+        PCAPNG_EPB_FLAG_INBOUND: PCAPNG_EPB_FLAG_OUTBOUND);
+    trailer[2] = PCAPNG_OPT_END;
+    trailer[3] = block[1];
+    WinDivertCaptureAppend(capture, block, sizeof(block));
+    WinDivertCaptureAppend(capture, WINDIVERT_BATCH_PACKET(hdr), cap_len);
+    WinDivertCaptureAppend(capture, pad, pad_len);
+    WinDivertCaptureAppend(capture, trailer, sizeof(trailer));
 }
 
 /*
- * Receive a WinDivert packet.
+ * Open the next capture file.  Rotated files are named "path.N".
  */
-extern BOOL WinDivertRecvEx(HANDLE handle, PVOID pPacket, UINT packetLen,
-    UINT64 flags, PWINDIVERT_ADDRESS addr, UINT *readlen,
-    LPOVERLAPPED overlapped)
+static BOOL WinDivertCaptureOpen(PWINDIVERT_CAPTURE capture)
 {
-    if (flags != 0)
+    char path[MAX_PATH + 12], digits[10];
+    UINT i, j, len, idx;
+
+    for (len = 0; capture->path[len] != '\0'; len++)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
+        path[len] = capture->path[len];
+    }
+    if (capture->rotate_size != 0 || capture->rotate_time != 0)
+    {
+        for (i = 0, idx = capture->file_idx; i == 0 || idx != 0;
+                i++, idx /= 10)
+        {
+            digits[i] = '0' + (char)(idx % 10);
+        }
+        path[len++] = '.';
+        for (j = 0; j < i; j++)
+        {
+            path[len++] = digits[i - j - 1];
+        }
+    }
+    path[len] = '\0';
+
+    capture->file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+        CREATE_ALWAYS, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+    if (capture->file == INVALID_HANDLE_VALUE)
+    {
+        WinDivertCaptureError(capture);
         return FALSE;
     }
-    if (overlapped == NULL)
+    capture->file_idx++;
+    capture->offset    = 0;
+    capture->len       = 0;
+    capture->ifs_len   = 1;
+    capture->open_time = GetTickCount64();
+    WinDivertCaptureSection(capture);
+    WinDivertCaptureInterface(capture, NULL);
+    return TRUE;
+}
+
+/*
+ * Flush and close the current capture file.
+ */
+static void WinDivertCaptureClose(PWINDIVERT_CAPTURE capture)
+{
+    LARGE_INTEGER size;
+
+    if (capture->file == INVALID_HANDLE_VALUE)
     {
-        return WinDivertIoControl(handle, IOCTL_WINDIVERT_RECV, 0,
-            (UINT64)addr, pPacket, packetLen, readlen);
+        return;
     }
-    else
+    size.QuadPart = (LONGLONG)(capture->offset + capture->len);
+    if (capture->len != 0)
+    {
+        WinDivertCaptureFlush(capture);
+    }
+    WinDivertCaptureWait(capture, capture->buf + 0);
+    WinDivertCaptureWait(capture, capture->buf + 1);
+
+    // Remove the padding of the last (unbuffered) write:
+    if (!SetFilePointerEx(capture->file, size, NULL, FILE_BEGIN) ||
+        !SetEndOfFile(capture->file))
     {
-        return WinDivertIoControlEx(handle, IOCTL_WINDIVERT_RECV, 0,
-            (UINT64)addr, pPacket, packetLen, readlen, overlapped);
+        WinDivertCaptureError(capture);
     }
+    CloseHandle(capture->file);
+    capture->file = INVALID_HANDLE_VALUE;
 }
 
 /*
- * Send a WinDivert packet.
+ * Capture engine callback.
  */
-extern BOOL WinDivertSend(HANDLE handle, PVOID pPacket, UINT packetLen,
-    PWINDIVERT_ADDRESS addr, UINT *writelen)
+static VOID WinDivertCaptureCallback(PVOID context, PVOID batch,
+    UINT batch_len, UINT count)
 {
-    return WinDivertIoControl(handle, IOCTL_WINDIVERT_SEND, 0, (UINT64)addr,
-        pPacket, packetLen, writelen);
+    PWINDIVERT_CAPTURE capture = (PWINDIVERT_CAPTURE)context;
+    PWINDIVERT_BATCH_HDR hdr = (PWINDIVERT_BATCH_HDR)batch;
+    UINT8 *end = (UINT8 *)batch + batch_len;
+    UINT64 now = GetTickCount64();
+    UINT i;
+
+    for (i = 0; i < count && capture->error == 0; i++)
+    {
+        if ((UINT8 *)(hdr + 1) > end ||
+            hdr->Length > (UINT)(end - (UINT8 *)(hdr + 1)))
+        {
+            return;
+        }
+        if ((capture->rotate_size != 0 &&
+             capture->offset + capture->len >= capture->rotate_size) ||
+            (capture->rotate_time != 0 &&
+             now - capture->open_time >= capture->rotate_time))
+        {
+            WinDivertCaptureClose(capture);
+            if (!WinDivertCaptureOpen(capture))
+            {
+                return;
+            }
+        }
+        WinDivertCaptureEPB(capture, hdr);
+        hdr = WINDIVERT_BATCH_NEXT(hdr);
+    }
 }
 
 /*
- * Send a WinDivert packet.
+ * Free capture resources.
  */
-extern BOOL WinDivertSendEx(HANDLE handle, PVOID pPacket, UINT packetLen,
-    UINT64 flags, PWINDIVERT_ADDRESS addr, UINT *writelen,
-    LPOVERLAPPED overlapped)
+static void WinDivertCaptureDestroy(PWINDIVERT_CAPTURE capture)
 {
-    if (flags != 0)
+    WinDivertCaptureClose(capture);
+    if (capture->buf[0].overlapped.hEvent != NULL)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
+        CloseHandle(capture->buf[0].overlapped.hEvent);
     }
-    if (overlapped == NULL)
+    if (capture->buf[1].overlapped.hEvent != NULL)
     {
-        return WinDivertIoControl(handle, IOCTL_WINDIVERT_SEND, 0,
-            (UINT64)addr, pPacket, packetLen, writelen);
+        CloseHandle(capture->buf[1].overlapped.hEvent);
     }
-    else
+    if (capture->data != NULL)
     {
-        return WinDivertIoControlEx(handle, IOCTL_WINDIVERT_SEND, 0,
-            (UINT64)addr, pPacket, packetLen, writelen, overlapped);
+        VirtualFree(capture->data, 0, MEM_RELEASE);
     }
+    free(capture);
 }
 
 /*
- * Close a WinDivert handle.
+ * Start capturing the packets received from a WinDivert handle to a pcapng
+ * file.
  */
-extern BOOL WinDivertClose(HANDLE handle)
+extern PWINDIVERT_CAPTURE WinDivertCaptureStart(HANDLE handle,
+    const char *path, const WINDIVERT_CAPTURE_OPTIONS *options)
 {
-    return CloseHandle(handle);
-}
+    PWINDIVERT_CAPTURE capture;
+    LARGE_INTEGER counter;
+    FILETIME now;
+    UINT i, buffer_len;
+    DWORD err;
 
-/*
- * Set a WinDivert parameter.
- */
-extern BOOL WinDivertSetParam(HANDLE handle, WINDIVERT_PARAM param,
-    UINT64 value)
-{
-    switch ((int)param)
+    for (i = 0; path != NULL && i < MAX_PATH && path[i] != '\0'; i++)
+        ;
+    buffer_len = (options == NULL || options->BufferLength == 0?
+        WINDIVERT_CAPTURE_BUFFER_DEFAULT: options->BufferLength);
+    if (path == NULL || i == 0 || i >= MAX_PATH ||
+        buffer_len < WINDIVERT_CAPTURE_BUFFER_MIN ||
+        buffer_len > WINDIVERT_CAPTURE_BUFFER_MAX ||
+        buffer_len % WINDIVERT_CAPTURE_ALIGN != 0)
     {
-        case WINDIVERT_PARAM_QUEUE_LEN:
-            if (value < WINDIVERT_PARAM_QUEUE_LEN_MIN ||
-                value > WINDIVERT_PARAM_QUEUE_LEN_MAX)
-            {
-                SetLastError(ERROR_INVALID_PARAMETER);
-                return FALSE;
-            }
-            break;
-        case WINDIVERT_PARAM_QUEUE_TIME:
-            if (value < WINDIVERT_PARAM_QUEUE_TIME_MIN ||
-                value > WINDIVERT_PARAM_QUEUE_TIME_MAX)
-            {
-                SetLastError(ERROR_INVALID_PARAMETER);
-                return FALSE;
-            }
-            break;
-        case WINDIVERT_PARAM_QUEUE_SIZE:
-            if (value < WINDIVERT_PARAM_QUEUE_SIZE_MIN ||
-                value > WINDIVERT_PARAM_QUEUE_SIZE_MAX)
-            {
-                SetLastError(ERROR_INVALID_PARAMETER);
-                return FALSE;
-            }
-            break;
-        default:
-            SetLastError(ERROR_INVALID_PARAMETER);
-            return FALSE;
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
     }
-    return WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_PARAM, (UINT8)param,
-        value, NULL, 0, NULL);
+
+    capture = (PWINDIVERT_CAPTURE)malloc(sizeof(struct windivert_capture_s));
+    if (capture == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    memset(capture, 0, sizeof(struct windivert_capture_s));
+    memcpy(capture->path, path, i + 1);
+    capture->file       = INVALID_HANDLE_VALUE;
+    capture->buffer_len = buffer_len;
+    if (options != NULL)
+    {
+        capture->snap_len    = options->SnapLength;
+        capture->rotate_size = options->RotateSize;
+        capture->rotate_time = (UINT64)options->RotateTime * 1000;
+    }
+
+    // Base for converting packet timestamps to pcapng time:
+    QueryPerformanceFrequency(&counter);
+    capture->qpc_freq = counter.QuadPart;
+    QueryPerformanceCounter(&counter);
+    capture->qpc_base = counter.QuadPart;
+    GetSystemTimeAsFileTime(&now);
+    capture->time_base = (INT64)(((UINT64)now.dwHighDateTime << 32) |
+        now.dwLowDateTime) - PCAPNG_EPOCH;
+
+    // Unbuffered writes need sector aligned buffers:
+    capture->data = VirtualAlloc(NULL, 2 * (SIZE_T)buffer_len,
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (capture->data == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        goto WinDivertCaptureStartError;
+    }
+    for (i = 0; i < 2; i++)
+    {
+        capture->buf[i].data = (UINT8 *)capture->data + i * buffer_len;
+        capture->buf[i].overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE,
+            NULL);
+        if (capture->buf[i].overlapped.hEvent == NULL)
+        {
+            goto WinDivertCaptureStartError;
+        }
+    }
+    if (!WinDivertCaptureOpen(capture))
+    {
+        goto WinDivertCaptureStartError;
+    }
+
+    // One engine thread: the writer is not thread-safe.
+    capture->engine = WinDivertEngineCreate(handle, WINDIVERT_CAPTURE_BATCHES,
+        WINDIVERT_CAPTURE_BATCH_LEN, 1, WinDivertCaptureCallback,
+        (PVOID)capture);
+    if (capture->engine == NULL)
+    {
+        goto WinDivertCaptureStartError;
+    }
+    return capture;
+
+WinDivertCaptureStartError:
+    err = GetLastError();
+    WinDivertCaptureDestroy(capture);
+    SetLastError(err);
+    return NULL;
 }
 
 /*
- * Get a WinDivert parameter.
+ * Stop a capture and close the capture file.
  */
-extern BOOL WinDivertGetParam(HANDLE handle, WINDIVERT_PARAM param,
-    UINT64 *pValue)
+extern BOOL WinDivertCaptureStop(PWINDIVERT_CAPTURE capture)
 {
-    switch ((int)param)
+    DWORD err;
+
+    if (capture == NULL)
     {
-        case WINDIVERT_PARAM_QUEUE_LEN: case WINDIVERT_PARAM_QUEUE_TIME:
-            break;
-        default:
-            SetLastError(ERROR_INVALID_PARAMETER);
-            return FALSE;
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
     }
-    return WinDivertIoControl(handle, IOCTL_WINDIVERT_GET_PARAM, (UINT8)param,
-        0, pValue, sizeof(UINT64), NULL);
+    WinDivertEngineFree(capture->engine);
+    WinDivertCaptureClose(capture);
+    err = capture->error;
+    WinDivertCaptureDestroy(capture);
+    if (err != 0)
+    {
+        SetLastError(err);
+        return FALSE;
+    }
+    return TRUE;
 }
 
 /*****************************************************************************/
@@ -924,6 +2242,24 @@ static void WinDivertFilterDump(windivert_ioctl_filter_t filter, UINT16 len)
             case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
                 printf("udp.PayloadLength ");
                 break;
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD:
+                printf("tcp.Payload[%u] ", filter[i].arg[1]);
+                break;
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD16:
+                printf("tcp.Payload16[%u] ", filter[i].arg[1]);
+                break;
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD32:
+                printf("tcp.Payload32[%u] ", filter[i].arg[1]);
+                break;
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD:
+                printf("udp.Payload[%u] ", filter[i].arg[1]);
+                break;
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD16:
+                printf("udp.Payload16[%u] ", filter[i].arg[1]);
+                break;
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD32:
+                printf("udp.Payload32[%u] ", filter[i].arg[1]);
+                break;
             default:
                 printf("unknown.Field ");       
                 break;
@@ -948,11 +2284,30 @@ static void WinDivertFilterDump(windivert_ioctl_filter_t filter, UINT16 len)
             case WINDIVERT_FILTER_TEST_GEQ:
                 printf(">= ");
                 break;
+            case WINDIVERT_FILTER_TEST_IN:
+                printf("in ");
+                break;
+            case WINDIVERT_FILTER_TEST_CONTAINS:
+                printf("contains ");
+                break;
+            case WINDIVERT_FILTER_TEST_PREFIX:
+                printf("startswith ");
+                break;
             default:
                 printf("?? ");
                 break;
         }
-        printf("%u)\n", filter[i].arg[0]);
+        if (filter[i].test == WINDIVERT_FILTER_TEST_IN ||
+            filter[i].test == WINDIVERT_FILTER_TEST_CONTAINS ||
+            filter[i].test == WINDIVERT_FILTER_TEST_PREFIX)
+        {
+            printf("set[%u..%u])\n", filter[i].arg[0],
+                filter[i].arg[0] + filter[i].arg[1]);
+        }
+        else
+        {
+            printf("%u)\n", filter[i].arg[0]);
+        }
         switch (filter[i].success)
         {
             case WINDIVERT_FILTER_RESULT_ACCEPT:
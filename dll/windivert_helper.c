@@ -20,6 +20,28 @@
 /* WINDIVERT HELPER IMPLEMENTATION                                          */
 /****************************************************************************/
 
+/*
+ * SIMD checksum support.  The vector paths are compiled whenever the
+ * compiler can emit them, and are selected at runtime based on CPUID.
+ */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <cpuid.h>
+#include <immintrin.h>
+#define WINDIVERT_CHECKSUM_SSE2
+#define WINDIVERT_CHECKSUM_AVX2
+#define WINDIVERT_TARGET(isa)           __attribute__((__target__(isa)))
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#include <emmintrin.h>
+#define WINDIVERT_CHECKSUM_SSE2
+#if _MSC_VER >= 1700
+#include <immintrin.h>
+#define WINDIVERT_CHECKSUM_AVX2
+#endif
+#define WINDIVERT_TARGET(isa)
+#endif
+
 /*
  * Protocols.
  */
@@ -77,6 +99,9 @@ typedef enum
     TOKEN_TCP_DST_PORT,
     TOKEN_TCP_FIN,
     TOKEN_TCP_HDR_LENGTH,
+    TOKEN_TCP_PAYLOAD,
+    TOKEN_TCP_PAYLOAD16,
+    TOKEN_TCP_PAYLOAD32,
     TOKEN_TCP_PAYLOAD_LENGTH,
     TOKEN_TCP_PSH,
     TOKEN_TCP_RST,
@@ -90,6 +115,9 @@ typedef enum
     TOKEN_UDP_CHECKSUM,
     TOKEN_UDP_DST_PORT,
     TOKEN_UDP_LENGTH,
+    TOKEN_UDP_PAYLOAD,
+    TOKEN_UDP_PAYLOAD16,
+    TOKEN_UDP_PAYLOAD32,
     TOKEN_UDP_PAYLOAD_LENGTH,
     TOKEN_UDP_SRC_PORT,
     TOKEN_TRUE,
@@ -111,7 +139,20 @@ typedef enum
     TOKEN_OR,
     TOKEN_COLON,
     TOKEN_QUESTION,
+    TOKEN_IN,
+    TOKEN_NOT_IN,
+    TOKEN_CONTAINS,
+    TOKEN_NOT_CONTAINS,
+    TOKEN_STARTS_WITH,
+    TOKEN_NOT_STARTS_WITH,
+    TOKEN_SET_OPEN,
+    TOKEN_SET_CLOSE,
+    TOKEN_INDEX_OPEN,
+    TOKEN_INDEX_CLOSE,
+    TOKEN_COMMA,
+    TOKEN_SET,
     TOKEN_NUMBER,
+    TOKEN_STRING,
     TOKEN_END,
 } KIND;
 
@@ -120,8 +161,11 @@ typedef struct
     KIND kind;
     UINT pos;
     UINT32 val[4];
+    INT prefix;
 } TOKEN;
 #define TOKEN_MAXLEN             32
+#define TOKENS_MAX                                                      \
+    (WINDIVERT_FILTER_MAXLEN*3 + WINDIVERT_FILTER_SET_MAXLEN*2)
 
 typedef struct
 {
@@ -140,6 +184,11 @@ struct EXPR
     {
         UINT32 val[4];
         PEXPR arg[3];
+        struct
+        {
+            TOKEN *elems;
+            UINT count;
+        } set;
     };
     UINT8 kind;
     UINT16 succ;
@@ -172,6 +221,25 @@ typedef UINT64 ERROR;
 #define IS_ERROR(err)                           \
     (GET_CODE(err) != WINDIVERT_ERROR_NONE)
 
+/*
+ * Maximum size of a compiled filter object (including set elements).
+ */
+#define WINDIVERT_FILTER_OBJECT_MAXSIZE                                 \
+    (WINDIVERT_FILTER_MAXLEN * sizeof(struct windivert_ioctl_filter_s) +  \
+     WINDIVERT_FILTER_SET_MAXLEN * sizeof(struct windivert_ioctl_set_s))
+
+/*
+ * Compiled filter object returned by WinDivertHelperCompileFilter().  The
+ * filter objects and set elements follow the header.
+ */
+struct WINDIVERT_FILTER_S
+{
+    UINT obj_len;                           // Number of filter objects.
+    UINT set_len;                           // Number of set elements.
+};
+#define WINDIVERT_FILTER_OBJECT(filter)                                 \
+    ((const struct windivert_ioctl_filter_s *)((filter) + 1))
+
 /*
  * Compiler memory pool:
  */
@@ -407,6 +475,78 @@ WinDivertHelperParsePacketExit:
     return success;
 }
 
+/*
+ * Parse each packet of a batch into a packet descriptor.
+ */
+extern BOOL WinDivertHelperParsePackets(const VOID *batch, UINT batch_len,
+    UINT count, PWINDIVERT_PACKET_INFO info)
+{
+    PWINDIVERT_BATCH_HDR hdr;
+    WINDIVERT_HEADERS headers;
+    UINT8 *packet, *end;
+    UINT i;
+
+    if (batch == NULL || info == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    hdr = (PWINDIVERT_BATCH_HDR)batch;
+    end = (UINT8 *)batch + batch_len;
+    for (i = 0; i < count; i++, info++)
+    {
+        if ((UINT8 *)(hdr + 1) > end ||
+            hdr->Length > (UINT)(end - (UINT8 *)(hdr + 1)) ||
+            hdr->Length > 0xFFFF)
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        packet = (UINT8 *)WINDIVERT_BATCH_PACKET(hdr);
+        WinDivertHelperParsePacket(packet, hdr->Length, &headers.IpHdr,
+            &headers.Ipv6Hdr, &headers.IcmpHdr, &headers.Icmpv6Hdr,
+            &headers.TcpHdr, &headers.UdpHdr, &headers.Data,
+            &headers.DataLen);
+
+        memset(info, 0, sizeof(WINDIVERT_PACKET_INFO));
+        info->Offset = (UINT32)(packet - (UINT8 *)batch);
+        info->Length = (UINT16)hdr->Length;
+        info->IpVersion =
+            (headers.IpHdr != NULL? 4: (headers.Ipv6Hdr != NULL? 6: 0));
+        if (headers.TcpHdr != NULL)
+        {
+            info->Protocol    = IPPROTO_TCP;
+            info->TransOffset = (UINT16)((UINT8 *)headers.TcpHdr - packet);
+            info->SrcPort     = ntohs(headers.TcpHdr->SrcPort);
+            info->DstPort     = ntohs(headers.TcpHdr->DstPort);
+        }
+        else if (headers.UdpHdr != NULL)
+        {
+            info->Protocol    = IPPROTO_UDP;
+            info->TransOffset = (UINT16)((UINT8 *)headers.UdpHdr - packet);
+            info->SrcPort     = ntohs(headers.UdpHdr->SrcPort);
+            info->DstPort     = ntohs(headers.UdpHdr->DstPort);
+        }
+        else if (headers.IcmpHdr != NULL)
+        {
+            info->Protocol    = IPPROTO_ICMP;
+            info->TransOffset = (UINT16)((UINT8 *)headers.IcmpHdr - packet);
+        }
+        else if (headers.Icmpv6Hdr != NULL)
+        {
+            info->Protocol    = IPPROTO_ICMPV6;
+            info->TransOffset = (UINT16)((UINT8 *)headers.Icmpv6Hdr - packet);
+        }
+        if (headers.Data != NULL)
+        {
+            info->DataOffset = (UINT16)((UINT8 *)headers.Data - packet);
+            info->DataLength = (UINT16)headers.DataLen;
+        }
+        hdr = WINDIVERT_BATCH_NEXT(hdr);
+    }
+    return TRUE;
+}
+
 /*
  * Calculate IPv4/IPv6/ICMP/ICMPv6/TCP/UDP checksums.
  */
@@ -572,41 +712,246 @@ static void WinDivertInitPseudoHeaderV6(PWINDIVERT_IPV6HDR ipv6_header,
     pseudov6_header->Zero    = 0;
 }
 
+/*
+ * Checksum summation.  Each function returns the (unfolded) one's complement
+ * sum of the data.  32-bit words are summed into 64-bit accumulators, which
+ * is equivalent to summing 16-bit words modulo 0xFFFF.
+ */
+typedef UINT64 (*PWINDIVERT_SUM)(const UINT8 *data, UINT len);
+
+static UINT64 WinDivertSumScalar(const UINT8 *data, UINT len)
+{
+    register const UINT32 *data32 = (const UINT32 *)data;
+    register UINT64 sum0 = 0, sum1 = 0;
+
+    while (len >= 8)
+    {
+        sum0 += (UINT64)data32[0];
+        sum1 += (UINT64)data32[1];
+        data32 += 2;
+        len -= 8;
+    }
+    data = (const UINT8 *)data32;
+    if (len >= 4)
+    {
+        sum0 += (UINT64)*(const UINT32 *)data;
+        data += 4;
+        len -= 4;
+    }
+    if (len >= 2)
+    {
+        sum1 += (UINT64)*(const UINT16 *)data;
+        data += 2;
+        len -= 2;
+    }
+    if (len != 0)
+    {
+        sum0 += (UINT64)data[0];
+    }
+    return sum0 + sum1;
+}
+
+#ifdef WINDIVERT_CHECKSUM_SSE2
+WINDIVERT_TARGET("sse2")
+static UINT64 WinDivertSumSSE2(const UINT8 *data, UINT len)
+{
+    __m128i zero = _mm_setzero_si128(), sum0 = zero, sum1 = zero, v0, v1;
+    UINT64 sum[2];
+
+    while (len >= 32)
+    {
+        v0 = _mm_loadu_si128((const __m128i *)data);
+        v1 = _mm_loadu_si128((const __m128i *)(data + 16));
+        sum0 = _mm_add_epi64(sum0, _mm_unpacklo_epi32(v0, zero));
+        sum1 = _mm_add_epi64(sum1, _mm_unpackhi_epi32(v0, zero));
+        sum0 = _mm_add_epi64(sum0, _mm_unpacklo_epi32(v1, zero));
+        sum1 = _mm_add_epi64(sum1, _mm_unpackhi_epi32(v1, zero));
+        data += 32;
+        len -= 32;
+    }
+    _mm_storeu_si128((__m128i *)sum, _mm_add_epi64(sum0, sum1));
+    return sum[0] + sum[1] + WinDivertSumScalar(data, len);
+}
+#endif
+
+#ifdef WINDIVERT_CHECKSUM_AVX2
+WINDIVERT_TARGET("avx2")
+static UINT64 WinDivertSumAVX2(const UINT8 *data, UINT len)
+{
+    __m256i zero = _mm256_setzero_si256(), sum0 = zero, sum1 = zero, v0, v1;
+    UINT64 sum[4];
+
+    while (len >= 64)
+    {
+        v0 = _mm256_loadu_si256((const __m256i *)data);
+        v1 = _mm256_loadu_si256((const __m256i *)(data + 32));
+        sum0 = _mm256_add_epi64(sum0, _mm256_unpacklo_epi32(v0, zero));
+        sum1 = _mm256_add_epi64(sum1, _mm256_unpackhi_epi32(v0, zero));
+        sum0 = _mm256_add_epi64(sum0, _mm256_unpacklo_epi32(v1, zero));
+        sum1 = _mm256_add_epi64(sum1, _mm256_unpackhi_epi32(v1, zero));
+        data += 64;
+        len -= 64;
+    }
+    _mm256_storeu_si256((__m256i *)sum, _mm256_add_epi64(sum0, sum1));
+    return sum[0] + sum[1] + sum[2] + sum[3] + WinDivertSumScalar(data, len);
+}
+#endif
+
+#ifdef WINDIVERT_CHECKSUM_SSE2
+/*
+ * Execute CPUID; regs = {EAX, EBX, ECX, EDX}.
+ */
+static void WinDivertCpuId(UINT32 leaf, UINT32 subleaf, UINT32 *regs)
+{
+#ifdef _MSC_VER
+    __cpuidex((int *)regs, (int)leaf, (int)subleaf);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+#endif
+
+#ifdef WINDIVERT_CHECKSUM_AVX2
+/*
+ * Read XCR0 (the OS-enabled register state).
+ */
+static UINT64 WinDivertXGetBV(void)
+{
+#ifdef _MSC_VER
+    return (UINT64)_xgetbv(0);
+#else
+    UINT32 lo, hi;
+    __asm__ __volatile__ (".byte 0x0F, 0x01, 0xD0" : "=a"(lo), "=d"(hi) :
+        "c"(0));
+    return ((UINT64)hi << 32) | (UINT64)lo;
+#endif
+}
+#endif
+
+/*
+ * Select the fastest summation function supported by this CPU.
+ */
+static PWINDIVERT_SUM WinDivertSumFunc = NULL;
+static PWINDIVERT_SUM WinDivertSumInit(void)
+{
+    PWINDIVERT_SUM func = WinDivertSumScalar;
+#ifdef WINDIVERT_CHECKSUM_SSE2
+    UINT32 regs[4], max;
+
+    WinDivertCpuId(0, 0, regs);
+    max = regs[0];
+    if (max >= 1)
+    {
+        WinDivertCpuId(1, 0, regs);
+        if ((regs[3] & (1 << 26)) != 0)     // SSE2
+        {
+            func = WinDivertSumSSE2;
+        }
+#ifdef WINDIVERT_CHECKSUM_AVX2
+        // AVX2 also requires OS support for the YMM register state:
+        if (max >= 7 && (regs[2] & (1 << 27)) != 0 &&   // OSXSAVE
+            (regs[2] & (1 << 28)) != 0 &&               // AVX
+            (WinDivertXGetBV() & 0x6) == 0x6)
+        {
+            WinDivertCpuId(7, 0, regs);
+            if ((regs[1] & (1 << 5)) != 0)  // AVX2
+            {
+                func = WinDivertSumAVX2;
+            }
+        }
+#endif
+    }
+#endif
+    WinDivertSumFunc = func;
+    return func;
+}
+
+/*
+ * Fold a 64-bit one's complement sum into 16 bits.
+ */
+static UINT16 WinDivertFoldSum(UINT64 sum)
+{
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (UINT16)sum;
+}
+
 /*
  * Generic checksum computation.
  */
 static UINT16 WinDivertHelperCalcChecksum(PVOID pseudo_header,
     UINT16 pseudo_header_len, PVOID data, UINT len)
 {
-    register const UINT16 *data16 = (const UINT16 *)pseudo_header;
-    register size_t len16 = pseudo_header_len >> 1;
-    register UINT32 sum = 0;
-    size_t i;
+    PWINDIVERT_SUM sum_func = WinDivertSumFunc;
+    UINT64 sum;
 
-    // Pseudo header:
-    for (i = 0; i < len16; i++)
+    if (sum_func == NULL)
     {
-        sum += (UINT32)data16[i];
+        sum_func = WinDivertSumInit();
     }
 
-    // Main data:
-    data16 = (const UINT16 *)data;
-    len16 = len >> 1;
+    // The pseudo header is small and always of even length:
+    sum = WinDivertSumScalar((const UINT8 *)pseudo_header, pseudo_header_len);
+    sum += sum_func((const UINT8 *)data, len);
+
+    return (UINT16)~WinDivertFoldSum(sum);
+}
+
+/*
+ * Incremental checksum update (RFC 1624, eqn. 3): HC' = ~(~HC + ~m + m').
+ */
+static UINT16 WinDivertUpdateChecksum(UINT16 checksum, const UINT16 *old_val,
+    const UINT16 *new_val, UINT len16)
+{
+    UINT64 sum = (UINT16)~checksum;
+    UINT i;
+
     for (i = 0; i < len16; i++)
     {
-        sum += (UINT32)data16[i];
+        sum += (UINT16)~old_val[i];
+        sum += new_val[i];
     }
+    return (UINT16)~WinDivertFoldSum(sum);
+}
+
+/*
+ * Update a checksum for a changed 16-bit field.
+ */
+extern UINT16 WinDivertHelperUpdateChecksum16(UINT16 checksum,
+    UINT16 oldValue, UINT16 newValue)
+{
+    return WinDivertUpdateChecksum(checksum, &oldValue, &newValue, 1);
+}
+
+/*
+ * Update a checksum for a changed 32-bit field.
+ */
+extern UINT16 WinDivertHelperUpdateChecksum32(UINT16 checksum,
+    UINT32 oldValue, UINT32 newValue)
+{
+    UINT16 old_val[2], new_val[2];
+
+    old_val[0] = (UINT16)oldValue;
+    old_val[1] = (UINT16)(oldValue >> 16);
+    new_val[0] = (UINT16)newValue;
+    new_val[1] = (UINT16)(newValue >> 16);
+    return WinDivertUpdateChecksum(checksum, old_val, new_val, 2);
+}
 
-    if (len & 0x1)
+/*
+ * Update a checksum for a changed 128-bit field (e.g. an IPv6 address).
+ */
+extern UINT16 WinDivertHelperUpdateChecksum128(UINT16 checksum,
+    const UINT32 *pOldValue, const UINT32 *pNewValue)
+{
+    if (pOldValue == NULL || pNewValue == NULL)
     {
-        const UINT8 *data8 = (const UINT8 *)data;
-        sum += (UINT16)data8[len-1];
+        return checksum;
     }
-
-    sum = (sum & 0xFFFF) + (sum >> 16);
-    sum += (sum >> 16);
-    sum = ~sum;
-    return (UINT16)sum;
+    return WinDivertUpdateChecksum(checksum, (const UINT16 *)pOldValue,
+        (const UINT16 *)pNewValue, 8);
 }
 
 /*
@@ -781,6 +1126,101 @@ static PTOKEN_NAME WinDivertTokenLookup(PTOKEN_NAME token_names,
     return NULL;
 }
 
+/*
+ * Parse an optional address prefix length, e.g. "/24".
+ */
+static BOOL WinDivertParsePrefix(const char *filter, UINT *i, UINT max,
+    INT *prefix)
+{
+    UINT32 len;
+    char *end;
+
+    if (filter[*i] != '/')
+    {
+        return TRUE;
+    }
+    if (!isdigit(filter[*i+1]) ||
+        !WinDivertAToI(filter + *i + 1, &end, &len) || len > max ||
+        isalnum(*end))
+    {
+        return FALSE;
+    }
+    *prefix = (INT)len;
+    *i = (UINT)(end - filter);
+    return TRUE;
+}
+
+/*
+ * Decode a string literal, e.g. "Host: \x41".  On entry *i indexes the
+ * character after the opening quote, and on exit the character after the
+ * closing quote.  The decoded bytes are written to out (if non-NULL).
+ */
+static BOOL WinDivertDecodeString(const char *filter, UINT *i, UINT8 *out,
+    UINT *lenptr)
+{
+    UINT len = 0, j;
+    UINT8 c;
+    char d;
+
+    while (filter[*i] != '"')
+    {
+        c = (UINT8)filter[*i];
+        *i = *i + 1;
+        switch (c)
+        {
+            case '\0':
+                return FALSE;
+            case '\\':
+                c = (UINT8)filter[*i];
+                *i = *i + 1;
+                switch (c)
+                {
+                    case '\\': case '"':
+                        break;
+                    case 'n':
+                        c = '\n';
+                        break;
+                    case 'r':
+                        c = '\r';
+                        break;
+                    case 't':
+                        c = '\t';
+                        break;
+                    case 'x':
+                        for (c = 0, j = 0; j < 2; j++)
+                        {
+                            d = filter[*i];
+                            if (!isxdigit(d))
+                            {
+                                return FALSE;
+                            }
+                            *i = *i + 1;
+                            c = (UINT8)((c << 4) | (isdigit(d)? d - '0':
+                                tolower(d) - 'a' + 0x0A));
+                        }
+                        break;
+                    default:
+                        return FALSE;
+                }
+                break;
+            default:
+                break;
+        }
+        if (len >= WINDIVERT_FILTER_PATTERN_MAXLEN)
+        {
+            return FALSE;
+        }
+        if (out != NULL)
+        {
+            out[len] = c;
+        }
+        len++;
+    }
+    *i = *i + 1;
+    *lenptr = len;
+    return (len != 0);
+}
+
 /*
  * Tokenize the given filter string.
  */
@@ -790,6 +1230,7 @@ static ERROR WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
     static const TOKEN_NAME token_names[] =
     {
         {"and",                 TOKEN_AND},
+        {"contains",            TOKEN_CONTAINS},
         {"false",               TOKEN_FALSE},
         {"icmp",                TOKEN_ICMP},
         {"icmp.Body",           TOKEN_ICMP_BODY},
@@ -802,6 +1243,7 @@ static ERROR WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
         {"icmpv6.Code",         TOKEN_ICMPV6_CODE},
         {"icmpv6.Type",         TOKEN_ICMPV6_TYPE},
         {"ifIdx",               TOKEN_IF_IDX},
+        {"in",                  TOKEN_IN},
         {"inbound",             TOKEN_INBOUND},
         {"ip",                  TOKEN_IP},
         {"ip.Checksum",         TOKEN_IP_CHECKSUM},
@@ -827,6 +1269,7 @@ static ERROR WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
         {"not",                 TOKEN_NOT},
         {"or",                  TOKEN_OR},
         {"outbound",            TOKEN_OUTBOUND},
+        {"startswith",          TOKEN_STARTS_WITH},
         {"subIfIdx",            TOKEN_SUB_IF_IDX},
         {"tcp",                 TOKEN_TCP},
         {"tcp.Ack",             TOKEN_TCP_ACK},
@@ -835,6 +1278,9 @@ static ERROR WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
         {"tcp.DstPort",         TOKEN_TCP_DST_PORT},
         {"tcp.Fin",             TOKEN_TCP_FIN},
         {"tcp.HdrLength",       TOKEN_TCP_HDR_LENGTH},
+        {"tcp.Payload",         TOKEN_TCP_PAYLOAD},
+        {"tcp.Payload16",       TOKEN_TCP_PAYLOAD16},
+        {"tcp.Payload32",       TOKEN_TCP_PAYLOAD32},
         {"tcp.PayloadLength",   TOKEN_TCP_PAYLOAD_LENGTH},
         {"tcp.Psh",             TOKEN_TCP_PSH},
         {"tcp.Rst",             TOKEN_TCP_RST},
@@ -849,6 +1295,9 @@ static ERROR WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
         {"udp.Checksum",        TOKEN_UDP_CHECKSUM},
         {"udp.DstPort",         TOKEN_UDP_DST_PORT},
         {"udp.Length",          TOKEN_UDP_LENGTH},
+        {"udp.Payload",         TOKEN_UDP_PAYLOAD},
+        {"udp.Payload16",       TOKEN_UDP_PAYLOAD16},
+        {"udp.Payload32",       TOKEN_UDP_PAYLOAD32},
         {"udp.PayloadLength",   TOKEN_UDP_PAYLOAD_LENGTH},
         {"udp.SrcPort",         TOKEN_UDP_SRC_PORT},
     };
@@ -865,6 +1314,7 @@ static ERROR WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
             return MAKE_ERROR(WINDIVERT_ERROR_TOO_LONG, i);
         }
         memset(tokens[tp].val, 0, sizeof(tokens[tp].val));
+        tokens[tp].prefix = -1;
         while (isspace(filter[i]))
         {
             i++;
@@ -932,6 +1382,32 @@ static ERROR WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
             case '?':
                 tokens[tp++].kind = TOKEN_QUESTION;
                 continue;
+            case '{':
+                tokens[tp++].kind = TOKEN_SET_OPEN;
+                continue;
+            case '}':
+                tokens[tp++].kind = TOKEN_SET_CLOSE;
+                continue;
+            case '[':
+                tokens[tp++].kind = TOKEN_INDEX_OPEN;
+                continue;
+            case ']':
+                tokens[tp++].kind = TOKEN_INDEX_CLOSE;
+                continue;
+            case '"':
+                // The string is decoded again when it is emitted.
+                tokens[tp].val[0] = i;
+                if (!WinDivertDecodeString(filter, &i, NULL,
+                        &tokens[tp].val[1]))
+                {
+                    return MAKE_ERROR(WINDIVERT_ERROR_BAD_TOKEN,
+                        tokens[tp].pos);
+                }
+                tokens[tp++].kind = TOKEN_STRING;
+                continue;
+            case ',':
+                tokens[tp++].kind = TOKEN_COMMA;
+                continue;
             case '&':
                 if (filter[i++] != '&')
                 {
@@ -1017,6 +1493,11 @@ static ERROR WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
             // Check for IPv4 address:
             if (WinDivertHelperParseIPv4Address(token, tokens[tp].val))
             {
+                if (!WinDivertParsePrefix(filter, &i, 32,
+                        &tokens[tp].prefix))
+                {
+                    return MAKE_ERROR(WINDIVERT_ERROR_BAD_TOKEN, i);
+                }
                 tokens[tp].kind = TOKEN_NUMBER;
                 tp++;
                 continue;
@@ -1036,6 +1517,11 @@ static ERROR WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
                 tokens[tp].val[1] = tokens[tp].val[2];
                 tokens[tp].val[2] = tmp;
 
+                if (!WinDivertParsePrefix(filter, &i, 128,
+                        &tokens[tp].prefix))
+                {
+                    return MAKE_ERROR(WINDIVERT_ERROR_BAD_TOKEN, i);
+                }
                 tokens[tp].kind = TOKEN_NUMBER;
                 tp++;
                 continue;
@@ -1112,6 +1598,9 @@ static PEXPR WinDivertMakeVar(PPOOL pool, KIND kind)
         {{{0}}, TOKEN_TCP_DST_PORT},
         {{{0}}, TOKEN_TCP_FIN},
         {{{0}}, TOKEN_TCP_HDR_LENGTH},
+        {{{0}}, TOKEN_TCP_PAYLOAD},
+        {{{0}}, TOKEN_TCP_PAYLOAD16},
+        {{{0}}, TOKEN_TCP_PAYLOAD32},
         {{{0}}, TOKEN_TCP_PAYLOAD_LENGTH},
         {{{0}}, TOKEN_TCP_PSH},
         {{{0}}, TOKEN_TCP_RST},
@@ -1125,6 +1614,9 @@ static PEXPR WinDivertMakeVar(PPOOL pool, KIND kind)
         {{{0}}, TOKEN_UDP_CHECKSUM},
         {{{0}}, TOKEN_UDP_DST_PORT},
         {{{0}}, TOKEN_UDP_LENGTH},
+        {{{0}}, TOKEN_UDP_PAYLOAD},
+        {{{0}}, TOKEN_UDP_PAYLOAD16},
+        {{{0}}, TOKEN_UDP_PAYLOAD32},
         {{{0}}, TOKEN_UDP_PAYLOAD_LENGTH},
         {{{0}}, TOKEN_UDP_SRC_PORT},
         {{{0}}, TOKEN_TRUE},
@@ -1232,87 +1724,273 @@ static PEXPR WinDivertMakeIfThenElse(PPOOL pool, PEXPR cond, PEXPR th,
 }
 
 /*
- * Parse a filter test.
+ * Parse a filter set, e.g. {10.0.0.0/8, 192.168.1.1}.  Sets of patterns,
+ * e.g. {"GET ", "POST "}, are parsed with kind == TOKEN_STRING.
  */
-static PEXPR WinDivertParseTest(PPOOL pool, TOKEN *toks, UINT *i)
+static PEXPR WinDivertParseSet(PPOOL pool, KIND kind, TOKEN *toks, UINT *i)
 {
-    PEXPR var, val;
-    KIND kind;
-    BOOL not = FALSE;
-    while (toks[*i].kind == TOKEN_NOT)
-    {
-        not = !not;
-        *i = *i + 1;
-    }
-    switch (toks[*i].kind)
+    PEXPR expr;
+    UINT start, count = 0, states = 1;
+    KIND elem = TOKEN_NUMBER;
+    INT max;
+
+    switch (kind)
     {
-        case TOKEN_TRUE:
-        case TOKEN_FALSE:
-        case TOKEN_OUTBOUND:
-        case TOKEN_INBOUND:
-        case TOKEN_IF_IDX:
-        case TOKEN_SUB_IF_IDX:
-        case TOKEN_IP:
-        case TOKEN_IPV6:
-        case TOKEN_ICMP:
-        case TOKEN_ICMPV6:
-        case TOKEN_TCP:
-        case TOKEN_UDP:
-        case TOKEN_IP_HDR_LENGTH:
-        case TOKEN_IP_TOS:
-        case TOKEN_IP_LENGTH:
-        case TOKEN_IP_ID:
-        case TOKEN_IP_DF:
-        case TOKEN_IP_MF:
-        case TOKEN_IP_FRAG_OFF:
-        case TOKEN_IP_TTL:
-        case TOKEN_IP_PROTOCOL:
-        case TOKEN_IP_CHECKSUM:
         case TOKEN_IP_SRC_ADDR:
         case TOKEN_IP_DST_ADDR:
-        case TOKEN_IPV6_TRAFFIC_CLASS:
-        case TOKEN_IPV6_FLOW_LABEL:
-        case TOKEN_IPV6_LENGTH:
-        case TOKEN_IPV6_NEXT_HDR:
-        case TOKEN_IPV6_HOP_LIMIT:
+            max = 32;
+            break;
         case TOKEN_IPV6_SRC_ADDR:
         case TOKEN_IPV6_DST_ADDR:
-        case TOKEN_ICMP_TYPE:
-        case TOKEN_ICMP_CODE:
-        case TOKEN_ICMP_CHECKSUM:
-        case TOKEN_ICMP_BODY:
-        case TOKEN_ICMPV6_TYPE:
-        case TOKEN_ICMPV6_CODE:
-        case TOKEN_ICMPV6_CHECKSUM:
-        case TOKEN_ICMPV6_BODY:
-        case TOKEN_TCP_SRC_PORT:
-        case TOKEN_TCP_DST_PORT:
-        case TOKEN_TCP_SEQ_NUM:
-        case TOKEN_TCP_ACK_NUM:
-        case TOKEN_TCP_HDR_LENGTH:
-        case TOKEN_TCP_URG:
-        case TOKEN_TCP_ACK:
-        case TOKEN_TCP_PSH:
-        case TOKEN_TCP_RST:
-        case TOKEN_TCP_SYN:
-        case TOKEN_TCP_FIN:
-        case TOKEN_TCP_WINDOW:
-        case TOKEN_TCP_CHECKSUM:
-        case TOKEN_TCP_URG_PTR:
-        case TOKEN_TCP_PAYLOAD_LENGTH:
-        case TOKEN_UDP_SRC_PORT:
-        case TOKEN_UDP_DST_PORT:
-        case TOKEN_UDP_LENGTH:
-        case TOKEN_UDP_CHECKSUM:
-        case TOKEN_UDP_PAYLOAD_LENGTH:
+            max = 128;
             break;
-        default:
+        case TOKEN_TCP_PAYLOAD:
+        case TOKEN_TCP_PAYLOAD16:
+        case TOKEN_TCP_PAYLOAD32:
+        case TOKEN_UDP_PAYLOAD:
+        case TOKEN_UDP_PAYLOAD16:
+        case TOKEN_UDP_PAYLOAD32:
+            pool->error = MAKE_ERROR(WINDIVERT_ERROR_UNEXPECTED_TOKEN,
+                toks[*i].pos);
+            return NULL;
+        case TOKEN_STRING:
+            elem = TOKEN_STRING;
+            // Fallthrough
+        default:
+            max = -1;               // No prefixes.
+            break;
+    }
+    if (toks[*i].kind != TOKEN_SET_OPEN)
+    {
+        pool->error = MAKE_ERROR(WINDIVERT_ERROR_UNEXPECTED_TOKEN,
+            toks[*i].pos);
+        return NULL;
+    }
+    *i = *i + 1;
+    start = *i;
+    while (toks[*i].kind != TOKEN_SET_CLOSE)
+    {
+        if (count != 0)
+        {
+            if (toks[*i].kind != TOKEN_COMMA)
+            {
+                pool->error = MAKE_ERROR(WINDIVERT_ERROR_UNEXPECTED_TOKEN,
+                    toks[*i].pos);
+                return NULL;
+            }
+            *i = *i + 1;
+        }
+        if (toks[*i].kind != elem || toks[*i].prefix > max)
+        {
+            pool->error = MAKE_ERROR(WINDIVERT_ERROR_UNEXPECTED_TOKEN,
+                toks[*i].pos);
+            return NULL;
+        }
+        if (elem == TOKEN_STRING)
+        {
+            // Each pattern byte is (at most) one matcher state:
+            states += toks[*i].val[1];
+        }
+        if (count >= WINDIVERT_FILTER_SET_MAXLEN ||
+            states > WINDIVERT_FILTER_PATTERN_MAXSTATES)
+        {
+            pool->error = MAKE_ERROR(WINDIVERT_ERROR_TOO_LONG, toks[*i].pos);
+            return NULL;
+        }
+        count++;
+        *i = *i + 1;
+    }
+    *i = *i + 1;
+    expr = (PEXPR)WinDivertAlloc(pool, sizeof(EXPR));
+    if (expr == NULL)
+    {
+        return NULL;
+    }
+    memset(expr, 0, sizeof(EXPR));
+    expr->kind = TOKEN_SET;
+    expr->set.elems = toks + start;     // Elements are comma-separated.
+    expr->set.count = count;
+    return expr;
+}
+
+/*
+ * Parse a set of patterns, or a single pattern, e.g. "GET ".
+ */
+static PEXPR WinDivertParsePatterns(PPOOL pool, TOKEN *toks, UINT *i)
+{
+    PEXPR expr;
+
+    if (toks[*i].kind != TOKEN_STRING)
+    {
+        return WinDivertParseSet(pool, TOKEN_STRING, toks, i);
+    }
+    expr = (PEXPR)WinDivertAlloc(pool, sizeof(EXPR));
+    if (expr == NULL)
+    {
+        return NULL;
+    }
+    memset(expr, 0, sizeof(EXPR));
+    expr->kind = TOKEN_SET;
+    expr->set.elems = toks + *i;
+    expr->set.count = 1;
+    *i = *i + 1;
+    return expr;
+}
+
+/*
+ * Parse a payload index, e.g. [4].
+ */
+static PEXPR WinDivertParseIndex(PPOOL pool, PEXPR var, TOKEN *toks, UINT *i)
+{
+    PEXPR expr;
+    TOKEN *tok;
+
+    if (toks[*i].kind != TOKEN_INDEX_OPEN)
+    {
+        pool->error = MAKE_ERROR(WINDIVERT_ERROR_UNEXPECTED_TOKEN,
+            toks[*i].pos);
+        return NULL;
+    }
+    tok = toks + *i + 1;
+    if (tok->kind != TOKEN_NUMBER || tok->prefix >= 0 || tok->val[1] != 0 ||
+        tok->val[2] != 0 || tok->val[3] != 0 ||
+        tok->val[0] > WINDIVERT_FILTER_PAYLOAD_OFFSET_MAX)
+    {
+        pool->error = MAKE_ERROR(WINDIVERT_ERROR_UNEXPECTED_TOKEN, tok->pos);
+        return NULL;
+    }
+    if (tok[1].kind != TOKEN_INDEX_CLOSE)
+    {
+        pool->error = MAKE_ERROR(WINDIVERT_ERROR_UNEXPECTED_TOKEN,
+            tok[1].pos);
+        return NULL;
+    }
+    *i = *i + 3;
+    expr = (PEXPR)WinDivertAlloc(pool, sizeof(EXPR));
+    if (expr == NULL)
+    {
+        return NULL;
+    }
+    memset(expr, 0, sizeof(EXPR));
+    expr->kind = var->kind;
+    expr->val[0] = tok->val[0];         // Payload offset.
+    return expr;
+}
+
+/*
+ * Parse a filter test.
+ */
+static PEXPR WinDivertParseTest(PPOOL pool, TOKEN *toks, UINT *i)
+{
+    PEXPR var, val;
+    KIND kind;
+    BOOL not = FALSE;
+    while (toks[*i].kind == TOKEN_NOT)
+    {
+        not = !not;
+        *i = *i + 1;
+    }
+    switch (toks[*i].kind)
+    {
+        case TOKEN_TRUE:
+        case TOKEN_FALSE:
+        case TOKEN_OUTBOUND:
+        case TOKEN_INBOUND:
+        case TOKEN_IF_IDX:
+        case TOKEN_SUB_IF_IDX:
+        case TOKEN_IP:
+        case TOKEN_IPV6:
+        case TOKEN_ICMP:
+        case TOKEN_ICMPV6:
+        case TOKEN_TCP:
+        case TOKEN_UDP:
+        case TOKEN_IP_HDR_LENGTH:
+        case TOKEN_IP_TOS:
+        case TOKEN_IP_LENGTH:
+        case TOKEN_IP_ID:
+        case TOKEN_IP_DF:
+        case TOKEN_IP_MF:
+        case TOKEN_IP_FRAG_OFF:
+        case TOKEN_IP_TTL:
+        case TOKEN_IP_PROTOCOL:
+        case TOKEN_IP_CHECKSUM:
+        case TOKEN_IP_SRC_ADDR:
+        case TOKEN_IP_DST_ADDR:
+        case TOKEN_IPV6_TRAFFIC_CLASS:
+        case TOKEN_IPV6_FLOW_LABEL:
+        case TOKEN_IPV6_LENGTH:
+        case TOKEN_IPV6_NEXT_HDR:
+        case TOKEN_IPV6_HOP_LIMIT:
+        case TOKEN_IPV6_SRC_ADDR:
+        case TOKEN_IPV6_DST_ADDR:
+        case TOKEN_ICMP_TYPE:
+        case TOKEN_ICMP_CODE:
+        case TOKEN_ICMP_CHECKSUM:
+        case TOKEN_ICMP_BODY:
+        case TOKEN_ICMPV6_TYPE:
+        case TOKEN_ICMPV6_CODE:
+        case TOKEN_ICMPV6_CHECKSUM:
+        case TOKEN_ICMPV6_BODY:
+        case TOKEN_TCP_SRC_PORT:
+        case TOKEN_TCP_DST_PORT:
+        case TOKEN_TCP_SEQ_NUM:
+        case TOKEN_TCP_ACK_NUM:
+        case TOKEN_TCP_HDR_LENGTH:
+        case TOKEN_TCP_URG:
+        case TOKEN_TCP_ACK:
+        case TOKEN_TCP_PSH:
+        case TOKEN_TCP_RST:
+        case TOKEN_TCP_SYN:
+        case TOKEN_TCP_FIN:
+        case TOKEN_TCP_WINDOW:
+        case TOKEN_TCP_CHECKSUM:
+        case TOKEN_TCP_URG_PTR:
+        case TOKEN_TCP_PAYLOAD_LENGTH:
+        case TOKEN_UDP_SRC_PORT:
+        case TOKEN_UDP_DST_PORT:
+        case TOKEN_UDP_LENGTH:
+        case TOKEN_UDP_CHECKSUM:
+        case TOKEN_UDP_PAYLOAD_LENGTH:
+        case TOKEN_TCP_PAYLOAD:
+        case TOKEN_TCP_PAYLOAD16:
+        case TOKEN_TCP_PAYLOAD32:
+        case TOKEN_UDP_PAYLOAD:
+        case TOKEN_UDP_PAYLOAD16:
+        case TOKEN_UDP_PAYLOAD32:
+            break;
+        default:
             pool->error = MAKE_ERROR(WINDIVERT_ERROR_UNEXPECTED_TOKEN,
                 toks[*i].pos);
             return NULL;
     }
     var = WinDivertMakeVar(pool, toks[*i].kind);
     *i = *i + 1;
+    switch (var == NULL? TOKEN_END: var->kind)
+    {
+        case TOKEN_TCP_PAYLOAD:
+        case TOKEN_UDP_PAYLOAD:
+            kind = toks[*i].kind;
+            if (kind == TOKEN_CONTAINS || kind == TOKEN_STARTS_WITH)
+            {
+                *i = *i + 1;
+                val = WinDivertParsePatterns(pool, toks, i);
+                if (not)
+                {
+                    kind = (kind == TOKEN_CONTAINS? TOKEN_NOT_CONTAINS:
+                        TOKEN_NOT_STARTS_WITH);
+                }
+                return WinDivertMakeBinOp(pool, kind, var, val);
+            }
+            // Fallthrough
+        case TOKEN_TCP_PAYLOAD16:
+        case TOKEN_TCP_PAYLOAD32:
+        case TOKEN_UDP_PAYLOAD16:
+        case TOKEN_UDP_PAYLOAD32:
+            var = WinDivertParseIndex(pool, var, toks, i);
+            break;
+        default:
+            break;
+    }
     switch (toks[*i].kind)
     {
         case TOKEN_EQ:
@@ -1323,6 +2001,12 @@ static PEXPR WinDivertParseTest(PPOOL pool, TOKEN *toks, UINT *i)
         case TOKEN_GEQ:
             kind = toks[*i].kind;
             break;
+        case TOKEN_IN:
+            *i = *i + 1;
+            val = (var == NULL? NULL:
+                WinDivertParseSet(pool, var->kind, toks, i));
+            return WinDivertMakeBinOp(pool, (not? TOKEN_NOT_IN: TOKEN_IN),
+                var, val);
         default:
             return WinDivertMakeBinOp(pool, (not? TOKEN_EQ: TOKEN_NEQ), var,
                 WinDivertMakeZero(pool));
@@ -1475,6 +2159,17 @@ static BOOL WinDivertEvalTest(PEXPR test, BOOL *res)
     UINT32 val32 = val->val[0];
     BOOL big = (val->val[1] != 0 || val->val[2] != 0 || val->val[3] != 0);
     UINT32 lb, ub;
+    if (val->kind == TOKEN_SET)
+    {
+        if (val->set.count != 0)
+        {
+            return FALSE;
+        }
+        *res = (test->kind == TOKEN_NOT_IN ||   // Empty set.
+            test->kind == TOKEN_NOT_CONTAINS ||
+            test->kind == TOKEN_NOT_STARTS_WITH);
+        return TRUE;
+    }
     switch (var->kind)
     {
         case TOKEN_TRUE:
@@ -1514,6 +2209,8 @@ static BOOL WinDivertEvalTest(PEXPR test, BOOL *res)
         case TOKEN_ICMP_CODE:
         case TOKEN_ICMPV6_TYPE:
         case TOKEN_ICMPV6_CODE:
+        case TOKEN_TCP_PAYLOAD:
+        case TOKEN_UDP_PAYLOAD:
             lb = 0; ub = 0xFF;
             break;
         case TOKEN_IP_FRAG_OFF:
@@ -1537,6 +2234,8 @@ static BOOL WinDivertEvalTest(PEXPR test, BOOL *res)
         case TOKEN_UDP_LENGTH:
         case TOKEN_UDP_CHECKSUM:
         case TOKEN_UDP_PAYLOAD_LENGTH:
+        case TOKEN_TCP_PAYLOAD16:
+        case TOKEN_UDP_PAYLOAD16:
             lb = 0; ub = 0xFFFF;
             break;
         case TOKEN_IPV6_FLOW_LABEL:
@@ -1675,13 +2374,98 @@ static INT16 WinDivertFlattenExpr(PEXPR expr, INT16 *label, INT16 succ,
     }
 }
 
+/*
+ * Emit the elements of a set.  Returns the number of elements emitted.
+ */
+static UINT WinDivertEmitSet(KIND kind, PEXPR expr, windivert_ioctl_set_t set)
+{
+    TOKEN *elem;
+    UINT i, len = 0;
+    UINT8 width = 32;
+    BOOL big;
+
+    switch (kind)
+    {
+        case TOKEN_IPV6_SRC_ADDR:
+        case TOKEN_IPV6_DST_ADDR:
+            width = 128;
+            break;
+        default:
+            break;
+    }
+    for (i = 0; i < expr->set.count; i++)
+    {
+        elem = expr->set.elems + 2*i;
+        big = (elem->val[1] != 0 || elem->val[2] != 0 || elem->val[3] != 0);
+        if (big && width <= 32)
+        {
+            continue;               // Can never match.
+        }
+        set[len].val[0] = elem->val[0];
+        set[len].val[1] = elem->val[1];
+        set[len].val[2] = elem->val[2];
+        set[len].val[3] = elem->val[3];
+        set[len].prefix = (elem->prefix < 0? width: (UINT8)elem->prefix);
+        len++;
+    }
+    return len;
+}
+
+/*
+ * Emit the elements of a set of patterns.  Returns the number of elements
+ * emitted.
+ */
+static UINT WinDivertEmitPatterns(const char *filter, PEXPR expr,
+    windivert_ioctl_set_t set)
+{
+    UINT8 pattern[16 * WINDIVERT_FILTER_PATTERN_ELEMS(
+        WINDIVERT_FILTER_PATTERN_MAXLEN)];
+    TOKEN *elem;
+    UINT i, j, k, pattern_len, len = 0;
+
+    for (i = 0; i < expr->set.count; i++)
+    {
+        elem = expr->set.elems + 2*i;
+        j = elem->val[0];
+        memset(pattern, 0, sizeof(pattern));
+        WinDivertDecodeString(filter, &j, pattern, &pattern_len);
+        memset(set + len, 0, sizeof(struct windivert_ioctl_set_s));
+        set[len++].val[0] = pattern_len;
+        for (k = 0; k < WINDIVERT_FILTER_PATTERN_ELEMS(pattern_len); k++)
+        {
+            memcpy(set[len].val, pattern + 16 * k, 16);
+            set[len++].prefix = 0;
+        }
+    }
+    return len;
+}
+
+/*
+ * The number of elements emitted for a set.
+ */
+static UINT WinDivertSetLength(PEXPR expr)
+{
+    TOKEN *elem;
+    UINT i, len = 0;
+
+    for (i = 0; i < expr->set.count; i++)
+    {
+        elem = expr->set.elems + 2*i;
+        len += (elem->kind == TOKEN_STRING?
+            1 + WINDIVERT_FILTER_PATTERN_ELEMS(elem->val[1]): 1);
+    }
+    return len;
+}
+
 /*
  * Emit a test.
  */
-static void WinDivertEmitTest(PEXPR test, UINT16 offset,
-    windivert_ioctl_filter_t object)
+static void WinDivertEmitTest(const char *filter, PEXPR test, UINT16 offset,
+    windivert_ioctl_filter_t object, windivert_ioctl_set_t set,
+    UINT *set_len)
 {
     PEXPR var = test->arg[0], val = test->arg[1];
+    UINT16 tmp;
     switch (test->kind)
     {
         case TOKEN_EQ:
@@ -1702,6 +2486,18 @@ static void WinDivertEmitTest(PEXPR test, UINT16 offset,
         case TOKEN_GEQ:
             object->test = WINDIVERT_FILTER_TEST_GEQ;
             break;
+        case TOKEN_IN:
+        case TOKEN_NOT_IN:
+            object->test = WINDIVERT_FILTER_TEST_IN;
+            break;
+        case TOKEN_CONTAINS:
+        case TOKEN_NOT_CONTAINS:
+            object->test = WINDIVERT_FILTER_TEST_CONTAINS;
+            break;
+        case TOKEN_STARTS_WITH:
+        case TOKEN_NOT_STARTS_WITH:
+            object->test = WINDIVERT_FILTER_TEST_PREFIX;
+            break;
         default:
             return;
     }
@@ -1878,13 +2674,56 @@ static void WinDivertEmitTest(PEXPR test, UINT16 offset,
         case TOKEN_UDP_PAYLOAD_LENGTH:
             object->field = WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH;
             break;
+        case TOKEN_TCP_PAYLOAD:
+            object->field = WINDIVERT_FILTER_FIELD_TCP_PAYLOAD;
+            break;
+        case TOKEN_TCP_PAYLOAD16:
+            object->field = WINDIVERT_FILTER_FIELD_TCP_PAYLOAD16;
+            break;
+        case TOKEN_TCP_PAYLOAD32:
+            object->field = WINDIVERT_FILTER_FIELD_TCP_PAYLOAD32;
+            break;
+        case TOKEN_UDP_PAYLOAD:
+            object->field = WINDIVERT_FILTER_FIELD_UDP_PAYLOAD;
+            break;
+        case TOKEN_UDP_PAYLOAD16:
+            object->field = WINDIVERT_FILTER_FIELD_UDP_PAYLOAD16;
+            break;
+        case TOKEN_UDP_PAYLOAD32:
+            object->field = WINDIVERT_FILTER_FIELD_UDP_PAYLOAD32;
+            break;
         default:
             return;
     }
-    object->arg[0] = val->val[0];
-    object->arg[1] = val->val[1];
-    object->arg[2] = val->val[2];
-    object->arg[3] = val->val[3];
+    if (val->kind == TOKEN_SET)
+    {
+        object->arg[0] = *set_len;
+        object->arg[1] = (object->test == WINDIVERT_FILTER_TEST_IN?
+            WinDivertEmitSet(var->kind, val, set + *set_len):
+            WinDivertEmitPatterns(filter, val, set + *set_len));
+        object->arg[2] = object->arg[3] = 0;
+        *set_len += object->arg[1];
+    }
+    else
+    {
+        object->arg[0] = val->val[0];
+        object->arg[1] = val->val[1];
+        object->arg[2] = val->val[2];
+        object->arg[3] = val->val[3];
+        switch (var->kind)
+        {
+            case TOKEN_TCP_PAYLOAD:
+            case TOKEN_TCP_PAYLOAD16:
+            case TOKEN_TCP_PAYLOAD32:
+            case TOKEN_UDP_PAYLOAD:
+            case TOKEN_UDP_PAYLOAD16:
+            case TOKEN_UDP_PAYLOAD32:
+                object->arg[1] = var->val[0];   // Payload offset.
+                break;
+            default:
+                break;
+        }
+    }
     switch (test->succ)
     {
         case WINDIVERT_FILTER_RESULT_ACCEPT:
@@ -1905,16 +2744,26 @@ static void WinDivertEmitTest(PEXPR test, UINT16 offset,
             object->failure = offset - test->fail;
             break;
     }
+    if (test->kind == TOKEN_NOT_IN || test->kind == TOKEN_NOT_CONTAINS ||
+        test->kind == TOKEN_NOT_STARTS_WITH)
+    {
+        tmp = object->success;
+        object->success = object->failure;
+        object->failure = tmp;
+    }
     return;
 }
 
 /*
  * Emit a filter object.
  */
-static void WinDivertEmitFilter(PEXPR *stack, UINT len, UINT16 label,
-    windivert_ioctl_filter_t object, UINT *obj_len)
+static void WinDivertEmitFilter(const char *filter, PEXPR *stack, UINT len,
+    UINT16 label, windivert_ioctl_filter_t object, UINT *obj_len,
+    UINT *set_len)
 {
+    windivert_ioctl_set_t set;
     UINT i;
+    *set_len = 0;
     switch (label)
     {
         case WINDIVERT_FILTER_RESULT_ACCEPT:
@@ -1932,31 +2781,41 @@ static void WinDivertEmitFilter(PEXPR *stack, UINT len, UINT16 label,
             break;
     }
     *obj_len = len + 1;
+    set = (windivert_ioctl_set_t)(object + *obj_len);
     for (i = 0; i <= len; i++)
     {
-        WinDivertEmitTest(stack[len - i], label, object + i);
+        WinDivertEmitTest(filter, stack[len - i], label, object + i, set,
+            set_len);
     }
 }
 
 /*
- * Compile a filter string into an executable filter object.
+ * Compile a filter string into an executable filter object.  The object
+ * buffer must be WINDIVERT_FILTER_OBJECT_MAXSIZE bytes; set elements are
+ * emitted directly after the obj_len filter objects.
  */
 static ERROR WinDivertCompileFilter(const char *filter,
-    WINDIVERT_LAYER layer, windivert_ioctl_filter_t object, UINT *obj_len)
+    WINDIVERT_LAYER layer, windivert_ioctl_filter_t object, UINT *obj_len,
+    UINT *set_len)
 {
-    TOKEN tokens[WINDIVERT_FILTER_MAXLEN*3];
+    TOKEN *tokens;
     PEXPR stack[WINDIVERT_FILTER_MAXLEN];
     PPOOL pool;
     PEXPR expr;
-    UINT i, max_depth;
-    INT16 label;
+    UINT i, max_depth, count;
+    INT16 label, j;
     ERROR error;
 
     // Tokenize the filter string:
-    error = WinDivertTokenizeFilter(filter, layer, tokens,
-        sizeof(tokens) / sizeof(tokens[0]) - 1);
+    tokens = (TOKEN *)malloc(TOKENS_MAX * sizeof(TOKEN));
+    if (tokens == NULL)
+    {
+        return MAKE_ERROR(WINDIVERT_ERROR_NO_MEMORY, 0);
+    }
+    error = WinDivertTokenizeFilter(filter, layer, tokens, TOKENS_MAX - 1);
     if (IS_ERROR(error))
     {
+        free(tokens);
         return error;
     }
 
@@ -1964,6 +2823,7 @@ static ERROR WinDivertCompileFilter(const char *filter,
     pool = (PPOOL)malloc(sizeof(POOL));
     if (pool == NULL)
     {
+        free(tokens);
         return MAKE_ERROR(WINDIVERT_ERROR_NO_MEMORY, 0);
     }
     pool->offset = 0;
@@ -1976,13 +2836,12 @@ static ERROR WinDivertCompileFilter(const char *filter,
     if (expr == NULL)
     {
         error = pool->error;
-        free(pool);
-        return error;
+        goto WinDivertCompileFilterExit;
     }
     if (tokens[i].kind != TOKEN_END)
     {
-        free(pool);
-        return MAKE_ERROR(WINDIVERT_ERROR_UNEXPECTED_TOKEN, tokens[i].pos);
+        error = MAKE_ERROR(WINDIVERT_ERROR_UNEXPECTED_TOKEN, tokens[i].pos);
+        goto WinDivertCompileFilterExit;
     }
 
     // Construct the filter tree:
@@ -1991,18 +2850,37 @@ static ERROR WinDivertCompileFilter(const char *filter,
         WINDIVERT_FILTER_RESULT_REJECT, stack);
     if (label < 0)
     {
-        free(pool);
-        return MAKE_ERROR(WINDIVERT_ERROR_TOO_LONG, 0);
+        error = MAKE_ERROR(WINDIVERT_ERROR_TOO_LONG, 0);
+        goto WinDivertCompileFilterExit;
+    }
+
+    // Check the total number of set elements:
+    count = 0;
+    for (j = 0; label < WINDIVERT_FILTER_MAXLEN && j <= label; j++)
+    {
+        if (stack[j]->arg[1]->kind == TOKEN_SET)
+        {
+            count += WinDivertSetLength(stack[j]->arg[1]);
+        }
+    }
+    if (count > WINDIVERT_FILTER_SET_MAXLEN)
+    {
+        error = MAKE_ERROR(WINDIVERT_ERROR_TOO_LONG, 0);
+        goto WinDivertCompileFilterExit;
     }
 
     // Emit the final object.
     if (object != NULL)
     {
-        WinDivertEmitFilter(stack, label, label, object, obj_len);
+        WinDivertEmitFilter(filter, stack, label, label, object, obj_len,
+            set_len);
     }
-    free(pool);
+    error = MAKE_ERROR(WINDIVERT_ERROR_NONE, 0);
 
-    return MAKE_ERROR(WINDIVERT_ERROR_NONE, 0);
+WinDivertCompileFilterExit:
+    free(pool);
+    free(tokens);
+    return error;
 }
 
 /*
@@ -2047,7 +2925,7 @@ extern BOOL WinDivertHelperCheckFilter(const char *filter_str,
         SetLastError(ERROR_INVALID_PARAMETER);
         return FALSE;
     }
-    err = WinDivertCompileFilter(filter_str, layer, NULL, NULL);
+    err = WinDivertCompileFilter(filter_str, layer, NULL, NULL, NULL);
     if (error != NULL)
     {
         *error = WinDivertErrorString(GET_CODE(err));
@@ -2100,43 +2978,106 @@ static int WinDivertBigNumCompare(const UINT32 *a, const UINT32 *b)
 }
 
 /*
- * Evaluate the given filter with the given packet as input.
+ * Test if a value is a member of a set (linear scan).
  */
-extern BOOL WinDivertHelperEvalFilter(const char *filter,
-    WINDIVERT_LAYER layer, PVOID packet, UINT packet_len,
-    PWINDIVERT_ADDRESS addr)
+static BOOL WinDivertSetMember(const UINT32 *val, UINT width,
+    const struct windivert_ioctl_set_s *set, UINT len)
 {
-    UINT16 pc;
-    ERROR err;
-    PWINDIVERT_IPHDR iphdr;
-    PWINDIVERT_IPV6HDR ipv6hdr;
-    PWINDIVERT_ICMPHDR icmphdr;
-    PWINDIVERT_ICMPV6HDR icmpv6hdr;
-    PWINDIVERT_TCPHDR tcphdr;
-    PWINDIVERT_UDPHDR udphdr;
-    UINT payload_len;
-    UINT32 val[4];
-    BOOL pass;
-    int cmp;
-    struct windivert_ioctl_filter_s object[WINDIVERT_FILTER_MAXLEN];
-    UINT obj_len;
+    UINT i, j;
+    INT bits;
+    UINT32 mask;
 
-    if (filter == NULL || packet == NULL || addr == NULL)
+    for (i = 0; i < len; i++)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
+        for (j = 0; j < 4; j++)
+        {
+            // Number of prefix bits that cover word j (0 = least
+            // significant).  Words beyond the field width are exact.
+            bits = (INT)set[i].prefix - ((INT)width - 32 * (INT)(j + 1));
+            bits = ((INT)width < 32 * (INT)(j + 1)? 32: bits);
+            mask = (bits <= 0? 0: (bits >= 32? 0xFFFFFFFF:
+                ~(0xFFFFFFFF >> bits)));
+            if (((val[j] ^ set[i].val[j]) & mask) != 0)
+            {
+                break;
+            }
+        }
+        if (j == 4)
+        {
+            return TRUE;
+        }
     }
+    return FALSE;
+}
 
-    err = WinDivertCompileFilter(filter, layer, object, &obj_len);
-    if (IS_ERROR(err))
+/*
+ * Test if the payload contains (or starts with) any of the given patterns
+ * (naive scan).
+ */
+static BOOL WinDivertPatternMatch(const UINT8 *data, UINT data_len,
+    const struct windivert_ioctl_set_s *set, UINT len, BOOL prefix)
+{
+    const UINT8 *pattern;
+    UINT i, j, pattern_len;
+
+    for (i = 0; i < len; i += 1 + WINDIVERT_FILTER_PATTERN_ELEMS(pattern_len))
+    {
+        pattern_len = set[i].val[0];
+        pattern = (const UINT8 *)set[i + 1].val;
+        for (j = 0; j + pattern_len <= data_len; j++)
+        {
+            if (memcmp(data + j, pattern, pattern_len) == 0)
+            {
+                return TRUE;
+            }
+            if (prefix)
+            {
+                break;
+            }
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Load a big-endian payload value of the given size (in bytes).
+ */
+static BOOL WinDivertPayloadLoad(const UINT8 *data, UINT data_len,
+    UINT offset, UINT size, UINT32 *val)
+{
+    UINT i;
+
+    if (data == NULL || offset + size > data_len)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
         return FALSE;
     }
+    *val = 0;
+    for (i = 0; i < size; i++)
+    {
+        *val = (*val << 8) | data[offset + i];
+    }
+    return TRUE;
+}
+
+/*
+ * Evaluate a compiled filter object with the given packet headers as input.
+ */
+static BOOL WinDivertEvalObject(const struct windivert_ioctl_filter_s *object,
+    UINT obj_len, const struct windivert_ioctl_set_s *set,
+    const WINDIVERT_HEADERS *headers, const WINDIVERT_ADDRESS *addr)
+{
+    UINT16 pc;
+    PWINDIVERT_IPHDR iphdr = headers->IpHdr;
+    PWINDIVERT_IPV6HDR ipv6hdr = headers->Ipv6Hdr;
+    PWINDIVERT_ICMPHDR icmphdr = headers->IcmpHdr;
+    PWINDIVERT_ICMPV6HDR icmpv6hdr = headers->Icmpv6Hdr;
+    PWINDIVERT_TCPHDR tcphdr = headers->TcpHdr;
+    PWINDIVERT_UDPHDR udphdr = headers->UdpHdr;
+    UINT payload_len = headers->DataLen;
+    UINT32 val[4];
+    BOOL pass;
+    int cmp;
 
-    WinDivertHelperParsePacket(packet, packet_len, &iphdr, &ipv6hdr, &icmphdr,
-        &icmpv6hdr, &tcphdr, &udphdr, NULL, &payload_len);
-    
     pc = 0;
     while (TRUE)
     {
@@ -2207,6 +3148,9 @@ extern BOOL WinDivertHelperEvalFilter(const char *filter,
             case WINDIVERT_FILTER_FIELD_TCP_CHECKSUM:
             case WINDIVERT_FILTER_FIELD_TCP_URGPTR:
             case WINDIVERT_FILTER_FIELD_TCP_PAYLOADLENGTH:
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD:
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD16:
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD32:
                 pass = (tcphdr != NULL);
                 break;
             case WINDIVERT_FILTER_FIELD_UDP_SRCPORT:
@@ -2214,6 +3158,9 @@ extern BOOL WinDivertHelperEvalFilter(const char *filter,
             case WINDIVERT_FILTER_FIELD_UDP_LENGTH:
             case WINDIVERT_FILTER_FIELD_UDP_CHECKSUM:
             case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD16:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD32:
                 pass = (udphdr != NULL);
                 break;
             default:
@@ -2225,6 +3172,20 @@ extern BOOL WinDivertHelperEvalFilter(const char *filter,
             pc = object[pc].failure;
             continue;
         }
+        switch (object[pc].test)
+        {
+            case WINDIVERT_FILTER_TEST_CONTAINS:
+            case WINDIVERT_FILTER_TEST_PREFIX:
+                pass = (headers->Data != NULL &&
+                    WinDivertPatternMatch((const UINT8 *)headers->Data,
+                        payload_len, set + object[pc].arg[0],
+                        object[pc].arg[1],
+                        (object[pc].test == WINDIVERT_FILTER_TEST_PREFIX)));
+                pc = (pass? object[pc].success: object[pc].failure);
+                continue;
+            default:
+                break;
+        }
         val[1] = val[2] = val[3] = 0;
         switch (object[pc].field)
         {
@@ -2408,10 +3369,43 @@ extern BOOL WinDivertHelperEvalFilter(const char *filter,
             case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
                 val[0] = payload_len;
                 break;
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD:
+                pass = WinDivertPayloadLoad((const UINT8 *)headers->Data,
+                    payload_len, object[pc].arg[1], 1, val);
+                break;
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD16:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD16:
+                pass = WinDivertPayloadLoad((const UINT8 *)headers->Data,
+                    payload_len, object[pc].arg[1], 2, val);
+                break;
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD32:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD32:
+                pass = WinDivertPayloadLoad((const UINT8 *)headers->Data,
+                    payload_len, object[pc].arg[1], 4, val);
+                break;
             default:
                 SetLastError(ERROR_INVALID_PARAMETER);
                 return FALSE;
         }
+        if (!pass)
+        {
+            pc = object[pc].failure;            // Beyond the payload.
+            continue;
+        }
+        switch (object[pc].field)
+        {
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD:
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD16:
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD32:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD16:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD32:
+                val[1] = object[pc].arg[1];     // Ignore the offset word.
+                break;
+            default:
+                break;
+        }
         cmp = WinDivertBigNumCompare(val, object[pc].arg);
         switch (object[pc].test)
         {
@@ -2433,6 +3427,13 @@ extern BOOL WinDivertHelperEvalFilter(const char *filter,
             case WINDIVERT_FILTER_TEST_GEQ:
                 pass = (cmp >= 0);
                 break;
+            case WINDIVERT_FILTER_TEST_IN:
+                pass = WinDivertSetMember(val,
+                    (object[pc].field == WINDIVERT_FILTER_FIELD_IPV6_SRCADDR ||
+                     object[pc].field == WINDIVERT_FILTER_FIELD_IPV6_DSTADDR?
+                        128: 32),
+                    set + object[pc].arg[0], object[pc].arg[1]);
+                break;
             default:
                 SetLastError(ERROR_INVALID_PARAMETER);
                 return FALSE;
@@ -2441,3 +3442,903 @@ extern BOOL WinDivertHelperEvalFilter(const char *filter,
     }
 }
 
+/*
+ * Evaluate the given filter with the given packet as input.
+ */
+extern BOOL WinDivertHelperEvalFilter(const char *filter,
+    WINDIVERT_LAYER layer, PVOID packet, UINT packet_len,
+    PWINDIVERT_ADDRESS addr)
+{
+    ERROR err;
+    WINDIVERT_HEADERS headers;
+    windivert_ioctl_filter_t object;
+    windivert_ioctl_set_t set;
+    UINT obj_len, set_len;
+    BOOL result = FALSE;
+
+    if (filter == NULL || packet == NULL || addr == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    object = (windivert_ioctl_filter_t)malloc(
+        WINDIVERT_FILTER_OBJECT_MAXSIZE);
+    if (object == NULL)
+    {
+        return FALSE;
+    }
+    err = WinDivertCompileFilter(filter, layer, object, &obj_len, &set_len);
+    if (IS_ERROR(err))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        goto WinDivertHelperEvalFilterExit;
+    }
+    set = (windivert_ioctl_set_t)(object + obj_len);
+
+    WinDivertHelperParsePacket(packet, packet_len, &headers.IpHdr,
+        &headers.Ipv6Hdr, &headers.IcmpHdr, &headers.Icmpv6Hdr,
+        &headers.TcpHdr, &headers.UdpHdr, &headers.Data, &headers.DataLen);
+    result = WinDivertEvalObject(object, obj_len, set, &headers, addr);
+
+WinDivertHelperEvalFilterExit:
+    free(object);
+    return result;
+}
+
+/*
+ * Compile the given filter string into a filter object.
+ */
+extern PWINDIVERT_FILTER WinDivertHelperCompileFilter(const char *filter,
+    WINDIVERT_LAYER layer)
+{
+    ERROR err;
+    windivert_ioctl_filter_t object;
+    PWINDIVERT_FILTER result = NULL;
+    UINT obj_len, set_len;
+    size_t size;
+
+    if (filter == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    object = (windivert_ioctl_filter_t)malloc(
+        WINDIVERT_FILTER_OBJECT_MAXSIZE);
+    if (object == NULL)
+    {
+        return NULL;
+    }
+    err = WinDivertCompileFilter(filter, layer, object, &obj_len, &set_len);
+    if (IS_ERROR(err))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        goto WinDivertHelperCompileFilterExit;
+    }
+
+    // Copy the object into an allocation of the exact size:
+    size = obj_len * sizeof(struct windivert_ioctl_filter_s) +
+        set_len * sizeof(struct windivert_ioctl_set_s);
+    result = (PWINDIVERT_FILTER)malloc(sizeof(WINDIVERT_FILTER) + size);
+    if (result == NULL)
+    {
+        goto WinDivertHelperCompileFilterExit;
+    }
+    result->obj_len = obj_len;
+    result->set_len = set_len;
+    memcpy(result + 1, object, size);
+
+WinDivertHelperCompileFilterExit:
+    free(object);
+    return result;
+}
+
+/*
+ * Evaluate a filter object with the given parsed packet as input.
+ */
+extern BOOL WinDivertHelperEvalFilterHeaders(const WINDIVERT_FILTER *filter,
+    const WINDIVERT_HEADERS *headers, const WINDIVERT_ADDRESS *addr)
+{
+    const struct windivert_ioctl_filter_s *object;
+
+    if (filter == NULL || headers == NULL || addr == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    object = WINDIVERT_FILTER_OBJECT(filter);
+    return WinDivertEvalObject(object, filter->obj_len,
+        (const struct windivert_ioctl_set_s *)(object + filter->obj_len),
+        headers, addr);
+}
+
+/*
+ * Evaluate a filter object against each packet in a batch, as returned by
+ * WinDivertRecvBatch().
+ */
+extern BOOL WinDivertHelperEvalFilterBatch(const WINDIVERT_FILTER *filter,
+    const VOID *batch, UINT batch_len, UINT count, BOOL *results)
+{
+    const struct windivert_ioctl_filter_s *object;
+    const struct windivert_ioctl_set_s *set;
+    PWINDIVERT_BATCH_HDR hdr;
+    WINDIVERT_HEADERS headers;
+    UINT8 *end;
+    UINT i;
+
+    if (filter == NULL || batch == NULL || results == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    object = WINDIVERT_FILTER_OBJECT(filter);
+    set = (const struct windivert_ioctl_set_s *)(object + filter->obj_len);
+    hdr = (PWINDIVERT_BATCH_HDR)batch;
+    end = (UINT8 *)batch + batch_len;
+    for (i = 0; i < count; i++)
+    {
+        if ((UINT8 *)(hdr + 1) > end ||
+            hdr->Length > (UINT)(end - (UINT8 *)(hdr + 1)))
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        WinDivertHelperParsePacket(WINDIVERT_BATCH_PACKET(hdr), hdr->Length,
+            &headers.IpHdr, &headers.Ipv6Hdr, &headers.IcmpHdr,
+            &headers.Icmpv6Hdr, &headers.TcpHdr, &headers.UdpHdr,
+            &headers.Data, &headers.DataLen);
+        results[i] = WinDivertEvalObject(object, filter->obj_len, set,
+            &headers, &hdr->Addr);
+        hdr = WINDIVERT_BATCH_NEXT(hdr);
+    }
+    return TRUE;
+}
+
+/*
+ * Free a filter object.
+ */
+extern VOID WinDivertHelperFreeFilter(PWINDIVERT_FILTER filter)
+{
+    free(filter);
+}
+
+
+/*
+ * Flow table.  This is an open addressing (linear probing) hash table of
+ * cache line sized slots.  Writers are serialized by an SRW lock, whereas
+ * readers are lock-free, and use the slot's sequence number (odd while the
+ * slot is being written) to detect torn reads.  Removed slots are marked as
+ * deleted, so a reader never misses a flow that is in the table for the
+ * whole lookup.  Once too many deleted slots have built up, the table is
+ * rebuilt in place; this moves slots, so the table also has a sequence
+ * number (odd during a rebuild), and readers retry any lookup that a
+ * rebuild overlapped.
+ *
+ * Idle flows are removed with a lazy timer wheel: a flow is linked to the
+ * bucket of its deadline when it is inserted, and is only checked (and
+ * possibly moved to a later bucket) when that bucket is reached.
+ */
+#define WINDIVERT_FLOW_HASH_EMPTY       0
+#define WINDIVERT_FLOW_HASH_DELETED     1
+#define WINDIVERT_FLOW_NONE             0xFFFFFFFF
+#define WINDIVERT_FLOW_WHEEL_SIZE       256
+#define WINDIVERT_FLOW_WHEEL_TICKS      128     // Ticks per idle timeout.
+#define WINDIVERT_FLOW_DELETED_SHIFT    3       // Rebuild at 1/8 deleted.
+
+struct windivert_flow_key_s
+{
+    UINT32 addr[2][4];                  // Endpoint addresses.
+    UINT16 port[2];                     // Endpoint ports.
+    UINT8 version;                      // IP version.
+    UINT8 protocol;                     // IP protocol.
+    UINT16 reserved;
+};
+typedef struct windivert_flow_key_s *windivert_flow_key_t;
+
+struct windivert_flow_slot_s
+{
+    volatile LONG seq;                  // Odd while being written.
+    volatile UINT32 hash;               // Key hash, or EMPTY/DELETED.
+    struct windivert_flow_key_s key;    // Key (lowest endpoint first).
+    UINT8 state;                        // TCP state.
+    UINT8 initiator;                    // Key endpoint of the initiator.
+    UINT8 fin;                          // Directions that sent a FIN.
+    UINT8 reserved;
+    UINT32 wheel_next;                  // Next flow in the wheel bucket.
+    INT64 first_seen;                   // Time of the first packet.
+    INT64 last_seen;                    // Time of the last packet.
+    UINT64 packets[2];                  // Packets from initiator/responder.
+    UINT64 bytes[2];                    // Bytes from initiator/responder.
+    UINT64 data;                        // User data.
+    UINT8 pad[16];                      // (Pad to 128 bytes.)
+};
+typedef struct windivert_flow_slot_s *windivert_flow_slot_t;
+
+struct windivert_flow_table_s
+{
+    SRWLOCK lock;                       // Serializes writers.
+    volatile LONG seq;                  // Odd while being rebuilt.
+    windivert_flow_slot_t slots;        // Slots.
+    UINT32 mask;                        // Number of slots - 1.
+    UINT32 size;                        // Maximum number of flows.
+    UINT32 count;                       // Number of flows.
+    UINT32 deleted;                     // Number of deleted slots.
+    INT64 timeout;                      // Idle timeout.
+    INT64 tick;                         // Length of a wheel tick.
+    INT64 wheel_tick;                   // Last expired wheel tick.
+    UINT32 wheel[WINDIVERT_FLOW_WHEEL_SIZE];
+                                        // Wheel buckets.
+};
+
+/*
+ * Build the (direction independent) flow key of a packet.  Returns the key
+ * endpoint that sent the packet, or -1 if the packet is not IPv4/IPv6.
+ */
+static INT WinDivertFlowKey(const WINDIVERT_HEADERS *headers,
+    windivert_flow_key_t key, UINT *len)
+{
+    UINT32 src[4], dst[4];
+    UINT16 src_port = 0, dst_port = 0;
+    INT cmp;
+
+    memset(key, 0, sizeof(struct windivert_flow_key_s));
+    memset(src, 0, sizeof(src));
+    memset(dst, 0, sizeof(dst));
+    if (headers->IpHdr != NULL)
+    {
+        key->version  = 4;
+        key->protocol = headers->IpHdr->Protocol;
+        src[0] = headers->IpHdr->SrcAddr;
+        dst[0] = headers->IpHdr->DstAddr;
+        *len = ntohs(headers->IpHdr->Length);
+    }
+    else if (headers->Ipv6Hdr != NULL)
+    {
+        key->version  = 6;
+        key->protocol = headers->Ipv6Hdr->NextHdr;
+        memcpy(src, headers->Ipv6Hdr->SrcAddr, sizeof(src));
+        memcpy(dst, headers->Ipv6Hdr->DstAddr, sizeof(dst));
+        *len = ntohs(headers->Ipv6Hdr->Length) + sizeof(WINDIVERT_IPV6HDR);
+    }
+    else
+    {
+        return -1;
+    }
+    if (headers->TcpHdr != NULL)
+    {
+        key->protocol = IPPROTO_TCP;
+        src_port = headers->TcpHdr->SrcPort;
+        dst_port = headers->TcpHdr->DstPort;
+    }
+    else if (headers->UdpHdr != NULL)
+    {
+        key->protocol = IPPROTO_UDP;
+        src_port = headers->UdpHdr->SrcPort;
+        dst_port = headers->UdpHdr->DstPort;
+    }
+    else if (headers->IcmpHdr != NULL)
+    {
+        key->protocol = IPPROTO_ICMP;
+    }
+    else if (headers->Icmpv6Hdr != NULL)
+    {
+        key->protocol = IPPROTO_ICMPV6;
+    }
+
+    cmp = memcmp(src, dst, sizeof(src));
+    cmp = (cmp != 0? cmp: (INT)src_port - (INT)dst_port);
+    if (cmp <= 0)
+    {
+        memcpy(key->addr[0], src, sizeof(src));
+        memcpy(key->addr[1], dst, sizeof(dst));
+        key->port[0] = src_port;
+        key->port[1] = dst_port;
+        return 0;
+    }
+    memcpy(key->addr[0], dst, sizeof(dst));
+    memcpy(key->addr[1], src, sizeof(src));
+    key->port[0] = dst_port;
+    key->port[1] = src_port;
+    return 1;
+}
+
+/*
+ * Hash a flow key.  The EMPTY and DELETED values are never returned.
+ */
+static UINT32 WinDivertFlowHash(const struct windivert_flow_key_s *key)
+{
+    const UINT32 *words = (const UINT32 *)key;
+    UINT32 hash = 0;
+    UINT i;
+
+    for (i = 0; i < sizeof(struct windivert_flow_key_s) / sizeof(UINT32);
+            i++)
+    {
+        hash = (hash ^ words[i]) * 0x9E3779B1;
+        hash ^= hash >> 15;
+    }
+    return (hash <= WINDIVERT_FLOW_HASH_DELETED? hash + 2: hash);
+}
+
+/*
+ * Find the slot of a flow (writers only).  Also returns the first free slot
+ * on the probe sequence, or NONE.
+ */
+static UINT32 WinDivertFlowFind(PWINDIVERT_FLOW_TABLE table,
+    const struct windivert_flow_key_s *key, UINT32 hash, UINT32 *free_idx)
+{
+    windivert_flow_slot_t slot;
+    UINT32 i, idx = hash & table->mask;
+
+    *free_idx = WINDIVERT_FLOW_NONE;
+    for (i = 0; i <= table->mask; i++, idx = (idx + 1) & table->mask)
+    {
+        slot = table->slots + idx;
+        if (slot->hash == WINDIVERT_FLOW_HASH_EMPTY ||
+            slot->hash == WINDIVERT_FLOW_HASH_DELETED)
+        {
+            *free_idx = (*free_idx == WINDIVERT_FLOW_NONE? idx: *free_idx);
+            if (slot->hash == WINDIVERT_FLOW_HASH_EMPTY)
+            {
+                break;
+            }
+            continue;
+        }
+        if (slot->hash == hash &&
+            memcmp(&slot->key, key, sizeof(struct windivert_flow_key_s)) == 0)
+        {
+            return idx;
+        }
+    }
+    return WINDIVERT_FLOW_NONE;
+}
+
+/*
+ * Begin/end a slot write (writers only).
+ */
+static void WinDivertFlowWriteBegin(windivert_flow_slot_t slot)
+{
+    InterlockedIncrement(&slot->seq);
+}
+static void WinDivertFlowWriteEnd(windivert_flow_slot_t slot)
+{
+    InterlockedIncrement(&slot->seq);
+}
+
+/*
+ * Link a flow to the wheel bucket of its deadline (writers only).
+ */
+static void WinDivertFlowSchedule(PWINDIVERT_FLOW_TABLE table, UINT32 idx)
+{
+    windivert_flow_slot_t slot = table->slots + idx;
+    INT64 tick;
+    UINT32 bucket;
+
+    tick = (slot->last_seen + table->timeout) / table->tick;
+    tick = (tick <= table->wheel_tick? table->wheel_tick + 1: tick);
+    bucket = (UINT32)tick & (WINDIVERT_FLOW_WHEEL_SIZE - 1);
+    slot->wheel_next = table->wheel[bucket];
+    table->wheel[bucket] = idx;
+}
+
+/*
+ * Remove a flow (writers only).  The flow must already be unlinked from the
+ * wheel.
+ */
+static void WinDivertFlowDelete(PWINDIVERT_FLOW_TABLE table, UINT32 idx)
+{
+    windivert_flow_slot_t slot = table->slots + idx;
+    windivert_flow_slot_t next = table->slots + ((idx + 1) & table->mask);
+
+    WinDivertFlowWriteBegin(slot);
+    slot->hash = (next->hash == WINDIVERT_FLOW_HASH_EMPTY?
+        WINDIVERT_FLOW_HASH_EMPTY: WINDIVERT_FLOW_HASH_DELETED);
+    WinDivertFlowWriteEnd(slot);
+    table->count--;
+    table->deleted += (slot->hash == WINDIVERT_FLOW_HASH_DELETED? 1: 0);
+
+    // Deleted slots that end a probe sequence can be made empty:
+    while (slot->hash == WINDIVERT_FLOW_HASH_EMPTY)
+    {
+        idx = (idx - 1) & table->mask;
+        slot = table->slots + idx;
+        if (slot->hash != WINDIVERT_FLOW_HASH_DELETED)
+        {
+            break;
+        }
+        WinDivertFlowWriteBegin(slot);
+        slot->hash = WINDIVERT_FLOW_HASH_EMPTY;
+        WinDivertFlowWriteEnd(slot);
+        table->deleted--;
+    }
+}
+
+/*
+ * Rebuild the table in place to clear all deleted slots (writers only).
+ * Lock-free readers see the odd table sequence number and retry.  If
+ * memory is low the rebuild is skipped; the table remains correct, only
+ * slower.
+ */
+static void WinDivertFlowRebuild(PWINDIVERT_FLOW_TABLE table)
+{
+    windivert_flow_slot_t flows, slot;
+    UINT32 i, j, idx, count = 0;
+    LONG seq;
+
+    flows = (windivert_flow_slot_t)malloc(
+        (SIZE_T)table->count * sizeof(struct windivert_flow_slot_s));
+    if (flows == NULL && table->count != 0)
+    {
+        return;
+    }
+    for (i = 0; i <= table->mask; i++)
+    {
+        slot = table->slots + i;
+        if (slot->hash != WINDIVERT_FLOW_HASH_EMPTY &&
+            slot->hash != WINDIVERT_FLOW_HASH_DELETED)
+        {
+            memcpy(flows + count, slot, sizeof(struct windivert_flow_slot_s));
+            count++;
+        }
+    }
+
+    InterlockedIncrement(&table->seq);
+    for (i = 0; i <= table->mask; i++)
+    {
+        table->slots[i].hash = WINDIVERT_FLOW_HASH_EMPTY;
+    }
+    for (i = 0; i < WINDIVERT_FLOW_WHEEL_SIZE; i++)
+    {
+        table->wheel[i] = WINDIVERT_FLOW_NONE;
+    }
+    for (j = 0; j < count; j++)
+    {
+        idx = flows[j].hash & table->mask;
+        while (table->slots[idx].hash != WINDIVERT_FLOW_HASH_EMPTY)
+        {
+            idx = (idx + 1) & table->mask;
+        }
+        slot = table->slots + idx;
+        seq = slot->seq;
+        memcpy(slot, flows + j, sizeof(struct windivert_flow_slot_s));
+        slot->seq = seq;
+        WinDivertFlowSchedule(table, idx);
+    }
+    table->deleted = 0;
+    InterlockedIncrement(&table->seq);
+    free(flows);
+}
+
+/*
+ * Track the TCP state of a flow given a packet from the initiator (dir=0)
+ * or responder (dir=1).
+ */
+static void WinDivertFlowTrackTcp(windivert_flow_slot_t slot,
+    const WINDIVERT_TCPHDR *tcp_header, UINT dir)
+{
+    if (tcp_header->Rst)
+    {
+        slot->state = WINDIVERT_FLOW_STATE_CLOSED;
+        return;
+    }
+    if (tcp_header->Syn && !tcp_header->Ack &&
+        (slot->state == WINDIVERT_FLOW_STATE_TIME_WAIT ||
+         slot->state == WINDIVERT_FLOW_STATE_CLOSED))
+    {
+        // The connection is being reopened, possibly by the other side:
+        if (dir == 1)
+        {
+            UINT64 tmp;
+
+            slot->initiator = (UINT8)(1 - slot->initiator);
+            tmp = slot->packets[0];
+            slot->packets[0] = slot->packets[1];
+            slot->packets[1] = tmp;
+            tmp = slot->bytes[0];
+            slot->bytes[0] = slot->bytes[1];
+            slot->bytes[1] = tmp;
+        }
+        slot->state = WINDIVERT_FLOW_STATE_SYN_SENT;
+        slot->fin = 0;
+        return;
+    }
+    switch (slot->state)
+    {
+        case WINDIVERT_FLOW_STATE_SYN_SENT:
+            if (dir == 1 && tcp_header->Syn && tcp_header->Ack)
+            {
+                slot->state = WINDIVERT_FLOW_STATE_SYN_RECEIVED;
+            }
+            break;
+        case WINDIVERT_FLOW_STATE_SYN_RECEIVED:
+            if (dir == 0 && !tcp_header->Syn && tcp_header->Ack)
+            {
+                slot->state = WINDIVERT_FLOW_STATE_ESTABLISHED;
+            }
+            break;
+        default:
+            break;
+    }
+    if (tcp_header->Fin &&
+        (slot->state == WINDIVERT_FLOW_STATE_SYN_RECEIVED ||
+         slot->state == WINDIVERT_FLOW_STATE_ESTABLISHED ||
+         slot->state == WINDIVERT_FLOW_STATE_FIN_WAIT))
+    {
+        slot->fin |= (UINT8)(1 << dir);
+        slot->state = (slot->fin == 0x03? WINDIVERT_FLOW_STATE_TIME_WAIT:
+            WINDIVERT_FLOW_STATE_FIN_WAIT);
+    }
+}
+
+/*
+ * Copy a flow out of a slot.
+ */
+static void WinDivertFlowCopy(const struct windivert_flow_slot_s *slot,
+    INT sender, PWINDIVERT_FLOW flow)
+{
+    UINT src = slot->initiator, dst = 1 - slot->initiator;
+
+    memcpy(flow->SrcAddr, slot->key.addr[src], sizeof(flow->SrcAddr));
+    memcpy(flow->DstAddr, slot->key.addr[dst], sizeof(flow->DstAddr));
+    flow->SrcPort    = ntohs(slot->key.port[src]);
+    flow->DstPort    = ntohs(slot->key.port[dst]);
+    flow->IpVersion  = slot->key.version;
+    flow->Protocol   = slot->key.protocol;
+    flow->State      = slot->state;
+    flow->Reply      = (sender != (INT)src);
+    flow->FirstSeen  = slot->first_seen;
+    flow->LastSeen   = slot->last_seen;
+    flow->Packets[0] = slot->packets[0];
+    flow->Packets[1] = slot->packets[1];
+    flow->Bytes[0]   = slot->bytes[0];
+    flow->Bytes[1]   = slot->bytes[1];
+    flow->Data       = slot->data;
+}
+
+/*
+ * Create a flow table.
+ */
+extern PWINDIVERT_FLOW_TABLE WinDivertHelperFlowTableCreate(UINT size,
+    UINT timeout)
+{
+    PWINDIVERT_FLOW_TABLE table;
+    LARGE_INTEGER freq, now;
+    UINT64 slots;
+    UINT i;
+
+    if (size == 0 || size > WINDIVERT_FLOW_TABLE_SIZE_MAX || timeout == 0 ||
+        timeout > WINDIVERT_FLOW_TIMEOUT_MAX)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    // Keep the load factor at or below 3/4:
+    for (slots = 1; 3 * slots < 4 * (UINT64)size; slots <<= 1)
+        ;
+
+    table = (PWINDIVERT_FLOW_TABLE)malloc(
+        sizeof(struct windivert_flow_table_s));
+    if (table == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    memset(table, 0, sizeof(struct windivert_flow_table_s));
+    table->slots = (windivert_flow_slot_t)VirtualAlloc(NULL,
+        (SIZE_T)(slots * sizeof(struct windivert_flow_slot_s)),
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (table->slots == NULL)
+    {
+        free(table);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    InitializeSRWLock(&table->lock);
+    table->mask = (UINT32)(slots - 1);
+    table->size = size;
+
+    // Timestamps are in QueryPerformanceCounter() units, the same as the
+    // WINDIVERT_ADDRESS Timestamp field.
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    table->timeout = (INT64)timeout * freq.QuadPart / 1000;
+    table->timeout = (table->timeout == 0? 1: table->timeout);
+    table->tick = table->timeout / WINDIVERT_FLOW_WHEEL_TICKS;
+    table->tick = (table->tick == 0? 1: table->tick);
+    table->wheel_tick = now.QuadPart / table->tick;
+    for (i = 0; i < WINDIVERT_FLOW_WHEEL_SIZE; i++)
+    {
+        table->wheel[i] = WINDIVERT_FLOW_NONE;
+    }
+    return table;
+}
+
+/*
+ * Update (or create) the flow of a packet.
+ */
+extern BOOL WinDivertHelperFlowTableUpdate(PWINDIVERT_FLOW_TABLE table,
+    const WINDIVERT_HEADERS *headers, INT64 timestamp, PWINDIVERT_FLOW flow)
+{
+    struct windivert_flow_key_s key;
+    windivert_flow_slot_t slot;
+    UINT32 hash, idx, free_idx;
+    UINT len, dir;
+    INT sender;
+
+    if (table == NULL || headers == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    sender = WinDivertFlowKey(headers, &key, &len);
+    if (sender < 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    hash = WinDivertFlowHash(&key);
+
+    AcquireSRWLockExclusive(&table->lock);
+    idx = WinDivertFlowFind(table, &key, hash, &free_idx);
+    if (idx == WINDIVERT_FLOW_NONE)
+    {
+        if (table->count >= table->size || free_idx == WINDIVERT_FLOW_NONE)
+        {
+            ReleaseSRWLockExclusive(&table->lock);
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return FALSE;
+        }
+        idx = free_idx;
+        slot = table->slots + idx;
+        table->deleted -= (slot->hash == WINDIVERT_FLOW_HASH_DELETED? 1: 0);
+        WinDivertFlowWriteBegin(slot);
+        slot->key        = key;
+        slot->hash       = hash;
+        slot->state      = WINDIVERT_FLOW_STATE_NONE;
+        slot->initiator  = (UINT8)sender;
+        slot->fin        = 0;
+        slot->first_seen = timestamp;
+        slot->last_seen  = timestamp;
+        slot->packets[0] = slot->packets[1] = 0;
+        slot->bytes[0]   = slot->bytes[1]   = 0;
+        slot->data       = 0;
+        if (headers->TcpHdr != NULL)
+        {
+            // The initiator is the sender of the SYN:
+            if (headers->TcpHdr->Syn && !headers->TcpHdr->Ack)
+            {
+                slot->state = WINDIVERT_FLOW_STATE_SYN_SENT;
+            }
+            else if (headers->TcpHdr->Syn)
+            {
+                slot->state = WINDIVERT_FLOW_STATE_SYN_RECEIVED;
+                slot->initiator = (UINT8)(1 - sender);
+            }
+            else
+            {
+                slot->state = WINDIVERT_FLOW_STATE_ESTABLISHED;
+            }
+        }
+        table->count++;
+        WinDivertFlowSchedule(table, idx);
+    }
+    else
+    {
+        slot = table->slots + idx;
+        WinDivertFlowWriteBegin(slot);
+        slot->last_seen = (timestamp > slot->last_seen? timestamp:
+            slot->last_seen);
+    }
+    dir = (sender == slot->initiator? 0: 1);
+    slot->packets[dir]++;
+    slot->bytes[dir] += len;
+    if (headers->TcpHdr != NULL)
+    {
+        WinDivertFlowTrackTcp(slot, headers->TcpHdr, dir);
+    }
+    WinDivertFlowWriteEnd(slot);
+    if (flow != NULL)
+    {
+        WinDivertFlowCopy(slot, sender, flow);
+    }
+    ReleaseSRWLockExclusive(&table->lock);
+    return TRUE;
+}
+
+/*
+ * Look up the flow of a packet.  This function does not take the table
+ * lock, and may be called concurrently with any other flow table function
+ * (except WinDivertHelperFlowTableFree()).
+ */
+extern BOOL WinDivertHelperFlowTableLookup(PWINDIVERT_FLOW_TABLE table,
+    const WINDIVERT_HEADERS *headers, PWINDIVERT_FLOW flow)
+{
+    struct windivert_flow_key_s key;
+    struct windivert_flow_slot_s copy;
+    windivert_flow_slot_t slot;
+    UINT32 hash, slot_hash, i, idx;
+    UINT len;
+    LONG seq, table_seq;
+    INT sender;
+    BOOL match, found;
+
+    if (table == NULL || headers == NULL || flow == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    sender = WinDivertFlowKey(headers, &key, &len);
+    if (sender < 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    hash = WinDivertFlowHash(&key);
+
+    for (;;)
+    {
+        table_seq = table->seq;
+        if ((table_seq & 1) != 0)
+        {
+            YieldProcessor();           // Table is being rebuilt.
+            continue;
+        }
+        MemoryBarrier();
+        found = FALSE;
+        idx = hash & table->mask;
+        for (i = 0; i <= table->mask; )
+        {
+            slot = table->slots + idx;
+            seq = slot->seq;
+            if ((seq & 1) != 0)
+            {
+                YieldProcessor();
+                continue;
+            }
+            MemoryBarrier();
+            slot_hash = slot->hash;
+            match = (slot_hash == hash);
+            if (match)
+            {
+                memcpy(&copy, (const void *)slot, sizeof(copy));
+            }
+            MemoryBarrier();
+            if (slot->seq != seq)
+            {
+                continue;               // Torn read; retry the slot.
+            }
+            if (slot_hash == WINDIVERT_FLOW_HASH_EMPTY)
+            {
+                break;
+            }
+            if (match && memcmp(&copy.key, &key, sizeof(key)) == 0)
+            {
+                found = TRUE;
+                break;
+            }
+            i++;
+            idx = (idx + 1) & table->mask;
+        }
+        MemoryBarrier();
+        if (table->seq == table_seq)
+        {
+            break;
+        }
+        // Overlapped a rebuild; retry the lookup.
+    }
+    if (!found)
+    {
+        SetLastError(ERROR_NOT_FOUND);
+        return FALSE;
+    }
+    WinDivertFlowCopy(&copy, sender, flow);
+    return TRUE;
+}
+
+/*
+ * Set the user data of the flow of a packet.
+ */
+extern BOOL WinDivertHelperFlowTableSetData(PWINDIVERT_FLOW_TABLE table,
+    const WINDIVERT_HEADERS *headers, UINT64 data)
+{
+    struct windivert_flow_key_s key;
+    windivert_flow_slot_t slot;
+    UINT32 hash, idx, free_idx;
+    UINT len;
+
+    if (table == NULL || headers == NULL ||
+        WinDivertFlowKey(headers, &key, &len) < 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    hash = WinDivertFlowHash(&key);
+
+    AcquireSRWLockExclusive(&table->lock);
+    idx = WinDivertFlowFind(table, &key, hash, &free_idx);
+    if (idx == WINDIVERT_FLOW_NONE)
+    {
+        ReleaseSRWLockExclusive(&table->lock);
+        SetLastError(ERROR_NOT_FOUND);
+        return FALSE;
+    }
+    slot = table->slots + idx;
+    WinDivertFlowWriteBegin(slot);
+    slot->data = data;
+    WinDivertFlowWriteEnd(slot);
+    ReleaseSRWLockExclusive(&table->lock);
+    return TRUE;
+}
+
+/*
+ * Remove the flows that have been idle since before (timestamp - timeout).
+ * Returns the number of flows removed.
+ */
+extern UINT WinDivertHelperFlowTableExpire(PWINDIVERT_FLOW_TABLE table,
+    INT64 timestamp)
+{
+    windivert_flow_slot_t slot;
+    INT64 tick, now_tick;
+    UINT32 bucket, idx, next;
+    UINT count = 0;
+
+    if (table == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+
+    AcquireSRWLockExclusive(&table->lock);
+    now_tick = timestamp / table->tick;
+    tick = table->wheel_tick;
+    if (now_tick - tick > WINDIVERT_FLOW_WHEEL_SIZE)
+    {
+        // Every bucket is due; visit each bucket once.
+        tick = now_tick - WINDIVERT_FLOW_WHEEL_SIZE;
+    }
+    while (tick < now_tick)
+    {
+        tick++;
+        table->wheel_tick = tick;
+        bucket = (UINT32)tick & (WINDIVERT_FLOW_WHEEL_SIZE - 1);
+        idx = table->wheel[bucket];
+        table->wheel[bucket] = WINDIVERT_FLOW_NONE;
+        for (; idx != WINDIVERT_FLOW_NONE; idx = next)
+        {
+            slot = table->slots + idx;
+            next = slot->wheel_next;
+            if (slot->last_seen + table->timeout <= timestamp)
+            {
+                WinDivertFlowDelete(table, idx);
+                count++;
+            }
+            else
+            {
+                // Active since it was scheduled; move to its new deadline.
+                WinDivertFlowSchedule(table, idx);
+            }
+        }
+    }
+    if (table->deleted >
+            ((table->mask + 1) >> WINDIVERT_FLOW_DELETED_SHIFT))
+    {
+        WinDivertFlowRebuild(table);
+    }
+    ReleaseSRWLockExclusive(&table->lock);
+    return count;
+}
+
+/*
+ * Free a flow table.
+ */
+extern VOID WinDivertHelperFlowTableFree(PWINDIVERT_FLOW_TABLE table)
+{
+    if (table == NULL)
+    {
+        return;
+    }
+    VirtualFree(table->slots, 0, MEM_RELEASE);
+    free(table);
+}
@@ -33,6 +33,15 @@
 
 #define MAXBUF  0xFFFF
 
+/*
+ * Per-thread configuration.
+ */
+typedef struct
+{
+    HANDLE handle;
+    UINT queue;
+} CONFIG, *PCONFIG;
+
 static DWORD passthru(LPVOID arg);
 
 /*
@@ -42,6 +51,7 @@ int __cdecl main(int argc, char **argv)
 {
     int num_threads, i;
     HANDLE handle, thread;
+    static CONFIG config[64];
 
     if (argc != 3)
     {
@@ -55,8 +65,9 @@ int __cdecl main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    // Divert traffic matching the filter:
-    handle = WinDivertOpen(argv[1], WINDIVERT_LAYER_NETWORK, 0, 0);
+    // Divert traffic matching the filter, with one sub-queue per thread:
+    handle = WinDivertOpen(argv[1], WINDIVERT_LAYER_NETWORK, 0,
+        WINDIVERT_FLAG_QUEUES(num_threads));
     if (handle == INVALID_HANDLE_VALUE)
     {
         if (GetLastError() == ERROR_INVALID_PARAMETER)
@@ -70,10 +81,15 @@ int __cdecl main(int argc, char **argv)
     }
 
     // Start the threads
+    for (i = 0; i < num_threads; i++)
+    {
+        config[i].handle = handle;
+        config[i].queue = (UINT)i;
+    }
     for (i = 1; i < num_threads; i++)
     {
         thread = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)passthru,
-            (LPVOID)handle, 0, NULL);
+            (LPVOID)&config[i], 0, NULL);
         if (thread == NULL)
         {
             fprintf(stderr, "error: failed to start passthru thread (%u)\n",
@@ -83,7 +99,7 @@ int __cdecl main(int argc, char **argv)
     }
 
     // Main thread:
-    passthru((LPVOID)handle);
+    passthru((LPVOID)&config[0]);
 
     return 0;
 }
@@ -94,13 +110,17 @@ static DWORD passthru(LPVOID arg)
     unsigned char packet[MAXBUF];
     UINT packet_len;
     WINDIVERT_ADDRESS addr;
-    HANDLE handle = (HANDLE)arg;
+    PCONFIG config = (PCONFIG)arg;
+    HANDLE handle = config->handle;
 
     // Main loop:
     while (TRUE)
     {
-        // Read a matching packet.
-        if (!WinDivertRecv(handle, packet, sizeof(packet), &addr, &packet_len))
+        // Read a matching packet from this thread's sub-queue.  All packets
+        // of a flow use the same sub-queue, so they are handled in order.
+        if (!WinDivertRecvEx(handle, packet, sizeof(packet),
+                WINDIVERT_RECV_FLAG_QUEUE(config->queue), &addr, &packet_len,
+                NULL))
         {
             fprintf(stderr, "warning: failed to read packet (%d)\n",
                 GetLastError());
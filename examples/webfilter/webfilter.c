@@ -162,7 +162,9 @@ int __cdecl main(int argc, char **argv)
             "outbound && "              // Outbound traffic only
             "ip && "                    // Only IPv4 supported
             "tcp.DstPort == 80 && "     // HTTP (port 80) only
-            "tcp.PayloadLength > 0",    // TCP data packets only
+            "tcp.PayloadLength > 0 && " // TCP data packets only
+            "tcp.Payload startswith {\"GET /\", \"POST /\"}",
+                                        // HTTP requests only
             WINDIVERT_LAYER_NETWORK, priority, 0
         );
     if (handle == INVALID_HANDLE_VALUE)
@@ -29,6 +29,7 @@
 
 #ifdef __MINGW32__
 #define __in
+#define __in_opt
 #define __out
 #define __out_opt
 #define __inout
@@ -60,11 +61,67 @@ typedef struct
     UINT32 IfIdx;                       /* Packet's interface index. */
     UINT32 SubIfIdx;                    /* Packet's sub-interface index. */
     UINT8  Direction;                   /* Packet's direction. */
+    UINT32 Length;                      /* Packet's original length. */
+    UINT64 Id;                          /* Packet's verdict ID. */
+    INT64  Timestamp;                   /* Packet's capture timestamp. */
 } WINDIVERT_ADDRESS, *PWINDIVERT_ADDRESS;
 
 #define WINDIVERT_DIRECTION_OUTBOUND    0
 #define WINDIVERT_DIRECTION_INBOUND     1
 
+/*
+ * Divert verdict.  Packets received from a handle opened with
+ * WINDIVERT_FLAG_VERDICT are held by the driver until a verdict is returned
+ * for the packet's Id by WinDivertSetVerdict().
+ */
+typedef struct
+{
+    UINT64 Id;                          /* Packet's verdict ID. */
+    UINT8  Verdict;                     /* WINDIVERT_VERDICT_* */
+} WINDIVERT_VERDICT, *PWINDIVERT_VERDICT;
+
+#define WINDIVERT_VERDICT_ACCEPT        0   /* Reinject the held packet. */
+#define WINDIVERT_VERDICT_DROP          1   /* Drop the held packet. */
+#define WINDIVERT_VERDICT_MODIFY        2   /* Release, replaced by a send. */
+
+/*
+ * Divert batch header.  Each packet returned by WinDivertRecvBatch() or
+ * passed to WinDivertSendBatch() is preceded by a batch header, and each
+ * header is 8-byte aligned.
+ */
+typedef struct
+{
+    UINT32 Length;                      /* Packet's length. */
+    WINDIVERT_ADDRESS Addr;             /* Packet's address. */
+} WINDIVERT_BATCH_HDR, *PWINDIVERT_BATCH_HDR;
+
+#define WINDIVERT_BATCH_ALIGN(len)      (((len) + 7) & ~7)
+#define WINDIVERT_BATCH_PACKET(hdr)     ((PVOID)((hdr) + 1))
+#define WINDIVERT_BATCH_NEXT(hdr)                                           \
+    ((PWINDIVERT_BATCH_HDR)((UINT8 *)(hdr) +                                \
+        WINDIVERT_BATCH_ALIGN(sizeof(WINDIVERT_BATCH_HDR) + (hdr)->Length)))
+
+/*
+ * Divert shared ring.  Each ring mapped by WinDivertRingMap() is followed by
+ * `Slots' fixed-length slots, and each slot holds one packet preceded by a
+ * batch header.  Head and Tail are free-running slot indices.
+ */
+typedef struct
+{
+    volatile UINT32 Head;               /* Producer index. */
+    UINT8  Reserved1[60];
+    volatile UINT32 Tail;               /* Consumer index. */
+    UINT8  Reserved2[60];
+    UINT32 Slots;                       /* Number of slots (power of 2). */
+    UINT32 SlotLength;                  /* Length of each slot. */
+    UINT64 Event;                       /* RX ring non-empty event. */
+    UINT8  Reserved3[48];
+} WINDIVERT_RING, *PWINDIVERT_RING;
+
+#define WINDIVERT_RING_SLOT(ring, idx)                                      \
+    ((PWINDIVERT_BATCH_HDR)((UINT8 *)((ring) + 1) +                         \
+        (SIZE_T)((idx) & ((ring)->Slots - 1)) * (ring)->SlotLength))
+
 /*
  * Divert layers.
  */
@@ -80,6 +137,19 @@ typedef enum
 #define WINDIVERT_FLAG_SNIFF            1
 #define WINDIVERT_FLAG_DROP             2
 #define WINDIVERT_FLAG_DEBUG            4
+#define WINDIVERT_FLAG_VERDICT          8
+#define WINDIVERT_FLAG_FLOW_CACHE       16
+#define WINDIVERT_FLAG_QUEUES(queues)   (((UINT64)(queues) & 0xFF) << 8)
+
+/*
+ * WinDivertRecvEx() and WinDivertRecvBatchEx() flags.
+ */
+#define WINDIVERT_RECV_FLAG_QUEUE(queue) (((UINT64)(queue) & 0x3F) + 1)
+
+/*
+ * WinDivertSendEx() and WinDivertSendBatchEx() flags.
+ */
+#define WINDIVERT_SEND_FLAG_CHECKSUMS   1
 
 /*
  * Divert parameters.
@@ -88,12 +158,130 @@ typedef enum
 {
     WINDIVERT_PARAM_QUEUE_LEN  = 0,     /* Packet queue length. */
     WINDIVERT_PARAM_QUEUE_TIME = 1,     /* Packet queue time. */
-    WINDIVERT_PARAM_QUEUE_SIZE = 2      /* Packet queue size. */
+    WINDIVERT_PARAM_QUEUE_SIZE = 2,     /* Packet queue size. */
+    WINDIVERT_PARAM_QUEUE_MODE = 3,     /* Packet queue limit mode. */
+    WINDIVERT_PARAM_SNAPLEN    = 4,     /* Packet capture length. */
+    WINDIVERT_PARAM_OVERLOAD   = 5,     /* Overload policy. */
+    WINDIVERT_PARAM_BATCH_COUNT = 6,    /* Batch read coalescing count. */
+    WINDIVERT_PARAM_BATCH_TIME = 7,     /* Batch read coalescing time. */
+    WINDIVERT_PARAM_SAMPLE_RATE = 8,    /* 1-in-N packet sampling. */
+    WINDIVERT_PARAM_SAMPLE_MODE = 9,    /* Packet sampling mode. */
+    WINDIVERT_PARAM_RATE_LIMIT = 10,    /* Packet rate limit (packets/s). */
+    WINDIVERT_PARAM_RATE_MODE = 11      /* Packet rate limit mode. */
 } WINDIVERT_PARAM, *PWINDIVERT_PARAM;
-#define WINDIVERT_PARAM_MAX             WINDIVERT_PARAM_QUEUE_SIZE
+#define WINDIVERT_PARAM_MAX             WINDIVERT_PARAM_RATE_MODE
+
+/*
+ * WINDIVERT_PARAM_QUEUE_MODE values.
+ */
+#define WINDIVERT_QUEUE_MODE_AGGREGATE  0   /* Limits apply to all queues. */
+#define WINDIVERT_QUEUE_MODE_PER_CPU    1   /* Limits apply to each queue. */
+
+/*
+ * WINDIVERT_PARAM_OVERLOAD values.
+ */
+#define WINDIVERT_OVERLOAD_DROP_OLDEST  0   /* Drop the oldest packet. */
+#define WINDIVERT_OVERLOAD_DROP_NEWEST  1   /* Drop the new packet. */
+#define WINDIVERT_OVERLOAD_BYPASS       2   /* Pass packets unfiltered. */
+
+/*
+ * WINDIVERT_PARAM_SAMPLE_MODE values.
+ */
+#define WINDIVERT_SAMPLE_MODE_COUNT     0   /* Keep every N-th packet. */
+#define WINDIVERT_SAMPLE_MODE_RANDOM    1   /* Keep packets with prob. 1/N. */
+
+/*
+ * WINDIVERT_PARAM_RATE_MODE values.
+ */
+#define WINDIVERT_RATE_MODE_GLOBAL      0   /* One limit for all packets. */
+#define WINDIVERT_RATE_MODE_PER_FLOW    1   /* One limit per flow hash. */
+
+/*
+ * WinDivert handle statistics (see WinDivertGetStats()).  Latency bucket 0
+ * counts packets delivered in under 1us, and bucket i > 0 counts packets
+ * delivered in [2^(i-1), 2^i) us.  The last bucket also counts all longer
+ * latencies.
+ */
+#define WINDIVERT_LATENCY_BUCKETS       32
+
+typedef struct
+{
+    UINT64 Classified;                  /* Packets checked by the filter. */
+    UINT64 Matched;                     /* Packets that matched the filter. */
+    UINT64 Queued;                      /* Packets queued for reading. */
+    UINT64 FastPath;                    /* Packets read without queueing. */
+    UINT64 Reinjected;                  /* Non-matching packets reinjected. */
+    UINT64 Injected;                    /* Packets sent by user mode. */
+    UINT64 DropWorkQueue;               /* Dropped: work queue overflow. */
+    UINT64 DropQueueFull;               /* Dropped: packet queue full. */
+    UINT64 DropTimeout;                 /* Dropped: queue time exceeded. */
+    UINT64 DropNoMemory;                /* Dropped: out of memory. */
+    UINT64 DropReinject;                /* Dropped: reinjection failed. */
+    UINT64 DropRingFull;                /* Dropped: shared RX ring full. */
+    UINT64 DropVerdict;                 /* Dropped: no verdict in time. */
+    UINT64 Bypassed;                    /* Passed unfiltered: overload. */
+    UINT64 SampledOut;                  /* Not diverted: sampling. */
+    UINT64 RateLimited;                 /* Not diverted: rate limit. */
+    UINT64 DropHopLimit;                /* Dropped: TTL/HopLimit expired. */
+    UINT64 QueueLength;                 /* Current packet queue length. */
+    UINT64 QueueLengthPeak;             /* Peak packet queue length. */
+    UINT64 QueueSize;                   /* Current packet queue size. */
+    UINT64 QueueSizePeak;               /* Peak packet queue size. */
+    UINT64 ReadLatency[WINDIVERT_LATENCY_BUCKETS];
+                                        /* Capture-to-read (or -ring)
+                                           latency. */
+    UINT64 InjectLatency[WINDIVERT_LATENCY_BUCKETS];
+                                        /* Capture-to-inject latency. */
+} WINDIVERT_STATS, *PWINDIVERT_STATS;
 
 #ifndef WINDIVERT_KERNEL
 
+/*
+ * A WinDivert parameter setting (see WinDivertOpenEx()).
+ */
+typedef struct
+{
+    WINDIVERT_PARAM Param;              /* Parameter. */
+    UINT64 Value;                       /* Parameter value. */
+} WINDIVERT_PARAM_VALUE, *PWINDIVERT_PARAM_VALUE;
+
+/*
+ * Divert asynchronous receive engine (see WinDivertEngineCreate()).  The
+ * callback is invoked once for each completed batch receive, and the batch
+ * buffer is re-posted as soon as the callback returns.  A failed receive is
+ * reported with a NULL pBatch and the error in GetLastError().
+ */
+typedef struct windivert_engine_s *PWINDIVERT_ENGINE;
+
+typedef VOID (*WINDIVERT_ENGINE_CALLBACK)(
+    __in        PVOID context,
+    __in        PVOID pBatch,
+    __in        UINT batchLen,
+    __in        UINT count);
+
+#define WINDIVERT_ENGINE_BUFFERS_MAX    1024
+#define WINDIVERT_ENGINE_THREADS_MAX    64
+#define WINDIVERT_ENGINE_ERRORS_MAX     8
+
+/*
+ * Divert capture-to-file options (see WinDivertCaptureStart()).  Zero
+ * selects the default for each field.
+ */
+typedef struct
+{
+    UINT32 BufferLength;                /* Length of each write buffer. */
+    UINT32 SnapLength;                  /* Max bytes saved per packet. */
+    UINT64 RotateSize;                  /* Rotate after this many bytes. */
+    UINT32 RotateTime;                  /* Rotate after this many seconds. */
+    UINT32 Reserved;
+} WINDIVERT_CAPTURE_OPTIONS, *PWINDIVERT_CAPTURE_OPTIONS;
+
+typedef struct windivert_capture_s *PWINDIVERT_CAPTURE;
+
+#define WINDIVERT_CAPTURE_BUFFER_DEFAULT    0x00100000
+#define WINDIVERT_CAPTURE_BUFFER_MIN        0x00020000
+#define WINDIVERT_CAPTURE_BUFFER_MAX        0x04000000
+
 /*
  * Open a WinDivert handle.
  */
@@ -103,6 +291,17 @@ extern WINDIVERTEXPORT HANDLE WinDivertOpen(
     __in        INT16 priority,
     __in        UINT64 flags);
 
+/*
+ * Open a WinDivert handle with the given parameters set.
+ */
+extern WINDIVERTEXPORT HANDLE WinDivertOpenEx(
+    __in        const char *filter,
+    __in        WINDIVERT_LAYER layer,
+    __in        INT16 priority,
+    __in        UINT64 flags,
+    __in_opt    const WINDIVERT_PARAM_VALUE *params,
+    __in        UINT paramsLen);
+
 /*
  * Receive (read) a packet from a WinDivert handle.
  */
@@ -125,6 +324,28 @@ extern WINDIVERTEXPORT BOOL WinDivertRecvEx(
     __out_opt   UINT *readLen,
     __inout_opt LPOVERLAPPED lpOverlapped);
 
+/*
+ * Receive (read) a batch of packets from a WinDivert handle.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertRecvBatch(
+    __in        HANDLE handle,
+    __out       PVOID pBatch,
+    __in        UINT batchLen,
+    __out_opt   UINT *pCount,
+    __out_opt   UINT *readLen);
+
+/*
+ * Receive (read) a batch of packets from a WinDivert handle.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertRecvBatchEx(
+    __in        HANDLE handle,
+    __out       PVOID pBatch,
+    __in        UINT batchLen,
+    __in        UINT64 flags,
+    __out_opt   UINT *pCount,
+    __out_opt   UINT *readLen,
+    __inout_opt LPOVERLAPPED lpOverlapped);
+
 /*
  * Send (write/inject) a packet to a WinDivert handle.
  */
@@ -147,6 +368,64 @@ extern WINDIVERTEXPORT BOOL WinDivertSendEx(
     __out_opt   UINT *writeLen,
     __inout_opt LPOVERLAPPED lpOverlapped);
 
+/*
+ * Send (write/inject) a batch of packets to a WinDivert handle.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertSendBatch(
+    __in        HANDLE handle,
+    __in        PVOID pBatch,
+    __in        UINT batchLen,
+    __out_opt   UINT *writeLen);
+
+/*
+ * Send (write/inject) a batch of packets to a WinDivert handle.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertSendBatchEx(
+    __in        HANDLE handle,
+    __in        PVOID pBatch,
+    __in        UINT batchLen,
+    __in        UINT64 flags,
+    __out_opt   UINT *writeLen,
+    __inout_opt LPOVERLAPPED lpOverlapped);
+
+/*
+ * Map shared RX and TX rings into a WinDivert handle.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertRingMap(
+    __in        HANDLE handle,
+    __in        UINT slots,
+    __in        UINT slotLen,
+    __out       PWINDIVERT_RING *pRxRing,
+    __out       PWINDIVERT_RING *pTxRing);
+
+/*
+ * Send (write/inject) all packets queued in the shared TX ring.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertRingSend(
+    __in        HANDLE handle,
+    __out_opt   UINT *pCount);
+
+/*
+ * Free shared rings after the WinDivert handle has been closed.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertRingFree(
+    __in        PWINDIVERT_RING rxRing);
+
+/*
+ * Return verdicts for packets held by a WINDIVERT_FLAG_VERDICT handle.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertSetVerdict(
+    __in        HANDLE handle,
+    __in        const WINDIVERT_VERDICT *pVerdicts,
+    __in        UINT count);
+
+/*
+ * Replace the filter of an open WinDivert handle.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertSetFilter(
+    __in        HANDLE handle,
+    __in        const char *filter);
+
 /*
  * Close a WinDivert handle.
  */
@@ -169,6 +448,45 @@ extern WINDIVERTEXPORT BOOL WinDivertGetParam(
     __in        WINDIVERT_PARAM param,
     __out       UINT64 *pValue);
 
+/*
+ * Get a WinDivert handle's statistics.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertGetStats(
+    __in        HANDLE handle,
+    __out       PWINDIVERT_STATS pStats);
+
+/*
+ * Start an asynchronous receive engine on a WinDivert handle.
+ */
+extern WINDIVERTEXPORT PWINDIVERT_ENGINE WinDivertEngineCreate(
+    __in        HANDLE handle,
+    __in        UINT buffers,
+    __in        UINT bufferLen,
+    __in        UINT threads,
+    __in        WINDIVERT_ENGINE_CALLBACK callback,
+    __in_opt    PVOID context);
+
+/*
+ * Stop and free an asynchronous receive engine.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertEngineFree(
+    __in        PWINDIVERT_ENGINE engine);
+
+/*
+ * Start capturing the packets received from a WinDivert handle to a pcapng
+ * file.
+ */
+extern WINDIVERTEXPORT PWINDIVERT_CAPTURE WinDivertCaptureStart(
+    __in        HANDLE handle,
+    __in        const char *path,
+    __in_opt    const WINDIVERT_CAPTURE_OPTIONS *options);
+
+/*
+ * Stop a capture and close the capture file.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertCaptureStop(
+    __in        PWINDIVERT_CAPTURE capture);
+
 /****************************************************************************/
 /* WINDIVERT HELPER API                                                     */
 /****************************************************************************/
@@ -307,6 +625,87 @@ typedef struct
     UINT16 Checksum;
 } WINDIVERT_UDPHDR, *PWINDIVERT_UDPHDR;
 
+/*
+ * Parsed packet headers (see WinDivertHelperParsePacket()).  Headers that
+ * are not present are NULL.
+ */
+typedef struct
+{
+    PWINDIVERT_IPHDR IpHdr;             /* IPv4 header. */
+    PWINDIVERT_IPV6HDR Ipv6Hdr;         /* IPv6 header. */
+    PWINDIVERT_ICMPHDR IcmpHdr;         /* ICMP header. */
+    PWINDIVERT_ICMPV6HDR Icmpv6Hdr;     /* ICMPv6 header. */
+    PWINDIVERT_TCPHDR TcpHdr;           /* TCP header. */
+    PWINDIVERT_UDPHDR UdpHdr;           /* UDP header. */
+    PVOID Data;                         /* Payload. */
+    UINT DataLen;                       /* Payload length. */
+} WINDIVERT_HEADERS, *PWINDIVERT_HEADERS;
+
+/*
+ * Parsed packet descriptor (see WinDivertHelperParsePackets()).  Header
+ * offsets are relative to the start of the packet, and are zero if the
+ * header is not present.
+ */
+typedef struct
+{
+    UINT32 Offset;                      /* Packet's offset in the batch. */
+    UINT16 Length;                      /* Packet's length. */
+    UINT8  IpVersion;                   /* 4, 6, or 0 if not valid IP. */
+    UINT8  Protocol;                    /* Transport protocol, or 0. */
+    UINT16 TransOffset;                 /* Transport header offset. */
+    UINT16 DataOffset;                  /* Payload offset. */
+    UINT16 DataLength;                  /* Payload length. */
+    UINT16 SrcPort;                     /* TCP/UDP source port. */
+    UINT16 DstPort;                     /* TCP/UDP destination port. */
+    UINT16 Reserved;
+} WINDIVERT_PACKET_INFO, *PWINDIVERT_PACKET_INFO;
+
+/*
+ * Compiled filter object (opaque).
+ */
+typedef struct WINDIVERT_FILTER_S WINDIVERT_FILTER, *PWINDIVERT_FILTER;
+
+/*
+ * Flow table (see WinDivertHelperFlowTableCreate()).  A flow is identified
+ * by its addresses, protocol and ports, in either direction.  IPv4
+ * addresses are stored in SrcAddr[0]/DstAddr[0] (network byte order), and
+ * the "Src" endpoint is the flow's initiator.
+ */
+typedef struct windivert_flow_table_s *PWINDIVERT_FLOW_TABLE;
+
+typedef enum
+{
+    WINDIVERT_FLOW_STATE_NONE = 0,      /* Not a TCP flow. */
+    WINDIVERT_FLOW_STATE_SYN_SENT = 1,  /* SYN seen. */
+    WINDIVERT_FLOW_STATE_SYN_RECEIVED = 2,
+                                        /* SYN+ACK seen. */
+    WINDIVERT_FLOW_STATE_ESTABLISHED = 3,
+                                        /* Handshake complete. */
+    WINDIVERT_FLOW_STATE_FIN_WAIT = 4,  /* FIN seen in one direction. */
+    WINDIVERT_FLOW_STATE_TIME_WAIT = 5, /* FIN seen in both directions. */
+    WINDIVERT_FLOW_STATE_CLOSED = 6     /* RST seen. */
+} WINDIVERT_FLOW_STATE;
+
+typedef struct
+{
+    UINT32 SrcAddr[4];                  /* Initiator's address. */
+    UINT32 DstAddr[4];                  /* Responder's address. */
+    UINT16 SrcPort;                     /* Initiator's port (host order). */
+    UINT16 DstPort;                     /* Responder's port (host order). */
+    UINT8  IpVersion;                   /* 4 or 6. */
+    UINT8  Protocol;                    /* IP protocol. */
+    UINT8  State;                       /* WINDIVERT_FLOW_STATE. */
+    UINT8  Reply;                       /* Packet is from Dst? */
+    INT64  FirstSeen;                   /* Time of the first packet. */
+    INT64  LastSeen;                    /* Time of the last packet. */
+    UINT64 Packets[2];                  /* Packets from Src/Dst. */
+    UINT64 Bytes[2];                    /* Bytes from Src/Dst. */
+    UINT64 Data;                        /* User data. */
+} WINDIVERT_FLOW, *PWINDIVERT_FLOW;
+
+#define WINDIVERT_FLOW_TABLE_SIZE_MAX       0x01000000
+#define WINDIVERT_FLOW_TIMEOUT_MAX          86400000
+
 /*
  * Flags for WinDivertHelperCalcChecksums()
  */
@@ -332,6 +731,15 @@ extern WINDIVERTEXPORT BOOL WinDivertHelperParsePacket(
     __out_opt   PVOID *ppData,
     __out_opt   UINT *pDataLen);
 
+/*
+ * Parse each packet of a batch into a packet descriptor.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperParsePackets(
+    __in        const VOID *pBatch,
+    __in        UINT batchLen,
+    __in        UINT count,
+    __out       PWINDIVERT_PACKET_INFO pInfo);
+
 /*
  * Parse an IPv4 address.
  */
@@ -354,6 +762,22 @@ extern WINDIVERTEXPORT UINT WinDivertHelperCalcChecksums(
     __in        UINT packetLen,
     __in        UINT64 flags);
 
+/*
+ * Incrementally update a checksum for a changed 16/32/128-bit field.
+ */
+extern WINDIVERTEXPORT UINT16 WinDivertHelperUpdateChecksum16(
+    __in        UINT16 checksum,
+    __in        UINT16 oldValue,
+    __in        UINT16 newValue);
+extern WINDIVERTEXPORT UINT16 WinDivertHelperUpdateChecksum32(
+    __in        UINT16 checksum,
+    __in        UINT32 oldValue,
+    __in        UINT32 newValue);
+extern WINDIVERTEXPORT UINT16 WinDivertHelperUpdateChecksum128(
+    __in        UINT16 checksum,
+    __in        const UINT32 *pOldValue,
+    __in        const UINT32 *pNewValue);
+
 /*
  * Check the given filter string.
  */
@@ -373,6 +797,82 @@ extern WINDIVERTEXPORT BOOL WinDivertHelperEvalFilter(
     __in        UINT packetLen,
     __in        PWINDIVERT_ADDRESS pAddr);
 
+/*
+ * Compile the given filter string into a filter object.
+ */
+extern WINDIVERTEXPORT PWINDIVERT_FILTER WinDivertHelperCompileFilter(
+    __in        const char *filter,
+    __in        WINDIVERT_LAYER layer);
+
+/*
+ * Evaluate a filter object against an already parsed packet.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperEvalFilterHeaders(
+    __in        const WINDIVERT_FILTER *filter,
+    __in        const WINDIVERT_HEADERS *pHeaders,
+    __in        const WINDIVERT_ADDRESS *pAddr);
+
+/*
+ * Evaluate a filter object against each packet of a batch.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperEvalFilterBatch(
+    __in        const WINDIVERT_FILTER *filter,
+    __in        const VOID *pBatch,
+    __in        UINT batchLen,
+    __in        UINT count,
+    __out       BOOL *pResults);
+
+/*
+ * Free a filter object.
+ */
+extern WINDIVERTEXPORT VOID WinDivertHelperFreeFilter(
+    __in        PWINDIVERT_FILTER filter);
+
+/*
+ * Create a flow table.
+ */
+extern WINDIVERTEXPORT PWINDIVERT_FLOW_TABLE WinDivertHelperFlowTableCreate(
+    __in        UINT size,
+    __in        UINT idleTimeout);
+
+/*
+ * Update (or create) the flow of a packet.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperFlowTableUpdate(
+    __in        PWINDIVERT_FLOW_TABLE table,
+    __in        const WINDIVERT_HEADERS *pHeaders,
+    __in        INT64 timestamp,
+    __out_opt   PWINDIVERT_FLOW pFlow);
+
+/*
+ * Look up the flow of a packet.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperFlowTableLookup(
+    __in        PWINDIVERT_FLOW_TABLE table,
+    __in        const WINDIVERT_HEADERS *pHeaders,
+    __out       PWINDIVERT_FLOW pFlow);
+
+/*
+ * Set the user data of the flow of a packet.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperFlowTableSetData(
+    __in        PWINDIVERT_FLOW_TABLE table,
+    __in        const WINDIVERT_HEADERS *pHeaders,
+    __in        UINT64 data);
+
+/*
+ * Remove idle flows.
+ */
+extern WINDIVERTEXPORT UINT WinDivertHelperFlowTableExpire(
+    __in        PWINDIVERT_FLOW_TABLE table,
+    __in        INT64 timestamp);
+
+/*
+ * Free a flow table.
+ */
+extern WINDIVERTEXPORT VOID WinDivertHelperFlowTableFree(
+    __in        PWINDIVERT_FLOW_TABLE table);
+
 /****************************************************************************/
 /* WINDIVERT LEGACY API                                                     */
 /****************************************************************************/
@@ -43,7 +43,7 @@
 #define WINDIVERT_DEVICE_NAME                                               \
     L"WinDivert" WINDIVERT_VERSION_LSTR
 
-#define WINDIVERT_IOCTL_VERSION                     6
+#define WINDIVERT_IOCTL_VERSION                     9
 #define WINDIVERT_IOCTL_MAGIC                       0xA2BF
 
 #define WINDIVERT_FILTER_FIELD_ZERO                 0
@@ -104,8 +104,14 @@
 #define WINDIVERT_FILTER_FIELD_UDP_LENGTH           55
 #define WINDIVERT_FILTER_FIELD_UDP_CHECKSUM         56
 #define WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH    57
+#define WINDIVERT_FILTER_FIELD_TCP_PAYLOAD          58
+#define WINDIVERT_FILTER_FIELD_TCP_PAYLOAD16        59
+#define WINDIVERT_FILTER_FIELD_TCP_PAYLOAD32        60
+#define WINDIVERT_FILTER_FIELD_UDP_PAYLOAD          61
+#define WINDIVERT_FILTER_FIELD_UDP_PAYLOAD16        62
+#define WINDIVERT_FILTER_FIELD_UDP_PAYLOAD32        63
 #define WINDIVERT_FILTER_FIELD_MAX                  \
-    WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH
+    WINDIVERT_FILTER_FIELD_UDP_PAYLOAD32
 
 #define WINDIVERT_FILTER_TEST_EQ                    0
 #define WINDIVERT_FILTER_TEST_NEQ                   1
@@ -113,9 +119,16 @@
 #define WINDIVERT_FILTER_TEST_LEQ                   3
 #define WINDIVERT_FILTER_TEST_GT                    4
 #define WINDIVERT_FILTER_TEST_GEQ                   5
-#define WINDIVERT_FILTER_TEST_MAX                   WINDIVERT_FILTER_TEST_GEQ
+#define WINDIVERT_FILTER_TEST_IN                    6
+#define WINDIVERT_FILTER_TEST_CONTAINS              7
+#define WINDIVERT_FILTER_TEST_PREFIX                8
+#define WINDIVERT_FILTER_TEST_MAX                   WINDIVERT_FILTER_TEST_PREFIX
 
 #define WINDIVERT_FILTER_MAXLEN                     128
+#define WINDIVERT_FILTER_SET_MAXLEN                 32768
+#define WINDIVERT_FILTER_PAYLOAD_OFFSET_MAX         0xFFFF
+#define WINDIVERT_FILTER_PATTERN_MAXLEN             255
+#define WINDIVERT_FILTER_PATTERN_MAXSTATES          16384
 
 #define WINDIVERT_FILTER_RESULT_ACCEPT              (WINDIVERT_FILTER_MAXLEN+1)
 #define WINDIVERT_FILTER_RESULT_REJECT              (WINDIVERT_FILTER_MAXLEN+2)
@@ -131,13 +144,34 @@
  * WinDivert flags.
  */
 #define WINDIVERT_FLAGS_ALL                                                 \
-    (WINDIVERT_FLAG_SNIFF | WINDIVERT_FLAG_DROP | WINDIVERT_FLAG_DEBUG)
+    (WINDIVERT_FLAG_SNIFF | WINDIVERT_FLAG_DROP | WINDIVERT_FLAG_DEBUG |    \
+     WINDIVERT_FLAG_VERDICT | WINDIVERT_FLAG_FLOW_CACHE)
 #define WINDIVERT_FLAGS_EXCLUDE(flags, flag1, flag2)                        \
     (((flags) & ((flag1) | (flag2))) != ((flag1) | (flag2)))
+#define WINDIVERT_FLAGS_QUEUES_MASK                 0xFF00
+#define WINDIVERT_FLAGS_QUEUES(flags)                                       \
+    ((UINT8)(((flags) & WINDIVERT_FLAGS_QUEUES_MASK) >> 8))
 #define WINDIVERT_FLAGS_VALID(flags)                                        \
-    ((((flags) & ~WINDIVERT_FLAGS_ALL) == 0) &&                             \
+    ((((flags) & ~(WINDIVERT_FLAGS_ALL | WINDIVERT_FLAGS_QUEUES_MASK)) ==   \
+        0) &&                                                               \
+     WINDIVERT_FLAGS_QUEUES(flags) <= WINDIVERT_QUEUES_MAX &&               \
      WINDIVERT_FLAGS_EXCLUDE(flags, WINDIVERT_FLAG_SNIFF,                   \
-        WINDIVERT_FLAG_DROP))
+        WINDIVERT_FLAG_DROP) &&                                             \
+     WINDIVERT_FLAGS_EXCLUDE(flags, WINDIVERT_FLAG_SNIFF,                   \
+        WINDIVERT_FLAG_VERDICT) &&                                          \
+     WINDIVERT_FLAGS_EXCLUDE(flags, WINDIVERT_FLAG_DROP,                    \
+        WINDIVERT_FLAG_VERDICT))
+
+/*
+ * WinDivert sub-queues.
+ */
+#define WINDIVERT_QUEUES_MAX                        64
+#define WINDIVERT_RECV_FLAGS_VALID(flags)                                   \
+    ((flags) <= WINDIVERT_QUEUES_MAX)
+#define WINDIVERT_SEND_FLAGS_ALL                                            \
+    WINDIVERT_SEND_FLAG_CHECKSUMS
+#define WINDIVERT_SEND_FLAGS_VALID(flags)                                   \
+    (((flags) & ~WINDIVERT_SEND_FLAGS_ALL) == 0)
 
 /*
  * WinDivert priorities.
@@ -160,6 +194,55 @@
 #define WINDIVERT_PARAM_QUEUE_SIZE_MIN              65535       // 64KB
 #define WINDIVERT_PARAM_QUEUE_SIZE_MAX              33554432    // 32MB
 #define WINDIVERT_PARAM_QUEUE_SIZE_DEFAULT          4194304     // 4MB
+#define WINDIVERT_PARAM_QUEUE_MODE_DEFAULT          0           // Aggregate
+#define WINDIVERT_PARAM_QUEUE_MODE_MAX              1           // Per-CPU
+#define WINDIVERT_PARAM_SNAPLEN_DEFAULT             0           // No limit
+#define WINDIVERT_PARAM_SNAPLEN_MAX                 65535
+#define WINDIVERT_PARAM_OVERLOAD_DEFAULT            0           // Drop oldest
+#define WINDIVERT_PARAM_OVERLOAD_MAX                2           // Bypass
+#define WINDIVERT_PARAM_BATCH_COUNT_DEFAULT         1           // Off
+#define WINDIVERT_PARAM_BATCH_COUNT_MIN             1
+#define WINDIVERT_PARAM_BATCH_COUNT_MAX             256         // Batch max
+#define WINDIVERT_PARAM_BATCH_TIME_DEFAULT          1000        // 1ms
+#define WINDIVERT_PARAM_BATCH_TIME_MIN              1           // 1us
+#define WINDIVERT_PARAM_BATCH_TIME_MAX              1000000     // 1s
+#define WINDIVERT_PARAM_SAMPLE_RATE_DEFAULT         1           // Off
+#define WINDIVERT_PARAM_SAMPLE_RATE_MIN             1
+#define WINDIVERT_PARAM_SAMPLE_RATE_MAX             1000000
+#define WINDIVERT_PARAM_SAMPLE_MODE_DEFAULT         0           // Count
+#define WINDIVERT_PARAM_SAMPLE_MODE_MAX             1           // Random
+#define WINDIVERT_PARAM_RATE_LIMIT_DEFAULT          0           // Off
+#define WINDIVERT_PARAM_RATE_LIMIT_MAX              10000000    // 10M/s
+#define WINDIVERT_PARAM_RATE_MODE_DEFAULT           0           // Global
+#define WINDIVERT_PARAM_RATE_MODE_MAX               1           // Per-flow
+
+/*
+ * Read-only IOCTL_WINDIVERT_GET_PARAM parameter holding the handle's layer.
+ * Not accepted by WinDivertGetParam().
+ */
+#define WINDIVERT_PARAM_LAYER                       0xFF
+
+/*
+ * WinDivert batch limits.
+ */
+#define WINDIVERT_BATCH_MAX                         256
+
+/*
+ * WinDivert ring limits.
+ */
+#define WINDIVERT_RING_SLOTS_MIN                    16
+#define WINDIVERT_RING_SLOTS_MAX                    65536
+#define WINDIVERT_RING_SLOT_LEN_MIN                 128
+#define WINDIVERT_RING_SLOT_LEN_MAX                 65552
+#define WINDIVERT_RING_SIZE_MAX                     67108864    // 64MB
+#define WINDIVERT_RING_SIZE(slots, slot_len)                                \
+    (sizeof(WINDIVERT_RING) + (UINT64)(slots) * (UINT64)(slot_len))
+
+/*
+ * WinDivert verdicts.
+ */
+#define WINDIVERT_VERDICT_MAX                       WINDIVERT_VERDICT_MODIFY
+#define WINDIVERT_VERDICTS_MAX                      WINDIVERT_BATCH_MAX
 
 /*
  * WinDivert message definitions.
@@ -186,6 +269,53 @@ struct windivert_ioctl_filter_s
     UINT32 arg[4];                  // Argument.
 };
 typedef struct windivert_ioctl_filter_s *windivert_ioctl_filter_t;
+
+/*
+ * Set elements follow the filter objects.  A WINDIVERT_FILTER_TEST_IN object
+ * tests membership of the elements arg[0]..arg[0]+arg[1]-1.
+ */
+struct windivert_ioctl_set_s
+{
+    UINT32 val[4];                  // Set element value.
+    UINT8  prefix;                  // Set element prefix length.
+};
+typedef struct windivert_ioctl_set_s *windivert_ioctl_set_t;
+
+/*
+ * The patterns of a WINDIVERT_FILTER_TEST_CONTAINS/PREFIX object are stored
+ * in the set elements arg[0]..arg[0]+arg[1]-1.  Each pattern is one element
+ * holding the pattern length in val[0], followed by the pattern bytes packed
+ * into the val fields of the next WINDIVERT_FILTER_PATTERN_ELEMS(length)
+ * elements.  For the other tests of the payload fields, arg[1] holds the
+ * payload offset.
+ */
+#define WINDIVERT_FILTER_PATTERN_ELEMS(len)         (((len) + 15) / 16)
+
+struct windivert_ioctl_ring_s
+{
+    UINT64 addr;                    // Ring memory address.
+    UINT64 event;                   // RX ring event handle.
+    UINT32 slots;                   // Number of slots per ring.
+    UINT32 slot_len;                // Length of each slot.
+};
+typedef struct windivert_ioctl_ring_s *windivert_ioctl_ring_t;
+
+/*
+ * IOCTL_WINDIVERT_OPEN configures and starts a handle in one request.  The
+ * filter objects follow the structure.  Only params[i] with bit i set in
+ * param_mask are applied.
+ */
+struct windivert_ioctl_open_s
+{
+    UINT64 flags;                   // WINDIVERT_FLAG_*
+    UINT32 layer;                   // WINDIVERT_LAYER_*
+    UINT32 priority;                // Handle priority.
+    UINT32 param_mask;              // Mask of valid params.
+    UINT32 reserved;                // Reserved (must be zero).
+    UINT64 params[WINDIVERT_PARAM_MAX+1];
+                                    // Param values.
+};
+typedef struct windivert_ioctl_open_s *windivert_ioctl_open_t;
 #pragma pack(pop)
 
 /*
@@ -207,5 +337,21 @@ typedef struct windivert_ioctl_filter_s *windivert_ioctl_filter_t;
     CTL_CODE(FILE_DEVICE_NETWORK, 0x90E, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
 #define IOCTL_WINDIVERT_GET_PARAM                                           \
     CTL_CODE(FILE_DEVICE_NETWORK, 0x90F, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_WINDIVERT_RECV_BATCH                                          \
+    CTL_CODE(FILE_DEVICE_NETWORK, 0x910, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_WINDIVERT_SEND_BATCH                                          \
+    CTL_CODE(FILE_DEVICE_NETWORK, 0x911, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_WINDIVERT_MAP_RING                                            \
+    CTL_CODE(FILE_DEVICE_NETWORK, 0x912, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_WINDIVERT_RING_SEND                                           \
+    CTL_CODE(FILE_DEVICE_NETWORK, 0x913, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_WINDIVERT_SET_VERDICT                                         \
+    CTL_CODE(FILE_DEVICE_NETWORK, 0x914, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_WINDIVERT_SET_FILTER                                          \
+    CTL_CODE(FILE_DEVICE_NETWORK, 0x915, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_WINDIVERT_GET_STATS                                           \
+    CTL_CODE(FILE_DEVICE_NETWORK, 0x916, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_WINDIVERT_OPEN                                                \
+    CTL_CODE(FILE_DEVICE_NETWORK, 0x917, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
 
 #endif      /* __WINDIVERT_DEVICE_H */
@@ -27,6 +27,13 @@
 
 #include "windivert_device.h"
 
+/*
+ * Older WDKs do not define the "no execute" pool flag.
+ */
+#ifndef POOL_NX_ALLOCATION
+#define POOL_NX_ALLOCATION      512
+#endif
+
 /*
  * WDK function declaration cruft.
  */
@@ -90,6 +97,11 @@ struct filter_s
     UINT8  field;                               // Field of interest
     UINT16 success;                             // Success continuation
     UINT16 failure;                             // Fail continuation
+    UINT8  op;                                  // Compiled field access
+    UINT8  base;                                // Compiled field header
+    UINT8  offset;                              // Compiled field offset
+    UINT8  shift;                               // Compiled field shift
+    UINT32 mask;                                // Compiled field mask
     UINT32 arg[4];                              // Comparison argument
 };
 typedef struct filter_s *filter_t;
@@ -100,13 +112,166 @@ typedef struct filter_s *filter_t;
 #define WINDIVERT_FILTER_PROTOCOL_ICMPV6        4
 #define WINDIVERT_FILTER_PROTOCOL_TCP           5
 #define WINDIVERT_FILTER_PROTOCOL_UDP           6
+#define WINDIVERT_FILTER_PROTOCOL_MAX           WINDIVERT_FILTER_PROTOCOL_UDP
+
+/*
+ * WinDivert compiled filter set (WINDIVERT_FILTER_TEST_IN).  The elements are
+ * stored in an open addressing hash table keyed by (masked value, prefix),
+ * so a lookup costs one probe per distinct prefix length in the set.  The
+ * set lives in the same allocation as the filter, at byte offset arg[0].
+ */
+struct filter_set_entry_s
+{
+    UINT32 val[4];                              // Masked element value
+    UINT8  prefix;                              // Element prefix length
+    UINT8  used;                                // Entry is occupied?
+};
+typedef struct filter_set_entry_s *filter_set_entry_t;
+struct filter_set_s
+{
+    UINT32 mask;                                // Table size - 1
+    UINT8  width;                               // Field width (32 or 128)
+    UINT8  prefixes_len;                        // # distinct prefixes
+    UINT8  prefixes[128+1];                     // Distinct prefixes
+};
+typedef struct filter_set_s *filter_set_t;
+#define WINDIVERT_FILTER_SET_ENTRIES(set)                                   \
+    ((filter_set_entry_t)((set) + 1))
+
+/*
+ * WinDivert compiled pattern matcher (WINDIVERT_FILTER_TEST_CONTAINS and
+ * WINDIVERT_FILTER_TEST_PREFIX).  The patterns are stored in an Aho-Corasick
+ * automaton, so the payload is scanned once regardless of the number of
+ * patterns.  Each state's children form a sibling list sorted by byte;
+ * the root's transitions are indexed directly.  Most of the payload is
+ * scanned at the root or one byte below it, so the first
+ * WINDIVERT_FILTER_AC_DENSE_MAX children of the root also get a dense
+ * 256-entry row of their complete transitions (failure links resolved),
+ * stored after the states.  State 0 is the root.  The automaton lives in
+ * the same allocation as the filter, at byte offset arg[0].
+ */
+struct filter_ac_state_s
+{
+    UINT16 child;                               // First child (0 = none)
+    UINT16 sibling;                             // Next sibling (0 = none)
+    UINT16 fail;                                // Failure link
+    UINT16 dense;                               // Dense row + 1 (0 = none)
+    UINT8  byte;                                // Transition byte
+    UINT8  flags;                               // WINDIVERT_FILTER_AC_*
+};
+typedef struct filter_ac_state_s *filter_ac_state_t;
+struct filter_ac_s
+{
+    UINT16 states_len;                          // # states (incl. root)
+    UINT16 root[256];                           // Root transitions
+};
+typedef struct filter_ac_s *filter_ac_t;
+#define WINDIVERT_FILTER_AC_FINAL               0x01    // Pattern ends here
+#define WINDIVERT_FILTER_AC_MATCH               0x02    // ... or at a suffix
+#define WINDIVERT_FILTER_AC_DENSE_MAX           8       // Max dense rows
+#define WINDIVERT_FILTER_AC_STATES(ac)                                      \
+    ((filter_ac_state_t)((ac) + 1))
+#define WINDIVERT_FILTER_AC_DENSE_ROWS(states)                              \
+    ((states) - 1 < WINDIVERT_FILTER_AC_DENSE_MAX? (states) - 1:            \
+        WINDIVERT_FILTER_AC_DENSE_MAX)
+#define WINDIVERT_FILTER_AC_DENSE(ac)                                       \
+    ((UINT16 (*)[256])(WINDIVERT_FILTER_AC_STATES(ac) + (ac)->states_len))
+
+/*
+ * WinDivert flow verdict cache (WINDIVERT_FLAG_FLOW_CACHE).  If the filter
+ * only depends on the direction, interfaces, addresses, protocol and ports,
+ * then all packets of a flow have the same verdict, which is cached in a
+ * direct mapped table keyed on these values.  Entries are updated without
+ * locks: a writer makes the entry's sequence number odd while it updates
+ * the entry, and a reader discards any entry whose sequence number is odd
+ * or changed while it was being read.
+ */
+#define WINDIVERT_FLOW_CACHE_SIZE               4096    // Power of 2
+#define WINDIVERT_FLOW_KEY_LEN                  12
+struct flow_cache_entry_s
+{
+    volatile LONG seq;                          // Entry sequence number
+    BOOL match;                                 // Cached verdict
+    UINT32 key[WINDIVERT_FLOW_KEY_LEN];         // Flow key
+};
+typedef struct flow_cache_entry_s *flow_cache_entry_t;
+struct flow_cache_s
+{
+    struct flow_cache_entry_s entries[WINDIVERT_FLOW_CACHE_SIZE];
+};
+typedef struct flow_cache_s *flow_cache_t;
+
+/*
+ * WinDivert filter program.  A context has two program slots so that the
+ * filter can be replaced while packets are being filtered: readers pin the
+ * current slot with a reference, and the old program is freed only once
+ * the references to its slot drain.
+ */
+struct program_s
+{
+    filter_t filter;                            // Packet filter.
+    flow_cache_t flow_cache;                    // Flow verdict cache.
+    volatile LONG refs;                         // Active readers.
+};
+typedef struct program_s *program_t;
+
+/*
+ * WinDivert parsed packet.  The headers of a NET_BUFFER are located once by
+ * windivert_parse(), and the result is shared by the filters of all handles
+ * that see the packet.
+ */
+struct meta_s
+{
+    BOOL valid;                                 // Packet is well-formed?
+    UINT8 *hdrs[WINDIVERT_FILTER_PROTOCOL_MAX+1];
+                                                // Headers (or NULL).
+    PNET_BUFFER buffer;                         // Packet.
+    size_t tot_len;                             // Packet length.
+    size_t ip_header_len;                       // IP + extension headers.
+    size_t payload_off;                         // TCP/UDP payload offset.
+    size_t payload_len;                         // TCP/UDP payload length.
+};
+typedef struct meta_s *meta_t;
+
+/*
+ * WinDivert compiled filter field access.  Each filter field is lowered to
+ * one of these operations on a header (base) when the filter is compiled,
+ * so windivert_filter() need not decode the field for every packet.
+ */
+#define WINDIVERT_FILTER_OP_ZERO                0   // 0
+#define WINDIVERT_FILTER_OP_INBOUND             1   // !outbound
+#define WINDIVERT_FILTER_OP_OUTBOUND            2   // outbound
+#define WINDIVERT_FILTER_OP_IFIDX               3   // if_idx
+#define WINDIVERT_FILTER_OP_SUBIFIDX            4   // sub_if_idx
+#define WINDIVERT_FILTER_OP_PRESENT             5   // base != NULL
+#define WINDIVERT_FILTER_OP_LOAD8               6   // 8-bit field
+#define WINDIVERT_FILTER_OP_LOAD16              7   // 16-bit field
+#define WINDIVERT_FILTER_OP_LOAD32              8   // 32-bit field
+#define WINDIVERT_FILTER_OP_LOAD128             9   // 128-bit field
+#define WINDIVERT_FILTER_OP_HOPLIMIT            10  // TTL/HopLimit
+#define WINDIVERT_FILTER_OP_CHECKSUM            11  // 16-bit, mask=valid
+#define WINDIVERT_FILTER_OP_FLOWLABEL           12  // IPv6 FlowLabel
+#define WINDIVERT_FILTER_OP_TCP_PAYLOADLENGTH   13  // TCP payload length
+#define WINDIVERT_FILTER_OP_UDP_PAYLOADLENGTH   14  // UDP payload length
+#define WINDIVERT_FILTER_OP_PAYLOAD8            15  // 8-bit payload value
+#define WINDIVERT_FILTER_OP_PAYLOAD16           16  // 16-bit payload value
+#define WINDIVERT_FILTER_OP_PAYLOAD32           17  // 32-bit payload value
+struct filter_field_s
+{
+    UINT8  protocol;                            // Field's protocol
+    UINT8  op;                                  // Field access
+    UINT8  base;                                // Field header
+    UINT8  offset;                              // Field offset
+    UINT8  shift;                               // Field shift
+    UINT32 mask;                                // Field mask
+};
 
 /*
  * WinDivert context information.
  */
 #define WINDIVERT_CONTEXT_SIZE                  (sizeof(struct context_s))
 #define WINDIVERT_CONTEXT_MAXLAYERS             4
-#define WINDIVERT_CONTEXT_MAXWORKERS            1
+#define WINDIVERT_CONTEXT_MAXWORKERS            64
 #define WINDIVERT_CONTEXT_OUTBOUND_IPV4_LAYER   0
 #define WINDIVERT_CONTEXT_INBOUND_IPV4_LAYER    1
 #define WINDIVERT_CONTEXT_OUTBOUND_IPV6_LAYER   2
@@ -119,46 +284,224 @@ typedef enum
     WINDIVERT_CONTEXT_STATE_CLOSED  = 0xD3,     // Context is closed.
     WINDIVERT_CONTEXT_STATE_INVALID = 0xE4      // Context is invalid.
 } context_state_t;
+struct worker_s
+{
+    KSPIN_LOCK lock;                            // Worker lock.
+    LIST_ENTRY work_queue;                      // Work queue.
+    ULONG work_queue_length;                    // Work queue length.
+    LIST_ENTRY packet_queue;                    // Packet queue.
+    ULONG packet_queue_length;                  // Packet queue length.
+    ULONG packet_queue_size;                    // Packet queue size.
+    WDFQUEUE read_queue;                        // Sub-queue read queue.
+    WDFWORKITEM item;                           // Work item.
+    LIST_ENTRY verdict_queue;                   // Held packet queue.
+    ULONG verdict_queue_length;                 // Held packet queue length.
+    UINT64 verdict_seq;                         // Held packet sequence.
+};
+typedef struct worker_s *worker_t;
+
+/*
+ * WinDivert statistics.  The counters are spread over per-CPU slots to avoid
+ * contention, and are summed when read.  The order matches WINDIVERT_STATS.
+ * Each slot starts on its own cache line, whatever the number of counters.
+ */
+#define WINDIVERT_STAT_CLASSIFIED               0
+#define WINDIVERT_STAT_MATCHED                  1
+#define WINDIVERT_STAT_QUEUED                   2
+#define WINDIVERT_STAT_FAST_PATH                3
+#define WINDIVERT_STAT_REINJECTED               4
+#define WINDIVERT_STAT_INJECTED                 5
+#define WINDIVERT_STAT_DROP_WORK_QUEUE          6
+#define WINDIVERT_STAT_DROP_QUEUE_FULL          7
+#define WINDIVERT_STAT_DROP_TIMEOUT             8
+#define WINDIVERT_STAT_DROP_NO_MEMORY           9
+#define WINDIVERT_STAT_DROP_REINJECT            10
+#define WINDIVERT_STAT_DROP_RING_FULL           11
+#define WINDIVERT_STAT_DROP_VERDICT             12
+#define WINDIVERT_STAT_BYPASSED                 13
+#define WINDIVERT_STAT_SAMPLED_OUT              14
+#define WINDIVERT_STAT_RATE_LIMITED             15
+#define WINDIVERT_STAT_DROP_HOP_LIMIT           16
+#define WINDIVERT_STAT_MAX                      17
+#define WINDIVERT_STATS_SLOTS                   64
+struct DECLSPEC_CACHEALIGN stats_s
+{
+    volatile LONG64 count[WINDIVERT_STAT_MAX];  // Counters.
+    volatile LONG64 read_latency[WINDIVERT_LATENCY_BUCKETS];
+                                                // Capture-to-read latency.
+    volatile LONG64 inject_latency[WINDIVERT_LATENCY_BUCKETS];
+                                                // Capture-to-inject latency.
+};
+
+/*
+ * WinDivert token bucket for packet rate limiting.  Tokens are scaled by the
+ * performance counter frequency, so a packet costs one second's worth of
+ * counts and the refill needs no division.
+ */
+#define WINDIVERT_RATE_BUCKETS                  256
+struct rate_s
+{
+    KSPIN_LOCK lock;                            // Bucket lock.
+    LONGLONG tokens;                            // Tokens (x counts/s).
+    LONGLONG timestamp;                         // Last refill time.
+};
 struct context_s
 {
     context_state_t state;                      // Context's state.
     KSPIN_LOCK lock;                            // Context-wide lock.
     WDFDEVICE device;                           // Context's device.
     WDFFILEOBJECT object;                       // Context's parent object.
-    LIST_ENTRY work_queue;                      // Work queue.
-    ULONG work_queue_length;                    // Work queue length.
-    LIST_ENTRY packet_queue;                    // Packet queue.
-    ULONG packet_queue_length;                  // Packet queue length.
+    volatile LONG packet_queue_length;          // Total packet queue length.
     ULONG packet_queue_maxlength;               // Packet queue max length.
-    ULONG packet_queue_size;                    // Packet queue size (in bytes).
+    volatile LONG packet_queue_size;            // Total packet queue size.
     ULONG packet_queue_maxsize;                 // Packet queue max size.
     LONGLONG packet_queue_maxcounts;            // Packet queue max counts.
     ULONG packet_queue_maxtime;                 // Packet queue max time.
+    UINT8 packet_queue_mode;                    // Packet queue limit mode.
+    ULONG snap_len;                             // Packet capture length.
+    UINT8 overload;                             // Overload policy.
+    UINT32 batch_count;                         // Read coalescing count.
+    ULONG batch_time;                           // Read coalescing time (us).
+    LONGLONG batch_maxcounts;                   // Read coalescing counts.
+    volatile LONG batch_timer_set;              // Read timer is set?
+    KTIMER batch_timer;                         // Read coalescing timer.
+    KDPC batch_dpc;                             // Read coalescing DPC.
+    volatile LONG verdict_timer_set;            // Verdict timer is set?
+    KTIMER verdict_timer;                       // Held packet expiry timer.
+    KDPC verdict_dpc;                           // Held packet expiry DPC.
+    ULONG sample_rate;                          // 1-in-N sampling rate.
+    UINT8 sample_mode;                          // Sampling mode.
+    volatile LONG sample_count;                 // Sampling counter.
+    ULONG rate_limit;                           // Rate limit (packets/s).
+    UINT8 rate_mode;                            // Rate limit mode.
+    struct rate_s rates[WINDIVERT_RATE_BUCKETS];
+                                                // Rate limit buckets.
+    volatile LONG packet_queue_peak_length;     // Peak packet queue length.
+    volatile LONG packet_queue_peak_size;       // Peak packet queue size.
+    struct stats_s *stats;                      // Per-CPU statistics.
     WDFQUEUE read_queue;                        // Read queue.
-    WDFWORKITEM workers[WINDIVERT_CONTEXT_MAXWORKERS];
+    struct worker_s workers[WINDIVERT_CONTEXT_MAXWORKERS];
                                                 // Read workers.
-    UINT8 worker_curr;                          // Current read worker.
+    UINT8 worker_count;                         // Number of read workers.
+    UINT8 queue_count;                          // Number of sub-queues.
+    UINT8 read_curr;                            // Next worker to read from.
     UINT8 layer;                                // Context's layer.
     UINT64 flags;                               // Context's flags.
     UINT32 priority;                            // Context's priority.
-    GUID callout_guid[WINDIVERT_CONTEXT_MAXLAYERS];
-                                                // Callout GUIDs.
-    GUID filter_guid[WINDIVERT_CONTEXT_MAXLAYERS];
-                                                // Filter GUIDs.
     BOOL installed[WINDIVERT_CONTEXT_MAXLAYERS];
-                                                // What is installed?
+                                                // Dispatchers joined.
     BOOL on;                                    // Is filtering on?
-    HANDLE engine_handle;                       // WFP engine handle.
-    filter_t filter;                            // Packet filter.
+    struct program_s programs[2];               // Filter programs.
+    volatile LONG program_curr;                 // Current program slot.
+    BOOL replacing;                             // Filter replace pending?
+    struct layer_s *layers[WINDIVERT_CONTEXT_MAXLAYERS];
+                                                // Installed layers.
+    PMDL ring_mdl;                              // Shared ring MDL.
+    PKEVENT ring_event;                         // Shared RX ring event.
+    struct windivert_ring_s *rx_ring;           // Shared RX ring.
+    struct windivert_ring_s *tx_ring;           // Shared TX ring.
+    UINT32 ring_slots;                          // Shared ring slots.
+    UINT32 ring_slot_len;                       // Shared ring slot length.
+    KSPIN_LOCK ring_lock;                       // Shared RX ring lock.
+    UINT32 rx_ring_reserve;                     // Next RX slot to fill.
+    UINT32 rx_ring_head;                        // Shared RX ring head.
+    BOOLEAN *rx_ring_ready;                     // Filled RX slots.
+    LONG rx_ring_writers;                       // RX slots being filled.
+    UINT32 tx_ring_tail;                        // Shared TX ring tail.
 };
 typedef struct context_s context_s;
 typedef struct context_s *context_t;
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(context_s, windivert_context_get);
 
+/*
+ * WinDivert work item context.
+ */
+struct worker_context_s
+{
+    worker_t worker;                            // Work item's worker.
+};
+typedef struct worker_context_s worker_context_s;
+typedef struct worker_context_s *worker_context_t;
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(worker_context_s,
+    windivert_worker_context_get);
+
 #define WINDIVERT_TIMEOUT(context, t0, t1)                                  \
     (((t1) >= (t0)? (t1) - (t0): (t0) - (t1)) >                             \
         (context)->packet_queue_maxcounts)
 
+/*
+ * Account for a packet entering or leaving a worker's packet queue.  The
+ * worker's lock must be held; the context-wide totals are kept atomically.
+ */
+#define WINDIVERT_QUEUE_INSERT(context, worker, len)                        \
+    do                                                                      \
+    {                                                                       \
+        (worker)->packet_queue_length++;                                    \
+        (worker)->packet_queue_size += (len);                               \
+        windivert_stat_peak(&(context)->packet_queue_peak_length,           \
+            InterlockedIncrement(&(context)->packet_queue_length));         \
+        windivert_stat_peak(&(context)->packet_queue_peak_size,             \
+            InterlockedExchangeAdd(&(context)->packet_queue_size,           \
+                (LONG)(len)) + (LONG)(len));                                \
+    }                                                                       \
+    while (FALSE)
+#define WINDIVERT_QUEUE_REMOVE(context, worker, len)                        \
+    do                                                                      \
+    {                                                                       \
+        (worker)->packet_queue_length--;                                    \
+        (worker)->packet_queue_size -= (len);                               \
+        InterlockedDecrement(&(context)->packet_queue_length);              \
+        InterlockedExchangeAdd(&(context)->packet_queue_size,               \
+            -(LONG)(len));                                                  \
+    }                                                                       \
+    while (FALSE)
+
+/*
+ * Count statistics in the current CPU's slot.
+ */
+#define WINDIVERT_STAT_ADD(context, stat, n)                                \
+    InterlockedExchangeAdd64(&(context)->stats[                             \
+        KeGetCurrentProcessorNumber() % WINDIVERT_STATS_SLOTS].count[stat], \
+        (LONG64)(n))
+#define WINDIVERT_STAT_INC(context, stat)                                   \
+    WINDIVERT_STAT_ADD((context), (stat), 1)
+#define WINDIVERT_STAT_LATENCY(context, histogram, t0, t1)                  \
+    windivert_stat_latency((context)->stats[                                \
+        KeGetCurrentProcessorNumber() % WINDIVERT_STATS_SLOTS].histogram,   \
+        (t0), (t1))
+
+/*
+ * WinDivert dispatcher.  All handles share one WFP callout and filter per
+ * layer.  The dispatcher parses each packet once, and passes it to the first
+ * handle (in priority order) whose filter matches.  The handles are published
+ * as a table with two slots, which readers pin like a filter program.
+ */
+#define WINDIVERT_DISPATCH_MAX                  128
+#define WINDIVERT_DISPATCH_METAS                4
+struct dispatch_entry_s
+{
+    context_t context;                          // Handle.
+    filter_t filter;                            // Handle's WFP filter.
+};
+struct dispatch_table_s
+{
+    volatile LONG refs;                         // Active readers.
+    UINT length;                                // Number of handles.
+    struct dispatch_entry_s entries[WINDIVERT_DISPATCH_MAX];
+                                                // Handles, by priority.
+};
+typedef struct dispatch_table_s *dispatch_table_t;
+struct dispatch_s
+{
+    struct dispatch_table_s tables[2];          // Handle tables.
+    volatile LONG table_curr;                   // Current table slot.
+    BOOL registered;                            // Callout registered?
+    BOOL installed;                             // Filter installed?
+    GUID callout_guid;                          // Callout GUID.
+    GUID filter_guid;                           // Filter GUID.
+};
+typedef struct dispatch_s *dispatch_t;
+
 /*
  * WinDivert Layer information.
  */
@@ -178,15 +521,43 @@ struct layer_s
     GUID layer_guid;                        // WFP layer GUID.
     GUID sublayer_guid;                     // Sub-layer GUID.
     windivert_callout_t callout;            // Call-out.
+    BOOL ipv4;                              // IPv4 layer?
+    const GUID *src_addr_key;               // SrcAddr condition (or NULL).
+    const GUID *dst_addr_key;               // DstAddr condition (or NULL).
+    const GUID *if_idx_key;                 // ifIdx condition (or NULL).
+    const GUID *sub_if_idx_key;             // subIfIdx condition (or NULL).
+    struct dispatch_s dispatch;             // Shared dispatcher.
 };
 typedef struct layer_s *layer_t;
 
+/*
+ * WinDivert WFP filter conditions.  Simple filter predicates are pushed down
+ * into the WFP filter so the base filtering engine can skip the callout for
+ * packets that cannot match.
+ */
+#define WINDIVERT_CONDITIONS_MAX                16
+struct conditions_s
+{
+    FWPM_FILTER_CONDITION0 cond[WINDIVERT_CONDITIONS_MAX];
+    FWP_V4_ADDR_AND_MASK v4[WINDIVERT_CONDITIONS_MAX];
+    FWP_V6_ADDR_AND_MASK v6[WINDIVERT_CONDITIONS_MAX];
+    FWP_BYTE_ARRAY16 addr[WINDIVERT_CONDITIONS_MAX];
+    UINT32 len;
+};
+typedef struct conditions_s *conditions_t;
+
 /*
  * WinDivert request context.
  */
 struct req_context_s
 {
     struct windivert_addr_s *addr;          // Pointer to address structure.
+    UINT32 *count;                          // Pointer to batch count.
+    ULONG batch_len;                        // Batch length (0 = no batch).
+    PMDL ring_mdl;                          // Locked shared ring memory.
+    PKEVENT ring_event;                     // Shared RX ring event.
+    UINT32 ring_slots;                      // Shared ring slots.
+    UINT32 ring_slot_len;                   // Shared ring slot length.
 };
 typedef struct req_context_s req_context_s;
 typedef struct req_context_s *req_context_t;
@@ -230,11 +601,53 @@ struct packet_s
     BOOL hop;                               // Decrement TTL?
     UINT32 if_idx;                          // Interface index.
     UINT32 sub_if_idx;                      // Sub-interface index.
+    UINT64 id;                              // Verdict ID (0 = not held).
     LONGLONG timestamp;                     // Packet timestamp.
+    UINT32 length;                          // Original packet length.
     size_t data_len;                        // Length of `data'.
-    char *data;                             // Packet data.
+    char *data;                             // Packet data (inline).
 };
 typedef struct packet_s *packet_t;
+#define WINDIVERT_PACKET_SIZE(data_len)                                     \
+    (sizeof(struct packet_s) + (data_len))
+#define WINDIVERT_SNAP_LEN(len, snap_len)                                   \
+    ((snap_len) != 0 && (snap_len) < (len)? (snap_len): (len))
+
+/*
+ * WinDivert held packet structure (WINDIVERT_FLAG_VERDICT).  The original
+ * NET_BUFFER_LIST is referenced until user mode returns a verdict, so that
+ * accepted packets are reinjected without copying.  The low bits of the ID
+ * select the worker that holds the packet.
+ */
+#define WINDIVERT_VERDICT_WORKER_BITS       6
+#define WINDIVERT_VERDICT_WORKER_MASK                                       \
+    ((1 << WINDIVERT_VERDICT_WORKER_BITS) - 1)
+struct verdict_s
+{
+    LIST_ENTRY entry;                       // Entry for queue.
+    UINT64 id;                              // Verdict ID.
+    PNET_BUFFER_LIST buffers;               // Referenced packet list.
+    PMDL mdl;                               // Packet's first MDL.
+    ULONG data_offset;                      // Packet's data offset.
+    ULONG data_len;                         // Packet's data length.
+    UINT8 direction;                        // Packet direction.
+    BOOL is_ipv4;                           // Is IPv4?
+    UINT32 if_idx;                          // Interface index.
+    UINT32 sub_if_idx;                      // Sub-interface index.
+    UINT32 priority;                        // WinDivert priority.
+    LONGLONG timestamp;                     // Packet timestamp.
+};
+typedef struct verdict_s *verdict_t;
+
+/*
+ * WinDivert injected packet batch structure.
+ */
+struct inject_batch_s
+{
+    LONG refcount;                          // Reference count.
+    PMDL mdl;                               // MDL for the batch data.
+};
+typedef struct inject_batch_s *inject_batch_t;
 
 /*
  * WinDivert address definition.
@@ -244,9 +657,53 @@ struct windivert_addr_s
     UINT32 IfIdx;
     UINT32 SubIfIdx;
     UINT8  Direction;
+    UINT32 Length;
+    UINT64 Id;
+    INT64  Timestamp;
 };
 typedef struct windivert_addr_s *windivert_addr_t;
 
+/*
+ * WinDivert verdict definition.
+ */
+struct windivert_verdict_s
+{
+    UINT64 Id;
+    UINT8  Verdict;
+};
+typedef struct windivert_verdict_s *windivert_verdict_t;
+
+/*
+ * WinDivert batch header definition.
+ */
+struct windivert_batch_hdr_s
+{
+    UINT32 Length;
+    struct windivert_addr_s Addr;
+};
+typedef struct windivert_batch_hdr_s *windivert_batch_hdr_t;
+
+/*
+ * WinDivert shared ring definition.
+ */
+struct windivert_ring_s
+{
+    volatile UINT32 Head;
+    UINT8  Reserved1[60];
+    volatile UINT32 Tail;
+    UINT8  Reserved2[60];
+    UINT32 Slots;
+    UINT32 SlotLength;
+    UINT64 Event;
+    UINT8  Reserved3[48];
+};
+typedef struct windivert_ring_s *windivert_ring_t;
+
+#define WINDIVERT_RING_SLOT_HDR(context, ring, idx)                         \
+    ((windivert_batch_hdr_t)((UINT8 *)((ring) + 1) +                        \
+        (SIZE_T)((idx) & ((context)->ring_slots - 1)) *                     \
+            (context)->ring_slot_len))
+
 /*
  * Header definitions.
  */
@@ -341,10 +798,24 @@ static HANDLE injectv6_handle = NULL;
 static NDIS_HANDLE nbl_pool_handle = NULL;
 static NDIS_HANDLE nb_pool_handle = NULL;
 static HANDLE engine_handle = NULL;
+static KEVENT dispatch_lock;
 static LONG priority_counter = 0;
 static LONGLONG counts_per_ms = 0;
 static POOL_TYPE non_paged_pool = NonPagedPool;
 
+/*
+ * Size-classed buffer pools.  Blocks larger than the biggest class fall back
+ * to windivert_malloc().
+ */
+#define WINDIVERT_POOL_CLASSES          2
+static const SIZE_T pool_sizes[WINDIVERT_POOL_CLASSES] =
+{
+    256,                                // Work items, small packets.
+    2048                                // MTU-sized packets.
+};
+static NPAGED_LOOKASIDE_LIST pools[WINDIVERT_POOL_CLASSES];
+static BOOL pools_init = FALSE;
+
 /*
  * Priorities.
  */
@@ -357,34 +828,111 @@ static UINT32 windivert_context_priority(UINT32 priority0)
     return ((priority0 << 16) | ((UINT32)priority1 & 0x0000FFFF));
 }
 
-#define WINDIVERT_FILTER_WEIGHT(priority)                                   \
-    ((UINT64)(UINT32_MAX - (priority)))
-
 /*
  * Prototypes.
  */
 static void windivert_driver_unload(void);
 extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
     IN size_t in_length, IN size_t out_len, IN ULONG code);
-static NTSTATUS windivert_read(context_t context, WDFREQUEST request);
+static NTSTATUS windivert_start_filter(context_t context,
+    windivert_ioctl_filter_t filter0, size_t filter0_len, UINT64 obj_len);
+static NTSTATUS windivert_set_layer(context_t context, UINT64 value);
+static NTSTATUS windivert_set_priority(context_t context, UINT64 value);
+static NTSTATUS windivert_set_flags(context_t context, UINT64 flags);
+static NTSTATUS windivert_set_param(context_t context, UINT8 param,
+    UINT64 value);
+static NTSTATUS windivert_open(context_t context, windivert_ioctl_open_t open,
+    size_t open_len, UINT64 obj_len);
+static NTSTATUS windivert_read(context_t context, WDFREQUEST request,
+    UINT8 queue);
 extern VOID windivert_worker(IN WDFWORKITEM item);
-static void windivert_read_service(context_t context);
+static void windivert_read_service(context_t context, worker_t worker);
+static BOOL windivert_read_hold(context_t context, worker_t worker,
+    WDFREQUEST request, packet_t packet, LONGLONG timestamp);
+static VOID windivert_read_timer(IN PKDPC dpc, IN PVOID context,
+    IN PVOID arg1, IN PVOID arg2);
+static void windivert_verdict_timer_arm(context_t context, LONGLONG t0,
+    LONGLONG timestamp);
+static VOID windivert_verdict_timer(IN PKDPC dpc, IN PVOID context,
+    IN PVOID arg1, IN PVOID arg2);
 extern VOID windivert_create(IN WDFDEVICE device, IN WDFREQUEST request,
     IN WDFFILEOBJECT object);
+static NTSTATUS windivert_worker_init(context_t context, worker_t worker,
+    BOOL bind);
 static NTSTATUS windivert_install_sublayer(layer_t layer);
+static UINT8 windivert_select_layers(UINT8 layer, BOOL is_inbound,
+    BOOL is_outbound, BOOL is_ipv4, BOOL is_ipv6, layer_t *layers);
 static NTSTATUS windivert_install_callouts(context_t context, UINT8 layer,
-    BOOL is_inbound, BOOL is_outbound, BOOL is_ipv4, BOOL is_ipv6);
+    BOOL is_inbound, BOOL is_outbound, BOOL is_ipv4, BOOL is_ipv6,
+    filter_t filter);
 static NTSTATUS windivert_install_callout(context_t context, UINT idx,
-    layer_t layer);
+    layer_t layer, filter_t filter);
+static NTSTATUS windivert_add_filter(layer_t layer, filter_t filter);
+static NTSTATUS windivert_update_callouts(context_t context, UINT8 layer,
+    BOOL is_inbound, BOOL is_outbound, BOOL is_ipv4, BOOL is_ipv6,
+    filter_t filter, BOOL *loosened);
+static void windivert_tighten_callouts(context_t context,
+    const BOOL *loosened);
 static void windivert_uninstall_callouts(context_t context,
     context_state_t state);
+static void windivert_dispatch_lock(void);
+static void windivert_dispatch_unlock(void);
+static dispatch_table_t windivert_dispatch_acquire(dispatch_t dispatch);
+static void windivert_dispatch_release(dispatch_table_t table);
+static void windivert_dispatch_publish(dispatch_t dispatch);
+static NTSTATUS windivert_dispatch_register(layer_t layer,
+    WDFDEVICE device);
+static void windivert_dispatch_unregister(layer_t layer);
+static NTSTATUS windivert_dispatch_install(layer_t layer, WDFDEVICE device,
+    filter_t filter);
+static void windivert_dispatch_uninstall(layer_t layer);
+static NTSTATUS windivert_dispatch_refilter(layer_t layer, filter_t filter);
+static NTSTATUS windivert_dispatch_join(context_t context, WDFDEVICE device,
+    layer_t layer, filter_t filter);
+static NTSTATUS windivert_dispatch_prepare(context_t context, layer_t layer,
+    filter_t filter, BOOL *loosened);
+static void windivert_dispatch_update(context_t context, layer_t layer,
+    filter_t filter);
+static void windivert_dispatch_tighten(context_t context, layer_t layer);
+static void windivert_dispatch_leave(context_t context, layer_t layer);
 extern VOID windivert_cleanup(IN WDFFILEOBJECT object);
 extern VOID windivert_close(IN WDFFILEOBJECT object);
 extern VOID windivert_destroy(IN WDFOBJECT object);
 extern NTSTATUS windivert_write(context_t context, WDFREQUEST request,
-    windivert_addr_t addr);
+    windivert_addr_t addr, UINT8 send_flags);
 extern void NTAPI windivert_inject_complete(VOID *context,
     NET_BUFFER_LIST *packets, BOOLEAN dispatch_level);
+static NTSTATUS windivert_write_batch(context_t context, WDFREQUEST request,
+    UINT8 send_flags);
+static NTSTATUS windivert_inject_batch(context_t context, inject_batch_t batch,
+    ULONG data_len, UINT8 send_flags, ULONG *inject_len,
+    UINT32 *inject_count);
+static void NTAPI windivert_inject_batch_complete(VOID *context,
+    NET_BUFFER_LIST *buffers, BOOLEAN dispatch_level);
+static void windivert_free_batch_buffers(PNET_BUFFER_LIST buffers);
+static void windivert_inject_batch_release(inject_batch_t batch);
+static NTSTATUS windivert_ring_lock(WDFREQUEST request,
+    req_context_t req_context);
+static void windivert_ring_unlock(PMDL mdl, PKEVENT event);
+static NTSTATUS windivert_ring_map(context_t context,
+    req_context_t req_context);
+static BOOL windivert_ring_put(context_t context, PNET_BUFFER buffer,
+    UINT8 direction, UINT32 if_idx, UINT32 sub_if_idx, UINT64 id,
+    LONGLONG timestamp, BOOL hop, UINT8 checksums);
+static BOOL windivert_ring_full(context_t context);
+static BOOL windivert_ring_bypass(context_t context, work_t work,
+    PNET_BUFFER buffer, BOOL sniff_mode, BOOL forward, BOOL *ok);
+static BOOL windivert_divert_packet(context_t context, worker_t worker,
+    work_t work, PNET_BUFFER buffer, BOOL sniff_mode, BOOL verdict_mode,
+    BOOL forward);
+static BOOL windivert_hop_expired(PNET_BUFFER buffer, ULONG len);
+static NTSTATUS windivert_ring_send(context_t context, UINT32 *count_ptr);
+static UINT64 windivert_verdict_retain(context_t context, worker_t worker,
+    work_t work, PNET_BUFFER buffer);
+static BOOL windivert_verdict_accept(BOOL forward, verdict_t verdict);
+static void windivert_verdict_release(verdict_t verdict);
+static NTSTATUS windivert_set_verdict(context_t context,
+    windivert_verdict_t verdicts, UINT count);
 static NTSTATUS windivert_notify_callout(IN FWPS_CALLOUT_NOTIFY_TYPE type,
     IN const GUID *filter_key, IN const FWPS_FILTER0 *filter);
 static void windivert_classify_outbound_network_v4_callout(
@@ -417,13 +965,21 @@ static void windivert_classify_forward_network_v6_callout(
     IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
     const FWPS_FILTER0 *filter, IN UINT64 flow_context,
     OUT FWPS_CLASSIFY_OUT0 *result);
-static void windivert_classify_callout(context_t context, IN UINT8 direction,
-    IN UINT32 if_idx, IN UINT32 sub_if_idx, IN BOOL isipv4,
-    IN BOOL loopback, IN UINT advance, IN OUT void *data,
-    IN UINT64 flow_context, OUT FWPS_CLASSIFY_OUT0 *result);
-static BOOL windivert_queue_packet(context_t context, PNET_BUFFER buffer,
-    UINT8 direction, UINT32 if_idx, UINT32 sub_if_idx, BOOL is_ipv4, BOOL hop,
-    UINT8 checksums, LONGLONG timestamp);
+static void windivert_dispatch(layer_t layer, IN UINT8 direction,
+    IN UINT32 if_idx, IN UINT32 sub_if_idx, IN BOOL isipv4, IN BOOL loopback,
+    IN UINT advance, IN OUT void *data, OUT FWPS_CLASSIFY_OUT0 *result);
+static BOOL windivert_classify_callout(context_t context, UINT8 direction,
+    UINT32 if_idx, UINT32 sub_if_idx, BOOL isipv4, BOOL hop, UINT8 checksums,
+    UINT advance, PNET_BUFFER_LIST buffers, PNET_BUFFER buffer_fst,
+    UINT32 hash, LONGLONG timestamp);
+static UINT32 windivert_meta_hash(meta_t meta);
+static BOOL windivert_sample(context_t context, UINT32 hash,
+    LONGLONG timestamp);
+static BOOL windivert_queue_full(context_t context, worker_t worker,
+    UINT data_len);
+static BOOL windivert_queue_packet(context_t context, worker_t worker,
+    PNET_BUFFER buffer, UINT8 direction, UINT32 if_idx, UINT32 sub_if_idx,
+    UINT64 id, BOOL is_ipv4, BOOL hop, UINT8 checksums, LONGLONG timestamp);
 static BOOL windivert_reinject_packet(BOOL sniff_mode, BOOL foward,
     UINT8 direction, BOOL isipv4, UINT32 if_idx, UINT32 sub_if_idx,
     UINT32 priority, PNET_BUFFER_LIST buffers, PNET_BUFFER buffer,
@@ -434,18 +990,39 @@ static void NTAPI windivert_reinject_clone_complete(VOID *context,
     NET_BUFFER_LIST *buffers_cpy, BOOLEAN dispatch_level);
 static void windivert_free_packet(packet_t packet);
 static UINT8 windivert_skip_headers(UINT8 proto, UINT8 **header, size_t *len);
+static void windivert_stat_peak(volatile LONG *peak, LONG value);
+static void windivert_stat_latency(volatile LONG64 *histogram, LONGLONG t0,
+    LONGLONG t1);
+static void windivert_get_stats(context_t context, UINT64 *stats);
 static int windivert_big_num_compare(const UINT32 *a, const UINT32 *b);
-static BOOL windivert_filter(PNET_BUFFER buffer, UINT32 if_idx,
-    UINT32 sub_if_idx, BOOL outbound, BOOL isipv4, BOOL hop, UINT8 checksums,
-    filter_t filter);
+static BOOL windivert_filter_set_lookup(filter_set_t set, const UINT32 *val);
+static BOOL windivert_parse(PNET_BUFFER buffer, BOOL isipv4, meta_t meta);
+static BOOL windivert_filter_meta(meta_t meta, UINT32 if_idx,
+    UINT32 sub_if_idx, BOOL outbound, BOOL hop, UINT8 checksums,
+    filter_t filter, flow_cache_t cache);
+static BOOL windivert_flow_cache_lookup(flow_cache_t cache,
+    const UINT32 *key, BOOL *match);
+static void windivert_flow_cache_insert(flow_cache_t cache,
+    const UINT32 *key, BOOL match);
 static NTSTATUS windivert_finalize_packet(void *header, size_t len,
     BOOL hop, UINT8 checksums);
+static void windivert_calc_checksums(void *header, size_t len);
 static filter_t windivert_filter_compile(windivert_ioctl_filter_t ioctl_filter,
-    size_t ioctl_filter_len);
+    size_t ioctl_filter_len, UINT64 length);
 static void windivert_filter_analyze(filter_t filter, BOOL *is_inbound,
     BOOL *is_outbound, BOOL *ip_ipv4, BOOL *is_ipv6);
+static void windivert_filter_conditions(filter_t filter, layer_t layer,
+    conditions_t conds);
+static BOOL windivert_conditions_equal(conditions_t a, conditions_t b);
 static BOOL windivert_filter_test(filter_t filter, UINT16 ip, UINT8 protocol,
     UINT8 field, UINT32 arg);
+static BOOL windivert_filter_flow_only(filter_t filter);
+static flow_cache_t windivert_flow_cache_create(context_t context,
+    filter_t filter);
+static program_t windivert_program_acquire(context_t context);
+static void windivert_program_release(program_t program);
+static void windivert_program_replace(context_t context, filter_t filter,
+    flow_cache_t flow_cache);
 
 /*
  * WinDivert sublayer GUIDs
@@ -572,6 +1149,42 @@ static VOID windivert_free(PVOID ptr)
     }
 }
 
+/*
+ * WinDivert pool alloc/free.  Always non-paged.  The block size must be
+ * passed to windivert_pool_free() so that the size class can be found.
+ */
+static PVOID windivert_pool_alloc(SIZE_T size)
+{
+    UINT i;
+
+    for (i = 0; i < WINDIVERT_POOL_CLASSES; i++)
+    {
+        if (size <= pool_sizes[i])
+        {
+            return ExAllocateFromNPagedLookasideList(&pools[i]);
+        }
+    }
+    return windivert_malloc(size, FALSE);
+}
+static VOID windivert_pool_free(PVOID ptr, SIZE_T size)
+{
+    UINT i;
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < WINDIVERT_POOL_CLASSES; i++)
+    {
+        if (size <= pool_sizes[i])
+        {
+            ExFreeToNPagedLookasideList(&pools[i], ptr);
+            return;
+        }
+    }
+    windivert_free(ptr);
+}
+
 /*
  * WinDivert driver entry routine.
  */
@@ -590,6 +1203,8 @@ extern NTSTATUS DriverEntry(IN PDRIVER_OBJECT driver_obj,
     NET_BUFFER_POOL_PARAMETERS nb_pool_params;
     RTL_OSVERSIONINFOW version;
     LARGE_INTEGER freq;
+    ULONG pool_flags;
+    UINT i;
     NTSTATUS status;
     DECLARE_CONST_UNICODE_STRING(device_name,
         L"\\Device\\" WINDIVERT_DEVICE_NAME);
@@ -609,6 +1224,15 @@ extern NTSTATUS DriverEntry(IN PDRIVER_OBJECT driver_obj,
         }
     }
 
+    // Initialize the buffer pools:
+    pool_flags = (non_paged_pool == NonPagedPool? 0: POOL_NX_ALLOCATION);
+    for (i = 0; i < WINDIVERT_POOL_CLASSES; i++)
+    {
+        ExInitializeNPagedLookasideList(&pools[i], NULL, NULL, pool_flags,
+            pool_sizes[i], WINDIVERT_TAG, 0);
+    }
+    pools_init = TRUE;
+
     // Initialize timer info.
     KeQueryPerformanceCounter(&freq);
     counts_per_ms = freq.QuadPart / 1000;
@@ -633,6 +1257,40 @@ extern NTSTATUS DriverEntry(IN PDRIVER_OBJECT driver_obj,
         WINDIVERT_SUBLAYER_FORWARD_IPV4_GUID;
     layer_forward_network_ipv6->sublayer_guid =
         WINDIVERT_SUBLAYER_FORWARD_IPV6_GUID;
+    layer_inbound_network_ipv4->ipv4 = TRUE;
+    layer_outbound_network_ipv4->ipv4 = TRUE;
+    layer_forward_network_ipv4->ipv4 = TRUE;
+    layer_inbound_network_ipv4->src_addr_key =
+    layer_inbound_network_ipv6->src_addr_key =
+        &FWPM_CONDITION_IP_REMOTE_ADDRESS;
+    layer_inbound_network_ipv4->dst_addr_key =
+    layer_inbound_network_ipv6->dst_addr_key =
+        &FWPM_CONDITION_IP_LOCAL_ADDRESS;
+    layer_outbound_network_ipv4->src_addr_key =
+    layer_outbound_network_ipv6->src_addr_key =
+        &FWPM_CONDITION_IP_LOCAL_ADDRESS;
+    layer_outbound_network_ipv4->dst_addr_key =
+    layer_outbound_network_ipv6->dst_addr_key =
+        &FWPM_CONDITION_IP_REMOTE_ADDRESS;
+    layer_forward_network_ipv4->src_addr_key =
+    layer_forward_network_ipv6->src_addr_key =
+        &FWPM_CONDITION_IP_SOURCE_ADDRESS;
+    layer_forward_network_ipv4->dst_addr_key =
+    layer_forward_network_ipv6->dst_addr_key =
+        &FWPM_CONDITION_IP_DESTINATION_ADDRESS;
+    layer_inbound_network_ipv4->if_idx_key =
+    layer_inbound_network_ipv6->if_idx_key =
+    layer_outbound_network_ipv4->if_idx_key =
+    layer_outbound_network_ipv6->if_idx_key =
+        &FWPM_CONDITION_INTERFACE_INDEX;
+    layer_forward_network_ipv4->if_idx_key =
+    layer_forward_network_ipv6->if_idx_key =
+        &FWPM_CONDITION_DESTINATION_INTERFACE_INDEX;
+    layer_inbound_network_ipv4->sub_if_idx_key =
+    layer_inbound_network_ipv6->sub_if_idx_key =
+    layer_outbound_network_ipv4->sub_if_idx_key =
+    layer_outbound_network_ipv6->sub_if_idx_key =
+        &FWPM_CONDITION_SUB_INTERFACE_INDEX;
 
     // Configure ourself as a non-PnP driver:
     WDF_DRIVER_CONFIG_INIT(&config, WDF_NO_EVENT_CALLBACK);
@@ -754,7 +1412,9 @@ extern NTSTATUS DriverEntry(IN PDRIVER_OBJECT driver_obj,
         goto driver_entry_exit;
     }
 
-    // Open a handle to the filter engine:
+    // Open a handle to the filter engine.  The handle also owns the WFP
+    // callouts and filters of the dispatchers.
+    KeInitializeEvent(&dispatch_lock, SynchronizationEvent, TRUE);
     status = FwpmEngineOpen0(NULL, RPC_C_AUTHN_DEFAULT, NULL, NULL,
         &engine_handle);
     if (!NT_SUCCESS(status))
@@ -810,6 +1470,15 @@ driver_entry_sublayer_error:
         goto driver_entry_exit;
     }
 
+    // Pre-register the WFP callouts, so that opening a handle only needs to
+    // add a filter.  (Failures are retried when a handle is opened.)
+    windivert_dispatch_register(layer_inbound_network_ipv4, device);
+    windivert_dispatch_register(layer_outbound_network_ipv4, device);
+    windivert_dispatch_register(layer_inbound_network_ipv6, device);
+    windivert_dispatch_register(layer_outbound_network_ipv6, device);
+    windivert_dispatch_register(layer_forward_network_ipv4, device);
+    windivert_dispatch_register(layer_forward_network_ipv6, device);
+
 driver_entry_exit:
 
     if (!NT_SUCCESS(status))
@@ -834,6 +1503,7 @@ extern VOID windivert_unload(IN WDFDRIVER Driver)
 static void windivert_driver_unload(void)
 {
     NTSTATUS status;
+    UINT i;
 
     DEBUG("UNLOAD: unloading the WinDivert driver");
 
@@ -853,8 +1523,22 @@ static void windivert_driver_unload(void)
     {
         NdisFreeNetBufferPool(nb_pool_handle);
     }
+    if (pools_init)
+    {
+        for (i = 0; i < WINDIVERT_POOL_CLASSES; i++)
+        {
+            ExDeleteNPagedLookasideList(&pools[i]);
+        }
+        pools_init = FALSE;
+    }
     if (engine_handle != NULL)
     {
+        windivert_dispatch_unregister(layer_inbound_network_ipv4);
+        windivert_dispatch_unregister(layer_outbound_network_ipv4);
+        windivert_dispatch_unregister(layer_inbound_network_ipv6);
+        windivert_dispatch_unregister(layer_outbound_network_ipv6);
+        windivert_dispatch_unregister(layer_forward_network_ipv4);
+        windivert_dispatch_unregister(layer_forward_network_ipv6);
         status = FwpmTransactionBegin0(engine_handle, 0);
         if (!NT_SUCCESS(status))
         {
@@ -913,11 +1597,9 @@ extern VOID windivert_create(IN WDFDEVICE device, IN WDFREQUEST request,
     IN WDFFILEOBJECT object)
 {
     WDF_IO_QUEUE_CONFIG queue_config;
-    WDF_WORKITEM_CONFIG item_config;
-    WDF_OBJECT_ATTRIBUTES obj_attrs;
-    FWPM_SESSION0 session;
     NTSTATUS status = STATUS_SUCCESS;
-    UINT8 i;
+    ULONG workers;
+    UINT i;
     context_t context = windivert_context_get(object);
 
     DEBUG("CREATE: creating a new WinDivert context (context=%p)", context);
@@ -926,7 +1608,6 @@ extern VOID windivert_create(IN WDFDEVICE device, IN WDFREQUEST request,
     context->state  = WINDIVERT_CONTEXT_STATE_OPENING;
     context->device = device;
     context->object = object;
-    context->work_queue_length = 0;
     context->packet_queue_length = 0;
     context->packet_queue_maxlength = WINDIVERT_PARAM_QUEUE_LEN_DEFAULT;
     context->packet_queue_size = 0;
@@ -934,38 +1615,87 @@ extern VOID windivert_create(IN WDFDEVICE device, IN WDFREQUEST request,
     context->packet_queue_maxcounts =
         WINDIVERT_PARAM_QUEUE_TIME_DEFAULT * counts_per_ms;
     context->packet_queue_maxtime = WINDIVERT_PARAM_QUEUE_TIME_DEFAULT;
+    context->packet_queue_mode = WINDIVERT_PARAM_QUEUE_MODE_DEFAULT;
+    context->snap_len = WINDIVERT_PARAM_SNAPLEN_DEFAULT;
+    context->overload = WINDIVERT_PARAM_OVERLOAD_DEFAULT;
+    context->batch_count = WINDIVERT_PARAM_BATCH_COUNT_DEFAULT;
+    context->batch_time = WINDIVERT_PARAM_BATCH_TIME_DEFAULT;
+    context->batch_maxcounts =
+        WINDIVERT_PARAM_BATCH_TIME_DEFAULT * counts_per_ms / 1000;
+    context->batch_timer_set = 0;
+    KeInitializeTimer(&context->batch_timer);
+    KeInitializeDpc(&context->batch_dpc, windivert_read_timer, context);
+    context->verdict_timer_set = 0;
+    KeInitializeTimer(&context->verdict_timer);
+    KeInitializeDpc(&context->verdict_dpc, windivert_verdict_timer, context);
+    context->sample_rate = WINDIVERT_PARAM_SAMPLE_RATE_DEFAULT;
+    context->sample_mode = WINDIVERT_PARAM_SAMPLE_MODE_DEFAULT;
+    context->sample_count = 0;
+    context->rate_limit = WINDIVERT_PARAM_RATE_LIMIT_DEFAULT;
+    context->rate_mode = WINDIVERT_PARAM_RATE_MODE_DEFAULT;
+    for (i = 0; i < WINDIVERT_RATE_BUCKETS; i++)
+    {
+        KeInitializeSpinLock(&context->rates[i].lock);
+        context->rates[i].tokens = 0;
+        context->rates[i].timestamp = 0;
+    }
+    context->packet_queue_peak_length = 0;
+    context->packet_queue_peak_size = 0;
+    context->stats = NULL;
     context->layer = WINDIVERT_LAYER_DEFAULT;
     context->flags = 0;
     context->priority = WINDIVERT_CONTEXT_PRIORITY(WINDIVERT_PRIORITY_DEFAULT);
-    context->filter = NULL;
+    RtlZeroMemory(context->programs, sizeof(context->programs));
+    context->program_curr = 0;
+    context->replacing = FALSE;
+    context->ring_mdl = NULL;
+    context->ring_event = NULL;
+    context->rx_ring = NULL;
+    context->tx_ring = NULL;
+    KeInitializeSpinLock(&context->ring_lock);
+    context->rx_ring_ready = NULL;
+    context->rx_ring_writers = 0;
+    workers = KeQueryActiveProcessorCount(NULL);
+    workers = (workers == 0? 1: workers);
+    workers = (workers > WINDIVERT_CONTEXT_MAXWORKERS?
+        WINDIVERT_CONTEXT_MAXWORKERS: workers);
+    context->worker_count = (UINT8)workers;
+    context->queue_count = 0;
+    context->read_curr = 0;
     for (i = 0; i < WINDIVERT_CONTEXT_MAXWORKERS; i++)
     {
-        context->workers[i] = NULL;
+        KeInitializeSpinLock(&context->workers[i].lock);
+        InitializeListHead(&context->workers[i].work_queue);
+        context->workers[i].work_queue_length = 0;
+        InitializeListHead(&context->workers[i].packet_queue);
+        context->workers[i].packet_queue_length = 0;
+        context->workers[i].packet_queue_size = 0;
+        context->workers[i].read_queue = NULL;
+        context->workers[i].item = NULL;
+        InitializeListHead(&context->workers[i].verdict_queue);
+        context->workers[i].verdict_queue_length = 0;
+        context->workers[i].verdict_seq = 0;
     }
-    context->worker_curr = 0;
     for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
     {
         context->installed[i] = FALSE;
     }
     context->on = FALSE;
     KeInitializeSpinLock(&context->lock);
-    InitializeListHead(&context->work_queue);
-    InitializeListHead(&context->packet_queue);
-    for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
+
+    // The statistics slots are allocated on their own: WDF only aligns the
+    // context to MEMORY_ALLOCATION_ALIGNMENT, but an allocation of a page or
+    // more is page aligned, so each slot really starts on a cache line.
+    context->stats = (struct stats_s *)windivert_malloc(
+        WINDIVERT_STATS_SLOTS * sizeof(struct stats_s), FALSE);
+    if (context->stats == NULL)
     {
-        status = ExUuidCreate(&context->callout_guid[i]);
-        if (!NT_SUCCESS(status))
-        {
-            DEBUG_ERROR("failed to create callout GUID", status);
-            goto windivert_create_exit;
-        }
-        status = ExUuidCreate(&context->filter_guid[i]);
-        if (!NT_SUCCESS(status))
-        {
-            DEBUG_ERROR("failed to create filter GUID", status);
-            goto windivert_create_exit;
-        }
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to allocate statistics", status);
+        goto windivert_create_exit;
     }
+    RtlZeroMemory((PVOID)context->stats,
+        WINDIVERT_STATS_SLOTS * sizeof(struct stats_s));
     WDF_IO_QUEUE_CONFIG_INIT(&queue_config, WdfIoQueueDispatchManual);
     status = WdfIoQueueCreate(device, &queue_config, WDF_NO_OBJECT_ATTRIBUTES,
         &context->read_queue);
@@ -974,29 +1704,14 @@ extern VOID windivert_create(IN WDFDEVICE device, IN WDFREQUEST request,
         DEBUG_ERROR("failed to create I/O read queue", status);
         goto windivert_create_exit;
     }
-    WDF_WORKITEM_CONFIG_INIT(&item_config, windivert_worker);
-    item_config.AutomaticSerialization = FALSE;
-    WDF_OBJECT_ATTRIBUTES_INIT(&obj_attrs);
-    obj_attrs.ParentObject = (WDFOBJECT)object;
-    for (i = 0; i < WINDIVERT_CONTEXT_MAXWORKERS; i++)
+    for (i = 0; i < context->worker_count; i++)
     {
-        status = WdfWorkItemCreate(&item_config, &obj_attrs,
-            context->workers + i);
+        status = windivert_worker_init(context, context->workers + i, FALSE);
         if (!NT_SUCCESS(status))
         {
-            DEBUG_ERROR("failed to create read service work item", status);
             goto windivert_create_exit;
         }
     }
-    RtlZeroMemory(&session, sizeof(session));
-    session.flags |= FWPM_SESSION_FLAG_DYNAMIC;
-    status = FwpmEngineOpen0(NULL, RPC_C_AUTHN_DEFAULT, NULL, &session,
-        &context->engine_handle);
-    if (!NT_SUCCESS(status))
-    {
-        DEBUG_ERROR("failed to create WFP engine handle", status);
-        goto windivert_create_exit;
-    }
     context->state = WINDIVERT_CONTEXT_STATE_OPEN;
 
 windivert_create_exit:
@@ -1005,37 +1720,103 @@ windivert_create_exit:
     if (!NT_SUCCESS(status))
     {
         context->state = WINDIVERT_CONTEXT_STATE_INVALID;
+        windivert_free((PVOID)context->stats);
+        context->stats = NULL;
         if (context->read_queue != NULL)
         {
             WdfObjectDelete(context->read_queue);
         }
         for (i = 0; i < WINDIVERT_CONTEXT_MAXWORKERS; i++)
         {
-            if (context->workers[i] != NULL)
+            if (context->workers[i].item != NULL)
             {
-                WdfObjectDelete(context->workers[i]);
+                WdfObjectDelete(context->workers[i].item);
             }
         }
-        if (context->engine_handle != NULL)
-        {
-            FwpmEngineClose0(context->engine_handle);
-        }
     }
 
     WdfRequestComplete(request, status);
 }
 
 /*
- * Register all WFP callouts.
+ * Create a worker's work item and, if the worker is bound to a sub-queue,
+ * its read queue.  Objects the worker already has are kept.
  */
-static NTSTATUS windivert_install_callouts(context_t context, UINT8 layer,
-    BOOL is_inbound, BOOL is_outbound, BOOL is_ipv4, BOOL is_ipv6)
+static NTSTATUS windivert_worker_init(context_t context, worker_t worker,
+    BOOL bind)
 {
-    UINT8 i, j;
-    layer_t layers[WINDIVERT_CONTEXT_MAXLAYERS];
+    KLOCK_QUEUE_HANDLE lock_handle;
+    WDF_IO_QUEUE_CONFIG queue_config;
+    WDF_WORKITEM_CONFIG item_config;
+    WDF_OBJECT_ATTRIBUTES obj_attrs;
+    WDFWORKITEM item = NULL;
+    WDFQUEUE read_queue = NULL;
     NTSTATUS status;
 
-    i = 0;
+    if (worker->item == NULL)
+    {
+        WDF_WORKITEM_CONFIG_INIT(&item_config, windivert_worker);
+        item_config.AutomaticSerialization = FALSE;
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&obj_attrs,
+            worker_context_s);
+        obj_attrs.ParentObject = (WDFOBJECT)context->object;
+        status = WdfWorkItemCreate(&item_config, &obj_attrs, &item);
+        if (!NT_SUCCESS(status))
+        {
+            DEBUG_ERROR("failed to create read service work item", status);
+            return status;
+        }
+        windivert_worker_context_get(item)->worker = worker;
+    }
+    if (bind && worker->read_queue == NULL)
+    {
+        WDF_IO_QUEUE_CONFIG_INIT(&queue_config, WdfIoQueueDispatchManual);
+        status = WdfIoQueueCreate(context->device, &queue_config,
+            WDF_NO_OBJECT_ATTRIBUTES, &read_queue);
+        if (!NT_SUCCESS(status))
+        {
+            DEBUG_ERROR("failed to create sub-queue read queue", status);
+            if (item != NULL)
+            {
+                WdfObjectDelete(item);
+            }
+            return status;
+        }
+    }
+
+    // Install the new objects, unless we lost a race with another thread:
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (item != NULL && worker->item == NULL)
+    {
+        worker->item = item;
+        item = NULL;
+    }
+    if (read_queue != NULL && worker->read_queue == NULL)
+    {
+        worker->read_queue = read_queue;
+        read_queue = NULL;
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    if (item != NULL)
+    {
+        WdfObjectDelete(item);
+    }
+    if (read_queue != NULL)
+    {
+        WdfObjectDelete(read_queue);
+    }
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Select the WFP layers that a filter needs.  Returns the number of layers,
+ * or WINDIVERT_CONTEXT_MAXLAYERS+1 for an invalid WinDivert layer.
+ */
+static UINT8 windivert_select_layers(UINT8 layer, BOOL is_inbound,
+    BOOL is_outbound, BOOL is_ipv4, BOOL is_ipv6, layer_t *layers)
+{
+    UINT8 i = 0;
+
     switch (layer)
     {
         case WINDIVERT_LAYER_NETWORK:
@@ -1069,12 +1850,32 @@ static NTSTATUS windivert_install_callouts(context_t context, UINT8 layer,
             break;
 
         default:
-            return STATUS_INVALID_PARAMETER;
+            return WINDIVERT_CONTEXT_MAXLAYERS+1;
+    }
+    return i;
+}
+
+/*
+ * Register all WFP callouts.
+ */
+static NTSTATUS windivert_install_callouts(context_t context, UINT8 layer,
+    BOOL is_inbound, BOOL is_outbound, BOOL is_ipv4, BOOL is_ipv6,
+    filter_t filter)
+{
+    UINT8 i, j;
+    layer_t layers[WINDIVERT_CONTEXT_MAXLAYERS];
+    NTSTATUS status = STATUS_SUCCESS;
+
+    i = windivert_select_layers(layer, is_inbound, is_outbound, is_ipv4,
+        is_ipv6, layers);
+    if (i > WINDIVERT_CONTEXT_MAXLAYERS)
+    {
+        return STATUS_INVALID_PARAMETER;
     }
 
     for (j = 0; j < i; j++)
     {
-        status = windivert_install_callout(context, j, layers[j]);
+        status = windivert_install_callout(context, j, layers[j], filter);
         if (!NT_SUCCESS(status))
         {
             goto windivert_install_callouts_exit;
@@ -1092,20 +1893,13 @@ windivert_install_callouts_exit:
 }
 
 /*
- * Register a WFP callout.
+ * Add a context to the dispatcher of a WFP layer.
  */
 static NTSTATUS windivert_install_callout(context_t context, UINT idx,
-    layer_t layer)
+    layer_t layer, filter_t filter)
 {
     KLOCK_QUEUE_HANDLE lock_handle;
-    FWPS_CALLOUT0 scallout;
-    FWPM_CALLOUT0 mcallout;
-    FWPM_FILTER0 filter;
-    UINT64 weight;
-    UINT32 priority;
-    GUID callout_guid, filter_guid;
     WDFDEVICE device;
-    HANDLE engine_handle;
     NTSTATUS status;
 
     KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
@@ -1115,67 +1909,12 @@ static NTSTATUS windivert_install_callout(context_t context, UINT idx,
         status = STATUS_INVALID_DEVICE_STATE;
         return status;
     }
-    priority = context->priority;
-    callout_guid = context->callout_guid[idx];
-    filter_guid = context->filter_guid[idx];
     device = context->device;
-    engine_handle = context->engine_handle;
     KeReleaseInStackQueuedSpinLock(&lock_handle);
 
-    weight = WINDIVERT_FILTER_WEIGHT(priority);
-    
-    RtlZeroMemory(&scallout, sizeof(scallout));
-    scallout.calloutKey              = callout_guid;
-    scallout.classifyFn              = layer->callout;
-    scallout.notifyFn                = windivert_notify_callout;
-    scallout.flowDeleteFn            = NULL;
-    RtlZeroMemory(&mcallout, sizeof(mcallout));
-    mcallout.calloutKey              = callout_guid;
-    mcallout.displayData.name        = layer->callout_name;
-    mcallout.displayData.description = layer->callout_desc;
-    mcallout.applicableLayer         = layer->layer_guid;
-    RtlZeroMemory(&filter, sizeof(filter));
-    filter.filterKey                 = filter_guid;
-    filter.layerKey                  = layer->layer_guid;
-    filter.displayData.name          = layer->filter_name;
-    filter.displayData.description   = layer->filter_desc;
-    filter.action.type               = FWP_ACTION_CALLOUT_UNKNOWN;
-    filter.action.calloutKey         = callout_guid;
-    filter.subLayerKey               = layer->sublayer_guid;
-    filter.weight.type               = FWP_UINT64;
-    filter.weight.uint64             = &weight;
-    filter.rawContext                = (UINT64)context;
-    status = FwpsCalloutRegister0(WdfDeviceWdmGetDeviceObject(device),
-        &scallout, NULL);
-    if (!NT_SUCCESS(status))
-    {
-        DEBUG_ERROR("failed to install WFP callout", status);
-        return status;
-    }
-    status = FwpmTransactionBegin0(engine_handle, 0);
-    if (!NT_SUCCESS(status))
-    {
-        DEBUG_ERROR("failed to begin WFP transaction", status);
-        FwpsCalloutUnregisterByKey0(&callout_guid);
-        return status;
-    }
-    status = FwpmCalloutAdd0(engine_handle, &mcallout, NULL, NULL);
-    if (!NT_SUCCESS(status))
-    {
-        DEBUG_ERROR("failed to add WFP callout", status);
-        goto windivert_install_callout_error;
-    }
-    status = FwpmFilterAdd0(engine_handle, &filter, NULL, NULL);
-    if (!NT_SUCCESS(status))
-    {
-        DEBUG_ERROR("failed to add WFP filter", status);
-        goto windivert_install_callout_error;
-    }
-    status = FwpmTransactionCommit0(engine_handle);
+    status = windivert_dispatch_join(context, device, layer, filter);
     if (!NT_SUCCESS(status))
     {
-        DEBUG_ERROR("failed to commit WFP transaction", status);
-        FwpsCalloutUnregisterByKey0(&callout_guid);
         return status;
     }
 
@@ -1183,2586 +1922,6630 @@ static NTSTATUS windivert_install_callout(context_t context, UINT idx,
     if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
     {
         KeReleaseInStackQueuedSpinLock(&lock_handle);
-        FwpsCalloutUnregisterByKey0(&callout_guid);
+        windivert_dispatch_leave(context, layer);
         status = STATUS_INVALID_DEVICE_STATE;
         return status;
     }
     context->installed[idx] = TRUE;
+    context->layers[idx] = layer;
     KeReleaseInStackQueuedSpinLock(&lock_handle);
 
     return STATUS_SUCCESS;
+}
+
+/*
+ * Add the WFP filter for a dispatcher.  If filter is non-NULL, then its
+ * simple predicates are pushed into the WFP filter.  The dispatch_lock must
+ * be held.
+ */
+static NTSTATUS windivert_add_filter(layer_t layer, filter_t filter)
+{
+    FWPM_FILTER0 mfilter;
+    conditions_t conds = NULL;
+    NTSTATUS status;
+
+    // Push simple predicates into the WFP filter.  This is an optimization
+    // only, so on allocation failure the filter is installed unconditioned.
+    if (filter != NULL)
+    {
+        conds = (conditions_t)windivert_malloc(sizeof(struct conditions_s),
+            TRUE);
+    }
+    if (conds != NULL)
+    {
+        windivert_filter_conditions(filter, layer, conds);
+    }
 
-windivert_install_callout_error:
-    FwpmTransactionAbort0(engine_handle);
-    FwpsCalloutUnregisterByKey0(&callout_guid);
+    RtlZeroMemory(&mfilter, sizeof(mfilter));
+    mfilter.filterKey                = layer->dispatch.filter_guid;
+    mfilter.layerKey                 = layer->layer_guid;
+    mfilter.displayData.name         = layer->filter_name;
+    mfilter.displayData.description  = layer->filter_desc;
+    mfilter.action.type              = FWP_ACTION_CALLOUT_UNKNOWN;
+    mfilter.action.calloutKey        = layer->dispatch.callout_guid;
+    mfilter.subLayerKey              = layer->sublayer_guid;
+    if (conds != NULL && conds->len != 0)
+    {
+        mfilter.numFilterConditions  = conds->len;
+        mfilter.filterCondition      = conds->cond;
+    }
+    status = FwpmFilterAdd0(engine_handle, &mfilter, NULL, NULL);
+    windivert_free(conds);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to add WFP filter", status);
+    }
     return status;
 }
 
 /*
- * WinDivert uninstall callouts routine.
+ * Update the dispatchers for a replacement filter.  Layers the new filter
+ * needs are joined.  Joined layers are never left, so the packet queues are
+ * kept, and an extra layer merely runs a filter that rejects.  Where the
+ * handle is alone and the WFP filter's conditions would change, the
+ * conditions are dropped first, since no conditions are safe for both the
+ * old and the new filter; loosened[i] is set for these layers, which
+ * windivert_tighten_callouts() restricts again once the new filter is
+ * current.  Every step that can fail is done before any dispatcher refers to
+ * the new filter.  On failure the layers joined here are left again, so the
+ * new filter can be freed and the handle diverts as before.
  */
-static void windivert_uninstall_callouts(context_t context,
-    context_state_t state)
+static NTSTATUS windivert_update_callouts(context_t context, UINT8 layer,
+    BOOL is_inbound, BOOL is_outbound, BOOL is_ipv4, BOOL is_ipv6,
+    filter_t filter, BOOL *loosened)
 {
     KLOCK_QUEUE_HANDLE lock_handle;
-    UINT i;
-    HANDLE engine_handle;
-    BOOL installed;
-    GUID callout_guid, filter_guid;
-    NTSTATUS status;
+    layer_t layers[WINDIVERT_CONTEXT_MAXLAYERS];
+    layer_t installed_layers[WINDIVERT_CONTEXT_MAXLAYERS];
+    BOOL installed[WINDIVERT_CONTEXT_MAXLAYERS];
+    BOOL joined[WINDIVERT_CONTEXT_MAXLAYERS];
+    BOOL leave;
+    UINT8 count, i, j;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
+    {
+        joined[i] = loosened[i] = FALSE;
+    }
+    count = windivert_select_layers(layer, is_inbound, is_outbound, is_ipv4,
+        is_ipv6, layers);
+    if (count > WINDIVERT_CONTEXT_MAXLAYERS)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
 
     KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    if (context->state != state)
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
     {
-windivert_uninstall_callouts_error:
         KeReleaseInStackQueuedSpinLock(&lock_handle);
-        status = STATUS_INVALID_DEVICE_STATE;
-        DEBUG_ERROR("failed to delete filters and callouts", status);
-        return;
+        return STATUS_INVALID_DEVICE_STATE;
     }
-    engine_handle = context->engine_handle;
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-
-    status = FwpmTransactionBegin0(engine_handle, 0);
-    if (!NT_SUCCESS(status))
+    for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
     {
-        // If the userspace app closes without closing the handle to
-        // WinDivert, any actions on engine_handle fail because the
-        // RPC handle was closed first. So, this path is "normal" if
-        // the user's app crashed or never closed the WinDivert handle.
-        DEBUG_ERROR("failed to begin WFP transaction", status);
-        goto unregister_callouts;
+        installed[i] = context->installed[i];
+        installed_layers[i] = context->layers[i];
     }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    // Prepare the joined layers:
     for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
     {
-        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-        if (context->state != state)
+        if (!installed[i])
         {
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            FwpmTransactionAbort0(engine_handle);
-            status = STATUS_INVALID_DEVICE_STATE;
-            DEBUG_ERROR("failed to delete filters and callouts", status);
-            return;
+            continue;
         }
-        installed = context->installed[i];
-        callout_guid = context->callout_guid[i];
-        filter_guid = context->filter_guid[i];
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-
-	    if (!installed)
-	    {
-	        continue;
-	    }
-        status = FwpmFilterDeleteByKey0(engine_handle, &filter_guid);
+        status = windivert_dispatch_prepare(context, installed_layers[i],
+            filter, &loosened[i]);
         if (!NT_SUCCESS(status))
         {
-            DEBUG_ERROR("failed to delete filter", status);
-            break;
+            goto windivert_update_callouts_error;
+        }
+    }
+
+    // Join the missing layers:
+    for (j = 0; j < count; j++)
+    {
+        for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
+        {
+            if (installed[i] && installed_layers[i] == layers[j])
+            {
+                break;
+            }
+        }
+        if (i < WINDIVERT_CONTEXT_MAXLAYERS)
+        {
+            continue;
+        }
+        for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS && installed[i]; i++)
+            ;
+        if (i >= WINDIVERT_CONTEXT_MAXLAYERS)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto windivert_update_callouts_error;
         }
-        status = FwpmCalloutDeleteByKey0(engine_handle, &callout_guid);
+        status = windivert_install_callout(context, i, layers[j], filter);
         if (!NT_SUCCESS(status))
         {
-            DEBUG_ERROR("failed to delete callout", status);
-            break;
+            goto windivert_update_callouts_error;
         }
+        installed[i] = joined[i] = TRUE;
+        installed_layers[i] = layers[j];
     }
-    if (!NT_SUCCESS(status))
-    {
-        FwpmTransactionAbort0(engine_handle);
-        goto unregister_callouts;
-    }
-    status = FwpmTransactionCommit0(engine_handle);
-    if (!NT_SUCCESS(status))
+
+    // Nothing can fail from here on:
+    for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
     {
-        DEBUG_ERROR("failed to commit WFP transaction", status);
-        //fallthrough
+        if (installed[i] && !joined[i])
+        {
+            windivert_dispatch_update(context, installed_layers[i], filter);
+        }
     }
-unregister_callouts:
+    return STATUS_SUCCESS;
+
+windivert_update_callouts_error:
+
+    // The dispatchers still refer to the old filter, except for the layers
+    // joined above:
     for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
     {
-        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-        if (context->state != state)
+        if (joined[i])
         {
-            goto windivert_uninstall_callouts_error;
+            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+            leave = context->installed[i];
+            context->installed[i] = FALSE;
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            if (leave)
+            {
+                windivert_dispatch_leave(context, installed_layers[i]);
+            }
         }
-        installed = context->installed[i];
-        callout_guid = context->callout_guid[i];
-        context->installed[i] = FALSE;
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        if (!installed)
+        else if (loosened[i])
         {
-            continue;
+            windivert_dispatch_tighten(context, installed_layers[i]);
+            loosened[i] = FALSE;
         }
-        FwpsCalloutUnregisterByKey0(&callout_guid);
     }
+    return status;
 }
 
 /*
- * Divert cleanup routine.
+ * Restrict the WFP filters that windivert_update_callouts() loosened to the
+ * conditions of the handle's filter again.
  */
-extern VOID windivert_cleanup(IN WDFFILEOBJECT object)
+static void windivert_tighten_callouts(context_t context,
+    const BOOL *loosened)
 {
     KLOCK_QUEUE_HANDLE lock_handle;
-    PLIST_ENTRY entry;
+    BOOL installed;
+    layer_t layer;
     UINT i;
-    context_t context = windivert_context_get(object);
-    work_t work;
-    packet_t packet;
-    WDFQUEUE read_queue;
-    WDFWORKITEM worker;
-    LONGLONG timestamp;
-    BOOL sniff_mode, timeout, forward, ok;
-    UINT priority;
-    NTSTATUS status;
-    
-    DEBUG("CLEANUP: cleaning up WinDivert context (context=%p)", context);
 
-    ok = TRUE;
-    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
-    {
-windivert_cleanup_error:
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        status = STATUS_INVALID_DEVICE_STATE;
-        DEBUG_ERROR("failed to verify state for cleanup routine", status);
-        return;
-    }
-    context->state = WINDIVERT_CONTEXT_STATE_CLOSING;
-    sniff_mode = ((context->flags & WINDIVERT_FLAG_SNIFF) != 0);
-    forward = (context->layer == WINDIVERT_LAYER_NETWORK_FORWARD);
-    priority = context->priority;
-    while (!IsListEmpty(&context->packet_queue))
+    for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
     {
-        entry = RemoveHeadList(&context->packet_queue);
-        packet = CONTAINING_RECORD(entry, struct packet_s, entry);
-        context->packet_queue_length--;
-        context->packet_queue_size -= packet->data_len;
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        timeout = WINDIVERT_TIMEOUT(context, packet->timestamp, timestamp);
-        if (!timeout && ok)
+        if (!loosened[i])
         {
-            ok = windivert_reinject_packet(sniff_mode, forward,
-                packet->direction, packet->is_ipv4, packet->if_idx,
-                packet->sub_if_idx, priority, NULL, NULL, packet);
+            continue;
         }
-        windivert_free_packet(packet);
-        timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
         KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-        if (context->state != WINDIVERT_CONTEXT_STATE_CLOSING)
-        {
-            goto windivert_cleanup_error;
-        }
-    }
-    while (!IsListEmpty(&context->work_queue))
-    {
-        entry = RemoveHeadList(&context->work_queue);
-        context->work_queue_length--;
+        installed = context->installed[i];
+        layer = context->layers[i];
         KeReleaseInStackQueuedSpinLock(&lock_handle);
-        work = CONTAINING_RECORD(entry, struct work_s, entry);
-        timeout = WINDIVERT_TIMEOUT(context, work->timestamp, timestamp);
-        if (!timeout && ok)
-        {
-            ok = windivert_reinject_packet(sniff_mode, forward,
-                work->direction, work->is_ipv4, work->if_idx,
-                work->sub_if_idx, work->priority, work->buffers, NULL, NULL);
-        }
-        FwpsDereferenceNetBufferList(work->buffers, FALSE);
-        windivert_free(work);
-        timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
-        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-        if (context->state != WINDIVERT_CONTEXT_STATE_CLOSING)
-        {
-            goto windivert_cleanup_error;
-        }
-    }
-    read_queue = context->read_queue;
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-    WdfIoQueuePurge(read_queue, NULL, NULL);
-    WdfObjectDelete(read_queue);
-    for (i = 0; i < WINDIVERT_CONTEXT_MAXWORKERS; i++)
-    {
-        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-        if (context->state != WINDIVERT_CONTEXT_STATE_CLOSING)
+        if (installed)
         {
-            goto windivert_cleanup_error;
+            windivert_dispatch_tighten(context, layer);
         }
-        worker = context->workers[i];
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        WdfWorkItemFlush(worker);
-        WdfObjectDelete(worker);
     }
-    windivert_uninstall_callouts(context, WINDIVERT_CONTEXT_STATE_CLOSING);
-    FwpmEngineClose0(context->engine_handle);
 }
 
 /*
- * WinDivert close routine.
+ * WinDivert uninstall callouts routine.  Removes the context from all
+ * dispatchers; once this returns no classify can see the context.
  */
-extern VOID windivert_close(IN WDFFILEOBJECT object)
+static void windivert_uninstall_callouts(context_t context,
+    context_state_t state)
 {
     KLOCK_QUEUE_HANDLE lock_handle;
-    context_t context = windivert_context_get(object);
+    UINT i;
+    BOOL installed;
+    layer_t layer;
     NTSTATUS status;
-    
-    DEBUG("CLOSE: closing WinDivert context (context=%p)", context);
-    
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    if (context->state != WINDIVERT_CONTEXT_STATE_CLOSING)
+
+    for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
     {
+        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+        if (context->state != state)
+        {
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            status = STATUS_INVALID_DEVICE_STATE;
+            DEBUG_ERROR("failed to delete filters and callouts", status);
+            return;
+        }
+        installed = context->installed[i];
+        layer = context->layers[i];
+        context->installed[i] = FALSE;
         KeReleaseInStackQueuedSpinLock(&lock_handle);
-        status = STATUS_INVALID_DEVICE_STATE;
-        DEBUG_ERROR("failed to verify state for close routine", status);
-        return;
+        if (!installed)
+        {
+            continue;
+        }
+        windivert_dispatch_leave(context, layer);
     }
-    context->state = WINDIVERT_CONTEXT_STATE_CLOSED;
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
 }
 
 /*
- * WinDivert destroy routine.
+ * Acquire/release the dispatch_lock, which serializes changes to the
+ * dispatchers and their WFP objects.  Must be called at PASSIVE_LEVEL.
  */
-extern VOID windivert_destroy(IN WDFOBJECT object)
+static void windivert_dispatch_lock(void)
 {
-    KLOCK_QUEUE_HANDLE lock_handle;
-    context_t context = windivert_context_get((WDFFILEOBJECT)object);
-    filter_t filter;
-    NTSTATUS status;
+    KeWaitForSingleObject(&dispatch_lock, Executive, KernelMode, FALSE,
+        NULL);
+}
+static void windivert_dispatch_unlock(void)
+{
+    KeSetEvent(&dispatch_lock, IO_NO_INCREMENT, FALSE);
+}
 
-    DEBUG("DESTROY: destroying WinDivert context (context=%p)", context);
+/*
+ * Pin the current handle table of a dispatcher, in the same way as
+ * windivert_program_acquire().
+ */
+static dispatch_table_t windivert_dispatch_acquire(dispatch_t dispatch)
+{
+    dispatch_table_t table;
+    LONG curr;
 
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    if (context->state != WINDIVERT_CONTEXT_STATE_CLOSED)
+    while (TRUE)
     {
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        status = STATUS_INVALID_DEVICE_STATE;
-        DEBUG_ERROR("failed to verify state for destroy routine", status);
-        return;
+        curr = dispatch->table_curr;
+        table = dispatch->tables + curr;
+        InterlockedIncrement(&table->refs);
+        if (dispatch->table_curr == curr)
+        {
+            return table;
+        }
+        InterlockedDecrement(&table->refs);
     }
-    filter = context->filter;
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-    windivert_free(filter);
 }
 
 /*
- * WinDivert read routine.
+ * Unpin a handle table.
  */
-static NTSTATUS windivert_read(context_t context, WDFREQUEST request)
+static void windivert_dispatch_release(dispatch_table_t table)
 {
-    KLOCK_QUEUE_HANDLE lock_handle;
-    NTSTATUS status = STATUS_SUCCESS;
-
-    DEBUG("READ: reading diverted packet (context=%p, request=%p)", context,
-        request);
+    InterlockedDecrement(&table->refs);
+}
 
-    // Forward the request to the pending read queue:
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
-    {
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        return STATUS_INVALID_DEVICE_STATE;
-    }
-    status = WdfRequestForwardToIoQueue(request, context->read_queue);
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-    if (!NT_SUCCESS(status))
-    {
-        DEBUG_ERROR("failed to forward I/O request to read queue", status);
-        return status;
-    }
+/*
+ * Make the other handle table (filled in by the caller) current, and wait
+ * until the old table has no readers.  Readers hold a table for at most one
+ * classify.  The dispatch_lock must be held.
+ */
+static void windivert_dispatch_publish(dispatch_t dispatch)
+{
+    LARGE_INTEGER delay;
+    dispatch_table_t old_table;
+    LONG curr;
+    UINT spins = 0;
 
-    // Service the read request:
-    windivert_read_service(context);
+    curr = dispatch->table_curr;
+    old_table = dispatch->tables + curr;
+    InterlockedExchange(&dispatch->table_curr, 1 - curr);
 
-    return STATUS_SUCCESS;
+    delay.QuadPart = -10;                       // 1us
+    while (old_table->refs != 0)
+    {
+        if (spins++ < 1024)
+        {
+            YieldProcessor();
+            continue;
+        }
+        KeDelayExecutionThread(KernelMode, FALSE, &delay);
+    }
 }
 
 /*
- * WinDivert service a single read request.
+ * Register a dispatcher's WFP callout.  The callout stays registered until
+ * the driver unloads, so that opening a handle only needs to add a filter.
+ * The dispatch_lock must be held.
  */
-static void windivert_read_service_request(packet_t packet,
-    PNET_BUFFER buffer, UINT8 direction, UINT32 if_idx, UINT32 sub_if_idx,
-    BOOL hop, UINT8 checksums, WDFREQUEST request)
+static NTSTATUS windivert_dispatch_register(layer_t layer, WDFDEVICE device)
 {
-    PMDL dst_mdl;
-    PVOID dst, src;
-    ULONG dst_len, src_len;
+    dispatch_t dispatch = &layer->dispatch;
+    FWPS_CALLOUT0 scallout;
+    FWPM_CALLOUT0 mcallout;
     NTSTATUS status;
-    req_context_t req_context;
-    windivert_addr_t addr;
 
-    DEBUG("SERVICE: servicing read request (request=%p)", request);
-        
-    status = WdfRequestRetrieveOutputWdmMdl(request, &dst_mdl);
+    status = ExUuidCreate(&dispatch->callout_guid);
     if (!NT_SUCCESS(status))
     {
-        DEBUG_ERROR("failed to retrieve output MDL", status);
-        goto windivert_read_service_request_exit;
+        DEBUG_ERROR("failed to create callout GUID", status);
+        return status;
     }
-    dst = MmGetSystemAddressForMdlSafe(dst_mdl, NormalPagePriority);
-    if (dst == NULL)
+    status = ExUuidCreate(&dispatch->filter_guid);
+    if (!NT_SUCCESS(status))
     {
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        DEBUG_ERROR("failed to get address of output MDL", status);
-        goto windivert_read_service_request_exit;
+        DEBUG_ERROR("failed to create filter GUID", status);
+        return status;
     }
 
-    dst_len = MmGetMdlByteCount(dst_mdl);
-    if (packet != NULL)
+    RtlZeroMemory(&scallout, sizeof(scallout));
+    scallout.calloutKey              = dispatch->callout_guid;
+    scallout.classifyFn              = layer->callout;
+    scallout.notifyFn                = windivert_notify_callout;
+    scallout.flowDeleteFn            = NULL;
+    RtlZeroMemory(&mcallout, sizeof(mcallout));
+    mcallout.calloutKey              = dispatch->callout_guid;
+    mcallout.displayData.name        = layer->callout_name;
+    mcallout.displayData.description = layer->callout_desc;
+    mcallout.applicableLayer         = layer->layer_guid;
+    status = FwpsCalloutRegister0(WdfDeviceWdmGetDeviceObject(device),
+        &scallout, NULL);
+    if (!NT_SUCCESS(status))
     {
-        src_len = packet->data_len;
-        dst_len = (src_len < dst_len? src_len: dst_len);
-        src = packet->data;
-        RtlCopyMemory(dst, src, dst_len);
+        DEBUG_ERROR("failed to install WFP callout", status);
+        return status;
     }
-    else
+    status = FwpmCalloutAdd0(engine_handle, &mcallout, NULL, NULL);
+    if (!NT_SUCCESS(status))
     {
-        src_len = NET_BUFFER_DATA_LENGTH(buffer);
-        dst_len = (src_len < dst_len? src_len: dst_len);
-        src = NdisGetDataBuffer(buffer, dst_len, NULL, 1, 0);
-        if (src == NULL)
-        {
-            NdisGetDataBuffer(buffer, dst_len, dst, 1, 0);
-        }
-        else
-        {
-            RtlCopyMemory(dst, src, dst_len);
-        }
+        DEBUG_ERROR("failed to add WFP callout", status);
+        FwpsCalloutUnregisterByKey0(&dispatch->callout_guid);
+        return status;
     }
+    dispatch->registered = TRUE;
+    return STATUS_SUCCESS;
+}
 
-    // Write the address information.
-    req_context = windivert_req_context_get(request);
-    addr = req_context->addr;
-    if (addr != NULL)
+/*
+ * Unregister a dispatcher's WFP callout.  The dispatcher must have no
+ * handles.
+ */
+static void windivert_dispatch_unregister(layer_t layer)
+{
+    dispatch_t dispatch = &layer->dispatch;
+    NTSTATUS status;
+
+    if (!dispatch->registered)
     {
-        addr->IfIdx = if_idx;
-        addr->SubIfIdx = sub_if_idx;
-        addr->Direction = direction;
+        return;
     }
-
-    // Zero the IP/TCP/UDP checksums and/or decrement the TTL (if required).
-    status = windivert_finalize_packet(dst, dst_len, hop, checksums);
-
-windivert_read_service_request_exit:
-    if (NT_SUCCESS(status))
+    if (dispatch->installed)
     {
-        WdfRequestCompleteWithInformation(request, status, dst_len);
+        // (A filter whose earlier deletion failed.)
+        windivert_dispatch_uninstall(layer);
     }
-    else
+    status = FwpmCalloutDeleteByKey0(engine_handle, &dispatch->callout_guid);
+    if (!NT_SUCCESS(status))
     {
-        WdfRequestComplete(request, status);
+        DEBUG_ERROR("failed to delete callout", status);
     }
+    FwpsCalloutUnregisterByKey0(&dispatch->callout_guid);
+    dispatch->registered = FALSE;
 }
 
 /*
- * WinDivert read request service.
+ * Add a dispatcher's WFP filter, registering the callout if needed.  The
+ * dispatch_lock must be held.
  */
-static void windivert_read_service(context_t context)
+static NTSTATUS windivert_dispatch_install(layer_t layer, WDFDEVICE device,
+    filter_t filter)
 {
-    KLOCK_QUEUE_HANDLE lock_handle;
-    WDFREQUEST request;
-    PLIST_ENTRY entry;
-    PMDL dst_mdl;
-    PVOID dst, src;
-    ULONG dst_len, src_len;
-    LONGLONG timestamp;
-    BOOL timeout;
+    dispatch_t dispatch = &layer->dispatch;
     NTSTATUS status;
-    packet_t packet;
-    req_context_t req_context;
-    windivert_addr_t addr;
 
-    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    while (context->state == WINDIVERT_CONTEXT_STATE_OPEN &&
-           !IsListEmpty(&context->packet_queue))
+    if (!dispatch->registered)
     {
-        entry = RemoveHeadList(&context->packet_queue);
-        packet = CONTAINING_RECORD(entry, struct packet_s, entry);
-        timeout = WINDIVERT_TIMEOUT(context, packet->timestamp, timestamp);
-        request = NULL;
-        if (!timeout)
+        status = windivert_dispatch_register(layer, device);
+        if (!NT_SUCCESS(status))
         {
-            status = WdfIoQueueRetrieveNextRequest(context->read_queue,
-                &request);
-            if (!NT_SUCCESS(status))
-            {
-                InsertHeadList(&context->packet_queue, entry);
-                break;
-            }
+            return status;
         }
-        context->packet_queue_length--;
-        context->packet_queue_size -= packet->data_len;
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
+    }
+    status = windivert_add_filter(layer, filter);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    dispatch->installed = TRUE;
+    return STATUS_SUCCESS;
+}
 
-        if (!timeout)
-        {
-            windivert_read_service_request(packet, NULL,
-                packet->direction, packet->if_idx, packet->sub_if_idx,
-                packet->hop, packet->checksums, request);
-        }
+/*
+ * Delete a dispatcher's WFP filter.  The callout stays registered.  The
+ * dispatch_lock must be held, and the dispatcher must have no handles.  If
+ * the filter cannot be deleted the dispatcher stays installed, and the next
+ * handle to join replaces the filter instead of adding it again.
+ */
+static void windivert_dispatch_uninstall(layer_t layer)
+{
+    dispatch_t dispatch = &layer->dispatch;
+    NTSTATUS status;
 
-        windivert_free_packet(packet);
-        timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
-        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    status = FwpmFilterDeleteByKey0(engine_handle, &dispatch->filter_guid);
+    if (!NT_SUCCESS(status) && status != STATUS_FWP_FILTER_NOT_FOUND)
+    {
+        DEBUG_ERROR("failed to delete filter", status);
+        return;
     }
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    dispatch->installed = FALSE;
 }
 
 /*
- * WinDivert write routine.
+ * Replace a dispatcher's WFP filter, with the conditions of the given filter
+ * (or none if NULL).  The dispatch_lock must be held.
  */
-static NTSTATUS windivert_write(context_t context, WDFREQUEST request,
-    windivert_addr_t addr)
+static NTSTATUS windivert_dispatch_refilter(layer_t layer, filter_t filter)
 {
-    KLOCK_QUEUE_HANDLE lock_handle;
-    PMDL mdl = NULL, mdl_copy = NULL;
-    PVOID data, data_copy = NULL;
-    UINT data_len;
-    struct iphdr *ip_header;
-    struct ipv6hdr *ipv6_header;
-    BOOL isipv4;
-    UINT8 layer;
-    UINT32 priority;
-    UINT64 flags;
-    HANDLE handle, compl_handle;
-    PNET_BUFFER_LIST buffers = NULL;
-    NTSTATUS status = STATUS_SUCCESS;
-
-    DEBUG("WRITE: writing/injecting a packet (context=%p, request=%p)",
-        context, request);
+    NTSTATUS status;
 
-    if (addr->Direction != WINDIVERT_DIRECTION_INBOUND &&
-        addr->Direction != WINDIVERT_DIRECTION_OUTBOUND)
+    status = FwpmTransactionBegin0(engine_handle, 0);
+    if (!NT_SUCCESS(status))
     {
-        status = STATUS_INVALID_PARAMETER;
-        DEBUG_ERROR("failed to inject packet; invalid direction", status);
-        goto windivert_write_exit;
+        DEBUG_ERROR("failed to begin WFP transaction", status);
+        return status;
     }
-
-    status = WdfRequestRetrieveOutputWdmMdl(request, &mdl);
+    status = FwpmFilterDeleteByKey0(engine_handle,
+        &layer->dispatch.filter_guid);
     if (!NT_SUCCESS(status))
     {
-        DEBUG_ERROR("failed to retrieve input MDL", status);
-        goto windivert_write_exit;
+        DEBUG_ERROR("failed to delete filter", status);
+        FwpmTransactionAbort0(engine_handle);
+        return status;
     }
-
-    data = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
-    if (data == NULL)
+    status = windivert_add_filter(layer, filter);
+    if (!NT_SUCCESS(status))
     {
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        DEBUG_ERROR("failed to get MDL address", status);
-        goto windivert_write_exit;
+        FwpmTransactionAbort0(engine_handle);
+        return status;
     }
-    
-    data_len = MmGetMdlByteCount(mdl);
-    if (data_len > UINT16_MAX || data_len < sizeof(struct iphdr))
+    status = FwpmTransactionCommit0(engine_handle);
+    if (!NT_SUCCESS(status))
     {
-windivert_write_bad_packet:
-        status = STATUS_INVALID_PARAMETER;
-        DEBUG_ERROR("failed to inject a bad packet", status);
-        goto windivert_write_exit;
+        DEBUG_ERROR("failed to commit WFP transaction", status);
     }
+    return status;
+}
 
-    data_copy = windivert_malloc(data_len, FALSE);
-    if (data_copy == NULL)
+/*
+ * Add a context to a layer's dispatcher, installing the dispatcher for the
+ * first context.  The BFE cannot skip the callout for some handles only, so
+ * the WFP filter carries a handle's conditions only while it is alone.
+ */
+static NTSTATUS windivert_dispatch_join(context_t context, WDFDEVICE device,
+    layer_t layer, filter_t filter)
+{
+    dispatch_t dispatch = &layer->dispatch;
+    dispatch_table_t table, next;
+    UINT32 priority;
+    UINT i, j;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    // (The priority is fixed once filtering is on.)
+    priority = context->priority;
+
+    windivert_dispatch_lock();
+    table = dispatch->tables + dispatch->table_curr;
+    next = dispatch->tables + (1 - dispatch->table_curr);
+    if (table->length >= WINDIVERT_DISPATCH_MAX)
     {
         status = STATUS_INSUFFICIENT_RESOURCES;
-        DEBUG_ERROR("failed to allocate memory for injected packet data",
-            status);
-        goto windivert_write_exit;
+        DEBUG_ERROR("failed to join dispatcher; too many handles", status);
+        goto windivert_dispatch_join_exit;
     }
-
-    RtlCopyMemory(data_copy, data, sizeof(struct iphdr));
-    ip_header = (struct iphdr *)data_copy;
-    switch (ip_header->Version)
+    if (!dispatch->installed)
     {
-        case 4:
-            if (data_len != RtlUshortByteSwap(ip_header->Length))
-                goto windivert_write_bad_packet;
-            isipv4 = TRUE;
-            break;
-        case 6:
-            if (data_len < sizeof(struct ipv6hdr))
-                goto windivert_write_bad_packet;
-            ipv6_header = (struct ipv6hdr *)data_copy;
-            if (data_len != RtlUshortByteSwap(ipv6_header->Length) +
-                    sizeof(struct ipv6hdr))
-                goto windivert_write_bad_packet;
-            isipv4 = FALSE;
-            break;
-        default:
-            goto windivert_write_bad_packet;
+        status = windivert_dispatch_install(layer, device, filter);
     }
-    if (data_len > sizeof(struct iphdr))
+    else if (table->length == 0)
     {
-        RtlCopyMemory((char *)data_copy + sizeof(struct iphdr),
-            (char *)data + sizeof(struct iphdr),
-            data_len - sizeof(struct iphdr));
+        // The last handle's filter could not be deleted; replace it with
+        // the new handle's:
+        status = windivert_dispatch_refilter(layer, filter);
     }
-
-    mdl_copy = IoAllocateMdl(data_copy, data_len, FALSE, FALSE, NULL);
-    if (mdl_copy == NULL)
+    else if (table->length == 1)
     {
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        DEBUG_ERROR("failed to allocate MDL for injected packet", status);
-        goto windivert_write_exit;
+        // The WFP filter must no longer skip packets for the new handle:
+        status = windivert_dispatch_refilter(layer, NULL);
     }
-
-    MmBuildMdlForNonPagedPool(mdl_copy);
-    status = FwpsAllocateNetBufferAndNetBufferList0(nbl_pool_handle, 0, 0,
-        mdl_copy, 0, data_len, &buffers);
     if (!NT_SUCCESS(status))
     {
-        DEBUG_ERROR("failed to create NET_BUFFER_LIST for injected packet",
-            status);
-        goto windivert_write_exit;
+        goto windivert_dispatch_join_exit;
     }
 
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+    // Insert the context in priority order:
+    for (i = 0, j = 0; i < table->length; i++)
     {
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        status = STATUS_INVALID_DEVICE_STATE;
-        goto windivert_write_exit;
-    }
-    layer = context->layer;
-    priority = context->priority;
-    flags = context->flags;
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-
-    handle = (isipv4? inject_handle: injectv6_handle);
-    compl_handle = ((flags & WINDIVERT_FLAG_DEBUG) != 0? (HANDLE)request: NULL);
-    if (layer == WINDIVERT_LAYER_NETWORK_FORWARD)
-    {
-        status = FwpsInjectForwardAsync0(handle, (HANDLE)priority, 0,
-            (isipv4? AF_INET: AF_INET6), UNSPECIFIED_COMPARTMENT_ID,
-            addr->IfIdx, buffers, windivert_inject_complete, compl_handle);
-    }
-    else if (addr->Direction == WINDIVERT_DIRECTION_OUTBOUND)
-    {
-        status = FwpsInjectNetworkSendAsync0(handle, (HANDLE)priority, 0,
-            UNSPECIFIED_COMPARTMENT_ID, buffers, windivert_inject_complete,
-            compl_handle);
+        if (i == j && table->entries[i].context->priority > priority)
+        {
+            next->entries[j].context = context;
+            next->entries[j].filter = filter;
+            j++;
+        }
+        next->entries[j++] = table->entries[i];
     }
-    else
+    if (i == j)
     {
-        status = FwpsInjectNetworkReceiveAsync0(handle, (HANDLE)priority, 0,
-            UNSPECIFIED_COMPARTMENT_ID, addr->IfIdx, addr->SubIfIdx, buffers,
-            windivert_inject_complete, compl_handle);
+        next->entries[j].context = context;
+        next->entries[j].filter = filter;
+        j++;
     }
+    next->length = j;
+    windivert_dispatch_publish(dispatch);
 
-windivert_write_exit:
+windivert_dispatch_join_exit:
+    windivert_dispatch_unlock();
+    return status;
+}
 
-    if (NT_SUCCESS(status))
+/*
+ * Prepare a layer's dispatcher for a change of a context's filter.  If the
+ * context is alone and the conditions of the WFP filter would change, the
+ * conditions are dropped and *loosened is set.
+ */
+static NTSTATUS windivert_dispatch_prepare(context_t context, layer_t layer,
+    filter_t filter, BOOL *loosened)
+{
+    dispatch_t dispatch = &layer->dispatch;
+    dispatch_table_t table;
+    conditions_t old_conds = NULL, new_conds = NULL;
+    UINT i;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    *loosened = FALSE;
+    windivert_dispatch_lock();
+    table = dispatch->tables + dispatch->table_curr;
+    for (i = 0; i < table->length && table->entries[i].context != context;
+            i++)
+        ;
+    if (i >= table->length)
     {
-        if ((flags & WINDIVERT_FLAG_DEBUG) == 0)
-        {
-            WdfRequestCompleteWithInformation(request, status, data_len);
-        }
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto windivert_dispatch_prepare_exit;
     }
-    else
+    if (table->length == 1)
     {
-        DEBUG_ERROR("failed to inject packet", status);
-        if (buffers != NULL)
+        old_conds = (conditions_t)windivert_malloc(
+            sizeof(struct conditions_s), TRUE);
+        new_conds = (conditions_t)windivert_malloc(
+            sizeof(struct conditions_s), TRUE);
+        if (old_conds == NULL || new_conds == NULL)
         {
-            FwpsFreeNetBufferList0(buffers);
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto windivert_dispatch_prepare_exit;
         }
-        if (mdl_copy != NULL)
+        windivert_filter_conditions(table->entries[i].filter, layer,
+            old_conds);
+        windivert_filter_conditions(filter, layer, new_conds);
+        if (!windivert_conditions_equal(old_conds, new_conds))
         {
-            IoFreeMdl(mdl_copy);
+            status = windivert_dispatch_refilter(layer, NULL);
+            *loosened = NT_SUCCESS(status);
         }
-        windivert_free(data_copy);
     }
 
+windivert_dispatch_prepare_exit:
+    windivert_dispatch_unlock();
+    windivert_free(old_conds);
+    windivert_free(new_conds);
     return status;
 }
 
 /*
- * WinDivert inject complete routine.
+ * Update a context's filter in a layer's dispatcher.
  */
-static void NTAPI windivert_inject_complete(VOID *context,
-    NET_BUFFER_LIST *buffers, BOOLEAN dispatch_level)
+static void windivert_dispatch_update(context_t context, layer_t layer,
+    filter_t filter)
 {
-    PMDL mdl;
-    PVOID data;
-    PNET_BUFFER buffer;
-    size_t length;
-    WDFREQUEST request;
-    NTSTATUS status;
-    UNREFERENCED_PARAMETER(dispatch_level);
+    dispatch_t dispatch = &layer->dispatch;
+    dispatch_table_t table;
+    UINT i;
 
-    buffer = NET_BUFFER_LIST_FIRST_NB(buffers);
-    request = (WDFREQUEST)context;
-    if (request != NULL)
+    windivert_dispatch_lock();
+    table = dispatch->tables + dispatch->table_curr;
+    for (i = 0; i < table->length; i++)
     {
-        status = NET_BUFFER_LIST_STATUS(buffers);
-        length = 0;
-        if (NT_SUCCESS(status))
+        if (table->entries[i].context == context)
         {
-            length = NET_BUFFER_DATA_LENGTH(buffer);
+            // Only writers read the filter, so it can be changed in place.
+            table->entries[i].filter = filter;
+            break;
         }
-        WdfRequestCompleteWithInformation(request, status, length);
     }
-    mdl = NET_BUFFER_FIRST_MDL(buffer);
-    data = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
-    windivert_free(data);
-    IoFreeMdl(mdl);
-    FwpsFreeNetBufferList0(buffers);
+    windivert_dispatch_unlock();
 }
 
 /*
- * WinDivert caller context preprocessing.
+ * Restrict a layer's WFP filter to the conditions of a context's filter
+ * again, if the context is still alone.  (An optimization only, so errors
+ * are ignored.)
  */
-VOID windivert_caller_context(IN WDFDEVICE device, IN WDFREQUEST request)
+static void windivert_dispatch_tighten(context_t context, layer_t layer)
 {
-    PCHAR inbuf;
-    size_t inbuflen;
-    WDF_REQUEST_PARAMETERS params;
-    WDFMEMORY memobj;
-    windivert_addr_t addr = NULL;
-    windivert_ioctl_t ioctl;
-    WDF_OBJECT_ATTRIBUTES attributes;
-    req_context_t req_context = NULL;
-    NTSTATUS status;
-
-    WDF_REQUEST_PARAMETERS_INIT(&params);
-    WdfRequestGetParameters(request, &params);
+    dispatch_t dispatch = &layer->dispatch;
+    dispatch_table_t table;
 
-    if (params.Type != WdfRequestTypeDeviceControl)
+    windivert_dispatch_lock();
+    table = dispatch->tables + dispatch->table_curr;
+    if (table->length == 1 && table->entries[0].context == context)
     {
-        goto windivert_caller_context_exit;
+        windivert_dispatch_refilter(layer, table->entries[0].filter);
     }
+    windivert_dispatch_unlock();
+}
 
-    // Get and verify the input buffer.
-    status = WdfRequestRetrieveInputBuffer(request, 0, &inbuf, &inbuflen);
-    if (!NT_SUCCESS(status))
+/*
+ * Remove a context from a layer's dispatcher, uninstalling the dispatcher
+ * with the last context.  Once this returns no classify can see the context.
+ */
+static void windivert_dispatch_leave(context_t context, layer_t layer)
+{
+    dispatch_t dispatch = &layer->dispatch;
+    dispatch_table_t table, next;
+    UINT i, j;
+
+    windivert_dispatch_lock();
+    table = dispatch->tables + dispatch->table_curr;
+    next = dispatch->tables + (1 - dispatch->table_curr);
+    for (i = 0, j = 0; i < table->length; i++)
     {
-        DEBUG_ERROR("failed to retrieve input buffer", status);
-        goto windivert_caller_context_error;
+        if (table->entries[i].context != context)
+        {
+            next->entries[j++] = table->entries[i];
+        }
     }
-
-    if (inbuflen != sizeof(struct windivert_ioctl_s))
+    if (i == j)
     {
-        status = STATUS_INVALID_PARAMETER;
-        DEBUG_ERROR("input buffer not an ioctl message header", status);
-        goto windivert_caller_context_error;
+        windivert_dispatch_unlock();
+        return;
     }
-
-    ioctl = (windivert_ioctl_t)inbuf;
-    if (ioctl->version != WINDIVERT_IOCTL_VERSION ||
-        ioctl->magic != WINDIVERT_IOCTL_MAGIC)
+    next->length = j;
+    windivert_dispatch_publish(dispatch);
+    if (j == 0)
     {
-        status = STATUS_INVALID_PARAMETER;
-        DEBUG_ERROR("input buffer contained a bad ioctl message header",
-            status);
-        goto windivert_caller_context_error;
+        windivert_dispatch_uninstall(layer);
+    }
+    else if (j == 1)
+    {
+        // The remaining handle is alone again.  (An optimization only, so
+        // errors are ignored.)
+        windivert_dispatch_refilter(layer, next->entries[0].filter);
     }
+    windivert_dispatch_unlock();
+}
 
-    // Probe and lock user buffers here (if required).
-    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, req_context_s);
-    status = WdfObjectAllocateContext(request, &attributes, &req_context);
-    if (!NT_SUCCESS(status))
+/*
+ * Divert cleanup routine.
+ */
+extern VOID windivert_cleanup(IN WDFFILEOBJECT object)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    PLIST_ENTRY entry;
+    UINT i;
+    context_t context = windivert_context_get(object);
+    work_t work;
+    packet_t packet;
+    WDFQUEUE read_queue;
+    WDFWORKITEM item;
+    worker_t worker;
+    PMDL ring_mdl;
+    PKEVENT ring_event;
+    BOOLEAN *ring_ready;
+    LARGE_INTEGER delay;
+    verdict_t verdict;
+    LONGLONG timestamp;
+    BOOL sniff_mode, held, timeout, forward, ok;
+    UINT priority;
+    NTSTATUS status;
+    
+    DEBUG("CLEANUP: cleaning up WinDivert context (context=%p)", context);
+
+    ok = TRUE;
+    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
     {
-        DEBUG_ERROR("failed to allocate request context for ioctl", status);
-        goto windivert_caller_context_error;
+windivert_cleanup_error:
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        status = STATUS_INVALID_DEVICE_STATE;
+        DEBUG_ERROR("failed to verify state for cleanup routine", status);
+        return;
     }
-    switch (params.Parameters.DeviceIoControl.IoControlCode)
+    context->state = WINDIVERT_CONTEXT_STATE_CLOSING;
+    sniff_mode = ((context->flags & WINDIVERT_FLAG_SNIFF) != 0);
+    held = ((context->flags & WINDIVERT_FLAG_VERDICT) != 0);
+    forward = (context->layer == WINDIVERT_LAYER_NETWORK_FORWARD);
+    priority = context->priority;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    // Workers only queue while the state is OPEN under their own lock, so
+    // nothing can be added to a queue once it has been drained here.
+    for (i = 0; i < context->worker_count; i++)
     {
-        case IOCTL_WINDIVERT_RECV:
-            if ((PVOID)ioctl->arg == NULL)
-            {
-                status = STATUS_INVALID_PARAMETER;
-                DEBUG_ERROR("null arg pointer for RECV ioctl", status);
-                goto windivert_caller_context_error;
-            }
-            status = WdfRequestProbeAndLockUserBufferForWrite(request,
-                (PVOID)ioctl->arg, sizeof(struct windivert_addr_s), &memobj);
-            if (!NT_SUCCESS(status))
+        worker = context->workers + i;
+        KeAcquireInStackQueuedSpinLock(&worker->lock, &lock_handle);
+        while (!IsListEmpty(&worker->packet_queue))
+        {
+            entry = RemoveHeadList(&worker->packet_queue);
+            packet = CONTAINING_RECORD(entry, struct packet_s, entry);
+            WINDIVERT_QUEUE_REMOVE(context, worker, packet->data_len);
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            timeout = WINDIVERT_TIMEOUT(context, packet->timestamp,
+                timestamp);
+            if (!timeout && ok)
             {
-                DEBUG_ERROR("invalid arg pointer for RECV ioctl", status);
-                goto windivert_caller_context_error;
+                // Held packets are reinjected from the verdict queue.
+                ok = windivert_reinject_packet(sniff_mode || held, forward,
+                    packet->direction, packet->is_ipv4, packet->if_idx,
+                    packet->sub_if_idx, priority, NULL, NULL, packet);
             }
-            addr = (windivert_addr_t)WdfMemoryGetBuffer(memobj, NULL);
-            break;
-
-        case IOCTL_WINDIVERT_SEND:
-            if ((PVOID)ioctl->arg == NULL)
+            windivert_free_packet(packet);
+            timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+            KeAcquireInStackQueuedSpinLock(&worker->lock, &lock_handle);
+        }
+        while (!IsListEmpty(&worker->verdict_queue))
+        {
+            entry = RemoveHeadList(&worker->verdict_queue);
+            worker->verdict_queue_length--;
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            verdict = CONTAINING_RECORD(entry, struct verdict_s, entry);
+            timeout = WINDIVERT_TIMEOUT(context, verdict->timestamp,
+                timestamp);
+            if (!timeout && ok)
             {
-                status = STATUS_INVALID_PARAMETER;
-                DEBUG_ERROR("null arg pointer for SEND ioctl", status);
-                goto windivert_caller_context_error;
+                ok = windivert_verdict_accept(forward, verdict);
+                WINDIVERT_STAT_INC(context, (ok? WINDIVERT_STAT_REINJECTED:
+                    WINDIVERT_STAT_DROP_REINJECT));
             }
-            status = WdfRequestProbeAndLockUserBufferForRead(request,
-                (PVOID)ioctl->arg, sizeof(struct windivert_addr_s), &memobj);
-            if (!NT_SUCCESS(status))
+            windivert_verdict_release(verdict);
+            timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+            KeAcquireInStackQueuedSpinLock(&worker->lock, &lock_handle);
+        }
+        while (!IsListEmpty(&worker->work_queue))
+        {
+            entry = RemoveHeadList(&worker->work_queue);
+            worker->work_queue_length--;
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            work = CONTAINING_RECORD(entry, struct work_s, entry);
+            timeout = WINDIVERT_TIMEOUT(context, work->timestamp, timestamp);
+            if (!timeout && ok)
             {
-                DEBUG_ERROR("invalid arg pointer for SEND ioctl", status);
-                goto windivert_caller_context_error;
+                ok = windivert_reinject_packet(sniff_mode, forward,
+                    work->direction, work->is_ipv4, work->if_idx,
+                    work->sub_if_idx, work->priority, work->buffers, NULL,
+                    NULL);
             }
-            addr = (windivert_addr_t)WdfMemoryGetBuffer(memobj, NULL);
-            break;
+            FwpsDereferenceNetBufferList(work->buffers, FALSE);
+            windivert_pool_free(work, sizeof(struct work_s));
+            timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+            KeAcquireInStackQueuedSpinLock(&worker->lock, &lock_handle);
+        }
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+    }
 
-        case IOCTL_WINDIVERT_START_FILTER:
-        case IOCTL_WINDIVERT_SET_LAYER:
-        case IOCTL_WINDIVERT_SET_PRIORITY:
-        case IOCTL_WINDIVERT_SET_FLAGS:
-        case IOCTL_WINDIVERT_SET_PARAM:
-        case IOCTL_WINDIVERT_GET_PARAM:
-            break;
-        
-        default:
-            status = STATUS_INVALID_DEVICE_REQUEST;
-            DEBUG_ERROR("failed to complete I/O control; invalid request",
-                status);
-            goto windivert_caller_context_error;
+    // The read and verdict timers are only set under a worker's lock while
+    // the state is OPEN, so they cannot be set again after the drain.
+    if (KeCancelTimer(&context->batch_timer))
+    {
+        WdfObjectDereference((WDFOBJECT)object);
+    }
+    if (KeCancelTimer(&context->verdict_timer))
+    {
+        WdfObjectDereference((WDFOBJECT)object);
     }
-    
-    req_context->addr = addr;
 
-windivert_caller_context_exit:
+    // RX ring slots are filled outside the ring lock, so wait for any
+    // writer that claimed a slot before the ring was detached.
+    KeAcquireInStackQueuedSpinLock(&context->ring_lock, &lock_handle);
+    context->rx_ring = NULL;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    delay.QuadPart = -10;                       // 1us
+    while (InterlockedCompareExchange(&context->rx_ring_writers, 0, 0) != 0)
+    {
+        KeDelayExecutionThread(KernelMode, FALSE, &delay);
+    }
 
-    status = WdfDeviceEnqueueRequest(device, request);
-    
-windivert_caller_context_error:    
-    
-    if (!NT_SUCCESS(status))
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_CLOSING)
     {
-        DEBUG_ERROR("failed to enqueue request", status);
-        WdfRequestComplete(request, status);
+        goto windivert_cleanup_error;
+    }
+    read_queue = context->read_queue;
+    ring_mdl = context->ring_mdl;
+    ring_event = context->ring_event;
+    ring_ready = context->rx_ring_ready;
+    context->ring_mdl = NULL;
+    context->ring_event = NULL;
+    context->rx_ring_ready = NULL;
+    context->tx_ring = NULL;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    WdfIoQueuePurge(read_queue, NULL, NULL);
+    WdfObjectDelete(read_queue);
+    if (ring_mdl != NULL)
+    {
+        windivert_ring_unlock(ring_mdl, ring_event);
+    }
+    windivert_free(ring_ready);
+    for (i = 0; i < WINDIVERT_CONTEXT_MAXWORKERS; i++)
+    {
+        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+        if (context->state != WINDIVERT_CONTEXT_STATE_CLOSING)
+        {
+            goto windivert_cleanup_error;
+        }
+        item = context->workers[i].item;
+        read_queue = context->workers[i].read_queue;
+        context->workers[i].item = NULL;
+        context->workers[i].read_queue = NULL;
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        if (read_queue != NULL)
+        {
+            WdfIoQueuePurge(read_queue, NULL, NULL);
+            WdfObjectDelete(read_queue);
+        }
+        if (item != NULL)
+        {
+            WdfWorkItemFlush(item);
+            WdfObjectDelete(item);
+        }
     }
+    windivert_uninstall_callouts(context, WINDIVERT_CONTEXT_STATE_CLOSING);
 }
 
 /*
- * WinDivert I/O control.
+ * WinDivert close routine.
  */
-extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
-    IN size_t out_length, IN size_t in_length, IN ULONG code)
+extern VOID windivert_close(IN WDFFILEOBJECT object)
 {
     KLOCK_QUEUE_HANDLE lock_handle;
-    PCHAR inbuf, outbuf;
-    size_t inbuflen, outbuflen, filter0_len;
-    windivert_ioctl_t ioctl;
-    windivert_ioctl_filter_t filter0;
-    filter_t filter;
-    UINT8 layer;
-    UINT32 priority;
-    UINT64 flags;
-    windivert_addr_t addr;
-    req_context_t req_context;
+    context_t context = windivert_context_get(object);
+    NTSTATUS status;
+    
+    DEBUG("CLOSE: closing WinDivert context (context=%p)", context);
+    
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_CLOSING)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        status = STATUS_INVALID_DEVICE_STATE;
+        DEBUG_ERROR("failed to verify state for close routine", status);
+        return;
+    }
+    context->state = WINDIVERT_CONTEXT_STATE_CLOSED;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+}
+
+/*
+ * WinDivert destroy routine.
+ */
+extern VOID windivert_destroy(IN WDFOBJECT object)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    context_t context = windivert_context_get((WDFFILEOBJECT)object);
+    NTSTATUS status;
+    UINT i;
+
+    DEBUG("DESTROY: destroying WinDivert context (context=%p)", context);
+
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_CLOSED)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        status = STATUS_INVALID_DEVICE_STATE;
+        DEBUG_ERROR("failed to verify state for destroy routine", status);
+        return;
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    for (i = 0; i < 2; i++)
+    {
+        windivert_free(context->programs[i].filter);
+        windivert_free(context->programs[i].flow_cache);
+    }
+    windivert_free((PVOID)context->stats);
+}
+
+/*
+ * WinDivert read routine.
+ */
+static NTSTATUS windivert_read(context_t context, WDFREQUEST request,
+    UINT8 queue)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    WDFQUEUE read_queue;
+    worker_t worker;
     NTSTATUS status = STATUS_SUCCESS;
-    context_t context =
-        windivert_context_get(WdfRequestGetFileObject(request));
-    UINT64 value, *valptr;
-    UNREFERENCED_PARAMETER(queue);
 
-    DEBUG("IOCTL: I/O control request (context=%p)", context);
+    DEBUG("READ: reading diverted packet (context=%p, request=%p)", context,
+        request);
 
-    // Get the buffers and do sanity checks.
-    status = WdfRequestRetrieveInputBuffer(request, 0, &inbuf, &inbuflen);
-    if (!NT_SUCCESS(status))
+    // Forward the request to the pending read queue (queue 0 means any
+    // sub-queue, otherwise (queue-1) is the sub-queue index):
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
     {
-        DEBUG_ERROR("failed to retrieve input buffer", status);
-        goto windivert_ioctl_exit;
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        return STATUS_INVALID_DEVICE_STATE;
     }
-    switch (code)
+    if (queue == 0)
     {
-        case IOCTL_WINDIVERT_START_FILTER: case IOCTL_WINDIVERT_GET_PARAM:
-            status = WdfRequestRetrieveOutputBuffer(request, 0, &outbuf,
-                &outbuflen);
-            if (!NT_SUCCESS(status))
-            {
-                DEBUG_ERROR("failed to retrieve output buffer", status);
-                goto windivert_ioctl_exit;
-            }
-            break;
-        default:
-            outbuf = NULL;
-            outbuflen = 0;
-            break;
+        worker = NULL;
+        read_queue = context->read_queue;
+    }
+    else if (queue <= context->queue_count)
+    {
+        worker = context->workers + (queue - 1);
+        read_queue = worker->read_queue;
+    }
+    else
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("failed to read from sub-queue; invalid index", status);
+        return status;
+    }
+    status = WdfRequestForwardToIoQueue(request, read_queue);
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to forward I/O request to read queue", status);
+        return status;
     }
 
-    // Handle the ioctl:
-    switch (code)
+    // Service the read request:
+    windivert_read_service(context, worker);
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * WinDivert copy packet data into a read buffer.  Data copied directly from
+ * a NET_BUFFER is truncated to snap_len (if non-zero).
+ */
+static ULONG windivert_read_copy(packet_t packet, PNET_BUFFER buffer,
+    ULONG snap_len, PVOID dst, ULONG dst_len)
+{
+    PVOID src;
+    ULONG src_len;
+
+    if (packet != NULL)
     {
-        case IOCTL_WINDIVERT_RECV:
-            status = windivert_read(context, request);
-            if (NT_SUCCESS(status))
-            {
-                return;
-            }
-            break;
-        
-        case IOCTL_WINDIVERT_SEND:
-            
-            req_context = windivert_req_context_get(request);
-            addr = req_context->addr;
-            status = windivert_write(context, request, addr);
-            if (NT_SUCCESS(status))
-            {
-                return;
-            }
-            break;
-        
-        case IOCTL_WINDIVERT_START_FILTER:
+        src_len = packet->data_len;
+        dst_len = (src_len < dst_len? src_len: dst_len);
+        src = packet->data;
+        RtlCopyMemory(dst, src, dst_len);
+    }
+    else
+    {
+        src_len = NET_BUFFER_DATA_LENGTH(buffer);
+        src_len = WINDIVERT_SNAP_LEN(src_len, snap_len);
+        dst_len = (src_len < dst_len? src_len: dst_len);
+        src = NdisGetDataBuffer(buffer, dst_len, NULL, 1, 0);
+        if (src == NULL)
         {
-            BOOL is_inbound, is_outbound, is_ipv4, is_ipv6;
+            NdisGetDataBuffer(buffer, dst_len, dst, 1, 0);
+        }
+        else
+        {
+            RtlCopyMemory(dst, src, dst_len);
+        }
+    }
+    return dst_len;
+}
 
-            filter0 = (windivert_ioctl_filter_t)outbuf;
-            filter0_len = outbuflen;
-            filter = windivert_filter_compile(filter0, filter0_len);
-            if (filter == NULL)
-            {
-                status = STATUS_INVALID_PARAMETER;
-                DEBUG_ERROR("failed to compile filter", status);
-                goto windivert_ioctl_exit;
-            }
+/*
+ * WinDivert copy a packet (with batch header) into a batch read buffer.
+ * Returns the number of bytes used, or 0 if the packet was discarded.
+ */
+static ULONG windivert_read_batch_packet(packet_t packet, PNET_BUFFER buffer,
+    UINT8 direction, UINT32 if_idx, UINT32 sub_if_idx, UINT64 id,
+    LONGLONG timestamp, BOOL hop, UINT8 checksums, ULONG snap_len, PVOID dst,
+    ULONG dst_len)
+{
+    windivert_batch_hdr_t hdr = (windivert_batch_hdr_t)dst;
+    PVOID data = (PVOID)(hdr + 1);
+    ULONG data_len, len;
+    NTSTATUS status;
 
-            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-            if (context->state != WINDIVERT_CONTEXT_STATE_OPEN || context->on)
-            {
-                KeReleaseInStackQueuedSpinLock(&lock_handle);
-                windivert_free(filter);
-                status = STATUS_INVALID_DEVICE_STATE;
-                goto windivert_ioctl_exit;
-            }
-            context->on = TRUE;
-            context->filter = filter;
-            layer = context->layer;
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
+    data_len = windivert_read_copy(packet, buffer, snap_len, data,
+        dst_len - sizeof(struct windivert_batch_hdr_s));
+    status = windivert_finalize_packet(data, data_len, hop, checksums);
+    if (!NT_SUCCESS(status))
+    {
+        return 0;
+    }
+    hdr->Length = data_len;
+    hdr->Addr.IfIdx = if_idx;
+    hdr->Addr.SubIfIdx = sub_if_idx;
+    hdr->Addr.Direction = direction;
+    hdr->Addr.Length = (packet != NULL? packet->length:
+        NET_BUFFER_DATA_LENGTH(buffer));
+    hdr->Addr.Id = id;
+    hdr->Addr.Timestamp = timestamp;
+    len = WINDIVERT_BATCH_ALIGN(sizeof(struct windivert_batch_hdr_s) +
+        data_len);
+    return (len < dst_len? len: dst_len);
+}
 
-            windivert_filter_analyze(filter, &is_inbound, &is_outbound,
-                &is_ipv4, &is_ipv6);
-            status = windivert_install_callouts(context, layer, is_inbound,
-                is_outbound, is_ipv4, is_ipv6);
+/*
+ * WinDivert service a single read request.
+ */
+static void windivert_read_service_request(packet_t packet,
+    PNET_BUFFER buffer, UINT8 direction, UINT32 if_idx, UINT32 sub_if_idx,
+    UINT64 id, LONGLONG timestamp, BOOL hop, UINT8 checksums, ULONG snap_len,
+    WDFREQUEST request)
+{
+    PMDL dst_mdl;
+    PVOID dst;
+    ULONG dst_len;
+    NTSTATUS status;
+    req_context_t req_context;
+    windivert_addr_t addr;
 
-            break;
+    DEBUG("SERVICE: servicing read request (request=%p)", request);
+        
+    status = WdfRequestRetrieveOutputWdmMdl(request, &dst_mdl);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to retrieve output MDL", status);
+        goto windivert_read_service_request_exit;
+    }
+    dst = MmGetSystemAddressForMdlSafe(dst_mdl, NormalPagePriority);
+    if (dst == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to get address of output MDL", status);
+        goto windivert_read_service_request_exit;
+    }
+
+    dst_len = MmGetMdlByteCount(dst_mdl);
+    req_context = windivert_req_context_get(request);
+    if (req_context->batch_len != 0)
+    {
+        // A batch read request containing a single packet.
+        dst_len = windivert_read_batch_packet(packet, buffer, direction,
+            if_idx, sub_if_idx, id, timestamp, hop, checksums, snap_len, dst,
+            dst_len);
+        if (dst_len == 0)
+        {
+            status = STATUS_HOPLIMIT_EXCEEDED;
+        }
+        else if (req_context->count != NULL)
+        {
+            *req_context->count = 1;
         }
+        goto windivert_read_service_request_exit;
+    }
+    dst_len = windivert_read_copy(packet, buffer, snap_len, dst, dst_len);
 
-        case IOCTL_WINDIVERT_SET_LAYER:
-            ioctl = (windivert_ioctl_t)inbuf;
-            if (ioctl->arg > WINDIVERT_LAYER_MAX)
-            {
-                status = STATUS_INVALID_PARAMETER;
-                DEBUG_ERROR("failed to set layer; value too big", status);
-                goto windivert_ioctl_exit;
-            }
-            layer = (UINT8)ioctl->arg;
-            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-            if (context->state != WINDIVERT_CONTEXT_STATE_OPEN || context->on)
-            {
-                KeReleaseInStackQueuedSpinLock(&lock_handle);
-                status = STATUS_INVALID_DEVICE_STATE;
-                goto windivert_ioctl_exit;
-            }
-            context->layer = layer;
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            break;
+    // Write the address information.
+    addr = req_context->addr;
+    if (addr != NULL)
+    {
+        addr->IfIdx = if_idx;
+        addr->SubIfIdx = sub_if_idx;
+        addr->Direction = direction;
+        addr->Length = (packet != NULL? packet->length:
+            NET_BUFFER_DATA_LENGTH(buffer));
+        addr->Id = id;
+        addr->Timestamp = timestamp;
+    }
 
-        case IOCTL_WINDIVERT_SET_PRIORITY:
-            ioctl = (windivert_ioctl_t)inbuf;
-            if (ioctl->arg < WINDIVERT_PRIORITY_MIN ||
-                ioctl->arg > WINDIVERT_PRIORITY_MAX)
-            {
-                status = STATUS_INVALID_PARAMETER;
-                DEBUG_ERROR("failed to set priority; value out of range",
-                    status);
-                goto windivert_ioctl_exit;
-            }
-            priority = WINDIVERT_CONTEXT_PRIORITY((UINT32)ioctl->arg);
-            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-            if (context->state != WINDIVERT_CONTEXT_STATE_OPEN || context->on)
-            {
-                KeReleaseInStackQueuedSpinLock(&lock_handle);
-                status = STATUS_INVALID_DEVICE_STATE;
-                goto windivert_ioctl_exit;
-            }
-            context->priority = priority;
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            break;
+    // Zero the IP/TCP/UDP checksums and/or decrement the TTL (if required).
+    status = windivert_finalize_packet(dst, dst_len, hop, checksums);
 
-        case IOCTL_WINDIVERT_SET_FLAGS:
-            ioctl = (windivert_ioctl_t)inbuf;
-            if (!WINDIVERT_FLAGS_VALID(ioctl->arg))
-            {
-                status = STATUS_INVALID_PARAMETER;
-                DEBUG_ERROR("failed to set flags; invalid flags value",
-                    status);
-                goto windivert_ioctl_exit;
-            }
-            flags = ioctl->arg;
-            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-            if (context->state != WINDIVERT_CONTEXT_STATE_OPEN || context->on)
-            {
-                KeReleaseInStackQueuedSpinLock(&lock_handle);
-                status = STATUS_INVALID_DEVICE_STATE;
-                goto windivert_ioctl_exit;
-            }
-            context->flags = flags;
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            break;
+windivert_read_service_request_exit:
+    if (NT_SUCCESS(status))
+    {
+        WdfRequestCompleteWithInformation(request, status, dst_len);
+    }
+    else
+    {
+        WdfRequestComplete(request, status);
+    }
+}
 
-        case IOCTL_WINDIVERT_SET_PARAM:
-            ioctl = (windivert_ioctl_t)inbuf;
-            value = ioctl->arg;
-            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-            if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
-            {
-                KeReleaseInStackQueuedSpinLock(&lock_handle);
-                status = STATUS_INVALID_DEVICE_STATE;
-                goto windivert_ioctl_exit;
-            }
-            switch ((WINDIVERT_PARAM)ioctl->arg8)
-            {
-                case WINDIVERT_PARAM_QUEUE_LEN:
-                    if (value < WINDIVERT_PARAM_QUEUE_LEN_MIN ||
-                        value > WINDIVERT_PARAM_QUEUE_LEN_MAX)
-                    {
-                        KeReleaseInStackQueuedSpinLock(&lock_handle);
-                        status = STATUS_INVALID_PARAMETER;
-                        DEBUG_ERROR("failed to set queue length; invalid "
-                            "value", status);
-                        goto windivert_ioctl_exit;
-                    }
-                    context->packet_queue_maxlength = (ULONG)value;
-                    break;
+/*
+ * WinDivert service a batch read request.
+ */
+static void windivert_read_service_batch(PLIST_ENTRY batch,
+    WDFREQUEST request)
+{
+    PMDL dst_mdl;
+    UINT8 *dst;
+    ULONG dst_len, len, offset;
+    UINT32 count;
+    PLIST_ENTRY entry;
+    packet_t packet;
+    req_context_t req_context;
+    NTSTATUS status;
 
-                case WINDIVERT_PARAM_QUEUE_TIME:
-                    if (value < WINDIVERT_PARAM_QUEUE_TIME_MIN ||
-                        value > WINDIVERT_PARAM_QUEUE_TIME_MAX)
-                    {
-                        KeReleaseInStackQueuedSpinLock(&lock_handle);
-                        status = STATUS_INVALID_PARAMETER;
-                        DEBUG_ERROR("failed to set queue time; invalid "
-                            "value", status);
-                        goto windivert_ioctl_exit;
-                    }
-                    context->packet_queue_maxcounts =
-                        (LONGLONG)value * counts_per_ms;
-                    context->packet_queue_maxtime = (ULONG)value;
-                    break;
+    DEBUG("SERVICE: servicing batch read request (request=%p)", request);
 
-                case WINDIVERT_PARAM_QUEUE_SIZE:
-                    if (value < WINDIVERT_PARAM_QUEUE_SIZE_MIN ||
-                        value > WINDIVERT_PARAM_QUEUE_SIZE_MAX)
-                    {
-                        KeReleaseInStackQueuedSpinLock(&lock_handle);
-                        status = STATUS_INVALID_PARAMETER;
-                        DEBUG_ERROR("failed to set queue size; invalid "
-                            "value", status);
-                        goto windivert_ioctl_exit;
-                    }
-                    context->packet_queue_maxsize = (ULONG)value;
-                    break;
+    offset = 0;
+    count = 0;
+    status = WdfRequestRetrieveOutputWdmMdl(request, &dst_mdl);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to retrieve output MDL", status);
+        goto windivert_read_service_batch_exit;
+    }
+    dst = (UINT8 *)MmGetSystemAddressForMdlSafe(dst_mdl, NormalPagePriority);
+    if (dst == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to get address of output MDL", status);
+        goto windivert_read_service_batch_exit;
+    }
 
-                default:
-                    KeReleaseInStackQueuedSpinLock(&lock_handle);
-                    status = STATUS_INVALID_PARAMETER;
-                    DEBUG_ERROR("failed to set parameter; invalid parameter",
-                        status);
-                    goto windivert_ioctl_exit;
-            }
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            break;
+    dst_len = MmGetMdlByteCount(dst_mdl);
+    while (!IsListEmpty(batch))
+    {
+        entry = RemoveHeadList(batch);
+        packet = CONTAINING_RECORD(entry, struct packet_s, entry);
+        if (dst_len - offset > sizeof(struct windivert_batch_hdr_s))
+        {
+            len = windivert_read_batch_packet(packet, NULL,
+                packet->direction, packet->if_idx, packet->sub_if_idx,
+                packet->id, packet->timestamp, packet->hop, packet->checksums,
+                0, dst + offset, dst_len - offset);
+            offset += len;
+            count += (len != 0? 1: 0);
+        }
+        windivert_free_packet(packet);
+    }
+    if (count == 0)
+    {
+        status = STATUS_HOPLIMIT_EXCEEDED;
+        goto windivert_read_service_batch_exit;
+    }
+    req_context = windivert_req_context_get(request);
+    if (req_context->count != NULL)
+    {
+        *req_context->count = count;
+    }
 
-        case IOCTL_WINDIVERT_GET_PARAM:
-            ioctl = (windivert_ioctl_t)inbuf;
-            if (outbuflen != sizeof(UINT64))
+windivert_read_service_batch_exit:
+    while (!IsListEmpty(batch))
+    {
+        entry = RemoveHeadList(batch);
+        packet = CONTAINING_RECORD(entry, struct packet_s, entry);
+        windivert_free_packet(packet);
+    }
+    if (NT_SUCCESS(status))
+    {
+        WdfRequestCompleteWithInformation(request, status, offset);
+    }
+    else
+    {
+        WdfRequestComplete(request, status);
+    }
+}
+
+/*
+ * Select the next worker with queued packets in round-robin order.  The
+ * packet queues are peeked without locking, so the caller must re-check the
+ * selected queue under the worker's lock.
+ */
+static worker_t windivert_read_next_worker(context_t context)
+{
+    worker_t worker;
+    UINT i, idx;
+
+    idx = context->read_curr;
+    for (i = 0; i < context->worker_count; i++)
+    {
+        idx = (idx >= context->worker_count? 0: idx);
+        worker = context->workers + idx;
+        idx++;
+        if (!IsListEmpty(&worker->packet_queue))
+        {
+            context->read_curr = (UINT8)idx;
+            return worker;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Retrieve a pending read request for a worker's packets.  Requests bound to
+ * the worker's sub-queue are preferred over requests for any sub-queue.  The
+ * worker's lock must be held.
+ */
+static WDFREQUEST windivert_read_request(context_t context, worker_t worker)
+{
+    WDFREQUEST request;
+    NTSTATUS status;
+
+    if (worker->read_queue != NULL)
+    {
+        status = WdfIoQueueRetrieveNextRequest(worker->read_queue, &request);
+        if (NT_SUCCESS(status))
+        {
+            return request;
+        }
+    }
+    status = WdfIoQueueRetrieveNextRequest(context->read_queue, &request);
+    return (NT_SUCCESS(status)? request: NULL);
+}
+
+/*
+ * WinDivert read coalescing.  Returns TRUE if a batch read request should
+ * wait for more of the worker's packets, in which case the request is put
+ * back at the head of its queue, and the read timer is set to service it
+ * once the oldest packet has waited for the batch time.  The worker's lock
+ * must be held.
+ */
+static BOOL windivert_read_hold(context_t context, worker_t worker,
+    WDFREQUEST request, packet_t packet, LONGLONG timestamp)
+{
+    req_context_t req_context;
+    LARGE_INTEGER due;
+    LONGLONG age;
+    ULONG len;
+
+    if (context->batch_count <= 1)
+    {
+        return FALSE;
+    }
+    req_context = windivert_req_context_get(request);
+    if (req_context->batch_len == 0 ||
+        worker->packet_queue_length >= context->batch_count)
+    {
+        return FALSE;
+    }
+
+    // Complete if the queued packets (plus headers) may already fill the
+    // request anyway:
+    len = worker->packet_queue_size + worker->packet_queue_length *
+        (sizeof(struct windivert_batch_hdr_s) + 7);
+    if (len >= req_context->batch_len)
+    {
+        return FALSE;
+    }
+    age = timestamp - packet->timestamp;
+    age = (age < 0? 0: age);
+    if (age >= context->batch_maxcounts)
+    {
+        return FALSE;
+    }
+    if (!NT_SUCCESS(WdfRequestRequeue(request)))
+    {
+        return FALSE;
+    }
+
+    // If the timer is already set it will re-check all workers when it
+    // fires, so it is only set here if idle.
+    if (InterlockedCompareExchange(&context->batch_timer_set, 1, 0) == 0)
+    {
+        // (Relative due time, in 100ns units.)
+        due.QuadPart = -((context->batch_maxcounts - age) * 10000 /
+            counts_per_ms);
+        due.QuadPart = (due.QuadPart == 0? -1: due.QuadPart);
+        WdfObjectReference((WDFOBJECT)context->object);
+        KeSetTimer(&context->batch_timer, due, &context->batch_dpc);
+    }
+    return TRUE;
+}
+
+/*
+ * WinDivert read timer DPC.  Services batch read requests that were held
+ * for coalescing.
+ */
+static VOID windivert_read_timer(IN PKDPC dpc, IN PVOID context,
+    IN PVOID arg1, IN PVOID arg2)
+{
+    context_t ctx = (context_t)context;
+    WDFOBJECT object = (WDFOBJECT)ctx->object;
+
+    UNREFERENCED_PARAMETER(dpc);
+    UNREFERENCED_PARAMETER(arg1);
+    UNREFERENCED_PARAMETER(arg2);
+
+    InterlockedExchange(&ctx->batch_timer_set, 0);
+    windivert_read_service(ctx, NULL);
+    WdfObjectDereference(object);
+}
+
+/*
+ * WinDivert read request service.  If worker is NULL then all workers are
+ * serviced in round-robin order, otherwise just the given worker.
+ */
+static void windivert_read_service(context_t context, worker_t worker)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    WDFREQUEST request;
+    PLIST_ENTRY entry;
+    LIST_ENTRY batch;
+    ULONG batch_len, len, packet_len;
+    UINT32 count;
+    LONGLONG timestamp;
+    BOOL timeout;
+    packet_t packet;
+    worker_t curr;
+    req_context_t req_context;
+    UINT held = 0;
+
+    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    while (context->state == WINDIVERT_CONTEXT_STATE_OPEN)
+    {
+        curr = (worker != NULL? worker: windivert_read_next_worker(context));
+        if (curr == NULL)
+        {
+            break;
+        }
+        KeAcquireInStackQueuedSpinLock(&curr->lock, &lock_handle);
+        if (context->state != WINDIVERT_CONTEXT_STATE_OPEN ||
+            IsListEmpty(&curr->packet_queue))
+        {
+            // Nothing queued, or lost a race with another reader:
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            if (worker != NULL)
             {
-                status = STATUS_INVALID_PARAMETER;
-                DEBUG_ERROR("failed to get parameter; invalid output "
-                    "buffer size", status);
-                goto windivert_ioctl_exit;
+                break;
             }
-            valptr = (UINT64 *)outbuf;
-            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-            if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+            continue;
+        }
+        entry = RemoveHeadList(&curr->packet_queue);
+        packet = CONTAINING_RECORD(entry, struct packet_s, entry);
+        timeout = WINDIVERT_TIMEOUT(context, packet->timestamp, timestamp);
+        request = NULL;
+        if (timeout)
+        {
+            WINDIVERT_STAT_INC(context, WINDIVERT_STAT_DROP_TIMEOUT);
+        }
+        else
+        {
+            request = windivert_read_request(context, curr);
+            if (request == NULL)
             {
+                InsertHeadList(&curr->packet_queue, entry);
                 KeReleaseInStackQueuedSpinLock(&lock_handle);
-                status = STATUS_INVALID_DEVICE_STATE;
-                goto windivert_ioctl_exit;
+                break;
             }
-            switch ((WINDIVERT_PARAM)ioctl->arg8)
+            if (windivert_read_hold(context, curr, request, packet,
+                    timestamp))
             {
-                case WINDIVERT_PARAM_QUEUE_LEN:
-                    *valptr = context->packet_queue_maxlength;
-                    break;
-                case WINDIVERT_PARAM_QUEUE_TIME:
-                    *valptr = context->packet_queue_maxtime;
+                // Coalescing; wait for more packets (or the read timer).
+                InsertHeadList(&curr->packet_queue, entry);
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                held++;
+                if (worker != NULL || held >= context->worker_count)
+                {
                     break;
-                case WINDIVERT_PARAM_QUEUE_SIZE:
-                    *valptr = context->packet_queue_maxsize;
+                }
+                continue;
+            }
+        }
+        WINDIVERT_QUEUE_REMOVE(context, curr, packet->data_len);
+
+        batch_len = 0;
+        if (!timeout)
+        {
+            WINDIVERT_STAT_LATENCY(context, read_latency, packet->timestamp,
+                timestamp);
+            req_context = windivert_req_context_get(request);
+            batch_len = req_context->batch_len;
+        }
+        if (batch_len != 0)
+        {
+            // Drain as many queued packets as will fit into the batch:
+            InitializeListHead(&batch);
+            InsertTailList(&batch, entry);
+            len = WINDIVERT_BATCH_ALIGN(sizeof(struct windivert_batch_hdr_s) +
+                packet->data_len);
+            count = 1;
+            while (count < WINDIVERT_BATCH_MAX &&
+                   !IsListEmpty(&curr->packet_queue))
+            {
+                entry = curr->packet_queue.Flink;
+                packet = CONTAINING_RECORD(entry, struct packet_s, entry);
+                packet_len = WINDIVERT_BATCH_ALIGN(
+                    sizeof(struct windivert_batch_hdr_s) + packet->data_len);
+                if (len + packet_len > batch_len ||
+                    WINDIVERT_TIMEOUT(context, packet->timestamp, timestamp))
+                {
                     break;
-                default:
-                    KeReleaseInStackQueuedSpinLock(&lock_handle);
-                    status = STATUS_INVALID_PARAMETER;
-                    DEBUG_ERROR("failed to get parameter; invalid parameter",
-                        status);
-                    goto windivert_ioctl_exit;
+                }
+                RemoveEntryList(entry);
+                InsertTailList(&batch, entry);
+                WINDIVERT_QUEUE_REMOVE(context, curr, packet->data_len);
+                WINDIVERT_STAT_LATENCY(context, read_latency,
+                    packet->timestamp, timestamp);
+                len += packet_len;
+                count++;
             }
             KeReleaseInStackQueuedSpinLock(&lock_handle);
-            break;
 
-        default:
-            status = STATUS_INVALID_DEVICE_REQUEST;
-            DEBUG_ERROR("failed to complete I/O control; invalid request",
-                status);
+            windivert_read_service_batch(&batch, request);
+        }
+        else
+        {
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+            if (!timeout)
+            {
+                windivert_read_service_request(packet, NULL,
+                    packet->direction, packet->if_idx, packet->sub_if_idx,
+                    packet->id, packet->timestamp, packet->hop,
+                    packet->checksums, 0, request);
+            }
+
+            windivert_free_packet(packet);
+        }
+        timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    }
+}
+
+/*
+ * WinDivert write routine.
+ */
+static NTSTATUS windivert_write(context_t context, WDFREQUEST request,
+    windivert_addr_t addr, UINT8 send_flags)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    PMDL mdl = NULL, mdl_copy = NULL;
+    PVOID data, data_copy = NULL;
+    UINT data_len;
+    struct iphdr *ip_header;
+    struct ipv6hdr *ipv6_header;
+    BOOL isipv4;
+    UINT8 layer;
+    UINT32 priority;
+    UINT64 flags;
+    HANDLE handle, compl_handle;
+    PNET_BUFFER_LIST buffers = NULL;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    DEBUG("WRITE: writing/injecting a packet (context=%p, request=%p)",
+        context, request);
+
+    if (addr->Direction != WINDIVERT_DIRECTION_INBOUND &&
+        addr->Direction != WINDIVERT_DIRECTION_OUTBOUND)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("failed to inject packet; invalid direction", status);
+        goto windivert_write_exit;
+    }
+
+    status = WdfRequestRetrieveOutputWdmMdl(request, &mdl);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to retrieve input MDL", status);
+        goto windivert_write_exit;
+    }
+
+    data = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+    if (data == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to get MDL address", status);
+        goto windivert_write_exit;
+    }
+    
+    data_len = MmGetMdlByteCount(mdl);
+    if (data_len > UINT16_MAX || data_len < sizeof(struct iphdr))
+    {
+windivert_write_bad_packet:
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("failed to inject a bad packet", status);
+        goto windivert_write_exit;
+    }
+
+    data_copy = windivert_pool_alloc(data_len);
+    if (data_copy == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to allocate memory for injected packet data",
+            status);
+        goto windivert_write_exit;
+    }
+
+    RtlCopyMemory(data_copy, data, sizeof(struct iphdr));
+    ip_header = (struct iphdr *)data_copy;
+    switch (ip_header->Version)
+    {
+        case 4:
+            if (data_len != RtlUshortByteSwap(ip_header->Length))
+                goto windivert_write_bad_packet;
+            isipv4 = TRUE;
+            break;
+        case 6:
+            if (data_len < sizeof(struct ipv6hdr))
+                goto windivert_write_bad_packet;
+            ipv6_header = (struct ipv6hdr *)data_copy;
+            if (data_len != RtlUshortByteSwap(ipv6_header->Length) +
+                    sizeof(struct ipv6hdr))
+                goto windivert_write_bad_packet;
+            isipv4 = FALSE;
+            break;
+        default:
+            goto windivert_write_bad_packet;
+    }
+    if (data_len > sizeof(struct iphdr))
+    {
+        RtlCopyMemory((char *)data_copy + sizeof(struct iphdr),
+            (char *)data + sizeof(struct iphdr),
+            data_len - sizeof(struct iphdr));
+    }
+    if ((send_flags & WINDIVERT_SEND_FLAG_CHECKSUMS) != 0)
+    {
+        windivert_calc_checksums(data_copy, data_len);
+    }
+
+    mdl_copy = IoAllocateMdl(data_copy, data_len, FALSE, FALSE, NULL);
+    if (mdl_copy == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to allocate MDL for injected packet", status);
+        goto windivert_write_exit;
+    }
+
+    MmBuildMdlForNonPagedPool(mdl_copy);
+    status = FwpsAllocateNetBufferAndNetBufferList0(nbl_pool_handle, 0, 0,
+        mdl_copy, 0, data_len, &buffers);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to create NET_BUFFER_LIST for injected packet",
+            status);
+        goto windivert_write_exit;
+    }
+
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto windivert_write_exit;
+    }
+    layer = context->layer;
+    priority = context->priority;
+    flags = context->flags;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    handle = (isipv4? inject_handle: injectv6_handle);
+    compl_handle = ((flags & WINDIVERT_FLAG_DEBUG) != 0? (HANDLE)request: NULL);
+    if (layer == WINDIVERT_LAYER_NETWORK_FORWARD)
+    {
+        status = FwpsInjectForwardAsync0(handle, (HANDLE)priority, 0,
+            (isipv4? AF_INET: AF_INET6), UNSPECIFIED_COMPARTMENT_ID,
+            addr->IfIdx, buffers, windivert_inject_complete, compl_handle);
+    }
+    else if (addr->Direction == WINDIVERT_DIRECTION_OUTBOUND)
+    {
+        status = FwpsInjectNetworkSendAsync0(handle, (HANDLE)priority, 0,
+            UNSPECIFIED_COMPARTMENT_ID, buffers, windivert_inject_complete,
+            compl_handle);
+    }
+    else
+    {
+        status = FwpsInjectNetworkReceiveAsync0(handle, (HANDLE)priority, 0,
+            UNSPECIFIED_COMPARTMENT_ID, addr->IfIdx, addr->SubIfIdx, buffers,
+            windivert_inject_complete, compl_handle);
+    }
+
+windivert_write_exit:
+
+    if (NT_SUCCESS(status))
+    {
+        WINDIVERT_STAT_INC(context, WINDIVERT_STAT_INJECTED);
+        WINDIVERT_STAT_LATENCY(context, inject_latency, addr->Timestamp,
+            KeQueryPerformanceCounter(NULL).QuadPart);
+        if ((flags & WINDIVERT_FLAG_DEBUG) == 0)
+        {
+            WdfRequestCompleteWithInformation(request, status, data_len);
+        }
+    }
+    else
+    {
+        DEBUG_ERROR("failed to inject packet", status);
+        if (buffers != NULL)
+        {
+            FwpsFreeNetBufferList0(buffers);
+        }
+        if (mdl_copy != NULL)
+        {
+            IoFreeMdl(mdl_copy);
+        }
+        windivert_pool_free(data_copy, data_len);
+    }
+
+    return status;
+}
+
+/*
+ * WinDivert inject complete routine.
+ */
+static void NTAPI windivert_inject_complete(VOID *context,
+    NET_BUFFER_LIST *buffers, BOOLEAN dispatch_level)
+{
+    PMDL mdl;
+    PVOID data;
+    PNET_BUFFER buffer;
+    size_t length;
+    WDFREQUEST request;
+    NTSTATUS status;
+    UNREFERENCED_PARAMETER(dispatch_level);
+
+    buffer = NET_BUFFER_LIST_FIRST_NB(buffers);
+    request = (WDFREQUEST)context;
+    if (request != NULL)
+    {
+        status = NET_BUFFER_LIST_STATUS(buffers);
+        length = 0;
+        if (NT_SUCCESS(status))
+        {
+            length = NET_BUFFER_DATA_LENGTH(buffer);
+        }
+        WdfRequestCompleteWithInformation(request, status, length);
+    }
+    mdl = NET_BUFFER_FIRST_MDL(buffer);
+    data = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+    windivert_pool_free(data, MmGetMdlByteCount(mdl));
+    IoFreeMdl(mdl);
+    FwpsFreeNetBufferList0(buffers);
+}
+
+/*
+ * WinDivert batch write routine.
+ */
+static NTSTATUS windivert_write_batch(context_t context, WDFREQUEST request,
+    UINT8 send_flags)
+{
+    PMDL mdl = NULL;
+    PVOID data;
+    ULONG data_len = 0, inject_len = 0;
+    UINT32 inject_count;
+    inject_batch_t batch = NULL;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    DEBUG("WRITE: writing/injecting a batch of packets (context=%p, "
+        "request=%p)", context, request);
+
+    status = WdfRequestRetrieveOutputWdmMdl(request, &mdl);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to retrieve input MDL", status);
+        goto windivert_write_batch_exit;
+    }
+
+    data = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+    if (data == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to get MDL address", status);
+        goto windivert_write_batch_exit;
+    }
+
+    // Copy the batch so that it cannot be modified during validation:
+    data_len = MmGetMdlByteCount(mdl);
+    batch = (inject_batch_t)windivert_malloc(
+        sizeof(struct inject_batch_s) + data_len, FALSE);
+    if (batch == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to allocate memory for injected packet batch",
+            status);
+        goto windivert_write_batch_exit;
+    }
+    batch->refcount = 1;
+    batch->mdl = NULL;
+    RtlCopyMemory(batch + 1, data, data_len);
+
+    status = windivert_inject_batch(context, batch, data_len, send_flags,
+        &inject_len, &inject_count);
+
+windivert_write_batch_exit:
+
+    if (NT_SUCCESS(status))
+    {
+        // May be less than the batch if a later group failed to inject.
+        WdfRequestCompleteWithInformation(request, status, inject_len);
+    }
+    if (batch != NULL)
+    {
+        windivert_inject_batch_release(batch);
+    }
+
+    return status;
+}
+
+/*
+ * WinDivert validate and inject a (copied) packet batch.  The caller retains
+ * its reference to the batch.  If a group of packets fails to inject after
+ * earlier groups were injected, the call succeeds and *inject_len and
+ * *inject_count only cover the injected packets, like a partial write.
+ */
+static NTSTATUS windivert_inject_batch(context_t context, inject_batch_t batch,
+    ULONG data_len, UINT8 send_flags, ULONG *inject_len,
+    UINT32 *inject_count)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    UINT8 *data_copy = (UINT8 *)(batch + 1);
+    ULONG offset, len, count, group_count, group_offset;
+    windivert_batch_hdr_t hdr, group_hdr;
+    LONGLONG timestamp;
+    struct iphdr *ip_header;
+    struct ipv6hdr *ipv6_header;
+    BOOL isipv4;
+    UINT8 layer;
+    UINT32 priority;
+    HANDLE handle;
+    PNET_BUFFER_LIST buffers;
+    PNET_BUFFER buffer, buffer_prev;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    *inject_len = 0;
+    *inject_count = 0;
+    if (data_len < sizeof(struct windivert_batch_hdr_s) +
+            sizeof(struct iphdr))
+    {
+windivert_inject_batch_bad_packet:
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("failed to inject a bad packet batch", status);
+        goto windivert_inject_batch_exit;
+    }
+
+
+    // Validate all packets before injecting any:
+    offset = 0;
+    count = 0;
+    while (offset < data_len)
+    {
+        if (data_len - offset < sizeof(struct windivert_batch_hdr_s) ||
+            count >= WINDIVERT_BATCH_MAX)
+        {
+            goto windivert_inject_batch_bad_packet;
+        }
+        hdr = (windivert_batch_hdr_t)(data_copy + offset);
+        len = hdr->Length;
+        if (len > UINT16_MAX || len < sizeof(struct iphdr) ||
+            len > data_len - offset - sizeof(struct windivert_batch_hdr_s))
+        {
+            goto windivert_inject_batch_bad_packet;
+        }
+        if (hdr->Addr.Direction != WINDIVERT_DIRECTION_INBOUND &&
+            hdr->Addr.Direction != WINDIVERT_DIRECTION_OUTBOUND)
+        {
+            goto windivert_inject_batch_bad_packet;
+        }
+        ip_header = (struct iphdr *)(hdr + 1);
+        switch (ip_header->Version)
+        {
+            case 4:
+                if (len != RtlUshortByteSwap(ip_header->Length))
+                    goto windivert_inject_batch_bad_packet;
+                break;
+            case 6:
+                if (len < sizeof(struct ipv6hdr))
+                    goto windivert_inject_batch_bad_packet;
+                ipv6_header = (struct ipv6hdr *)ip_header;
+                if (len != RtlUshortByteSwap(ipv6_header->Length) +
+                        sizeof(struct ipv6hdr))
+                    goto windivert_inject_batch_bad_packet;
+                break;
+            default:
+                goto windivert_inject_batch_bad_packet;
+        }
+        if ((send_flags & WINDIVERT_SEND_FLAG_CHECKSUMS) != 0)
+        {
+            windivert_calc_checksums(ip_header, len);
+        }
+        offset += WINDIVERT_BATCH_ALIGN(sizeof(struct windivert_batch_hdr_s) +
+            len);
+        count++;
+    }
+
+    batch->mdl = IoAllocateMdl(data_copy, data_len, FALSE, FALSE, NULL);
+    if (batch->mdl == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to allocate MDL for injected packet batch",
+            status);
+        goto windivert_inject_batch_exit;
+    }
+    MmBuildMdlForNonPagedPool(batch->mdl);
+
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto windivert_inject_batch_exit;
+    }
+    layer = context->layer;
+    priority = context->priority;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    // Inject each run of packets with the same direction, interface and IP
+    // version as a single multi-NET_BUFFER NET_BUFFER_LIST:
+    offset = 0;
+    while (offset < data_len)
+    {
+        group_offset = offset;
+        group_hdr = (windivert_batch_hdr_t)(data_copy + offset);
+        isipv4 = (((struct iphdr *)(group_hdr + 1))->Version == 4);
+        status = FwpsAllocateNetBufferAndNetBufferList0(nbl_pool_handle, 0, 0,
+            batch->mdl, offset + sizeof(struct windivert_batch_hdr_s),
+            group_hdr->Length, &buffers);
+        if (!NT_SUCCESS(status))
+        {
+            DEBUG_ERROR("failed to create NET_BUFFER_LIST for injected "
+                "packet batch", status);
+            goto windivert_inject_batch_exit;
+        }
+        buffer_prev = NET_BUFFER_LIST_FIRST_NB(buffers);
+        group_count = 1;
+        offset += WINDIVERT_BATCH_ALIGN(sizeof(struct windivert_batch_hdr_s) +
+            group_hdr->Length);
+        while (offset < data_len)
+        {
+            hdr = (windivert_batch_hdr_t)(data_copy + offset);
+            if (hdr->Addr.Direction != group_hdr->Addr.Direction ||
+                hdr->Addr.IfIdx != group_hdr->Addr.IfIdx ||
+                hdr->Addr.SubIfIdx != group_hdr->Addr.SubIfIdx ||
+                (((struct iphdr *)(hdr + 1))->Version == 4) != isipv4)
+            {
+                break;
+            }
+            buffer = NdisAllocateNetBuffer(nb_pool_handle, batch->mdl,
+                offset + sizeof(struct windivert_batch_hdr_s), hdr->Length);
+            if (buffer == NULL)
+            {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                DEBUG_ERROR("failed to create NET_BUFFER for injected "
+                    "packet batch", status);
+                windivert_free_batch_buffers(buffers);
+                goto windivert_inject_batch_exit;
+            }
+            NET_BUFFER_NEXT_NB(buffer_prev) = buffer;
+            buffer_prev = buffer;
+            group_count++;
+            offset += WINDIVERT_BATCH_ALIGN(
+                sizeof(struct windivert_batch_hdr_s) + hdr->Length);
+        }
+
+        InterlockedIncrement(&batch->refcount);
+        handle = (isipv4? inject_handle: injectv6_handle);
+        if (layer == WINDIVERT_LAYER_NETWORK_FORWARD)
+        {
+            status = FwpsInjectForwardAsync0(handle, (HANDLE)priority, 0,
+                (isipv4? AF_INET: AF_INET6), UNSPECIFIED_COMPARTMENT_ID,
+                group_hdr->Addr.IfIdx, buffers,
+                windivert_inject_batch_complete, (HANDLE)batch);
+        }
+        else if (group_hdr->Addr.Direction == WINDIVERT_DIRECTION_OUTBOUND)
+        {
+            status = FwpsInjectNetworkSendAsync0(handle, (HANDLE)priority, 0,
+                UNSPECIFIED_COMPARTMENT_ID, buffers,
+                windivert_inject_batch_complete, (HANDLE)batch);
+        }
+        else
+        {
+            status = FwpsInjectNetworkReceiveAsync0(handle, (HANDLE)priority,
+                0, UNSPECIFIED_COMPARTMENT_ID, group_hdr->Addr.IfIdx,
+                group_hdr->Addr.SubIfIdx, buffers,
+                windivert_inject_batch_complete, (HANDLE)batch);
+        }
+        if (!NT_SUCCESS(status))
+        {
+            windivert_free_batch_buffers(buffers);
+            windivert_inject_batch_release(batch);
+            goto windivert_inject_batch_exit;
+        }
+        *inject_len = offset;
+        *inject_count += group_count;
+        WINDIVERT_STAT_ADD(context, WINDIVERT_STAT_INJECTED, group_count);
+        timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+        while (group_offset < offset)
+        {
+            hdr = (windivert_batch_hdr_t)(data_copy + group_offset);
+            WINDIVERT_STAT_LATENCY(context, inject_latency,
+                hdr->Addr.Timestamp, timestamp);
+            group_offset += WINDIVERT_BATCH_ALIGN(
+                sizeof(struct windivert_batch_hdr_s) + hdr->Length);
+        }
+    }
+
+windivert_inject_batch_exit:
+
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to inject packet batch", status);
+        if (*inject_count != 0)
+        {
+            status = STATUS_SUCCESS;
+        }
+    }
+
+    return status;
+}
+
+/*
+ * WinDivert batch inject complete routine.
+ */
+static void NTAPI windivert_inject_batch_complete(VOID *context,
+    NET_BUFFER_LIST *buffers, BOOLEAN dispatch_level)
+{
+    inject_batch_t batch = (inject_batch_t)context;
+    UNREFERENCED_PARAMETER(dispatch_level);
+
+    windivert_free_batch_buffers(buffers);
+    windivert_inject_batch_release(batch);
+}
+
+/*
+ * Free a multi-NET_BUFFER NET_BUFFER_LIST for an injected packet batch.
+ */
+static void windivert_free_batch_buffers(PNET_BUFFER_LIST buffers)
+{
+    PNET_BUFFER buffer, buffer_next;
+
+    buffer = NET_BUFFER_LIST_FIRST_NB(buffers);
+    buffer_next = NET_BUFFER_NEXT_NB(buffer);
+    NET_BUFFER_NEXT_NB(buffer) = NULL;
+    while (buffer_next != NULL)
+    {
+        buffer = buffer_next;
+        buffer_next = NET_BUFFER_NEXT_NB(buffer);
+        NdisFreeNetBuffer(buffer);
+    }
+    FwpsFreeNetBufferList0(buffers);
+}
+
+/*
+ * Release a reference to an injected packet batch.
+ */
+static void windivert_inject_batch_release(inject_batch_t batch)
+{
+    if (InterlockedDecrement(&batch->refcount) != 0)
+    {
+        return;
+    }
+    if (batch->mdl != NULL)
+    {
+        IoFreeMdl(batch->mdl);
+    }
+    windivert_free(batch);
+}
+
+/*
+ * WinDivert lock the shared ring memory.  Must be called in the context of
+ * the requesting process.
+ */
+static NTSTATUS windivert_ring_lock(WDFREQUEST request,
+    req_context_t req_context)
+{
+    windivert_ioctl_ring_t ioctl_ring;
+    struct windivert_ioctl_ring_s ring;
+    UINT64 size;
+    PMDL mdl;
+    PVOID event;
+    NTSTATUS status;
+
+    status = WdfRequestRetrieveOutputBuffer(request,
+        sizeof(struct windivert_ioctl_ring_s), (PVOID *)&ioctl_ring, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to retrieve ring descriptor", status);
+        return status;
+    }
+    RtlCopyMemory(&ring, ioctl_ring, sizeof(ring));
+    if (ring.slots < WINDIVERT_RING_SLOTS_MIN ||
+        ring.slots > WINDIVERT_RING_SLOTS_MAX ||
+        (ring.slots & (ring.slots - 1)) != 0 ||
+        ring.slot_len < WINDIVERT_RING_SLOT_LEN_MIN ||
+        ring.slot_len > WINDIVERT_RING_SLOT_LEN_MAX ||
+        ring.slot_len % sizeof(UINT64) != 0 ||
+        ring.addr % sizeof(UINT64) != 0)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("invalid ring descriptor", status);
+        return status;
+    }
+    size = WINDIVERT_RING_SIZE(ring.slots, ring.slot_len);
+    if (size > WINDIVERT_RING_SIZE_MAX)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("invalid ring size", status);
+        return status;
+    }
+
+    // Lock both the RX and TX rings:
+    mdl = IoAllocateMdl((PVOID)ring.addr, (ULONG)(2 * size), FALSE, FALSE,
+        NULL);
+    if (mdl == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to allocate MDL for ring", status);
+        return status;
+    }
+    __try
+    {
+        MmProbeAndLockPages(mdl, UserMode, IoWriteAccess);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        status = GetExceptionCode();
+        DEBUG_ERROR("failed to lock ring memory", status);
+        IoFreeMdl(mdl);
+        return status;
+    }
+    if (MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority) == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to get address of ring MDL", status);
+        MmUnlockPages(mdl);
+        IoFreeMdl(mdl);
+        return status;
+    }
+    status = ObReferenceObjectByHandle((HANDLE)ring.event, EVENT_MODIFY_STATE,
+        *ExEventObjectType, UserMode, &event, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("invalid ring event handle", status);
+        MmUnlockPages(mdl);
+        IoFreeMdl(mdl);
+        return status;
+    }
+
+    req_context->ring_mdl = mdl;
+    req_context->ring_event = (PKEVENT)event;
+    req_context->ring_slots = ring.slots;
+    req_context->ring_slot_len = ring.slot_len;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * WinDivert unlock the shared ring memory.
+ */
+static void windivert_ring_unlock(PMDL mdl, PKEVENT event)
+{
+    MmUnlockPages(mdl);
+    IoFreeMdl(mdl);
+    ObDereferenceObject(event);
+}
+
+/*
+ * WinDivert attach locked shared rings to a context.
+ */
+static NTSTATUS windivert_ring_map(context_t context,
+    req_context_t req_context)
+{
+    KLOCK_QUEUE_HANDLE lock_handle, ring_lock_handle;
+    PMDL mdl = req_context->ring_mdl;
+    PKEVENT event = req_context->ring_event;
+    windivert_ring_t rx_ring;
+    BOOLEAN *ready;
+    NTSTATUS status;
+
+    req_context->ring_mdl = NULL;
+    req_context->ring_event = NULL;
+    if (mdl == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+    rx_ring = (windivert_ring_t)MmGetSystemAddressForMdlSafe(mdl,
+        NormalPagePriority);
+    ready = (BOOLEAN *)windivert_malloc(req_context->ring_slots *
+        sizeof(BOOLEAN), FALSE);
+    if (ready == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to allocate ring slot flags", status);
+        windivert_ring_unlock(mdl, event);
+        return status;
+    }
+    RtlZeroMemory(ready, req_context->ring_slots * sizeof(BOOLEAN));
+
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN ||
+        context->ring_mdl != NULL)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        status = STATUS_INVALID_DEVICE_STATE;
+        DEBUG_ERROR("failed to map ring", status);
+        windivert_ring_unlock(mdl, event);
+        windivert_free(ready);
+        return status;
+    }
+    context->ring_mdl = mdl;
+    context->ring_event = event;
+    context->ring_slots = req_context->ring_slots;
+    context->ring_slot_len = req_context->ring_slot_len;
+    context->tx_ring = (windivert_ring_t)((UINT8 *)rx_ring +
+        WINDIVERT_RING_SIZE(context->ring_slots, context->ring_slot_len));
+    context->tx_ring_tail = 0;
+    context->tx_ring->Tail = 0;
+    rx_ring->Head = 0;
+    KeAcquireInStackQueuedSpinLock(&context->ring_lock, &ring_lock_handle);
+    context->rx_ring_reserve = 0;
+    context->rx_ring_head = 0;
+    context->rx_ring_ready = ready;
+    context->rx_ring = rx_ring;
+    KeReleaseInStackQueuedSpinLock(&ring_lock_handle);
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * WinDivert write a packet into the shared RX ring.  A slot is claimed under
+ * the ring lock, filled without it, and published in order once all earlier
+ * slots are filled, so that workers copy packets in parallel.  Returns FALSE
+ * if no ring is mapped.
+ */
+static BOOL windivert_ring_put(context_t context, PNET_BUFFER buffer,
+    UINT8 direction, UINT32 if_idx, UINT32 sub_if_idx, UINT64 id,
+    LONGLONG timestamp, BOOL hop, UINT8 checksums)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    windivert_ring_t ring;
+    windivert_batch_hdr_t hdr;
+    UINT32 slot, head, mask;
+    ULONG len;
+    BOOLEAN *ready;
+
+    // A claimed slot must always be published, so drop packets that
+    // windivert_finalize_packet() would discard before claiming one.
+    len = WINDIVERT_SNAP_LEN(NET_BUFFER_DATA_LENGTH(buffer),
+        context->snap_len);
+    len = (len < context->ring_slot_len -
+        sizeof(struct windivert_batch_hdr_s)? len:
+        context->ring_slot_len - sizeof(struct windivert_batch_hdr_s));
+    if (hop && windivert_hop_expired(buffer, len))
+    {
+        WINDIVERT_STAT_INC(context, WINDIVERT_STAT_DROP_HOP_LIMIT);
+        return TRUE;
+    }
+
+    KeAcquireInStackQueuedSpinLock(&context->ring_lock, &lock_handle);
+    ring = context->rx_ring;
+    if (ring == NULL)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        return FALSE;
+    }
+    slot = context->rx_ring_reserve;
+    if (slot - ring->Tail >= context->ring_slots)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        DEBUG("DROP: shared ring is full, dropping packet");
+        WINDIVERT_STAT_INC(context, WINDIVERT_STAT_DROP_RING_FULL);
+        return TRUE;
+    }
+    context->rx_ring_reserve = slot + 1;
+    context->rx_ring_writers++;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    hdr = WINDIVERT_RING_SLOT_HDR(context, ring, slot);
+    windivert_read_batch_packet(NULL, buffer, direction, if_idx, sub_if_idx,
+        id, timestamp, hop, checksums, context->snap_len, hdr,
+        context->ring_slot_len);
+    WINDIVERT_STAT_INC(context, WINDIVERT_STAT_QUEUED);
+
+    // The consumer reads the ring without the driver, so the "read" latency
+    // of a ring packet is its capture-to-ring latency:
+    WINDIVERT_STAT_LATENCY(context, read_latency, timestamp,
+        KeQueryPerformanceCounter(NULL).QuadPart);
+
+    // Publish this slot and any later slots that were filled first, and
+    // wake the consumer if the ring was empty:
+    KeAcquireInStackQueuedSpinLock(&context->ring_lock, &lock_handle);
+    mask = context->ring_slots - 1;
+    ready = context->rx_ring_ready;
+    ready[slot & mask] = TRUE;
+    head = context->rx_ring_head;
+    if (slot == head)
+    {
+        while (head != context->rx_ring_reserve && ready[head & mask])
+        {
+            ready[head & mask] = FALSE;
+            head++;
+        }
+        KeMemoryBarrier();
+        ring->Head = head;
+        KeMemoryBarrier();
+        if (ring->Tail == context->rx_ring_head)
+        {
+            KeSetEvent(context->ring_event, IO_NO_INCREMENT, FALSE);
+        }
+        context->rx_ring_head = head;
+    }
+    context->rx_ring_writers--;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    return TRUE;
+}
+
+/*
+ * WinDivert check whether the shared RX ring has no free slot.
+ */
+static BOOL windivert_ring_full(context_t context)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    windivert_ring_t ring;
+    BOOL full;
+
+    KeAcquireInStackQueuedSpinLock(&context->ring_lock, &lock_handle);
+    ring = context->rx_ring;
+    full = (ring != NULL &&
+        context->rx_ring_reserve - ring->Tail >= context->ring_slots);
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    return full;
+}
+
+/*
+ * WinDivert check whether a forwarded packet's TTL/HopLimit is exhausted,
+ * given the length that will be copied (see windivert_finalize_packet()).
+ */
+static BOOL windivert_hop_expired(PNET_BUFFER buffer, ULONG len)
+{
+    UINT8 storage[sizeof(struct ipv6hdr)];
+    struct iphdr *ip_header;
+    struct ipv6hdr *ipv6_header;
+
+    if (len < sizeof(struct iphdr))
+    {
+        return FALSE;
+    }
+    ip_header = (struct iphdr *)NdisGetDataBuffer(buffer,
+        sizeof(struct iphdr), storage, 1, 0);
+    if (ip_header == NULL)
+    {
+        return FALSE;
+    }
+    switch (ip_header->Version)
+    {
+        case 4:
+            return (len >= ip_header->HdrLength * sizeof(UINT32) &&
+                ip_header->TTL <= 1);
+        case 6:
+            if (len < sizeof(struct ipv6hdr))
+            {
+                return FALSE;
+            }
+            ipv6_header = (struct ipv6hdr *)NdisGetDataBuffer(buffer,
+                sizeof(struct ipv6hdr), storage, 1, 0);
+            return (ipv6_header != NULL && ipv6_header->HopLimit <= 1);
+        default:
+            return FALSE;
+    }
+}
+
+/*
+ * WinDivert apply the BYPASS overload policy to a matching packet when the
+ * shared RX ring is full: the packet continues unfiltered instead of being
+ * dropped.  Returns TRUE if the packet was bypassed, and sets *ok as
+ * windivert_queue_packet() would.  (The ring may fill up after the check, in
+ * which case the packet is dropped.)
+ */
+static BOOL windivert_ring_bypass(context_t context, work_t work,
+    PNET_BUFFER buffer, BOOL sniff_mode, BOOL forward, BOOL *ok)
+{
+    if (context->overload != WINDIVERT_OVERLOAD_BYPASS ||
+        context->rx_ring == NULL || !windivert_ring_full(context))
+    {
+        return FALSE;
+    }
+
+    // In SNIFF mode the original packet has already continued.
+    *ok = (sniff_mode? TRUE:
+        windivert_reinject_packet(FALSE, forward, work->direction,
+            work->is_ipv4, work->if_idx, work->sub_if_idx, work->priority,
+            work->buffers, buffer, NULL));
+    WINDIVERT_STAT_INC(context, (*ok? WINDIVERT_STAT_BYPASSED:
+        WINDIVERT_STAT_DROP_REINJECT));
+    return TRUE;
+}
+
+/*
+ * WinDivert inject all packets queued in the shared TX ring.
+ */
+static NTSTATUS windivert_ring_send(context_t context, UINT32 *count_ptr)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    windivert_ring_t ring;
+    windivert_batch_hdr_t hdr, hdr_copy;
+    inject_batch_t batch;
+    UINT8 *data_copy;
+    UINT32 head, tail, slots, slot_len, count, i;
+    ULONG len, offset;
+    NTSTATUS status;
+
+    *count_ptr = 0;
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN ||
+        context->ring_mdl == NULL)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+    slots = context->ring_slots;
+    slot_len = context->ring_slot_len;
+    head = context->tx_ring->Head;
+    tail = context->tx_ring_tail;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    count = head - tail;
+    if (count > slots)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("failed to send ring; invalid head", status);
+        return status;
+    }
+    if (count == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+    count = (count > WINDIVERT_BATCH_MAX? WINDIVERT_BATCH_MAX: count);
+
+    batch = (inject_batch_t)windivert_malloc(
+        sizeof(struct inject_batch_s) + (SIZE_T)count * slot_len, FALSE);
+    if (batch == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to allocate memory for injected ring packets",
+            status);
+        return status;
+    }
+    batch->refcount = 1;
+    batch->mdl = NULL;
+    data_copy = (UINT8 *)(batch + 1);
+
+    // Copy the queued slots out of the shared ring:
+    offset = 0;
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN ||
+        context->ring_mdl == NULL)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        windivert_inject_batch_release(batch);
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+    ring = context->tx_ring;
+    head = ring->Head;
+    tail = context->tx_ring_tail;
+    KeMemoryBarrier();
+    if (head - tail > slots)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        windivert_inject_batch_release(batch);
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("failed to send ring; invalid head", status);
+        return status;
+    }
+    count = (head - tail < count? head - tail: count);
+    for (i = 0; i < count; i++)
+    {
+        hdr = WINDIVERT_RING_SLOT_HDR(context, ring, tail + i);
+        hdr_copy = (windivert_batch_hdr_t)(data_copy + offset);
+        RtlCopyMemory(hdr_copy, hdr, sizeof(struct windivert_batch_hdr_s));
+        len = hdr_copy->Length;
+        if (len > slot_len - sizeof(struct windivert_batch_hdr_s))
+        {
+            // Clamp to the slot; such packets fail validation below.
+            len = slot_len - sizeof(struct windivert_batch_hdr_s);
+            hdr_copy->Length = len;
+        }
+        RtlCopyMemory(hdr_copy + 1, hdr + 1, len);
+        offset += WINDIVERT_BATCH_ALIGN(sizeof(struct windivert_batch_hdr_s) +
+            len);
+    }
+    context->tx_ring_tail = tail + count;
+    KeMemoryBarrier();
+    ring->Tail = tail + count;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    if (count == 0)
+    {
+        windivert_inject_batch_release(batch);
+        return STATUS_SUCCESS;
+    }
+    status = windivert_inject_batch(context, batch, offset, 0, &offset,
+        &count);
+    windivert_inject_batch_release(batch);
+    if (NT_SUCCESS(status))
+    {
+        *count_ptr = count;
+    }
+    return status;
+}
+
+/*
+ * WinDivert hold a matching packet until user mode returns a verdict for it.
+ * Returns the packet's verdict ID, or 0 if the packet could not be held (see
+ * windivert_divert_packet()).
+ */
+static UINT64 windivert_verdict_retain(context_t context, worker_t worker,
+    work_t work, PNET_BUFFER buffer)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    PLIST_ENTRY old_entry;
+    verdict_t verdict, old_verdict;
+    LONGLONG timestamp;
+    UINT64 id;
+
+    verdict = (verdict_t)windivert_pool_alloc(sizeof(struct verdict_s));
+    if (verdict == NULL)
+    {
+        return 0;
+    }
+
+    // The packet's data offset is recorded now, since the worker restores
+    // the NET_BUFFER's original offset once the work item is done.
+    FwpsReferenceNetBufferList(work->buffers, TRUE);
+    verdict->buffers = work->buffers;
+    verdict->mdl = NET_BUFFER_FIRST_MDL(buffer);
+    verdict->data_offset = NET_BUFFER_DATA_OFFSET(buffer);
+    verdict->data_len = NET_BUFFER_DATA_LENGTH(buffer);
+    verdict->direction = work->direction;
+    verdict->is_ipv4 = work->is_ipv4;
+    verdict->if_idx = work->if_idx;
+    verdict->sub_if_idx = work->sub_if_idx;
+    verdict->priority = work->priority;
+    verdict->timestamp = work->timestamp;
+
+    old_entry = NULL;
+    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    KeAcquireInStackQueuedSpinLock(&worker->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        windivert_verdict_release(verdict);
+        return 0;
+    }
+    if (!IsListEmpty(&worker->verdict_queue))
+    {
+        // Make room by dropping the oldest held packet if the queue is full
+        // or the packet has expired.
+        old_verdict = CONTAINING_RECORD(worker->verdict_queue.Flink,
+            struct verdict_s, entry);
+        if (worker->verdict_queue_length >= context->packet_queue_maxlength ||
+            WINDIVERT_TIMEOUT(context, old_verdict->timestamp, timestamp))
+        {
+            old_entry = RemoveHeadList(&worker->verdict_queue);
+            worker->verdict_queue_length--;
+        }
+    }
+    worker->verdict_seq++;
+    id = (worker->verdict_seq << WINDIVERT_VERDICT_WORKER_BITS) |
+        (UINT64)(worker - context->workers);
+    verdict->id = id;
+    InsertTailList(&worker->verdict_queue, &verdict->entry);
+    worker->verdict_queue_length++;
+    old_verdict = CONTAINING_RECORD(worker->verdict_queue.Flink,
+        struct verdict_s, entry);
+    windivert_verdict_timer_arm(context, old_verdict->timestamp, timestamp);
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    if (old_entry != NULL)
+    {
+        DEBUG("DROP: verdict queue is full or expired, dropping packet");
+        WINDIVERT_STAT_INC(context, WINDIVERT_STAT_DROP_VERDICT);
+        old_verdict = CONTAINING_RECORD(old_entry, struct verdict_s, entry);
+        windivert_verdict_release(old_verdict);
+    }
+    return id;
+}
+
+/*
+ * WinDivert set the verdict timer to expire a held packet with timestamp t0,
+ * unless it is already set.  Held packets must not keep the stack's
+ * NET_BUFFER_LISTs pinned indefinitely if user mode stalls or traffic stops.
+ * Must be called with a worker's lock held while the context is OPEN.
+ */
+static void windivert_verdict_timer_arm(context_t context, LONGLONG t0,
+    LONGLONG timestamp)
+{
+    LARGE_INTEGER due;
+    LONGLONG age;
+
+    if (InterlockedCompareExchange(&context->verdict_timer_set, 1, 0) != 0)
+    {
+        return;
+    }
+    age = timestamp - t0;
+    age = (age < 0? 0: age);
+    age = (age > context->packet_queue_maxcounts?
+        context->packet_queue_maxcounts: age);
+
+    // (Relative due time, in 100ns units, just past the expiry time.)
+    due.QuadPart = -((context->packet_queue_maxcounts - age) * 10000 /
+        counts_per_ms) - 1;
+    WdfObjectReference((WDFOBJECT)context->object);
+    KeSetTimer(&context->verdict_timer, due, &context->verdict_dpc);
+}
+
+/*
+ * WinDivert verdict timer DPC.  Drops held packets that have waited longer
+ * than the queue time, and re-arms the timer for the oldest remaining one.
+ */
+static VOID windivert_verdict_timer(IN PKDPC dpc, IN PVOID context,
+    IN PVOID arg1, IN PVOID arg2)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    context_t ctx = (context_t)context;
+    WDFOBJECT object = (WDFOBJECT)ctx->object;
+    LIST_ENTRY expired;
+    PLIST_ENTRY entry;
+    verdict_t verdict;
+    worker_t worker, oldest_worker = NULL;
+    LONGLONG timestamp, oldest = 0;
+    UINT i;
+
+    UNREFERENCED_PARAMETER(dpc);
+    UNREFERENCED_PARAMETER(arg1);
+    UNREFERENCED_PARAMETER(arg2);
+
+    InterlockedExchange(&ctx->verdict_timer_set, 0);
+    InitializeListHead(&expired);
+    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    for (i = 0; i < ctx->worker_count; i++)
+    {
+        worker = ctx->workers + i;
+        KeAcquireInStackQueuedSpinLock(&worker->lock, &lock_handle);
+        while (!IsListEmpty(&worker->verdict_queue))
+        {
+            verdict = CONTAINING_RECORD(worker->verdict_queue.Flink,
+                struct verdict_s, entry);
+            if (!WINDIVERT_TIMEOUT(ctx, verdict->timestamp, timestamp))
+            {
+                if (oldest_worker == NULL || verdict->timestamp < oldest)
+                {
+                    oldest_worker = worker;
+                    oldest = verdict->timestamp;
+                }
+                break;
+            }
+            RemoveHeadList(&worker->verdict_queue);
+            worker->verdict_queue_length--;
+            InsertTailList(&expired, &verdict->entry);
+        }
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+    }
+
+    if (oldest_worker != NULL)
+    {
+        KeAcquireInStackQueuedSpinLock(&oldest_worker->lock, &lock_handle);
+        if (ctx->state == WINDIVERT_CONTEXT_STATE_OPEN)
+        {
+            windivert_verdict_timer_arm(ctx, oldest, timestamp);
+        }
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+    }
+
+    while (!IsListEmpty(&expired))
+    {
+        entry = RemoveHeadList(&expired);
+        verdict = CONTAINING_RECORD(entry, struct verdict_s, entry);
+        DEBUG("DROP: held packet expired, dropping packet");
+        WINDIVERT_STAT_INC(ctx, WINDIVERT_STAT_DROP_VERDICT);
+        windivert_verdict_release(verdict);
+    }
+    WdfObjectDereference(object);
+}
+
+/*
+ * WinDivert reinject a held packet without copying it.
+ */
+static BOOL windivert_verdict_accept(BOOL forward, verdict_t verdict)
+{
+    PNET_BUFFER_LIST buffers_cpy;
+    HANDLE handle;
+    NTSTATUS status;
+
+    status = FwpsAllocateNetBufferAndNetBufferList0(nbl_pool_handle, 0, 0,
+        verdict->mdl, verdict->data_offset, verdict->data_len, &buffers_cpy);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to create NET_BUFFER_LIST for accepted packet",
+            status);
+        return FALSE;
+    }
+    if (forward || verdict->direction == WINDIVERT_DIRECTION_OUTBOUND)
+    {
+        NdisCopySendNetBufferListInfo(buffers_cpy, verdict->buffers);
+    }
+    else
+    {
+        NdisCopyReceiveNetBufferListInfo(buffers_cpy, verdict->buffers);
+    }
+    FwpsReferenceNetBufferList(verdict->buffers, TRUE);
+
+    handle = (verdict->is_ipv4? inject_handle: injectv6_handle);
+    if (forward)
+    {
+        status = FwpsInjectForwardAsync0(handle, (HANDLE)verdict->priority, 0,
+            (verdict->is_ipv4? AF_INET: AF_INET6), UNSPECIFIED_COMPARTMENT_ID,
+            verdict->if_idx, buffers_cpy, windivert_reinject_complete,
+            (HANDLE)verdict->buffers);
+    }
+    else if (verdict->direction == WINDIVERT_DIRECTION_OUTBOUND)
+    {
+        status = FwpsInjectNetworkSendAsync0(handle,
+            (HANDLE)verdict->priority, 0, UNSPECIFIED_COMPARTMENT_ID,
+            buffers_cpy, windivert_reinject_complete,
+            (HANDLE)verdict->buffers);
+    }
+    else
+    {
+        status = FwpsInjectNetworkReceiveAsync0(handle,
+            (HANDLE)verdict->priority, 0, UNSPECIFIED_COMPARTMENT_ID,
+            verdict->if_idx, verdict->sub_if_idx, buffers_cpy,
+            windivert_reinject_complete, (HANDLE)verdict->buffers);
+    }
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to reinject accepted packet", status);
+        FwpsFreeNetBufferList0(buffers_cpy);
+        FwpsDereferenceNetBufferList(verdict->buffers, FALSE);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * WinDivert release a held packet.
+ */
+static void windivert_verdict_release(verdict_t verdict)
+{
+    FwpsDereferenceNetBufferList(verdict->buffers, FALSE);
+    windivert_pool_free(verdict, sizeof(struct verdict_s));
+}
+
+/*
+ * WinDivert apply user mode verdicts to held packets.  Unknown or expired
+ * IDs are ignored.
+ */
+static NTSTATUS windivert_set_verdict(context_t context,
+    windivert_verdict_t verdicts, UINT count)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    PLIST_ENTRY entry;
+    verdict_t verdict, itr;
+    worker_t worker;
+    UINT64 id;
+    UINT8 verdict_type;
+    UINT i;
+    BOOL forward, ok;
+    NTSTATUS status;
+
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN ||
+        (context->flags & WINDIVERT_FLAG_VERDICT) == 0)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+    forward = (context->layer == WINDIVERT_LAYER_NETWORK_FORWARD);
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    for (i = 0; i < count; i++)
+    {
+        if (verdicts[i].Verdict > WINDIVERT_VERDICT_MAX)
+        {
+            status = STATUS_INVALID_PARAMETER;
+            DEBUG_ERROR("failed to set verdict; invalid verdict", status);
+            return status;
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        id = verdicts[i].Id;
+        verdict_type = verdicts[i].Verdict;
+        if ((id & WINDIVERT_VERDICT_WORKER_MASK) >= context->worker_count)
+        {
+            continue;
+        }
+        worker = context->workers + (id & WINDIVERT_VERDICT_WORKER_MASK);
+
+        // IDs are issued in queue order, so the search can stop early.
+        verdict = NULL;
+        KeAcquireInStackQueuedSpinLock(&worker->lock, &lock_handle);
+        if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+        {
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            return STATUS_INVALID_DEVICE_STATE;
+        }
+        for (entry = worker->verdict_queue.Flink;
+             entry != &worker->verdict_queue; entry = entry->Flink)
+        {
+            itr = CONTAINING_RECORD(entry, struct verdict_s, entry);
+            if (itr->id >= id)
+            {
+                if (itr->id == id)
+                {
+                    RemoveEntryList(entry);
+                    worker->verdict_queue_length--;
+                    verdict = itr;
+                }
+                break;
+            }
+        }
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        if (verdict == NULL)
+        {
+            continue;
+        }
+
+        // MODIFY releases the original; the replacement is sent by
+        // WinDivertSend().
+        if (verdict_type == WINDIVERT_VERDICT_ACCEPT)
+        {
+            ok = windivert_verdict_accept(forward, verdict);
+            WINDIVERT_STAT_INC(context, (ok? WINDIVERT_STAT_REINJECTED:
+                WINDIVERT_STAT_DROP_REINJECT));
+            if (ok)
+            {
+                WINDIVERT_STAT_LATENCY(context, inject_latency,
+                    verdict->timestamp,
+                    KeQueryPerformanceCounter(NULL).QuadPart);
+            }
+        }
+        windivert_verdict_release(verdict);
+    }
+    return STATUS_SUCCESS;
+}
+
+/*
+ * WinDivert caller context preprocessing.
+ */
+VOID windivert_caller_context(IN WDFDEVICE device, IN WDFREQUEST request)
+{
+    PCHAR inbuf;
+    size_t inbuflen;
+    WDF_REQUEST_PARAMETERS params;
+    WDFMEMORY memobj;
+    windivert_addr_t addr = NULL;
+    UINT32 *count = NULL;
+    size_t batch_len = 0;
+    windivert_ioctl_t ioctl;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    req_context_t req_context = NULL;
+    NTSTATUS status;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(request, &params);
+
+    if (params.Type != WdfRequestTypeDeviceControl)
+    {
+        goto windivert_caller_context_exit;
+    }
+
+    // Get and verify the input buffer.
+    status = WdfRequestRetrieveInputBuffer(request, 0, &inbuf, &inbuflen);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to retrieve input buffer", status);
+        goto windivert_caller_context_error;
+    }
+
+    if (inbuflen != sizeof(struct windivert_ioctl_s))
+    {
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("input buffer not an ioctl message header", status);
+        goto windivert_caller_context_error;
+    }
+
+    ioctl = (windivert_ioctl_t)inbuf;
+    if (ioctl->version != WINDIVERT_IOCTL_VERSION ||
+        ioctl->magic != WINDIVERT_IOCTL_MAGIC)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("input buffer contained a bad ioctl message header",
+            status);
+        goto windivert_caller_context_error;
+    }
+
+    // Probe and lock user buffers here (if required).
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, req_context_s);
+    status = WdfObjectAllocateContext(request, &attributes, &req_context);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to allocate request context for ioctl", status);
+        goto windivert_caller_context_error;
+    }
+    req_context->ring_mdl = NULL;
+    req_context->ring_event = NULL;
+    switch (params.Parameters.DeviceIoControl.IoControlCode)
+    {
+        case IOCTL_WINDIVERT_RECV:
+            if ((PVOID)ioctl->arg == NULL)
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("null arg pointer for RECV ioctl", status);
+                goto windivert_caller_context_error;
+            }
+            status = WdfRequestProbeAndLockUserBufferForWrite(request,
+                (PVOID)ioctl->arg, sizeof(struct windivert_addr_s), &memobj);
+            if (!NT_SUCCESS(status))
+            {
+                DEBUG_ERROR("invalid arg pointer for RECV ioctl", status);
+                goto windivert_caller_context_error;
+            }
+            addr = (windivert_addr_t)WdfMemoryGetBuffer(memobj, NULL);
+            break;
+
+        case IOCTL_WINDIVERT_SEND:
+            if ((PVOID)ioctl->arg == NULL)
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("null arg pointer for SEND ioctl", status);
+                goto windivert_caller_context_error;
+            }
+            status = WdfRequestProbeAndLockUserBufferForRead(request,
+                (PVOID)ioctl->arg, sizeof(struct windivert_addr_s), &memobj);
+            if (!NT_SUCCESS(status))
+            {
+                DEBUG_ERROR("invalid arg pointer for SEND ioctl", status);
+                goto windivert_caller_context_error;
+            }
+            addr = (windivert_addr_t)WdfMemoryGetBuffer(memobj, NULL);
+            break;
+
+        case IOCTL_WINDIVERT_RECV_BATCH:
+            batch_len = params.Parameters.DeviceIoControl.OutputBufferLength;
+            if (batch_len <= sizeof(struct windivert_batch_hdr_s))
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("invalid buffer length for RECV_BATCH ioctl",
+                    status);
+                goto windivert_caller_context_error;
+            }
+            if ((PVOID)ioctl->arg == NULL)
+            {
+                break;
+            }
+            status = WdfRequestProbeAndLockUserBufferForWrite(request,
+                (PVOID)ioctl->arg, sizeof(UINT32), &memobj);
+            if (!NT_SUCCESS(status))
+            {
+                DEBUG_ERROR("invalid arg pointer for RECV_BATCH ioctl",
+                    status);
+                goto windivert_caller_context_error;
+            }
+            count = (UINT32 *)WdfMemoryGetBuffer(memobj, NULL);
+            break;
+
+        case IOCTL_WINDIVERT_MAP_RING:
+            status = windivert_ring_lock(request, req_context);
+            if (!NT_SUCCESS(status))
+            {
+                goto windivert_caller_context_error;
+            }
+            break;
+
+        case IOCTL_WINDIVERT_SEND_BATCH:
+        case IOCTL_WINDIVERT_RING_SEND:
+        case IOCTL_WINDIVERT_SET_VERDICT:
+        case IOCTL_WINDIVERT_START_FILTER:
+        case IOCTL_WINDIVERT_OPEN:
+        case IOCTL_WINDIVERT_SET_FILTER:
+        case IOCTL_WINDIVERT_SET_LAYER:
+        case IOCTL_WINDIVERT_SET_PRIORITY:
+        case IOCTL_WINDIVERT_SET_FLAGS:
+        case IOCTL_WINDIVERT_SET_PARAM:
+        case IOCTL_WINDIVERT_GET_PARAM:
+        case IOCTL_WINDIVERT_GET_STATS:
+            break;
+        
+        default:
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            DEBUG_ERROR("failed to complete I/O control; invalid request",
+                status);
+            goto windivert_caller_context_error;
+    }
+    
+    req_context->addr = addr;
+    req_context->count = count;
+    req_context->batch_len = (ULONG)batch_len;
+
+windivert_caller_context_exit:
+
+    status = WdfDeviceEnqueueRequest(device, request);
+    
+windivert_caller_context_error:    
+    
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to enqueue request", status);
+        if (req_context != NULL && req_context->ring_mdl != NULL)
+        {
+            windivert_ring_unlock(req_context->ring_mdl,
+                req_context->ring_event);
+            req_context->ring_mdl = NULL;
+        }
+        WdfRequestComplete(request, status);
+    }
+}
+
+/*
+ * Compile a filter object and start filtering.
+ */
+static NTSTATUS windivert_start_filter(context_t context,
+    windivert_ioctl_filter_t filter0, size_t filter0_len, UINT64 obj_len)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    filter_t filter;
+    flow_cache_t flow_cache;
+    BOOL is_inbound, is_outbound, is_ipv4, is_ipv6;
+    UINT8 layer;
+    NTSTATUS status;
+
+    filter = windivert_filter_compile(filter0, filter0_len, obj_len);
+    if (filter == NULL)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("failed to compile filter", status);
+        return status;
+    }
+
+    flow_cache = windivert_flow_cache_create(context, filter);
+
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN || context->on)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        windivert_free(filter);
+        windivert_free(flow_cache);
+        status = STATUS_INVALID_DEVICE_STATE;
+        return status;
+    }
+    context->on = TRUE;
+    context->programs[context->program_curr].filter = filter;
+    context->programs[context->program_curr].flow_cache = flow_cache;
+    layer = context->layer;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    windivert_filter_analyze(filter, &is_inbound, &is_outbound, &is_ipv4,
+        &is_ipv6);
+    status = windivert_install_callouts(context, layer, is_inbound,
+        is_outbound, is_ipv4, is_ipv6, filter);
+    return status;
+}
+
+/*
+ * Set the WinDivert context layer.
+ */
+static NTSTATUS windivert_set_layer(context_t context, UINT64 value)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    NTSTATUS status;
+
+    if (value > WINDIVERT_LAYER_MAX)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("failed to set layer; value too big", status);
+        return status;
+    }
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN || context->on)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        status = STATUS_INVALID_DEVICE_STATE;
+        return status;
+    }
+    context->layer = (UINT8)value;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Set the WinDivert context priority.
+ */
+static NTSTATUS windivert_set_priority(context_t context, UINT64 value)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    UINT32 priority;
+    NTSTATUS status;
+
+    if (value < WINDIVERT_PRIORITY_MIN || value > WINDIVERT_PRIORITY_MAX)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("failed to set priority; value out of range", status);
+        return status;
+    }
+    priority = WINDIVERT_CONTEXT_PRIORITY((UINT32)value);
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN || context->on)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        status = STATUS_INVALID_DEVICE_STATE;
+        return status;
+    }
+    context->priority = priority;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Set the WinDivert context flags.
+ */
+static NTSTATUS windivert_set_flags(context_t context, UINT64 flags)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    UINT8 queues, i;
+    NTSTATUS status;
+
+    if (!WINDIVERT_FLAGS_VALID(flags))
+    {
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("failed to set flags; invalid flags value", status);
+        return status;
+    }
+
+    // Each sub-queue is served by its own worker, and packets are steered
+    // to sub-queues by flow hash.
+    queues = WINDIVERT_FLAGS_QUEUES(flags);
+    for (i = 0; i < queues; i++)
+    {
+        status = windivert_worker_init(context, context->workers + i, TRUE);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN || context->on)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        status = STATUS_INVALID_DEVICE_STATE;
+        return status;
+    }
+    context->flags = flags;
+    if ((flags & (WINDIVERT_FLAG_SNIFF | WINDIVERT_FLAG_VERDICT)) == 0)
+    {
+        // Truncated packets cannot be reinjected.
+        context->snap_len = 0;
+    }
+    if ((flags & WINDIVERT_FLAG_SNIFF) == 0)
+    {
+        // Only SNIFF handles may skip matching packets.
+        context->sample_rate = WINDIVERT_PARAM_SAMPLE_RATE_DEFAULT;
+        context->rate_limit = WINDIVERT_PARAM_RATE_LIMIT_DEFAULT;
+    }
+    if (queues != 0)
+    {
+        context->worker_count = queues;
+        context->queue_count = queues;
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Set a WinDivert context parameter.
+ */
+static NTSTATUS windivert_set_param(context_t context, UINT8 param,
+    UINT64 value)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    NTSTATUS status;
+
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        status = STATUS_INVALID_DEVICE_STATE;
+        return status;
+    }
+    switch ((WINDIVERT_PARAM)param)
+    {
+        case WINDIVERT_PARAM_QUEUE_LEN:
+            if (value < WINDIVERT_PARAM_QUEUE_LEN_MIN ||
+                value > WINDIVERT_PARAM_QUEUE_LEN_MAX)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set queue length; invalid "
+                    "value", status);
+                return status;
+            }
+            context->packet_queue_maxlength = (ULONG)value;
+            break;
+
+        case WINDIVERT_PARAM_QUEUE_TIME:
+            if (value < WINDIVERT_PARAM_QUEUE_TIME_MIN ||
+                value > WINDIVERT_PARAM_QUEUE_TIME_MAX)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set queue time; invalid "
+                    "value", status);
+                return status;
+            }
+            context->packet_queue_maxcounts =
+                (LONGLONG)value * counts_per_ms;
+            context->packet_queue_maxtime = (ULONG)value;
+            break;
+
+        case WINDIVERT_PARAM_QUEUE_SIZE:
+            if (value < WINDIVERT_PARAM_QUEUE_SIZE_MIN ||
+                value > WINDIVERT_PARAM_QUEUE_SIZE_MAX)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set queue size; invalid "
+                    "value", status);
+                return status;
+            }
+            context->packet_queue_maxsize = (ULONG)value;
+            break;
+
+        case WINDIVERT_PARAM_QUEUE_MODE:
+            if (value > WINDIVERT_PARAM_QUEUE_MODE_MAX)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set queue mode; invalid "
+                    "value", status);
+                return status;
+            }
+            context->packet_queue_mode = (UINT8)value;
+            break;
+
+        case WINDIVERT_PARAM_SNAPLEN:
+            // Truncated packets cannot be reinjected, so a snap
+            // length is only valid if the original is kept.
+            if (value > WINDIVERT_PARAM_SNAPLEN_MAX ||
+                (value != 0 && (context->flags &
+                    (WINDIVERT_FLAG_SNIFF | WINDIVERT_FLAG_VERDICT))
+                        == 0))
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set snap length; invalid "
+                    "value", status);
+                return status;
+            }
+            context->snap_len = (ULONG)value;
+            break;
+
+        case WINDIVERT_PARAM_OVERLOAD:
+            if (value > WINDIVERT_PARAM_OVERLOAD_MAX)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set overload policy; invalid "
+                    "value", status);
+                return status;
+            }
+            context->overload = (UINT8)value;
+            break;
+
+        case WINDIVERT_PARAM_BATCH_COUNT:
+            if (value < WINDIVERT_PARAM_BATCH_COUNT_MIN ||
+                value > WINDIVERT_PARAM_BATCH_COUNT_MAX)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set batch count; invalid "
+                    "value", status);
+                return status;
+            }
+            context->batch_count = (UINT32)value;
+            break;
+
+        case WINDIVERT_PARAM_BATCH_TIME:
+            if (value < WINDIVERT_PARAM_BATCH_TIME_MIN ||
+                value > WINDIVERT_PARAM_BATCH_TIME_MAX)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set batch time; invalid "
+                    "value", status);
+                return status;
+            }
+            context->batch_maxcounts =
+                (LONGLONG)value * counts_per_ms / 1000;
+            context->batch_time = (ULONG)value;
+            break;
+
+        case WINDIVERT_PARAM_SAMPLE_RATE:
+            // Skipped packets are not diverted, so sampling is only
+            // valid for SNIFF handles.
+            if (value < WINDIVERT_PARAM_SAMPLE_RATE_MIN ||
+                value > WINDIVERT_PARAM_SAMPLE_RATE_MAX ||
+                (value != WINDIVERT_PARAM_SAMPLE_RATE_DEFAULT &&
+                    (context->flags & WINDIVERT_FLAG_SNIFF) == 0))
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set sample rate; invalid "
+                    "value", status);
+                return status;
+            }
+            context->sample_rate = (ULONG)value;
+            break;
+
+        case WINDIVERT_PARAM_SAMPLE_MODE:
+            if (value > WINDIVERT_PARAM_SAMPLE_MODE_MAX)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set sample mode; invalid "
+                    "value", status);
+                return status;
+            }
+            context->sample_mode = (UINT8)value;
+            break;
+
+        case WINDIVERT_PARAM_RATE_LIMIT:
+            // As above, only valid for SNIFF handles.
+            if (value > WINDIVERT_PARAM_RATE_LIMIT_MAX ||
+                (value != WINDIVERT_PARAM_RATE_LIMIT_DEFAULT &&
+                    (context->flags & WINDIVERT_FLAG_SNIFF) == 0))
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set rate limit; invalid "
+                    "value", status);
+                return status;
+            }
+            context->rate_limit = (ULONG)value;
+            break;
+
+        case WINDIVERT_PARAM_RATE_MODE:
+            if (value > WINDIVERT_PARAM_RATE_MODE_MAX)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set rate limit mode; invalid "
+                    "value", status);
+                return status;
+            }
+            context->rate_mode = (UINT8)value;
+            break;
+
+        default:
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            status = STATUS_INVALID_PARAMETER;
+            DEBUG_ERROR("failed to set parameter; invalid parameter",
+                status);
+            return status;
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Configure and start a WinDivert context in a single request.
+ */
+static NTSTATUS windivert_open(context_t context, windivert_ioctl_open_t open,
+    size_t open_len, UINT64 obj_len)
+{
+    UINT8 param;
+    NTSTATUS status;
+
+    if (open == NULL || open_len < sizeof(struct windivert_ioctl_open_s))
+    {
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("failed to open; missing configuration", status);
+        return status;
+    }
+    if (open->reserved != 0 ||
+        (open->param_mask & ~((1 << (WINDIVERT_PARAM_MAX+1)) - 1)) != 0)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("failed to open; invalid configuration", status);
+        return status;
+    }
+
+    // The flags must be set before the params, since the SNAPLEN and
+    // SAMPLE_RATE params are validated against them.
+    status = windivert_set_layer(context, open->layer);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = windivert_set_flags(context, open->flags);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = windivert_set_priority(context, open->priority);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    for (param = 0; param <= WINDIVERT_PARAM_MAX; param++)
+    {
+        if ((open->param_mask & (1 << param)) == 0)
+        {
+            continue;
+        }
+        status = windivert_set_param(context, param, open->params[param]);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    return windivert_start_filter(context,
+        (windivert_ioctl_filter_t)(open + 1),
+        open_len - sizeof(struct windivert_ioctl_open_s), obj_len);
+}
+
+/*
+ * WinDivert I/O control.
+ */
+extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
+    IN size_t out_length, IN size_t in_length, IN ULONG code)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    PCHAR inbuf, outbuf;
+    size_t inbuflen, outbuflen, filter0_len;
+    windivert_ioctl_t ioctl;
+    windivert_ioctl_filter_t filter0;
+    filter_t filter;
+    flow_cache_t flow_cache;
+    UINT8 layer;
+    windivert_addr_t addr;
+    req_context_t req_context;
+    NTSTATUS status = STATUS_SUCCESS;
+    context_t context =
+        windivert_context_get(WdfRequestGetFileObject(request));
+    UINT64 *valptr;
+    UNREFERENCED_PARAMETER(queue);
+
+    DEBUG("IOCTL: I/O control request (context=%p)", context);
+
+    // Get the buffers and do sanity checks.
+    status = WdfRequestRetrieveInputBuffer(request, 0, &inbuf, &inbuflen);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to retrieve input buffer", status);
+        goto windivert_ioctl_exit;
+    }
+    switch (code)
+    {
+        case IOCTL_WINDIVERT_START_FILTER: case IOCTL_WINDIVERT_GET_PARAM:
+        case IOCTL_WINDIVERT_RING_SEND: case IOCTL_WINDIVERT_SET_VERDICT:
+        case IOCTL_WINDIVERT_SET_FILTER: case IOCTL_WINDIVERT_GET_STATS:
+        case IOCTL_WINDIVERT_OPEN:
+            status = WdfRequestRetrieveOutputBuffer(request, 0, &outbuf,
+                &outbuflen);
+            if (!NT_SUCCESS(status))
+            {
+                DEBUG_ERROR("failed to retrieve output buffer", status);
+                goto windivert_ioctl_exit;
+            }
+            break;
+        default:
+            outbuf = NULL;
+            outbuflen = 0;
+            break;
+    }
+
+    // Handle the ioctl:
+    switch (code)
+    {
+        case IOCTL_WINDIVERT_RECV: case IOCTL_WINDIVERT_RECV_BATCH:
+            ioctl = (windivert_ioctl_t)inbuf;
+            status = windivert_read(context, request, ioctl->arg8);
+            if (NT_SUCCESS(status))
+            {
+                return;
+            }
+            break;
+        
+        case IOCTL_WINDIVERT_SEND:
+            ioctl = (windivert_ioctl_t)inbuf;
+            if (!WINDIVERT_SEND_FLAGS_VALID(ioctl->arg8))
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to send; invalid flags", status);
+                goto windivert_ioctl_exit;
+            }
+            req_context = windivert_req_context_get(request);
+            addr = req_context->addr;
+            status = windivert_write(context, request, addr, ioctl->arg8);
+            if (NT_SUCCESS(status))
+            {
+                return;
+            }
+            break;
+
+        case IOCTL_WINDIVERT_SEND_BATCH:
+            ioctl = (windivert_ioctl_t)inbuf;
+            if (!WINDIVERT_SEND_FLAGS_VALID(ioctl->arg8))
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to send batch; invalid flags", status);
+                goto windivert_ioctl_exit;
+            }
+            status = windivert_write_batch(context, request, ioctl->arg8);
+            if (NT_SUCCESS(status))
+            {
+                return;
+            }
+            break;
+
+        case IOCTL_WINDIVERT_MAP_RING:
+            req_context = windivert_req_context_get(request);
+            status = windivert_ring_map(context, req_context);
+            break;
+
+        case IOCTL_WINDIVERT_RING_SEND:
+            if (outbuflen != sizeof(UINT32))
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to send ring; invalid output buffer "
+                    "size", status);
+                goto windivert_ioctl_exit;
+            }
+            status = windivert_ring_send(context, (UINT32 *)outbuf);
+            break;
+
+        case IOCTL_WINDIVERT_SET_VERDICT:
+            if (outbuflen == 0 ||
+                outbuflen % sizeof(struct windivert_verdict_s) != 0 ||
+                outbuflen / sizeof(struct windivert_verdict_s) >
+                    WINDIVERT_VERDICTS_MAX)
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set verdict; invalid output buffer "
+                    "size", status);
+                goto windivert_ioctl_exit;
+            }
+            status = windivert_set_verdict(context,
+                (windivert_verdict_t)outbuf,
+                (UINT)(outbuflen / sizeof(struct windivert_verdict_s)));
+            break;
+        
+        case IOCTL_WINDIVERT_START_FILTER:
+            ioctl = (windivert_ioctl_t)inbuf;
+            status = windivert_start_filter(context,
+                (windivert_ioctl_filter_t)outbuf, outbuflen, ioctl->arg);
+            break;
+
+        case IOCTL_WINDIVERT_OPEN:
+            ioctl = (windivert_ioctl_t)inbuf;
+            status = windivert_open(context, (windivert_ioctl_open_t)outbuf,
+                outbuflen, ioctl->arg);
+            break;
+
+        case IOCTL_WINDIVERT_SET_FILTER:
+        {
+            BOOL is_inbound, is_outbound, is_ipv4, is_ipv6;
+            BOOL loosened[WINDIVERT_CONTEXT_MAXLAYERS];
+
+            ioctl = (windivert_ioctl_t)inbuf;
+            filter0 = (windivert_ioctl_filter_t)outbuf;
+            filter0_len = outbuflen;
+            filter = windivert_filter_compile(filter0, filter0_len,
+                ioctl->arg);
+            if (filter == NULL)
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to compile filter", status);
+                goto windivert_ioctl_exit;
+            }
+            flow_cache = windivert_flow_cache_create(context, filter);
+
+            // Only one replace at a time; the replace owns the old filter
+            // until it is done.
+            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+            if (context->state != WINDIVERT_CONTEXT_STATE_OPEN ||
+                !context->on || context->replacing)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                windivert_free(filter);
+                windivert_free(flow_cache);
+                status = STATUS_INVALID_DEVICE_STATE;
+                goto windivert_ioctl_exit;
+            }
+            context->replacing = TRUE;
+            layer = context->layer;
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+            windivert_filter_analyze(filter, &is_inbound, &is_outbound,
+                &is_ipv4, &is_ipv6);
+            status = windivert_update_callouts(context, layer, is_inbound,
+                is_outbound, is_ipv4, is_ipv6, filter, loosened);
+            if (NT_SUCCESS(status))
+            {
+                windivert_program_replace(context, filter, flow_cache);
+                windivert_tighten_callouts(context, loosened);
+            }
+            else
+            {
+                // No dispatcher refers to the new filter any more.
+                DEBUG_ERROR("failed to update callouts", status);
+                windivert_free(filter);
+                windivert_free(flow_cache);
+            }
+
+            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+            context->replacing = FALSE;
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            break;
+        }
+
+        case IOCTL_WINDIVERT_SET_LAYER:
+            ioctl = (windivert_ioctl_t)inbuf;
+            status = windivert_set_layer(context, ioctl->arg);
+            break;
+
+        case IOCTL_WINDIVERT_SET_PRIORITY:
+            ioctl = (windivert_ioctl_t)inbuf;
+            status = windivert_set_priority(context, ioctl->arg);
+            break;
+
+        case IOCTL_WINDIVERT_SET_FLAGS:
+            ioctl = (windivert_ioctl_t)inbuf;
+            status = windivert_set_flags(context, ioctl->arg);
+            break;
+
+        case IOCTL_WINDIVERT_SET_PARAM:
+            ioctl = (windivert_ioctl_t)inbuf;
+            status = windivert_set_param(context, ioctl->arg8, ioctl->arg);
+            break;
+
+        case IOCTL_WINDIVERT_GET_PARAM:
+            ioctl = (windivert_ioctl_t)inbuf;
+            if (outbuflen != sizeof(UINT64))
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to get parameter; invalid output "
+                    "buffer size", status);
+                goto windivert_ioctl_exit;
+            }
+            valptr = (UINT64 *)outbuf;
+            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+            if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_DEVICE_STATE;
+                goto windivert_ioctl_exit;
+            }
+            switch (ioctl->arg8)
+            {
+                case WINDIVERT_PARAM_QUEUE_LEN:
+                    *valptr = context->packet_queue_maxlength;
+                    break;
+                case WINDIVERT_PARAM_QUEUE_TIME:
+                    *valptr = context->packet_queue_maxtime;
+                    break;
+                case WINDIVERT_PARAM_QUEUE_SIZE:
+                    *valptr = context->packet_queue_maxsize;
+                    break;
+                case WINDIVERT_PARAM_QUEUE_MODE:
+                    *valptr = context->packet_queue_mode;
+                    break;
+                case WINDIVERT_PARAM_SNAPLEN:
+                    *valptr = context->snap_len;
+                    break;
+                case WINDIVERT_PARAM_OVERLOAD:
+                    *valptr = context->overload;
+                    break;
+                case WINDIVERT_PARAM_BATCH_COUNT:
+                    *valptr = context->batch_count;
+                    break;
+                case WINDIVERT_PARAM_BATCH_TIME:
+                    *valptr = context->batch_time;
+                    break;
+                case WINDIVERT_PARAM_SAMPLE_RATE:
+                    *valptr = context->sample_rate;
+                    break;
+                case WINDIVERT_PARAM_SAMPLE_MODE:
+                    *valptr = context->sample_mode;
+                    break;
+                case WINDIVERT_PARAM_RATE_LIMIT:
+                    *valptr = context->rate_limit;
+                    break;
+                case WINDIVERT_PARAM_RATE_MODE:
+                    *valptr = context->rate_mode;
+                    break;
+                case WINDIVERT_PARAM_LAYER:
+                    *valptr = context->layer;
+                    break;
+                default:
+                    KeReleaseInStackQueuedSpinLock(&lock_handle);
+                    status = STATUS_INVALID_PARAMETER;
+                    DEBUG_ERROR("failed to get parameter; invalid parameter",
+                        status);
+                    goto windivert_ioctl_exit;
+            }
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            break;
+
+        case IOCTL_WINDIVERT_GET_STATS:
+            if (outbuflen != sizeof(WINDIVERT_STATS))
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to get statistics; invalid output "
+                    "buffer size", status);
+                goto windivert_ioctl_exit;
+            }
+            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+            if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_DEVICE_STATE;
+                goto windivert_ioctl_exit;
+            }
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            windivert_get_stats(context, (UINT64 *)outbuf);
+            break;
+
+        default:
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            DEBUG_ERROR("failed to complete I/O control; invalid request",
+                status);
+            break;
+    }
+
+windivert_ioctl_exit:
+    WdfRequestComplete(request, status);
+}
+
+/*
+ * WinDivert notify callout.
+ */
+static NTSTATUS windivert_notify_callout(IN FWPS_CALLOUT_NOTIFY_TYPE type,
+    IN const GUID *filter_key, IN const FWPS_FILTER0 *filter)
+{
+    UNREFERENCED_PARAMETER(type);
+    UNREFERENCED_PARAMETER(filter_key);
+    UNREFERENCED_PARAMETER(filter);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * WinDivert classify outbound IPv4 callout.
+ */
+static void windivert_classify_outbound_network_v4_callout(
+    IN const FWPS_INCOMING_VALUES0 *fixed_vals,
+    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
+    const FWPS_FILTER0 *filter, IN UINT64 flow_context,
+    OUT FWPS_CLASSIFY_OUT0 *result)
+{
+    windivert_dispatch(layer_outbound_network_ipv4,
+        WINDIVERT_DIRECTION_OUTBOUND,
+        fixed_vals->incomingValue[
+            FWPS_FIELD_OUTBOUND_IPPACKET_V4_INTERFACE_INDEX].value.uint32,
+        fixed_vals->incomingValue[
+            FWPS_FIELD_OUTBOUND_IPPACKET_V4_SUB_INTERFACE_INDEX].value.uint32,
+        TRUE,
+        (fixed_vals->incomingValue[
+            FWPS_FIELD_OUTBOUND_IPPACKET_V4_FLAGS].value.uint32 &
+            FWP_CONDITION_FLAG_IS_LOOPBACK) != 0,
+        0, data, result);
+}
+
+/*
+ * WinDivert classify outbound IPv6 callout.
+ */
+static void windivert_classify_outbound_network_v6_callout(
+    IN const FWPS_INCOMING_VALUES0 *fixed_vals,
+    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
+    const FWPS_FILTER0 *filter, IN UINT64 flow_context,
+    OUT FWPS_CLASSIFY_OUT0 *result)
+{
+    windivert_dispatch(layer_outbound_network_ipv6,
+        WINDIVERT_DIRECTION_OUTBOUND,
+        fixed_vals->incomingValue[
+            FWPS_FIELD_OUTBOUND_IPPACKET_V6_INTERFACE_INDEX].value.uint32,
+        fixed_vals->incomingValue[
+            FWPS_FIELD_OUTBOUND_IPPACKET_V6_SUB_INTERFACE_INDEX].value.uint32,
+        FALSE,
+        (fixed_vals->incomingValue[
+            FWPS_FIELD_OUTBOUND_IPPACKET_V6_FLAGS].value.uint32 &
+            FWP_CONDITION_FLAG_IS_LOOPBACK) != 0,
+        0, data, result);
+}
+
+/*
+ * WinDivert classify inbound IPv4 callout.
+ */
+static void windivert_classify_inbound_network_v4_callout(
+    IN const FWPS_INCOMING_VALUES0 *fixed_vals,
+    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
+    const FWPS_FILTER0 *filter, IN UINT64 flow_context,
+    OUT FWPS_CLASSIFY_OUT0 *result)
+{
+    UINT advance = meta_vals->ipHeaderSize;
+    windivert_dispatch(layer_inbound_network_ipv4,
+        WINDIVERT_DIRECTION_INBOUND,
+        fixed_vals->incomingValue[
+            FWPS_FIELD_INBOUND_IPPACKET_V4_INTERFACE_INDEX].value.uint32,
+        fixed_vals->incomingValue[
+            FWPS_FIELD_INBOUND_IPPACKET_V4_SUB_INTERFACE_INDEX].value.uint32,
+        TRUE,
+        (fixed_vals->incomingValue[
+            FWPS_FIELD_INBOUND_IPPACKET_V4_FLAGS].value.uint32 &
+            FWP_CONDITION_FLAG_IS_LOOPBACK) != 0,
+        advance, data, result);
+}
+
+/*
+ * WinDivert classify inbound IPv6 callout.
+ */
+static void windivert_classify_inbound_network_v6_callout(
+    IN const FWPS_INCOMING_VALUES0 *fixed_vals,
+    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
+    const FWPS_FILTER0 *filter, IN UINT64 flow_context,
+    OUT FWPS_CLASSIFY_OUT0 *result)
+{
+    UINT advance = meta_vals->ipHeaderSize;
+    windivert_dispatch(layer_inbound_network_ipv6,
+        WINDIVERT_DIRECTION_INBOUND,
+        fixed_vals->incomingValue[
+            FWPS_FIELD_INBOUND_IPPACKET_V6_INTERFACE_INDEX].value.uint32,
+        fixed_vals->incomingValue[
+            FWPS_FIELD_INBOUND_IPPACKET_V6_SUB_INTERFACE_INDEX].value.uint32,
+        FALSE,
+        (fixed_vals->incomingValue[
+            FWPS_FIELD_INBOUND_IPPACKET_V6_FLAGS].value.uint32 &
+            FWP_CONDITION_FLAG_IS_LOOPBACK) != 0,
+        advance, data, result);
+}
+
+/*
+ * WinDivert classify forward IPv4 callout.
+ */
+static void windivert_classify_forward_network_v4_callout(
+    IN const FWPS_INCOMING_VALUES0 *fixed_vals,
+    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
+    const FWPS_FILTER0 *filter, IN UINT64 flow_context,
+    OUT FWPS_CLASSIFY_OUT0 *result)
+{
+    windivert_dispatch(layer_forward_network_ipv4,
+        WINDIVERT_DIRECTION_OUTBOUND,
+        fixed_vals->incomingValue[
+            FWPS_FIELD_IPFORWARD_V4_DESTINATION_INTERFACE_INDEX].value.uint32,
+        0, TRUE, FALSE, 0, data, result);
+}
+
+/*
+ * WinDivert classify forward IPv6 callout.
+ */
+static void windivert_classify_forward_network_v6_callout(
+    IN const FWPS_INCOMING_VALUES0 *fixed_vals,
+    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
+    const FWPS_FILTER0 *filter, IN UINT64 flow_context,
+    OUT FWPS_CLASSIFY_OUT0 *result)
+{
+    windivert_dispatch(layer_forward_network_ipv6,
+        WINDIVERT_DIRECTION_OUTBOUND,
+        fixed_vals->incomingValue[
+            FWPS_FIELD_IPFORWARD_V6_DESTINATION_INTERFACE_INDEX].value.uint32,
+        0, FALSE, FALSE, 0, data, result);
+}
+
+/*
+ * WinDivert dispatcher classify.  Each packet is checked against the filters
+ * of the layer's handles in priority order, and passed to the first handle
+ * with a match.  Handles at or above the priority of a reinjected packet have
+ * already seen it and are skipped.
+ */
+static void windivert_dispatch(layer_t layer, IN UINT8 direction,
+    IN UINT32 if_idx, IN UINT32 sub_if_idx, IN BOOL isipv4, IN BOOL loopback,
+    IN UINT advance, IN OUT void *data, OUT FWPS_CLASSIFY_OUT0 *result)
+{
+    FWPS_PACKET_INJECTION_STATE packet_state;
+    HANDLE packet_context;
+    UINT32 packet_priority;
+    PNET_BUFFER_LIST buffers;
+    PNET_BUFFER buffer, buffer_fst;
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO checksums_info;
+    struct meta_s metas[WINDIVERT_DISPATCH_METAS + 1];
+    meta_t meta;
+    dispatch_table_t table;
+    context_t context;
+    program_t program;
+    UINT8 checksums;
+    BOOL outbound, hop, self, absorbed;
+    UINT i, j, parsed, classified;
+    LONGLONG timestamp;
+    NTSTATUS status;
+
+    // Basic checks:
+    if (!(result->rights & FWPS_RIGHT_ACTION_WRITE) || data == NULL)
+    {
+        return;
+    }
+
+    buffers = (PNET_BUFFER_LIST)data;
+    buffer = NET_BUFFER_LIST_FIRST_NB(buffers);
+    if (NET_BUFFER_LIST_NEXT_NBL(buffers) != NULL)
+    {
+        // This is a fragment group.  This can be ignored since each fragment
+        // should have already been indicated.
+        result->actionType = FWP_ACTION_CONTINUE;
+        return;
+    }
+
+    // Loopback packets are considered outbound only.
+    if (loopback && direction == WINDIVERT_DIRECTION_INBOUND)
+    {
+        result->actionType = FWP_ACTION_CONTINUE;
+        return;
+    }
+
+    if (isipv4)
+    {
+        packet_state = FwpsQueryPacketInjectionState0(inject_handle, buffers,
+            &packet_context);
+    }
+    else
+    {
+        packet_state = FwpsQueryPacketInjectionState0(injectv6_handle,
+            buffers, &packet_context);
+    }
+
+    hop = FALSE;
+    self = FALSE;
+    packet_priority = 0;
+    if (packet_state == FWPS_PACKET_INJECTED_BY_SELF ||
+        packet_state == FWPS_PACKET_PREVIOUSLY_INJECTED_BY_SELF)
+    {
+        self = TRUE;
+        packet_priority = (UINT32)packet_context;
+    }
+    else if (packet_state == FWPS_PACKET_INJECTED_BY_OTHER)
+    {
+        // This is a packet injected by another driver, possibly an older
+        // version of WinDivert.  To prevent block-clone-reinject infinite
+        // loops, we consider this capture to be a "hop".
+        hop = TRUE;
+    }
+
+    // Determine which checksum fields are present or not.
+    if (loopback)
+    {
+        // Loopback packets appear to have bogus checksums, so do not trust.
+        checksums = 0;
+    }
+    else if (direction == WINDIVERT_DIRECTION_OUTBOUND)
+    {
+        checksums_info.Value = NET_BUFFER_LIST_INFO(buffers,
+            TcpIpChecksumNetBufferListInfo);
+        checksums =
+            (isipv4? 0: WINDIVERT_IP_CHECKSUM) |
+            (checksums_info.Transmit.TcpChecksum? 0: WINDIVERT_TCP_CHECKSUM) |
+            (checksums_info.Transmit.UdpChecksum? 0: WINDIVERT_UDP_CHECKSUM);
+    }
+    else
+    {
+        checksums = WINDIVERT_ALL_CHECKSUMS;
+    }
+    if (hop && isipv4)
+    {
+        checksums &= ~WINDIVERT_IP_CHECKSUM;
+    }
+
+    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    // Retreat the NET_BUFFER to the IP header, if necessary.
+    // If (advance != 0) then this must be in the inbound path, and the
+    // NET_BUFFER_LIST must contain exactly one NET_BUFFER.
+    if (advance != 0)
+    {
+        status = NdisRetreatNetBufferDataStart(buffer, advance, 0, NULL);
+        if (!NT_SUCCESS(status))
+        {
+            result->actionType = FWP_ACTION_CONTINUE;
+            return;
+        }
+    }
+
+    /*
+     * This code is complicated by the fact the a single NET_BUFFER_LIST
+     * may contain several NET_BUFFER structures.  Each NET_BUFFER needs to
+     * be filtered independently.  To achieve this we do the following:
+     * 1) For each handle, check if any NET_BUFFER passes its filter.  The
+     *    headers of each NET_BUFFER are parsed only once for all handles.
+     * 2) If no, then CONTINUE the entire NET_BUFFER_LIST.
+     * 3) Else, split the NET_BUFFER_LIST into individual NET_BUFFERs; and
+     *    either queue or re-inject based on the handle's filter.  This step
+     *    is done out-of-band, see windivert_worker().
+     */
+    outbound = (direction == WINDIVERT_DIRECTION_OUTBOUND);
+    absorbed = FALSE;
+    parsed = 0;
+    table = windivert_dispatch_acquire(&layer->dispatch);
+    for (i = 0; !absorbed && i < table->length; i++)
+    {
+        // The priority and filter are fixed once filtering is on, so the
+        // context lock is not needed here.  The state is re-checked under
+        // the worker's lock before the packet is queued.
+        context = table->entries[i].context;
+        if ((self && context->priority <= packet_priority) ||
+            context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+        {
+            continue;
+        }
+
+        // Find the first NET_BUFFER this handle needs to queue:
+        buffer_fst = buffer;
+        program = windivert_program_acquire(context);
+        classified = 0;
+        for (j = 0; buffer_fst != NULL; j++)
+        {
+            BOOL match;
+
+            // The first few packets are parsed on first use and kept; the
+            // (rare) remainder is parsed into the last slot every time.
+            meta = metas + (j < WINDIVERT_DISPATCH_METAS? j:
+                WINDIVERT_DISPATCH_METAS);
+            if (j >= parsed)
+            {
+                windivert_parse(buffer_fst, isipv4, meta);
+                parsed = (j < WINDIVERT_DISPATCH_METAS? j + 1: parsed);
+            }
+            match = windivert_filter_meta(meta, if_idx, sub_if_idx, outbound,
+                hop, checksums, program->filter, program->flow_cache);
+            classified++;
+            if (match)
+            {
+                if (windivert_sample(context, windivert_meta_hash(meta),
+                        timestamp))
+                {
+                    break;
+                }
+                // Matched, but skipped by sampling or the rate limit:
+                WINDIVERT_STAT_INC(context, WINDIVERT_STAT_MATCHED);
+            }
+            buffer_fst = NET_BUFFER_NEXT_NB(buffer_fst);
+        }
+        windivert_program_release(program);
+        WINDIVERT_STAT_ADD(context, WINDIVERT_STAT_CLASSIFIED, classified);
+        if (buffer_fst == NULL)
+        {
+            continue;
+        }
+
+        // The worker retreats the NET_BUFFER itself.
+        if (advance != 0)
+        {
+            NdisAdvanceNetBufferDataStart(buffer, advance, FALSE, NULL);
+        }
+        absorbed = windivert_classify_callout(context, direction, if_idx,
+            sub_if_idx, isipv4, hop, checksums, advance, buffers, buffer_fst,
+            windivert_meta_hash(meta), timestamp);
+        if (!absorbed && advance != 0)
+        {
+            status = NdisRetreatNetBufferDataStart(buffer, advance, 0, NULL);
+            if (!NT_SUCCESS(status))
+            {
+                // (Should never occur.)  Stop at the advanced position.
+                advance = 0;
+                break;
+            }
+        }
+    }
+    windivert_dispatch_release(table);
+
+    if (absorbed)
+    {
+        result->actionType = FWP_ACTION_BLOCK;
+        result->flags |= FWPS_CLASSIFY_OUT_FLAG_ABSORB;
+        result->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+        return;
+    }
+
+    // No handle takes the packets; continue the entire NET_BUFFER_LIST.
+    if (advance != 0)
+    {
+        NdisAdvanceNetBufferDataStart(buffer, advance, FALSE, NULL);
+    }
+    result->actionType = FWP_ACTION_CONTINUE;
+}
+
+/*
+ * WinDivert classify callout.  Queues a NET_BUFFER_LIST to a handle, given
+ * the first NET_BUFFER that matched the handle's filter.  Returns TRUE if the
+ * packets were absorbed (queued or dropped), or FALSE if they should continue
+ * to lower priority handles.
+ */
+static BOOL windivert_classify_callout(context_t context, UINT8 direction,
+    UINT32 if_idx, UINT32 sub_if_idx, BOOL isipv4, BOOL hop, UINT8 checksums,
+    UINT advance, PNET_BUFFER_LIST buffers, PNET_BUFFER buffer_fst,
+    UINT32 hash, LONGLONG timestamp)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    WDFOBJECT object;
+    work_t work;
+    worker_t worker;
+    PLIST_ENTRY old_entry;
+    UINT8 overload;
+
+    object = (WDFOBJECT)context->object;
+    WdfObjectReference(object);
+
+    // At least one packet matches the filter.  Delay all further processing
+    // until windivert_worker() at IRQL=PASSIVE_LEVEL.  Packets from the same
+    // flow always use the same worker, so that per-flow packet ordering is
+    // preserved.
+    WINDIVERT_STAT_INC(context, WINDIVERT_STAT_MATCHED);
+    worker = context->workers + (hash % context->worker_count);
+    overload = context->overload;
+    if (overload == WINDIVERT_OVERLOAD_BYPASS &&
+        windivert_queue_full(context, worker, 0))
+    {
+        // Fail open: the packet queue has reached its limits, so let the
+        // packets continue unfiltered.  (Racy reads are OK here.)
+        WINDIVERT_STAT_INC(context, WINDIVERT_STAT_BYPASSED);
+        WdfObjectDereference(object);
+        return FALSE;
+    }
+    work = (work_t)windivert_pool_alloc(sizeof(struct work_s));
+    if (work == NULL)
+    {
+        WINDIVERT_STAT_INC(context, WINDIVERT_STAT_DROP_NO_MEMORY);
+        goto windivert_classify_callout_exit;
+    }
+
+    FwpsReferenceNetBufferList(buffers, TRUE);
+    work->buffers = buffers;
+    work->buffer = buffer_fst;
+    work->advance = advance;
+    work->is_ipv4 = isipv4;
+    work->hop = hop;
+    work->checksums = checksums;
+    work->direction = direction;
+    work->if_idx = if_idx;
+    work->sub_if_idx = sub_if_idx;
+    work->priority = context->priority;
+    work->timestamp = timestamp;
+    old_entry = NULL;
+
+    KeAcquireInStackQueuedSpinLock(&worker->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        WdfObjectDereference(object);
+        FwpsDereferenceNetBufferList(buffers, FALSE);
+        windivert_pool_free(work, sizeof(struct work_s));
+        return FALSE;
+    }
+    if (worker->work_queue_length >= WINDIVERT_WORK_QUEUE_LEN_MAX)
+    {
+        if (overload != WINDIVERT_OVERLOAD_DROP_OLDEST)
+        {
+            // The work queue is full; drop or bypass the new packets:
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            FwpsDereferenceNetBufferList(buffers, FALSE);
+            windivert_pool_free(work, sizeof(struct work_s));
+            if (overload == WINDIVERT_OVERLOAD_BYPASS)
+            {
+                WINDIVERT_STAT_INC(context, WINDIVERT_STAT_BYPASSED);
+                WdfObjectDereference(object);
+                return FALSE;
+            }
+            WINDIVERT_STAT_INC(context, WINDIVERT_STAT_DROP_WORK_QUEUE);
+            goto windivert_classify_callout_exit;
+        }
+        old_entry = RemoveHeadList(&worker->work_queue);
+        worker->work_queue_length--;
+    }
+    worker->work_queue_length++;
+    InsertTailList(&worker->work_queue, &work->entry);
+    WdfWorkItemEnqueue(worker->item);
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    if (old_entry != NULL)
+    {
+        WINDIVERT_STAT_INC(context, WINDIVERT_STAT_DROP_WORK_QUEUE);
+        work = CONTAINING_RECORD(old_entry, struct work_s, entry);
+        FwpsDereferenceNetBufferList(work->buffers, FALSE);
+        windivert_pool_free(work, sizeof(struct work_s));
+    }
+
+windivert_classify_callout_exit:
+
+    WdfObjectDereference(object);
+    return TRUE;
+}
+
+/*
+ * WinDivert work item routine for out-of-band filtering.
+ */
+VOID windivert_worker(IN WDFWORKITEM item)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    WDFFILEOBJECT object = (WDFFILEOBJECT)WdfWorkItemGetParentObject(item);
+    PLIST_ENTRY entry;
+    work_t work;
+    context_t context = windivert_context_get(object);
+    worker_t worker = windivert_worker_context_get(item)->worker;
+    PNET_BUFFER_LIST buffers_clone;
+    PNET_BUFFER buffer_itr, buffer_fst;
+    UINT advance;
+    BOOL match, ok, outbound, sniff_mode, verdict_mode, forward;
+    program_t program;
+    struct meta_s meta;
+    NTSTATUS status;
+
+    KeAcquireInStackQueuedSpinLock(&worker->lock, &lock_handle);
+    if (context->state == WINDIVERT_CONTEXT_STATE_OPEN)
+    {
+        sniff_mode = ((context->flags & WINDIVERT_FLAG_SNIFF) != 0);
+        verdict_mode = ((context->flags & WINDIVERT_FLAG_VERDICT) != 0);
+        forward = (context->layer == WINDIVERT_LAYER_NETWORK_FORWARD);
+    }
+    while (context->state == WINDIVERT_CONTEXT_STATE_OPEN &&
+            !IsListEmpty(&worker->work_queue))
+    {
+        entry = RemoveHeadList(&worker->work_queue);
+        worker->work_queue_length--;
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+        work = CONTAINING_RECORD(entry, struct work_s, entry);
+        advance = work->advance;
+        buffer_fst = work->buffer;
+        if (advance != 0)
+        {
+            status = NdisRetreatNetBufferDataStart(buffer_fst, advance, 0,
+                NULL);
+            if (!NT_SUCCESS(status))
+            {
+                advance = 0;
+                goto windivert_worker_complete;
+            }
+        }
+
+        if (!sniff_mode)
+        {
+            // In non-SNIFF mode, reinject all non-matching packets up to the
+            // first matching packet.
+            buffer_itr = NET_BUFFER_LIST_FIRST_NB(work->buffers);
+            while (buffer_itr != buffer_fst)
+            {
+                ok = windivert_reinject_packet(sniff_mode, forward,
+                    work->direction, work->is_ipv4, work->if_idx,
+                    work->sub_if_idx, work->priority, work->buffers,
+                    buffer_itr, NULL);
+                WINDIVERT_STAT_INC(context, (ok? WINDIVERT_STAT_REINJECTED:
+                    WINDIVERT_STAT_DROP_REINJECT));
+                if (!ok)
+                {
+                    goto windivert_worker_complete;
+                }
+                buffer_itr = NET_BUFFER_NEXT_NB(buffer_itr);
+            }
+        }
+        else
+        {
+            // In SNIFF mode, reinject the entire NET_BUFFER_LIST.
+            ok = windivert_reinject_packet(sniff_mode, forward,
+                work->direction, work->is_ipv4, work->if_idx,
+                work->sub_if_idx, work->priority, work->buffers, NULL, NULL);
+            WINDIVERT_STAT_INC(context, (ok? WINDIVERT_STAT_REINJECTED:
+                WINDIVERT_STAT_DROP_REINJECT));
+            if (!ok)
+            {
+                goto windivert_worker_complete;
+            }
+            buffer_itr = buffer_fst;
+        }
+
+        // Queue the first matching packet.
+        ok = windivert_divert_packet(context, worker, work, buffer_itr,
+            sniff_mode, verdict_mode, forward);
+        if (!ok)
+        {
+            goto windivert_worker_complete;
+        }
+        buffer_itr = NET_BUFFER_NEXT_NB(buffer_itr);
+
+        // Queue or re-inject all remaining packets.
+        outbound = (work->direction == WINDIVERT_DIRECTION_OUTBOUND);
+        program = windivert_program_acquire(context);
+        while (buffer_itr != NULL)
+        {
+            match = (windivert_parse(buffer_itr, work->is_ipv4, &meta) &&
+                windivert_filter_meta(&meta, work->if_idx, work->sub_if_idx,
+                    outbound, work->hop, work->checksums, program->filter,
+                    program->flow_cache));
+            WINDIVERT_STAT_INC(context, WINDIVERT_STAT_CLASSIFIED);
+            if (match)
+            {
+                WINDIVERT_STAT_INC(context, WINDIVERT_STAT_MATCHED);
+                match = windivert_sample(context, windivert_meta_hash(&meta),
+                    work->timestamp);
+            }
+            if (match)
+            {
+                ok = windivert_divert_packet(context, worker, work,
+                    buffer_itr, sniff_mode, verdict_mode, forward);
+            }
+            else
+            {
+                ok = windivert_reinject_packet(sniff_mode, forward,
+                    work->direction, work->is_ipv4, work->if_idx,
+                    work->sub_if_idx, work->priority, work->buffers,
+                    buffer_itr, NULL);
+                WINDIVERT_STAT_INC(context, (ok? WINDIVERT_STAT_REINJECTED:
+                    WINDIVERT_STAT_DROP_REINJECT));
+            }
+            if (!ok)
+            {
+                break;
+            }
+            buffer_itr = NET_BUFFER_NEXT_NB(buffer_itr);
+        }
+        windivert_program_release(program);
+
+windivert_worker_complete:
+        if (advance != 0)
+        {
+            NdisAdvanceNetBufferDataStart(work->buffer, advance, 0, 0);
+        }
+        FwpsDereferenceNetBufferList(work->buffers, FALSE);
+        windivert_pool_free(work, sizeof(struct work_s));
+        KeAcquireInStackQueuedSpinLock(&worker->lock, &lock_handle);
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+}
+
+/*
+ * WinDivert divert a matching packet from a work item.  In VERDICT mode the
+ * packet is also held until user mode returns a verdict for its ID.  Returns
+ * FALSE if the rest of the work item should not be processed.
+ */
+static BOOL windivert_divert_packet(context_t context, worker_t worker,
+    work_t work, PNET_BUFFER buffer, BOOL sniff_mode, BOOL verdict_mode,
+    BOOL forward)
+{
+    UINT64 id = 0;
+    BOOL ok;
+
+    if (windivert_ring_bypass(context, work, buffer, sniff_mode, forward,
+            &ok))
+    {
+        return ok;
+    }
+    if (verdict_mode)
+    {
+        id = windivert_verdict_retain(context, worker, work, buffer);
+        if (id == 0)
+        {
+            // No verdict can release a packet that is not held, so let it
+            // continue unfiltered rather than lose it.
+            ok = windivert_reinject_packet(FALSE, forward, work->direction,
+                work->is_ipv4, work->if_idx, work->sub_if_idx,
+                work->priority, work->buffers, buffer, NULL);
+            WINDIVERT_STAT_INC(context, (ok? WINDIVERT_STAT_BYPASSED:
+                WINDIVERT_STAT_DROP_REINJECT));
+            return ok;
+        }
+    }
+    return windivert_queue_packet(context, worker, buffer, work->direction,
+        work->if_idx, work->sub_if_idx, id, work->is_ipv4, work->hop,
+        work->checksums, work->timestamp);
+}
+
+/*
+ * WinDivert flow hash of a parsed packet's addresses, protocol and ports.
+ * Used to pick a worker so that packets from the same flow are processed in
+ * order, and for per-flow rate limiting.
+ */
+static UINT32 windivert_meta_hash(meta_t meta)
+{
+    struct iphdr *ip_header =
+        (struct iphdr *)meta->hdrs[WINDIVERT_FILTER_PROTOCOL_IP];
+    struct ipv6hdr *ipv6_header =
+        (struct ipv6hdr *)meta->hdrs[WINDIVERT_FILTER_PROTOCOL_IPV6];
+    UINT8 *ports_header = meta->hdrs[WINDIVERT_FILTER_PROTOCOL_TCP];
+    UINT32 hash, ports = 0;
+
+    if (!meta->valid)
+    {
+        return 0;
+    }
+    if (ports_header == NULL)
+    {
+        ports_header = meta->hdrs[WINDIVERT_FILTER_PROTOCOL_UDP];
+    }
+    if (ip_header != NULL)
+    {
+        hash = ip_header->SrcAddr ^ ip_header->DstAddr ^ ip_header->Protocol;
+        if (ports_header != NULL && IPHDR_GET_FRAGOFF(ip_header) == 0 &&
+            IPHDR_GET_MF(ip_header) == 0)
+        {
+            ports = *(UINT32 *)ports_header;
+        }
+    }
+    else
+    {
+        hash = ipv6_header->SrcAddr[0] ^ ipv6_header->SrcAddr[1] ^
+            ipv6_header->SrcAddr[2] ^ ipv6_header->SrcAddr[3] ^
+            ipv6_header->DstAddr[0] ^ ipv6_header->DstAddr[1] ^
+            ipv6_header->DstAddr[2] ^ ipv6_header->DstAddr[3] ^
+            ipv6_header->NextHdr;
+        if (ports_header != NULL &&
+            (ipv6_header->NextHdr == IPPROTO_TCP ||
+             ipv6_header->NextHdr == IPPROTO_UDP))
+        {
+            ports = *(UINT32 *)ports_header;
+        }
+    }
+    hash ^= ports;
+    hash *= 0x9E3779B1;
+    return hash ^ (hash >> 16);
+}
+
+/*
+ * WinDivert sampling and rate limiting of a matching packet.  Returns FALSE
+ * if the packet should be skipped, i.e. treated as if it did not match.
+ * Only SNIFF handles enable either, see IOCTL_WINDIVERT_SET_PARAM.  The hash
+ * is the packet's windivert_meta_hash().
+ */
+static BOOL windivert_sample(context_t context, UINT32 hash,
+    LONGLONG timestamp)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    struct rate_s *rate;
+    LONGLONG counts_per_sec, max_tokens, elapsed;
+    ULONG sample_rate, rate_limit;
+    UINT32 count;
+    BOOL keep;
+
+    // (Racy reads are OK here.)
+    sample_rate = context->sample_rate;
+    rate_limit = context->rate_limit;
+    if (sample_rate > 1)
+    {
+        count = (UINT32)InterlockedIncrement(&context->sample_count);
+        if (context->sample_mode == WINDIVERT_SAMPLE_MODE_RANDOM)
+        {
+            // Mix the counter with the timestamp's low bits, so packets are
+            // kept independently of their position in the stream.
+            count ^= (UINT32)timestamp;
+            count *= 0x9E3779B1;
+            count ^= (count >> 15);
+            count *= 0x85EBCA6B;
+            count ^= (count >> 13);
+        }
+        if (count % sample_rate != 0)
+        {
+            WINDIVERT_STAT_INC(context, WINDIVERT_STAT_SAMPLED_OUT);
+            return FALSE;
+        }
+    }
+    if (rate_limit == 0)
+    {
+        return TRUE;
+    }
+
+    // Token bucket: the bucket refills at rate_limit packets per second and
+    // holds at most one second's worth of packets.
+    rate = context->rates;
+    if (context->rate_mode == WINDIVERT_RATE_MODE_PER_FLOW)
+    {
+        rate += hash % WINDIVERT_RATE_BUCKETS;
+    }
+    counts_per_sec = counts_per_ms * 1000;
+    max_tokens = counts_per_sec * rate_limit;
+    KeAcquireInStackQueuedSpinLock(&rate->lock, &lock_handle);
+    elapsed = timestamp - rate->timestamp;
+    if (elapsed > 0)
+    {
+        // (Packets from different CPUs may arrive slightly out of order, so
+        //  only move forward in time.)
+        rate->tokens = (elapsed >= counts_per_sec? max_tokens:
+            rate->tokens + elapsed * rate_limit);
+        rate->timestamp = timestamp;
+    }
+    rate->tokens = (rate->tokens > max_tokens? max_tokens: rate->tokens);
+    keep = (rate->tokens >= counts_per_sec);
+    if (keep)
+    {
+        rate->tokens -= counts_per_sec;
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    if (!keep)
+    {
+        WINDIVERT_STAT_INC(context, WINDIVERT_STAT_RATE_LIMITED);
+    }
+    return keep;
+}
+
+/*
+ * Raise a peak value to at least the given value.
+ */
+static void windivert_stat_peak(volatile LONG *peak, LONG value)
+{
+    LONG old = *peak, prev;
+
+    while (value > old)
+    {
+        prev = InterlockedCompareExchange(peak, value, old);
+        if (prev == old)
+        {
+            break;
+        }
+        old = prev;
+    }
+}
+
+/*
+ * Record the latency from capture timestamp t0 to t1 in a histogram.  Zero or
+ * future timestamps (e.g. from user mode) are ignored.
+ */
+static void windivert_stat_latency(volatile LONG64 *histogram, LONGLONG t0,
+    LONGLONG t1)
+{
+    UINT64 us;
+    UINT bucket;
+
+    if (t0 <= 0 || t0 > t1)
+    {
+        return;
+    }
+    us = (UINT64)(t1 - t0) * 1000 / (UINT64)counts_per_ms;
+    for (bucket = 0; us != 0 && bucket < WINDIVERT_LATENCY_BUCKETS - 1;
+            bucket++)
+    {
+        us >>= 1;
+    }
+    InterlockedIncrement64(&histogram[bucket]);
+}
+
+/*
+ * Sum the per-CPU statistics of a context into a WINDIVERT_STATS layout.
+ */
+static void windivert_get_stats(context_t context, UINT64 *stats)
+{
+    UINT i, j, k;
+
+    for (i = 0; i < WINDIVERT_STAT_MAX; i++)
+    {
+        stats[i] = 0;
+        for (j = 0; j < WINDIVERT_STATS_SLOTS; j++)
+        {
+            // (Atomic read, the counters are 64-bit even on x86).
+            stats[i] += (UINT64)InterlockedCompareExchange64(
+                &context->stats[j].count[i], 0, 0);
+        }
+    }
+    stats[i++] = (UINT64)context->packet_queue_length;
+    stats[i++] = (UINT64)context->packet_queue_peak_length;
+    stats[i++] = (UINT64)context->packet_queue_size;
+    stats[i++] = (UINT64)context->packet_queue_peak_size;
+    for (j = 0; j < WINDIVERT_LATENCY_BUCKETS; j++, i++)
+    {
+        stats[i] = stats[i + WINDIVERT_LATENCY_BUCKETS] = 0;
+        for (k = 0; k < WINDIVERT_STATS_SLOTS; k++)
+        {
+            stats[i] += (UINT64)InterlockedCompareExchange64(
+                &context->stats[k].read_latency[j], 0, 0);
+            stats[i + WINDIVERT_LATENCY_BUCKETS] +=
+                (UINT64)InterlockedCompareExchange64(
+                    &context->stats[k].inject_latency[j], 0, 0);
+        }
+    }
+}
+
+/*
+ * Check whether a packet of the given length would overflow the packet
+ * queue.  Depending on the queue mode, the limits apply to the total over all
+ * workers or to each worker's queue.  The worker's lock must be held.
+ */
+static BOOL windivert_queue_full(context_t context, worker_t worker,
+    UINT data_len)
+{
+    ULONG length, size;
+
+    if (context->packet_queue_mode == WINDIVERT_QUEUE_MODE_PER_CPU)
+    {
+        length = worker->packet_queue_length;
+        size = worker->packet_queue_size;
+    }
+    else
+    {
+        length = (ULONG)context->packet_queue_length;
+        size = (ULONG)context->packet_queue_size;
+    }
+    return (size + data_len > context->packet_queue_maxsize ||
+            length + 1 > context->packet_queue_maxlength);
+}
+
+/*
+ * Queue a NET_BUFFER.
+ */
+static BOOL windivert_queue_packet(context_t context, worker_t worker,
+    PNET_BUFFER buffer, UINT8 direction, UINT32 if_idx, UINT32 sub_if_idx,
+    UINT64 id, BOOL is_ipv4, BOOL hop, UINT8 checksums, LONGLONG timestamp0)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    PVOID data;
+    WDFREQUEST request;
+    PLIST_ENTRY entry, old_entry;
+    packet_t packet, old_packet;
+    UINT data_len;
+    ULONG snap_len;
+    LONGLONG timestamp;
+    BOOL timeout, ring;
+
+    // First we attempt to immediately service a read request directly without
+    // queuing the packet.  This helps reduce overhead where possible.  Only
+    // this worker's queue needs to be empty, since packets from one flow
+    // are always queued by the same worker.  With read coalescing the
+    // packet is always queued, so windivert_read_hold() can decide.
+    timeout = FALSE;
+    request = NULL;
+    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    KeAcquireInStackQueuedSpinLock(&worker->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        return FALSE;
+    }
+    if ((context->flags & WINDIVERT_FLAG_DROP) != 0)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        return TRUE;
+    }
+    timeout = WINDIVERT_TIMEOUT(context, timestamp0, timestamp);
+    ring = (context->rx_ring != NULL);
+    snap_len = context->snap_len;
+    if (!timeout && !ring && context->batch_count <= 1 &&
+        IsListEmpty(&worker->packet_queue))
+    {
+        request = windivert_read_request(context, worker);
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    if (timeout)
+    {
+        WINDIVERT_STAT_INC(context, WINDIVERT_STAT_DROP_TIMEOUT);
+        return TRUE;
+    }
+    if (ring)
+    {
+        // RING PATH: Write the packet directly into the shared RX ring.  The
+        // ring is only unmapped once the context is closing.
+        return windivert_ring_put(context, buffer, direction, if_idx,
+            sub_if_idx, id, timestamp0, hop, checksums);
+    }
+    if (request != NULL)
+    {
+        // FAST PATH: Service an I/O request without queueing the packet.
+        WINDIVERT_STAT_INC(context, WINDIVERT_STAT_FAST_PATH);
+        WINDIVERT_STAT_LATENCY(context, read_latency, timestamp0, timestamp);
+        windivert_read_service_request(NULL, buffer, direction, if_idx,
+            sub_if_idx, id, timestamp0, hop, checksums, snap_len, request);
+        return TRUE;
+    }
+
+    // SLOW PATH: queue the packet.  Only the first snap_len bytes are
+    // copied and counted against the queue size.
+    data_len = WINDIVERT_SNAP_LEN(NET_BUFFER_DATA_LENGTH(buffer), snap_len);
+    packet = (packet_t)windivert_pool_alloc(WINDIVERT_PACKET_SIZE(data_len));
+    if (packet == NULL)
+    {
+        WINDIVERT_STAT_INC(context, WINDIVERT_STAT_DROP_NO_MEMORY);
+        return FALSE;
+    }
+    packet->data = (char *)(packet + 1);
+    packet->data_len = data_len;
+    data = NdisGetDataBuffer(buffer, data_len, NULL, 1, 0);
+    if (data == NULL)
+    {
+        NdisGetDataBuffer(buffer, data_len, packet->data, 1, 0);
+    }
+    else
+    {
+        RtlCopyMemory(packet->data, data, data_len);
+    }
+    packet->is_ipv4 = is_ipv4;
+    packet->hop = hop;
+    packet->checksums = checksums;
+    packet->direction = direction;
+    packet->if_idx = if_idx;
+    packet->sub_if_idx = sub_if_idx;
+    packet->id = id;
+    packet->timestamp = timestamp0;
+    packet->length = NET_BUFFER_DATA_LENGTH(buffer);
+    entry = &packet->entry;
+
+    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    KeAcquireInStackQueuedSpinLock(&worker->lock, &lock_handle);
+    while (TRUE)
+    {
+        if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+        {
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            windivert_free_packet(packet);
+            return FALSE;
+        }
+        if (data_len > context->packet_queue_maxsize)
+        {
+            // (Corner case) the packet is larger than the max queue size:
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            WINDIVERT_STAT_INC(context, WINDIVERT_STAT_DROP_QUEUE_FULL);
+            windivert_free_packet(packet);
+            return TRUE;
+        }
+        timeout = WINDIVERT_TIMEOUT(context, packet->timestamp, timestamp);
+        if (timeout)
+        {
+            // (Corner case) the packet has already expired:
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            WINDIVERT_STAT_INC(context, WINDIVERT_STAT_DROP_TIMEOUT);
+            windivert_free_packet(packet);
+            return TRUE;
+        }
+
+        if (windivert_queue_full(context, worker, data_len))
+        {
+            if (IsListEmpty(&worker->packet_queue) ||
+                context->overload != WINDIVERT_OVERLOAD_DROP_OLDEST)
+            {
+                // Drop the new packet.  This is also the case if the queue
+                // is full of other workers' packets, or in bypass mode (the
+                // packet has already been absorbed).
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                DEBUG("DROP: packet queue is full, dropping packet");
+                WINDIVERT_STAT_INC(context, WINDIVERT_STAT_DROP_QUEUE_FULL);
+                windivert_free_packet(packet);
+                return TRUE;
+            }
+
+            // The queue is full; drop a packet & try again:
+            old_entry = RemoveHeadList(&worker->packet_queue);
+            old_packet = CONTAINING_RECORD(old_entry, struct packet_s, entry);
+            WINDIVERT_QUEUE_REMOVE(context, worker, old_packet->data_len);
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            DEBUG("DROP: packet queue is full, dropping packet");
+            WINDIVERT_STAT_INC(context, WINDIVERT_STAT_DROP_QUEUE_FULL);
+            windivert_free_packet(old_packet);
+            timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+            KeAcquireInStackQueuedSpinLock(&worker->lock, &lock_handle);
+            continue;
+        }
+        else
+        {
+            // Queue the packet:
+            InsertTailList(&worker->packet_queue, entry);
+            WINDIVERT_QUEUE_INSERT(context, worker, data_len);
+            WINDIVERT_STAT_INC(context, WINDIVERT_STAT_QUEUED);
             break;
+        }
     }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
 
-windivert_ioctl_exit:
-    WdfRequestComplete(request, status);
-}
+    DEBUG("PACKET: diverting packet (packet=%p)", packet);
 
-/*
- * WinDivert notify callout.
- */
-static NTSTATUS windivert_notify_callout(IN FWPS_CALLOUT_NOTIFY_TYPE type,
-    IN const GUID *filter_key, IN const FWPS_FILTER0 *filter)
-{
-    UNREFERENCED_PARAMETER(type);
-    UNREFERENCED_PARAMETER(filter_key);
-    UNREFERENCED_PARAMETER(filter);
-    return STATUS_SUCCESS;
-}
+    // Service any pending I/O request.
+    windivert_read_service(context, worker);
 
-/*
- * WinDivert classify outbound IPv4 callout.
- */
-static void windivert_classify_outbound_network_v4_callout(
-    IN const FWPS_INCOMING_VALUES0 *fixed_vals,
-    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
-    const FWPS_FILTER0 *filter, IN UINT64 flow_context,
-    OUT FWPS_CLASSIFY_OUT0 *result)
-{
-    windivert_classify_callout((context_t)filter->context,
-        WINDIVERT_DIRECTION_OUTBOUND,
-        fixed_vals->incomingValue[
-            FWPS_FIELD_OUTBOUND_IPPACKET_V4_INTERFACE_INDEX].value.uint32,
-        fixed_vals->incomingValue[
-            FWPS_FIELD_OUTBOUND_IPPACKET_V4_SUB_INTERFACE_INDEX].value.uint32,
-        TRUE,
-        (fixed_vals->incomingValue[
-            FWPS_FIELD_OUTBOUND_IPPACKET_V4_FLAGS].value.uint32 &
-            FWP_CONDITION_FLAG_IS_LOOPBACK) != 0,
-        0, data, flow_context, result);
+    return TRUE;
 }
 
 /*
- * WinDivert classify outbound IPv6 callout.
+ * Re-inject a packet or packets.
  */
-static void windivert_classify_outbound_network_v6_callout(
-    IN const FWPS_INCOMING_VALUES0 *fixed_vals,
-    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
-    const FWPS_FILTER0 *filter, IN UINT64 flow_context,
-    OUT FWPS_CLASSIFY_OUT0 *result)
+static BOOL windivert_reinject_packet(BOOL sniff_mode, BOOL forward,
+    UINT8 direction, BOOL isipv4, UINT32 if_idx, UINT32 sub_if_idx,
+    UINT32 priority, PNET_BUFFER_LIST buffers, PNET_BUFFER buffer,
+    packet_t packet)
 {
-    windivert_classify_callout((context_t)filter->context,
-        WINDIVERT_DIRECTION_OUTBOUND,
-        fixed_vals->incomingValue[
-            FWPS_FIELD_OUTBOUND_IPPACKET_V6_INTERFACE_INDEX].value.uint32,
-        fixed_vals->incomingValue[
-            FWPS_FIELD_OUTBOUND_IPPACKET_V6_SUB_INTERFACE_INDEX].value.uint32,
-        FALSE,
-        (fixed_vals->incomingValue[
-            FWPS_FIELD_OUTBOUND_IPPACKET_V6_FLAGS].value.uint32 &
-            FWP_CONDITION_FLAG_IS_LOOPBACK) != 0,
-        0, data, flow_context, result);
-}
+    PNET_BUFFER_LIST buffers_cpy;
+    BOOL clone;
+    PMDL mdl = NULL;
+    PVOID data = NULL;
+    FWPS_INJECT_COMPLETE0 completion;
+    HANDLE compl_handle, handle;
+    NTSTATUS status;
 
-/*
- * WinDivert classify inbound IPv4 callout.
- */
-static void windivert_classify_inbound_network_v4_callout(
-    IN const FWPS_INCOMING_VALUES0 *fixed_vals,
-    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
-    const FWPS_FILTER0 *filter, IN UINT64 flow_context,
-    OUT FWPS_CLASSIFY_OUT0 *result)
-{
-    UINT advance = meta_vals->ipHeaderSize;
-    windivert_classify_callout((context_t)filter->context,
-        WINDIVERT_DIRECTION_INBOUND,
-        fixed_vals->incomingValue[
-            FWPS_FIELD_INBOUND_IPPACKET_V4_INTERFACE_INDEX].value.uint32,
-        fixed_vals->incomingValue[
-            FWPS_FIELD_INBOUND_IPPACKET_V4_SUB_INTERFACE_INDEX].value.uint32,
-        TRUE,
-        (fixed_vals->incomingValue[
-            FWPS_FIELD_INBOUND_IPPACKET_V4_FLAGS].value.uint32 &
-            FWP_CONDITION_FLAG_IS_LOOPBACK) != 0,
-        advance, data, flow_context, result);
+    if (buffer != NULL)
+    {
+        // Re-inject a specific packet.  Not applicable for SNIFF mode.
+        if (sniff_mode)
+        {
+            return TRUE;
+        }
+        status = FwpsAllocateNetBufferAndNetBufferList0(nbl_pool_handle, 0, 0,
+            NET_BUFFER_FIRST_MDL(buffer), NET_BUFFER_DATA_OFFSET(buffer),
+            NET_BUFFER_DATA_LENGTH(buffer), &buffers_cpy);
+        if (!NT_SUCCESS(status))
+        {
+            DEBUG_ERROR("failed to create NET_BUFFER_LIST for injected packet",
+                status);
+            return FALSE;
+        }
+        if (forward || direction == WINDIVERT_DIRECTION_OUTBOUND)
+        {
+            NdisCopySendNetBufferListInfo(buffers_cpy, buffers);
+        }
+        else
+        {
+            NdisCopyReceiveNetBufferListInfo(buffers_cpy, buffers);
+        }
+        clone = FALSE;
+        completion = windivert_reinject_complete;
+        compl_handle = (HANDLE)buffers;
+        FwpsReferenceNetBufferList(buffers, TRUE);
+    }
+    else if (buffers != NULL)
+    {
+        // Re-inject all packets for SNIFF mode.
+        status = FwpsAllocateCloneNetBufferList0(buffers, nbl_pool_handle,
+            nb_pool_handle, 0, &buffers_cpy);
+        if (!NT_SUCCESS(status))
+        {
+            DEBUG_ERROR("failed to clone NET_BUFFER_LIST for injected packets",
+                status);
+            return FALSE;
+        }
+        clone = TRUE;
+        completion = windivert_reinject_clone_complete;
+        compl_handle = (HANDLE)buffers;
+        FwpsReferenceNetBufferList(buffers, TRUE);
+    }
+    else if (packet != NULL)
+    {
+        // Re-inject a packet_t for cleanup.
+        if (sniff_mode)
+        {
+            return TRUE;        // Already re-injected.
+        }
+        data = windivert_pool_alloc(packet->data_len);
+        if (data == NULL)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            DEBUG_ERROR("failed to allocate memory for injected packet data",
+                status);
+            return FALSE;
+        }
+        RtlCopyMemory(data, packet->data, packet->data_len);
+        mdl = IoAllocateMdl(data, packet->data_len, FALSE, FALSE, NULL);
+        if (mdl == NULL)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            DEBUG_ERROR("failed to allocate MDL for injected packet", status);
+            windivert_pool_free(data, packet->data_len);
+            return FALSE;
+        }
+        MmBuildMdlForNonPagedPool(mdl);
+        status = FwpsAllocateNetBufferAndNetBufferList0(nbl_pool_handle, 0, 0,
+            mdl, 0, packet->data_len, &buffers_cpy);
+        if (!NT_SUCCESS(status))
+        {
+            DEBUG_ERROR("failed to create NET_BUFFER_LIST for injected packet",
+                status);
+            IoFreeMdl(mdl);
+            windivert_pool_free(data, packet->data_len);
+            return FALSE;
+        }
+        clone = FALSE;
+        completion = windivert_inject_complete;
+        compl_handle = (HANDLE)NULL;
+    }
+    else
+        return TRUE;
+
+    handle = (isipv4? inject_handle: injectv6_handle);
+    if (forward)
+    {
+        status = FwpsInjectForwardAsync0(handle, (HANDLE)priority, 0,
+            (isipv4? AF_INET: AF_INET6), UNSPECIFIED_COMPARTMENT_ID,
+            if_idx, buffers_cpy, completion, compl_handle);
+    }
+    else if (direction == WINDIVERT_DIRECTION_OUTBOUND)
+    {
+        status = FwpsInjectNetworkSendAsync0(handle,
+            (HANDLE)priority, 0, UNSPECIFIED_COMPARTMENT_ID, buffers_cpy,
+            completion, compl_handle);
+    }
+    else
+    {
+        status = FwpsInjectNetworkReceiveAsync0(handle, 
+            (HANDLE)priority, 0, UNSPECIFIED_COMPARTMENT_ID, if_idx,
+            sub_if_idx, buffers_cpy, completion, compl_handle);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to (re)inject packet(s)", status);
+        if (clone)
+        {
+            FwpsFreeNetBufferList0(buffers_cpy);
+        }
+        else
+        {
+            FwpsFreeCloneNetBufferList0(buffers_cpy, 0);
+        }
+        if (buffers != NULL)
+        {
+            FwpsDereferenceNetBufferList(buffers, FALSE);
+        }
+        if (mdl != NULL)
+        {
+            IoFreeMdl(mdl);
+        }
+        if (data != NULL)
+        {
+            windivert_pool_free(data, packet->data_len);
+        }
+    }
+
+    return TRUE;
 }
 
 /*
- * WinDivert classify inbound IPv6 callout.
+ * WinDivert (re)inject complete.
  */
-static void windivert_classify_inbound_network_v6_callout(
-    IN const FWPS_INCOMING_VALUES0 *fixed_vals,
-    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
-    const FWPS_FILTER0 *filter, IN UINT64 flow_context,
-    OUT FWPS_CLASSIFY_OUT0 *result)
+static void NTAPI windivert_reinject_complete(VOID *context,
+    NET_BUFFER_LIST *buffers_cpy, BOOLEAN dispatch_level)
 {
-    UINT advance = meta_vals->ipHeaderSize;
-    windivert_classify_callout((context_t)filter->context,
-        WINDIVERT_DIRECTION_INBOUND,
-        fixed_vals->incomingValue[
-            FWPS_FIELD_INBOUND_IPPACKET_V6_INTERFACE_INDEX].value.uint32,
-        fixed_vals->incomingValue[
-            FWPS_FIELD_INBOUND_IPPACKET_V6_SUB_INTERFACE_INDEX].value.uint32,
-        FALSE,
-        (fixed_vals->incomingValue[
-            FWPS_FIELD_INBOUND_IPPACKET_V6_FLAGS].value.uint32 &
-            FWP_CONDITION_FLAG_IS_LOOPBACK) != 0,
-        advance, data, flow_context, result);
+    PNET_BUFFER_LIST buffers = (PNET_BUFFER_LIST)context;
+    FwpsFreeNetBufferList0(buffers_cpy);
+    FwpsDereferenceNetBufferList(buffers, dispatch_level);
 }
 
 /*
- * WinDivert classify forward IPv4 callout.
+ * WinDivert (re)inject complete.
  */
-static void windivert_classify_forward_network_v4_callout(
-    IN const FWPS_INCOMING_VALUES0 *fixed_vals,
-    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
-    const FWPS_FILTER0 *filter, IN UINT64 flow_context,
-    OUT FWPS_CLASSIFY_OUT0 *result)
+static void NTAPI windivert_reinject_clone_complete(VOID *context,
+    NET_BUFFER_LIST *buffers_cpy, BOOLEAN dispatch_level)
 {
-    windivert_classify_callout((context_t)filter->context,
-        WINDIVERT_DIRECTION_OUTBOUND,
-        fixed_vals->incomingValue[
-            FWPS_FIELD_IPFORWARD_V4_DESTINATION_INTERFACE_INDEX].value.uint32,
-        0, TRUE, FALSE, 0, data, flow_context, result);
+    PNET_BUFFER_LIST buffers = (PNET_BUFFER_LIST)context;
+    FwpsFreeCloneNetBufferList0(buffers_cpy, 0);
+    FwpsDereferenceNetBufferList(buffers, dispatch_level);
 }
 
 /*
- * WinDivert classify forward IPv6 callout.
+ * Free a packet.
  */
-static void windivert_classify_forward_network_v6_callout(
-    IN const FWPS_INCOMING_VALUES0 *fixed_vals,
-    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
-    const FWPS_FILTER0 *filter, IN UINT64 flow_context,
-    OUT FWPS_CLASSIFY_OUT0 *result)
+static void windivert_free_packet(packet_t packet)
 {
-    windivert_classify_callout((context_t)filter->context,
-        WINDIVERT_DIRECTION_OUTBOUND,
-        fixed_vals->incomingValue[
-            FWPS_FIELD_IPFORWARD_V6_DESTINATION_INTERFACE_INDEX].value.uint32,
-        0, FALSE, FALSE, 0, data, flow_context, result);
+    windivert_pool_free(packet, WINDIVERT_PACKET_SIZE(packet->data_len));
 }
 
 /*
- * WinDivert classify callout.
+ * Skip well-known IPv6 extension headers.
  */
-static void windivert_classify_callout(context_t context, IN UINT8 direction,
-    IN UINT32 if_idx, IN UINT32 sub_if_idx, IN BOOL isipv4, IN BOOL loopback,
-    IN UINT advance, IN OUT void *data, IN UINT64 flow_context,
-    OUT FWPS_CLASSIFY_OUT0 *result)
+static UINT8 windivert_skip_headers(UINT8 proto, UINT8 **header, size_t *len)
 {
-    KLOCK_QUEUE_HANDLE lock_handle;
-    FWPS_PACKET_INJECTION_STATE packet_state;
-    HANDLE packet_context;
-    UINT32 priority, packet_priority;
-    PNET_BUFFER_LIST buffers;
-    PNET_BUFFER buffer, buffer_fst, buffer_itr;
-    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO checksums_info;
-    UINT8 checksums;
-    BOOL outbound, hop;
-    WDFOBJECT object;
-    work_t work;
-    PLIST_ENTRY old_entry;
-    filter_t filter;
-    LONGLONG timestamp;
-    NTSTATUS status;
-
-    // Basic checks:
-    if (!(result->rights & FWPS_RIGHT_ACTION_WRITE) || data == NULL)
-    {
-        return;
-    }
+    size_t hdrlen;
 
-    buffers = (PNET_BUFFER_LIST)data;
-    buffer = NET_BUFFER_LIST_FIRST_NB(buffers);
-    if (NET_BUFFER_LIST_NEXT_NBL(buffers) != NULL)
-    {
-        // This is a fragment group.  This can be ignored since each fragment
-        // should have already been indicated.
-        result->actionType = FWP_ACTION_CONTINUE;
-        return;
-    }
-    if (isipv4)
-    {
-        packet_state = FwpsQueryPacketInjectionState0(inject_handle, buffers,
-            &packet_context);
-    }
-    else
+    while (TRUE)
     {
-        packet_state = FwpsQueryPacketInjectionState0(injectv6_handle,
-            buffers, &packet_context);
-    }
+        if (*len <= 2)
+        {
+            return IPPROTO_NONE;
+        }
 
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
-    {
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        result->actionType = FWP_ACTION_CONTINUE;
-        return;
-    }
-    priority = context->priority;
-    filter = context->filter;
-    object = (WDFOBJECT)context->object;
-    WdfObjectReference(object);
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
+        hdrlen = (size_t)*(*header + 1);
+        switch (proto)
+        {
+            case IPPROTO_FRAGMENT:
+                hdrlen = 8;
+                break;
+            case IPPROTO_AH:
+                hdrlen += 2;
+                hdrlen *= 4;
+                break;
+            case IPPROTO_HOPOPTS:
+            case IPPROTO_DSTOPTS:
+            case IPPROTO_ROUTING:
+                hdrlen++;
+                hdrlen *= 8;
+                break;
+            case IPPROTO_NONE:
+                return proto;
+            default:
+                return proto;
+        }
 
-    hop = FALSE;
-    if (packet_state == FWPS_PACKET_INJECTED_BY_SELF ||
-        packet_state == FWPS_PACKET_PREVIOUSLY_INJECTED_BY_SELF)
-    {
-        packet_priority = (UINT32)packet_context;
-        if (packet_priority >= priority)
+        if (hdrlen >= *len)
         {
-            WdfObjectDereference(object);
-            result->actionType = FWP_ACTION_CONTINUE;
-            return;
+            return IPPROTO_NONE;
         }
-    }
-    else if (packet_state == FWPS_PACKET_INJECTED_BY_OTHER)
-    {
-        // This is a packet injected by another driver, possibly an older
-        // version of WinDivert.  To prevent block-clone-reinject infinite
-        // loops, we consider this capture to be a "hop".
-        hop = TRUE;
-    }
 
-    // Loopback packets are considered outbound only.
-    if (loopback && direction == WINDIVERT_DIRECTION_INBOUND)
-    {
-        WdfObjectDereference(object);
-        result->actionType = FWP_ACTION_CONTINUE;
-        return;
+        proto = **header;
+        *header += hdrlen;
+        *len -= hdrlen;
     }
+}
 
-    // Determine which checksum fields are present or not.
-    if (loopback)
-    {
-        // Loopback packets appear to have bogus checksums, so do not trust.
-        checksums = 0;
-    }
-    else if (direction == WINDIVERT_DIRECTION_OUTBOUND)
+/*
+ * Zero the IP/TCP/UDP checksums and/or decrement the TTL (if required)
+ */
+static NTSTATUS windivert_finalize_packet(void *header, size_t len,
+    BOOL hop, UINT8 checksums)
+{
+    struct iphdr *ip_header = (struct iphdr *)header;
+    struct ipv6hdr *ipv6_header = (struct ipv6hdr *)header;
+    size_t ip_header_len, trans_len; 
+    void *trans_header;
+    struct tcphdr *tcp_header;
+    struct udphdr *udp_header;
+    UINT8 proto;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (checksums == WINDIVERT_ALL_CHECKSUMS && !hop)
     {
-        checksums_info.Value = NET_BUFFER_LIST_INFO(buffers,
-            TcpIpChecksumNetBufferListInfo);
-        checksums =
-            (isipv4? 0: WINDIVERT_IP_CHECKSUM) |
-            (checksums_info.Transmit.TcpChecksum? 0: WINDIVERT_TCP_CHECKSUM) |
-            (checksums_info.Transmit.UdpChecksum? 0: WINDIVERT_UDP_CHECKSUM);
+        return status;
     }
-    else
+    if (len < sizeof(struct iphdr))
     {
-        checksums = WINDIVERT_ALL_CHECKSUMS;
+        return status;
     }
-    if (hop && isipv4)
+
+    switch (ip_header->Version)
     {
-        checksums &= ~WINDIVERT_IP_CHECKSUM;
-    }
+        case 4:
+            ip_header_len = ip_header->HdrLength*sizeof(UINT32);
+            if (len < ip_header_len)
+            {
+                return status;
+            }
 
-    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+            if (hop)
+            {
+                if (ip_header->TTL <= 1)
+                {
+                    status = STATUS_HOPLIMIT_EXCEEDED;
+                }
+                if (ip_header->TTL != 0)
+                {
+                    ip_header->TTL--;
+                }
+            }
 
-    // Retreat the NET_BUFFER to the IP header, if necessary.
-    // If (advance != 0) then this must be in the inbound path, and the
-    // NET_BUFFER_LIST must contain exactly one NET_BUFFER.
-    if (advance != 0)
-    {
-        status = NdisRetreatNetBufferDataStart(buffer, advance, 0, NULL);
-        if (!NT_SUCCESS(status))
-        {
-            WdfObjectDereference(object);
-            result->actionType = FWP_ACTION_CONTINUE;
-            return;
-        }
-    }
+            if ((checksums & WINDIVERT_IP_CHECKSUM) != 0)
+            {
+                ip_header->Checksum = 0;
+            }
+            proto = ip_header->Protocol;
+            trans_len = len - ip_header_len;
+            trans_header = (UINT8 *)ip_header + ip_header_len;
+            break;
 
-    /*
-     * This code is complicated by the fact the a single NET_BUFFER_LIST
-     * may contain several NET_BUFFER structures.  Each NET_BUFFER needs to
-     * be filtered independently.  To achieve this we do the following:
-     * 1) First check if any NET_BUFFER passes the filter.
-     * 2) If no, then CONTINUE the entire NET_BUFFER_LIST.
-     * 3) Else, split the NET_BUFFER_LIST into individual NET_BUFFERs; and
-     *    either queue or re-inject based on the filter.  This step is done
-     *    out-of-band, see windivert_worker().
-     */
+        case 6:
+            if (len < sizeof(struct ipv6hdr))
+            {
+                return status;
+            }
+            
+            if (hop)
+            {
+                if (ipv6_header->HopLimit <= 1)
+                {
+                    status = STATUS_HOPLIMIT_EXCEEDED;
+                }
+                if (ipv6_header->HopLimit != 0)
+                {
+                    ipv6_header->HopLimit--;
+                }
+            }
 
-    // Find the first NET_BUFFER we need to queue:
-    buffer_fst = buffer;
-    outbound = (direction == WINDIVERT_DIRECTION_OUTBOUND);
-    do
+            trans_len = len - sizeof(struct ipv6hdr);
+            trans_header = (UINT8 *)(ipv6_header + 1);
+
+            // Skip extension headers:
+            proto = windivert_skip_headers(ipv6_header->NextHdr,
+                (UINT8 **)&trans_header, &trans_len);
+            break;
+
+        default:
+            return status;
+    }
+
+    switch (proto)
     {
-        BOOL match = windivert_filter(buffer_fst, if_idx, sub_if_idx, outbound,
-            isipv4, hop, checksums, filter);
-        if (match)
-        {
+        case IPPROTO_TCP:
+            if ((checksums & WINDIVERT_TCP_CHECKSUM) != 0)
+            {
+                return status;
+            }
+            tcp_header = (struct tcphdr *)trans_header;
+            if (trans_len < sizeof(struct tcphdr))
+            {
+                return status;
+            }
+            tcp_header->Checksum = 0;
+            break;
+        
+        case IPPROTO_UDP:
+            if ((checksums & WINDIVERT_UDP_CHECKSUM) != 0)
+            {
+                return status;
+            }
+            udp_header = (struct udphdr *)trans_header;
+            if (trans_len < sizeof(struct udphdr))
+            {
+                return status;
+            }
+            udp_header->Checksum = 0;
             break;
-        }
-        buffer_fst = NET_BUFFER_NEXT_NB(buffer_fst);
-    }
-    while (buffer_fst != NULL);
-    if (advance != 0)
-    {
-        NdisAdvanceNetBufferDataStart(buffer, advance, FALSE, NULL);
     }
 
-    if (buffer_fst == NULL)
-    {
-        // No packet matches the filter; continue the entire NET_BUFFER_LIST.
-        WdfObjectDereference(object);
-        result->actionType = FWP_ACTION_CONTINUE;
-        return;
-    }
+    return status;
+}
 
-    // At least one packet matches the filter.  Delay all further processing
-    // until windivert_worker() at IRQL=PASSIVE_LEVEL.
-    work = (work_t)windivert_malloc(sizeof(struct work_s), FALSE);
-    if (work == NULL)
-    {
-        goto windivert_classify_callout_exit;
-    }
+/*
+ * One's complement checksum of a pseudo header sum and data.
+ */
+static UINT16 windivert_checksum(UINT64 sum, const void *data, size_t len)
+{
+    const UINT32 *data32 = (const UINT32 *)data;
+    const UINT8 *data8;
 
-    FwpsReferenceNetBufferList(buffers, TRUE);
-    work->buffers = buffers;
-    work->buffer = buffer_fst;
-    work->advance = advance;
-    work->is_ipv4 = isipv4;
-    work->hop = hop;
-    work->checksums = checksums;
-    work->direction = direction;
-    work->if_idx = if_idx;
-    work->sub_if_idx = sub_if_idx;
-    work->priority = priority;
-    work->timestamp = timestamp;
-    old_entry = NULL;
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+    for (; len >= 4; len -= 4)
     {
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        WdfObjectDereference(object);
-        FwpsDereferenceNetBufferList(buffers, FALSE);
-        windivert_free(work);
-        result->actionType = FWP_ACTION_CONTINUE;
-        return;
+        sum += (UINT64)*data32++;
     }
-    context->work_queue_length++;
-    if (context->work_queue_length > WINDIVERT_WORK_QUEUE_LEN_MAX)
+    data8 = (const UINT8 *)data32;
+    if (len >= 2)
     {
-        old_entry = RemoveHeadList(&context->work_queue);
-        context->work_queue_length--;
+        sum += (UINT64)*(const UINT16 *)data8;
+        data8 += 2;
+        len -= 2;
     }
-    InsertTailList(&context->work_queue, &work->entry);
-    WdfWorkItemEnqueue(context->workers[context->worker_curr]);
-    context->worker_curr =
-        (context->worker_curr + 1) % WINDIVERT_CONTEXT_MAXWORKERS;
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-
-    if (old_entry != NULL)
+    if (len != 0)
     {
-        work = CONTAINING_RECORD(old_entry, struct work_s, entry);
-        FwpsDereferenceNetBufferList(work->buffers, FALSE);
-        windivert_free(work);
+        sum += (UINT64)*data8;
     }
-
-windivert_classify_callout_exit:
-
-    WdfObjectDereference(object);
-    result->actionType = FWP_ACTION_BLOCK;
-    result->flags |= FWPS_CLASSIFY_OUT_FLAG_ABSORB;
-    result->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (UINT16)~sum;
 }
 
 /*
- * WinDivert work item routine for out-of-band filtering.
+ * (Re)calculate the IPv4/ICMP/ICMPv6/TCP/UDP checksums of a packet.  The
+ * packet has already been validated by the caller.
  */
-VOID windivert_worker(IN WDFWORKITEM item)
+static void windivert_calc_checksums(void *header, size_t len)
 {
-    KLOCK_QUEUE_HANDLE lock_handle;
-    WDFFILEOBJECT object = (WDFFILEOBJECT)WdfWorkItemGetParentObject(item);
-    PLIST_ENTRY entry;
-    work_t work;
-    context_t context = windivert_context_get(object);
-    PNET_BUFFER_LIST buffers_clone;
-    PNET_BUFFER buffer_itr, buffer_fst;
-    UINT advance;
-    BOOL match, ok, outbound, sniff_mode, forward;
-    filter_t filter;
-    NTSTATUS status;
+    struct iphdr *ip_header = (struct iphdr *)header;
+    struct ipv6hdr *ipv6_header = (struct ipv6hdr *)header;
+    struct icmphdr *icmp_header;
+    struct icmpv6hdr *icmpv6_header;
+    struct tcphdr *tcp_header;
+    struct udphdr *udp_header;
+    size_t ip_header_len, trans_len;
+    void *trans_header;
+    UINT64 pseudo_sum;
+    UINT8 proto;
 
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    if (context->state == WINDIVERT_CONTEXT_STATE_OPEN)
-    {
-        sniff_mode = ((context->flags & WINDIVERT_FLAG_SNIFF) != 0);
-        forward = (context->layer == WINDIVERT_LAYER_NETWORK_FORWARD);
-        filter = context->filter;
-    }
-    while (context->state == WINDIVERT_CONTEXT_STATE_OPEN &&
-            !IsListEmpty(&context->work_queue))
+    switch (ip_header->Version)
     {
-        entry = RemoveHeadList(&context->work_queue);
-        context->work_queue_length--;
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-
-        work = CONTAINING_RECORD(entry, struct work_s, entry);
-        advance = work->advance;
-        buffer_fst = work->buffer;
-        if (advance != 0)
-        {
-            status = NdisRetreatNetBufferDataStart(buffer_fst, advance, 0,
-                NULL);
-            if (!NT_SUCCESS(status))
+        case 4:
+            ip_header_len = ip_header->HdrLength*sizeof(UINT32);
+            if (ip_header_len < sizeof(struct iphdr) || len < ip_header_len)
             {
-                advance = 0;
-                goto windivert_worker_complete;
+                return;
             }
-        }
-
-        if (!sniff_mode)
-        {
-            // In non-SNIFF mode, reinject all non-matching packets up to the
-            // first matching packet.
-            buffer_itr = NET_BUFFER_LIST_FIRST_NB(work->buffers);
-            while (buffer_itr != buffer_fst)
+            ip_header->Checksum = 0;
+            ip_header->Checksum = windivert_checksum(0, ip_header,
+                ip_header_len);
+            if (IPHDR_GET_FRAGOFF(ip_header) != 0 ||
+                IPHDR_GET_MF(ip_header) != 0)
             {
-                ok = windivert_reinject_packet(sniff_mode, forward,
-                    work->direction, work->is_ipv4, work->if_idx,
-                    work->sub_if_idx, work->priority, work->buffers,
-                    buffer_itr, NULL);
-                if (!ok)
-                {
-                    goto windivert_worker_complete;
-                }
-                buffer_itr = NET_BUFFER_NEXT_NB(buffer_itr);
+                return;
             }
-        }
-        else
-        {
-            // In SNIFF mode, reinject the entire NET_BUFFER_LIST.
-            ok = windivert_reinject_packet(sniff_mode, forward,
-                work->direction, work->is_ipv4, work->if_idx,
-                work->sub_if_idx, work->priority, work->buffers, NULL, NULL);
-            if (!ok)
+            proto = ip_header->Protocol;
+            trans_len = len - ip_header_len;
+            trans_header = (UINT8 *)ip_header + ip_header_len;
+            pseudo_sum = (UINT64)ip_header->SrcAddr +
+                (UINT64)ip_header->DstAddr;
+            break;
+
+        case 6:
+            trans_len = len - sizeof(struct ipv6hdr);
+            trans_header = (UINT8 *)(ipv6_header + 1);
+            proto = windivert_skip_headers(ipv6_header->NextHdr,
+                (UINT8 **)&trans_header, &trans_len);
+            pseudo_sum =
+                (UINT64)ipv6_header->SrcAddr[0] +
+                (UINT64)ipv6_header->SrcAddr[1] +
+                (UINT64)ipv6_header->SrcAddr[2] +
+                (UINT64)ipv6_header->SrcAddr[3] +
+                (UINT64)ipv6_header->DstAddr[0] +
+                (UINT64)ipv6_header->DstAddr[1] +
+                (UINT64)ipv6_header->DstAddr[2] +
+                (UINT64)ipv6_header->DstAddr[3];
+            break;
+
+        default:
+            return;
+    }
+
+    // Pseudo header protocol and length (len <= UINT16_MAX):
+    pseudo_sum += (UINT64)RtlUshortByteSwap((UINT16)proto) +
+        (UINT64)RtlUshortByteSwap((UINT16)trans_len);
+
+    switch (proto)
+    {
+        case IPPROTO_ICMP:
+            icmp_header = (struct icmphdr *)trans_header;
+            if (ip_header->Version != 4 ||
+                trans_len < sizeof(struct icmphdr))
             {
-                goto windivert_worker_complete;
+                return;
             }
-            buffer_itr = buffer_fst;
-        }
+            icmp_header->Checksum = 0;
+            icmp_header->Checksum = windivert_checksum(0, icmp_header,
+                trans_len);
+            break;
 
-        // Queue the first matching packet.
-        ok = windivert_queue_packet(context, buffer_itr, work->direction,
-            work->if_idx, work->sub_if_idx, work->is_ipv4, work->hop,
-            work->checksums, work->timestamp);
-        if (!ok)
-        {
-            goto windivert_worker_complete;
-        }
-        buffer_itr = NET_BUFFER_NEXT_NB(buffer_itr);
+        case IPPROTO_ICMPV6:
+            icmpv6_header = (struct icmpv6hdr *)trans_header;
+            if (ip_header->Version != 6 ||
+                trans_len < sizeof(struct icmpv6hdr))
+            {
+                return;
+            }
+            icmpv6_header->Checksum = 0;
+            icmpv6_header->Checksum = windivert_checksum(pseudo_sum,
+                icmpv6_header, trans_len);
+            break;
 
-        // Queue or re-inject all remaining packets.
-        outbound = (work->direction == WINDIVERT_DIRECTION_OUTBOUND);
-        while (buffer_itr != NULL)
-        {
-            match = windivert_filter(buffer_itr, work->if_idx,
-                work->sub_if_idx, outbound, work->is_ipv4, work->hop,
-                work->checksums, filter);
-            if (match)
+        case IPPROTO_TCP:
+            tcp_header = (struct tcphdr *)trans_header;
+            if (trans_len < sizeof(struct tcphdr))
             {
-                ok = windivert_queue_packet(context, buffer_itr,
-                    work->direction, work->if_idx, work->sub_if_idx,
-                    work->is_ipv4, work->hop, work->checksums,
-                    work->timestamp);
+                return;
             }
-            else
+            tcp_header->Checksum = 0;
+            tcp_header->Checksum = windivert_checksum(pseudo_sum, tcp_header,
+                trans_len);
+            break;
+
+        case IPPROTO_UDP:
+            udp_header = (struct udphdr *)trans_header;
+            if (trans_len < sizeof(struct udphdr))
             {
-                ok = windivert_reinject_packet(sniff_mode, forward,
-                    work->direction, work->is_ipv4, work->if_idx,
-                    work->sub_if_idx, work->priority, work->buffers,
-                    buffer_itr, NULL);
+                return;
             }
-            if (!ok)
+            udp_header->Checksum = 0;
+            udp_header->Checksum = windivert_checksum(pseudo_sum, udp_header,
+                trans_len);
+            if (udp_header->Checksum == 0)
             {
-                goto windivert_worker_complete;
+                udp_header->Checksum = 0xFFFF;
             }
-            buffer_itr = NET_BUFFER_NEXT_NB(buffer_itr);
-        }
-
-windivert_worker_complete:
-        if (advance != 0)
-        {
-            NdisAdvanceNetBufferDataStart(work->buffer, advance, 0, 0);
-        }
-        FwpsDereferenceNetBufferList(work->buffers, FALSE);
-        windivert_free(work);
-        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+            break;
     }
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
 }
 
 /*
- * Queue a NET_BUFFER.
+ * Big number comparison.
  */
-static BOOL windivert_queue_packet(context_t context, PNET_BUFFER buffer,
-    UINT8 direction, UINT32 if_idx, UINT32 sub_if_idx, BOOL is_ipv4, BOOL hop,
-    UINT8 checksums, LONGLONG timestamp0)
+static int windivert_big_num_compare(const UINT32 *a, const UINT32 *b)
 {
-    KLOCK_QUEUE_HANDLE lock_handle;
-    PVOID data;
-    WDFREQUEST request;
-    PLIST_ENTRY entry, old_entry;
-    packet_t packet, old_packet;
-    UINT data_len;
-    LONGLONG timestamp;
-    BOOL timeout;
-    NTSTATUS status;
-
-    // First we attempt to immediately service a read request directly without
-    // queuing the packet.  This helps reduce overhead where possible.
-    timeout = FALSE;
-    request = NULL;
-    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+    if (a[3] < b[3])
     {
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        return FALSE;
+        return -1;
     }
-    if ((context->flags & WINDIVERT_FLAG_DROP) != 0)
+    if (a[3] > b[3])
     {
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        return TRUE;
+        return 1;
     }
-    timeout = WINDIVERT_TIMEOUT(context, timestamp0, timestamp);
-    if (!timeout && IsListEmpty(&context->packet_queue))
+    if (a[2] < b[2])
     {
-        status = WdfIoQueueRetrieveNextRequest(context->read_queue, &request);
-        if (!NT_SUCCESS(status))
-        {
-            request = NULL;
-        }
+        return -1;
     }
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-    if (timeout)
+    if (a[2] > b[2])
     {
-        return TRUE;
+        return 1;
     }
-    if (request != NULL)
+    if (a[1] < b[1])
     {
-        // FAST PATH: Service an I/O request without queueing the packet.
-        windivert_read_service_request(NULL, buffer, direction, if_idx,
-            sub_if_idx, hop, checksums, request);
-        return TRUE;
+        return -1;
     }
-
-    // SLOW PATH: queue the packet.
-    data_len = NET_BUFFER_DATA_LENGTH(buffer);
-    packet = (packet_t)windivert_malloc(sizeof(struct packet_s), FALSE);
-    if (packet == NULL)
+    if (a[1] > b[1])
     {
-        return FALSE;
+        return 1;
     }
-    packet->data = windivert_malloc(data_len, TRUE);
-    if (packet->data == NULL)
+    if (a[0] < b[0])
     {
-        windivert_free_packet(packet);
-        return FALSE;
+        return -1;
     }
-    packet->data_len = data_len;
-    data = NdisGetDataBuffer(buffer, data_len, NULL, 1, 0);
-    if (data == NULL)
+    if (a[0] > b[0])
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Mask a set value to the given prefix length.
+ */
+static void windivert_filter_set_mask(UINT32 *key, const UINT32 *val,
+    UINT8 width, UINT8 prefix)
+{
+    INT bits;
+    UINT i;
+
+    for (i = 0; i < 4; i++)
     {
-        NdisGetDataBuffer(buffer, data_len, packet->data, 1, 0);
+        // Prefix bits covering word i (0 = least significant).  Words
+        // beyond the field width are compared exactly.
+        bits = (INT)prefix - ((INT)width - 32 * (INT)(i + 1));
+        bits = ((INT)width < 32 * (INT)(i + 1)? 32: bits);
+        key[i] = (bits <= 0? 0: (bits >= 32? val[i]:
+            val[i] & ~(0xFFFFFFFF >> bits)));
     }
-    else
+}
+
+/*
+ * Hash a (masked) set value.
+ */
+static UINT32 windivert_filter_set_hash(const UINT32 *key, UINT8 prefix)
+{
+    UINT32 hash = 0x9E3779B9 ^ (UINT32)prefix;
+    UINT i;
+
+    for (i = 0; i < 4; i++)
     {
-        RtlCopyMemory(packet->data, data, data_len);
+        hash ^= key[i];
+        hash *= 0x85EBCA6B;
+        hash ^= hash >> 13;
     }
-    packet->is_ipv4 = is_ipv4;
-    packet->hop = hop;
-    packet->checksums = checksums;
-    packet->direction = direction;
-    packet->if_idx = if_idx;
-    packet->sub_if_idx = sub_if_idx;
-    packet->timestamp = timestamp0;
-    entry = &packet->entry;
+    return hash;
+}
 
-    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    while (TRUE)
+/*
+ * Insert an element into a set.
+ */
+static void windivert_filter_set_insert(filter_set_t set, const UINT32 *val,
+    UINT8 prefix)
+{
+    filter_set_entry_t entries = WINDIVERT_FILTER_SET_ENTRIES(set);
+    UINT32 key[4], idx;
+    UINT8 i;
+
+    windivert_filter_set_mask(key, val, set->width, prefix);
+    idx = windivert_filter_set_hash(key, prefix) & set->mask;
+    while (entries[idx].used)
     {
-        if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
-        {
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            windivert_free_packet(packet);
-            return FALSE;
-        }
-        if (data_len > context->packet_queue_maxsize)
-        {
-            // (Corner case) the packet is larger than the max queue size:
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            windivert_free_packet(packet);
-            return TRUE;
-        }
-        timeout = WINDIVERT_TIMEOUT(context, packet->timestamp, timestamp);
-        if (timeout)
+        if (entries[idx].prefix == prefix &&
+            RtlEqualMemory(entries[idx].val, key, sizeof(key)))
         {
-            // (Corner case) the packet has already expired:
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            windivert_free_packet(packet);
-            return TRUE;
+            return;                 // Duplicate.
         }
+        idx = (idx + 1) & set->mask;
+    }
+    RtlCopyMemory(entries[idx].val, key, sizeof(key));
+    entries[idx].prefix = prefix;
+    entries[idx].used   = TRUE;
 
-        if (context->packet_queue_size + data_len >
-                context->packet_queue_maxsize ||
-            context->packet_queue_length + 1 > context->packet_queue_maxlength)
-        {
-            // The queue is full; drop a packet & try again:
-            old_entry = RemoveHeadList(&context->packet_queue);
-            old_packet = CONTAINING_RECORD(old_entry, struct packet_s, entry);
-            context->packet_queue_length--;
-            context->packet_queue_size -= old_packet->data_len;
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            DEBUG("DROP: packet queue is full, dropping packet");
-            windivert_free_packet(old_packet);
-            timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
-            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-            continue;
-        }
-        else
+    for (i = 0; i < set->prefixes_len && set->prefixes[i] != prefix; i++)
+        ;
+    if (i == set->prefixes_len)
+    {
+        set->prefixes[set->prefixes_len++] = prefix;
+    }
+}
+
+/*
+ * Test if a value is a member of a set.
+ */
+static BOOL windivert_filter_set_lookup(filter_set_t set, const UINT32 *val)
+{
+    filter_set_entry_t entries = WINDIVERT_FILTER_SET_ENTRIES(set);
+    UINT32 key[4], idx;
+    UINT8 i, prefix;
+
+    for (i = 0; i < set->prefixes_len; i++)
+    {
+        prefix = set->prefixes[i];
+        windivert_filter_set_mask(key, val, set->width, prefix);
+        idx = windivert_filter_set_hash(key, prefix) & set->mask;
+        while (entries[idx].used)
         {
-            // Queue the packet:
-            InsertTailList(&context->packet_queue, entry);
-            context->packet_queue_length++;
-            context->packet_queue_size += data_len;
-            break;
+            if (entries[idx].prefix == prefix &&
+                entries[idx].val[0] == key[0] &&
+                entries[idx].val[1] == key[1] &&
+                entries[idx].val[2] == key[2] &&
+                entries[idx].val[3] == key[3])
+            {
+                return TRUE;
+            }
+            idx = (idx + 1) & set->mask;
         }
     }
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    return FALSE;
+}
 
-    DEBUG("PACKET: diverting packet (packet=%p)", packet);
+/*
+ * Size of the set table for the given number of elements (load <= 1/2).
+ */
+static UINT32 windivert_filter_set_size(UINT32 count)
+{
+    UINT32 size = 1;
+    while (size < 2 * count)
+    {
+        size <<= 1;
+    }
+    return size;
+}
 
-    // Service any pending I/O request.
-    windivert_read_service(context);
+/*
+ * The child of a pattern matcher state for the given byte (0 = none).
+ */
+static UINT16 windivert_filter_ac_child(filter_ac_t ac, UINT16 s, UINT8 b)
+{
+    filter_ac_state_t states = WINDIVERT_FILTER_AC_STATES(ac);
+    UINT16 t;
 
-    return TRUE;
+    if (s == 0)
+    {
+        return ac->root[b];
+    }
+    for (t = states[s].child; t != 0 && states[t].byte < b;
+            t = states[t].sibling)
+        ;
+    return (t != 0 && states[t].byte == b? t: 0);
 }
 
 /*
- * Re-inject a packet or packets.
+ * The next pattern matcher state for the given byte.
  */
-static BOOL windivert_reinject_packet(BOOL sniff_mode, BOOL forward,
-    UINT8 direction, BOOL isipv4, UINT32 if_idx, UINT32 sub_if_idx,
-    UINT32 priority, PNET_BUFFER_LIST buffers, PNET_BUFFER buffer,
-    packet_t packet)
+static UINT16 windivert_filter_ac_next(filter_ac_t ac, UINT16 s, UINT8 b)
 {
-    PNET_BUFFER_LIST buffers_cpy;
-    BOOL clone;
-    PMDL mdl = NULL;
-    PVOID data = NULL;
-    FWPS_INJECT_COMPLETE0 completion;
-    HANDLE compl_handle, handle;
-    NTSTATUS status;
+    filter_ac_state_t states = WINDIVERT_FILTER_AC_STATES(ac);
+    UINT16 t;
 
-    if (buffer != NULL)
+    while (s != 0)
     {
-        // Re-inject a specific packet.  Not applicable for SNIFF mode.
-        if (sniff_mode)
-        {
-            return TRUE;
-        }
-        status = FwpsAllocateNetBufferAndNetBufferList0(nbl_pool_handle, 0, 0,
-            NET_BUFFER_FIRST_MDL(buffer), NET_BUFFER_DATA_OFFSET(buffer),
-            NET_BUFFER_DATA_LENGTH(buffer), &buffers_cpy);
-        if (!NT_SUCCESS(status))
-        {
-            DEBUG_ERROR("failed to create NET_BUFFER_LIST for injected packet",
-                status);
-            return FALSE;
-        }
-        if (forward || direction == WINDIVERT_DIRECTION_OUTBOUND)
+        if (states[s].dense != 0)
         {
-            NdisCopySendNetBufferListInfo(buffers_cpy, buffers);
+            return WINDIVERT_FILTER_AC_DENSE(ac)[states[s].dense - 1][b];
         }
-        else
+        t = windivert_filter_ac_child(ac, s, b);
+        if (t != 0)
         {
-            NdisCopyReceiveNetBufferListInfo(buffers_cpy, buffers);
+            return t;
         }
-        clone = FALSE;
-        completion = windivert_reinject_complete;
-        compl_handle = (HANDLE)buffers;
-        FwpsReferenceNetBufferList(buffers, TRUE);
+        s = states[s].fail;
     }
-    else if (buffers != NULL)
+    return ac->root[b];
+}
+
+/*
+ * Insert a pattern into a pattern matcher.
+ */
+static BOOL windivert_filter_ac_insert(filter_ac_t ac, UINT16 capacity,
+    const UINT8 *pattern, UINT len)
+{
+    filter_ac_state_t states = WINDIVERT_FILTER_AC_STATES(ac);
+    UINT16 s = 0, t, *link;
+    UINT i;
+
+    for (i = 0; i < len; i++)
     {
-        // Re-inject all packets for SNIFF mode.
-        status = FwpsAllocateCloneNetBufferList0(buffers, nbl_pool_handle,
-            nb_pool_handle, 0, &buffers_cpy);
-        if (!NT_SUCCESS(status))
+        link = (s == 0? ac->root + pattern[i]: &states[s].child);
+        while (s != 0 && *link != 0 && states[*link].byte < pattern[i])
         {
-            DEBUG_ERROR("failed to clone NET_BUFFER_LIST for injected packets",
-                status);
-            return FALSE;
+            link = &states[*link].sibling;
         }
-        clone = TRUE;
-        completion = windivert_reinject_clone_complete;
-        compl_handle = (HANDLE)buffers;
-        FwpsReferenceNetBufferList(buffers, TRUE);
-    }
-    else if (packet != NULL)
-    {
-        // Re-inject a packet_t for cleanup.
-        if (sniff_mode)
+        t = *link;
+        if (t == 0 || states[t].byte != pattern[i])
         {
-            return TRUE;        // Already re-injected.
+            if (ac->states_len >= capacity)
+            {
+                return FALSE;
+            }
+            t = ac->states_len++;
+            states[t].byte    = pattern[i];
+            states[t].sibling = (s == 0? 0: *link);
+            *link = t;
         }
-        data = windivert_malloc(packet->data_len, FALSE);
-        if (data == NULL)
+        s = t;
+    }
+    states[s].flags |= WINDIVERT_FILTER_AC_FINAL | WINDIVERT_FILTER_AC_MATCH;
+    return TRUE;
+}
+
+/*
+ * Build a pattern matcher from the given (already validated) set elements.
+ */
+static BOOL windivert_filter_ac_build(filter_ac_t ac, UINT16 capacity,
+    windivert_ioctl_set_t elems, UINT32 count)
+{
+    filter_ac_state_t states = WINDIVERT_FILTER_AC_STATES(ac);
+    UINT8 pattern[16 * WINDIVERT_FILTER_PATTERN_ELEMS(
+        WINDIVERT_FILTER_PATTERN_MAXLEN)];
+    UINT16 *queue, head, tail, u, v, (*dense)[256];
+    UINT32 i, j, len, dense_len = 0;
+    UINT b, c;
+
+    ac->states_len = 1;
+    for (i = 0; i < count; i += 1 + WINDIVERT_FILTER_PATTERN_ELEMS(len))
+    {
+        // Re-check, the elements are user memory:
+        len = elems[i].val[0];
+        if (len == 0 || len > WINDIVERT_FILTER_PATTERN_MAXLEN ||
+            i + 1 + WINDIVERT_FILTER_PATTERN_ELEMS(len) > count)
         {
-            status = STATUS_INSUFFICIENT_RESOURCES;
-            DEBUG_ERROR("failed to allocate memory for injected packet data",
-                status);
             return FALSE;
         }
-        RtlCopyMemory(data, packet->data, packet->data_len);
-        mdl = IoAllocateMdl(data, packet->data_len, FALSE, FALSE, NULL);
-        if (mdl == NULL)
+        for (j = 0; j < WINDIVERT_FILTER_PATTERN_ELEMS(len); j++)
         {
-            status = STATUS_INSUFFICIENT_RESOURCES;
-            DEBUG_ERROR("failed to allocate MDL for injected packet", status);
-            windivert_free(data);
-            return FALSE;
+            RtlCopyMemory(pattern + 16 * j, elems[i + 1 + j].val, 16);
         }
-        MmBuildMdlForNonPagedPool(mdl);
-        status = FwpsAllocateNetBufferAndNetBufferList0(nbl_pool_handle, 0, 0,
-            mdl, 0, packet->data_len, &buffers_cpy);
-        if (!NT_SUCCESS(status))
+        if (!windivert_filter_ac_insert(ac, capacity, pattern, len))
         {
-            DEBUG_ERROR("failed to create NET_BUFFER_LIST for injected packet",
-                status);
-            IoFreeMdl(mdl);
-            windivert_free(data);
             return FALSE;
         }
-        clone = FALSE;
-        completion = windivert_inject_complete;
-        compl_handle = (HANDLE)NULL;
     }
-    else
-        return TRUE;
 
-    handle = (isipv4? inject_handle: injectv6_handle);
-    if (forward)
+    // Compute the failure links (breadth first):
+    queue = (UINT16 *)windivert_malloc(ac->states_len * sizeof(UINT16),
+        TRUE);
+    if (queue == NULL)
     {
-        status = FwpsInjectForwardAsync0(handle, (HANDLE)priority, 0,
-            (isipv4? AF_INET: AF_INET6), UNSPECIFIED_COMPARTMENT_ID,
-            if_idx, buffers_cpy, completion, compl_handle);
+        return FALSE;
     }
-    else if (direction == WINDIVERT_DIRECTION_OUTBOUND)
+    head = tail = 0;
+    for (b = 0; b < 256; b++)
     {
-        status = FwpsInjectNetworkSendAsync0(handle,
-            (HANDLE)priority, 0, UNSPECIFIED_COMPARTMENT_ID, buffers_cpy,
-            completion, compl_handle);
+        if (ac->root[b] != 0)
+        {
+            queue[tail++] = ac->root[b];    // fail = root
+        }
     }
-    else
+    while (head < tail)
     {
-        status = FwpsInjectNetworkReceiveAsync0(handle, 
-            (HANDLE)priority, 0, UNSPECIFIED_COMPARTMENT_ID, if_idx,
-            sub_if_idx, buffers_cpy, completion, compl_handle);
+        u = queue[head++];
+        for (v = states[u].child; v != 0; v = states[v].sibling)
+        {
+            states[v].fail = windivert_filter_ac_next(ac, states[u].fail,
+                states[v].byte);
+            states[v].flags |=
+                states[states[v].fail].flags & WINDIVERT_FILTER_AC_MATCH;
+            queue[tail++] = v;
+        }
     }
+    windivert_free(queue);
 
-    if (!NT_SUCCESS(status))
+    // Dense rows for the root's children.  Their failure links all point
+    // to the root, so no row depends on another:
+    dense = WINDIVERT_FILTER_AC_DENSE(ac);
+    for (b = 0; b < 256 &&
+            dense_len < WINDIVERT_FILTER_AC_DENSE_ROWS(capacity); b++)
     {
-        DEBUG_ERROR("failed to (re)inject packet(s)", status);
-        if (clone)
-        {
-            FwpsFreeNetBufferList0(buffers_cpy);
-        }
-        else
-        {
-            FwpsFreeCloneNetBufferList0(buffers_cpy, 0);
-        }
-        if (buffers != NULL)
-        {
-            FwpsDereferenceNetBufferList(buffers, FALSE);
-        }
-        if (mdl != NULL)
+        u = ac->root[b];
+        if (u == 0)
         {
-            IoFreeMdl(mdl);
+            continue;
         }
-        if (data != NULL)
+        for (c = 0; c < 256; c++)
         {
-            windivert_free(data);
+            dense[dense_len][c] = windivert_filter_ac_next(ac, u, (UINT8)c);
         }
+        states[u].dense = (UINT16)(++dense_len);
     }
-
     return TRUE;
 }
 
 /*
- * WinDivert (re)inject complete.
+ * Test if the payload contains (or starts with) any pattern.
  */
-static void NTAPI windivert_reinject_complete(VOID *context,
-    NET_BUFFER_LIST *buffers_cpy, BOOLEAN dispatch_level)
+static BOOL windivert_filter_ac_match(filter_ac_t ac, PNET_BUFFER buffer,
+    size_t offset, size_t len, BOOL prefix)
 {
-    PNET_BUFFER_LIST buffers = (PNET_BUFFER_LIST)context;
-    FwpsFreeNetBufferList0(buffers_cpy);
-    FwpsDereferenceNetBufferList(buffers, dispatch_level);
-}
+    filter_ac_state_t states = WINDIVERT_FILTER_AC_STATES(ac);
+    PMDL mdl;
+    UINT8 *data;
+    size_t mdl_len;
+    UINT16 s = 0;
 
-/*
- * WinDivert (re)inject complete.
- */
-static void NTAPI windivert_reinject_clone_complete(VOID *context,
-    NET_BUFFER_LIST *buffers_cpy, BOOLEAN dispatch_level)
-{
-    PNET_BUFFER_LIST buffers = (PNET_BUFFER_LIST)context;
-    FwpsFreeCloneNetBufferList0(buffers_cpy, 0);
-    FwpsDereferenceNetBufferList(buffers, dispatch_level);
+    mdl = NET_BUFFER_CURRENT_MDL(buffer);
+    offset += NET_BUFFER_CURRENT_MDL_OFFSET(buffer);
+    for (; mdl != NULL && len != 0; mdl = mdl->Next)
+    {
+        mdl_len = MmGetMdlByteCount(mdl);
+        if (offset >= mdl_len)
+        {
+            offset -= mdl_len;
+            continue;
+        }
+        data = (UINT8 *)MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+        if (data == NULL)
+        {
+            return FALSE;
+        }
+        for (data += offset, mdl_len -= offset, offset = 0;
+                mdl_len != 0 && len != 0; data++, mdl_len--, len--)
+        {
+            if (prefix)
+            {
+                s = windivert_filter_ac_child(ac, s, *data);
+                if (s == 0)
+                {
+                    return FALSE;
+                }
+                if ((states[s].flags & WINDIVERT_FILTER_AC_FINAL) != 0)
+                {
+                    return TRUE;
+                }
+            }
+            else
+            {
+                s = windivert_filter_ac_next(ac, s, *data);
+                if ((states[s].flags & WINDIVERT_FILTER_AC_MATCH) != 0)
+                {
+                    return TRUE;
+                }
+            }
+        }
+    }
+    return FALSE;
 }
 
 /*
- * Free a packet.
+ * Load a big-endian payload value of the given size (in bytes).
  */
-static void windivert_free_packet(packet_t packet)
+static BOOL windivert_filter_payload_load(PNET_BUFFER buffer, size_t offset,
+    UINT size, UINT32 *val)
 {
-    windivert_free(packet->data);
-    windivert_free(packet);
+    UINT8 storage[sizeof(UINT32)], *data;
+    UINT i;
+    NTSTATUS status;
+
+    NdisAdvanceNetBufferDataStart(buffer, (ULONG)offset, FALSE, NULL);
+    data = (UINT8 *)NdisGetDataBuffer(buffer, size, storage, 1, 0);
+    *val = 0;
+    for (i = 0; data != NULL && i < size; i++)
+    {
+        *val = (*val << 8) | (UINT32)data[i];
+    }
+    status = NdisRetreatNetBufferDataStart(buffer, (ULONG)offset, 0, NULL);
+    return (data != NULL && NT_SUCCESS(status));
 }
 
 /*
- * Skip well-known IPv6 extension headers.
+ * Compiled filter field definitions, indexed by WINDIVERT_FILTER_FIELD_*.
  */
-static UINT8 windivert_skip_headers(UINT8 proto, UINT8 **header, size_t *len)
+#define WINDIVERT_FILTER_FIELD(protocol, op, base, offset, shift, mask)     \
+    {WINDIVERT_FILTER_PROTOCOL_##protocol, WINDIVERT_FILTER_OP_##op,        \
+     WINDIVERT_FILTER_PROTOCOL_##base, (offset), (shift), (mask)}
+static const struct filter_field_s filter_fields[WINDIVERT_FILTER_FIELD_MAX+1] =
 {
-    size_t hdrlen;
-
-    while (TRUE)
-    {
-        if (*len <= 2)
-        {
-            return IPPROTO_NONE;
-        }
-
-        hdrlen = (size_t)*(*header + 1);
-        switch (proto)
-        {
-            case IPPROTO_FRAGMENT:
-                hdrlen = 8;
-                break;
-            case IPPROTO_AH:
-                hdrlen += 2;
-                hdrlen *= 4;
-                break;
-            case IPPROTO_HOPOPTS:
-            case IPPROTO_DSTOPTS:
-            case IPPROTO_ROUTING:
-                hdrlen++;
-                hdrlen *= 8;
-                break;
-            case IPPROTO_NONE:
-                return proto;
-            default:
-                return proto;
-        }
-
-        if (hdrlen >= *len)
-        {
-            return IPPROTO_NONE;
-        }
-
-        proto = **header;
-        *header += hdrlen;
-        *len -= hdrlen;
-    }
-}
+    WINDIVERT_FILTER_FIELD(NONE,   ZERO,     NONE,   0,  0,  0),    // zero
+    WINDIVERT_FILTER_FIELD(NONE,   INBOUND,  NONE,   0,  0,  0),    // inbound
+    WINDIVERT_FILTER_FIELD(NONE,   OUTBOUND, NONE,   0,  0,  0),    // outbound
+    WINDIVERT_FILTER_FIELD(NONE,   IFIDX,    NONE,   0,  0,  0),    // ifIdx
+    WINDIVERT_FILTER_FIELD(NONE,   SUBIFIDX, NONE,   0,  0,  0),    // subIfIdx
+    WINDIVERT_FILTER_FIELD(NONE,   PRESENT,  IP,     0,  0,  0),    // ip
+    WINDIVERT_FILTER_FIELD(NONE,   PRESENT,  IPV6,   0,  0,  0),    // ipv6
+    WINDIVERT_FILTER_FIELD(NONE,   PRESENT,  ICMP,   0,  0,  0),    // icmp
+    WINDIVERT_FILTER_FIELD(NONE,   PRESENT,  TCP,    0,  0,  0),    // tcp
+    WINDIVERT_FILTER_FIELD(NONE,   PRESENT,  UDP,    0,  0,  0),    // udp
+    WINDIVERT_FILTER_FIELD(NONE,   PRESENT,  ICMPV6, 0,  0,  0),    // icmpv6
+    WINDIVERT_FILTER_FIELD(IP,     LOAD8,    IP,     0,  0,  0x0F), // HdrLength
+    WINDIVERT_FILTER_FIELD(IP,     LOAD8,    IP,     1,  0,  0xFF), // TOS
+    WINDIVERT_FILTER_FIELD(IP,     LOAD16,   IP,     2,  0,  0xFFFF),
+    WINDIVERT_FILTER_FIELD(IP,     LOAD16,   IP,     4,  0,  0xFFFF),
+    WINDIVERT_FILTER_FIELD(IP,     LOAD16,   IP,     6,  14, 0x01), // DF
+    WINDIVERT_FILTER_FIELD(IP,     LOAD16,   IP,     6,  13, 0x01), // MF
+    WINDIVERT_FILTER_FIELD(IP,     LOAD16,   IP,     6,  0,  0x1FFF),
+    WINDIVERT_FILTER_FIELD(IP,     HOPLIMIT, IP,     8,  0,  0),    // TTL
+    WINDIVERT_FILTER_FIELD(IP,     LOAD8,    IP,     9,  0,  0xFF), // Protocol
+    WINDIVERT_FILTER_FIELD(IP,     CHECKSUM, IP,     10, 0,
+        WINDIVERT_IP_CHECKSUM),
+    WINDIVERT_FILTER_FIELD(IP,     LOAD32,   IP,     12, 0,  0xFFFFFFFF),
+    WINDIVERT_FILTER_FIELD(IP,     LOAD32,   IP,     16, 0,  0xFFFFFFFF),
+    WINDIVERT_FILTER_FIELD(IPV6,   LOAD16,   IPV6,   0,  4,  0xFF), // Class
+    WINDIVERT_FILTER_FIELD(IPV6,   FLOWLABEL, IPV6,  0,  0,  0),
+    WINDIVERT_FILTER_FIELD(IPV6,   LOAD16,   IPV6,   4,  0,  0xFFFF),
+    WINDIVERT_FILTER_FIELD(IPV6,   LOAD8,    IPV6,   6,  0,  0xFF), // NextHdr
+    WINDIVERT_FILTER_FIELD(IPV6,   HOPLIMIT, IPV6,   7,  0,  0),
+    WINDIVERT_FILTER_FIELD(IPV6,   LOAD128,  IPV6,   8,  0,  0),    // SrcAddr
+    WINDIVERT_FILTER_FIELD(IPV6,   LOAD128,  IPV6,   24, 0,  0),    // DstAddr
+    WINDIVERT_FILTER_FIELD(ICMP,   LOAD8,    ICMP,   0,  0,  0xFF), // Type
+    WINDIVERT_FILTER_FIELD(ICMP,   LOAD8,    ICMP,   1,  0,  0xFF), // Code
+    WINDIVERT_FILTER_FIELD(ICMP,   LOAD16,   ICMP,   2,  0,  0xFFFF),
+    WINDIVERT_FILTER_FIELD(ICMP,   LOAD32,   ICMP,   4,  0,  0xFFFFFFFF),
+    WINDIVERT_FILTER_FIELD(ICMPV6, LOAD8,    ICMPV6, 0,  0,  0xFF), // Type
+    WINDIVERT_FILTER_FIELD(ICMPV6, LOAD8,    ICMPV6, 1,  0,  0xFF), // Code
+    WINDIVERT_FILTER_FIELD(ICMPV6, LOAD16,   ICMPV6, 2,  0,  0xFFFF),
+    WINDIVERT_FILTER_FIELD(ICMPV6, LOAD32,   ICMPV6, 4,  0,  0xFFFFFFFF),
+    WINDIVERT_FILTER_FIELD(TCP,    LOAD16,   TCP,    0,  0,  0xFFFF),
+    WINDIVERT_FILTER_FIELD(TCP,    LOAD16,   TCP,    2,  0,  0xFFFF),
+    WINDIVERT_FILTER_FIELD(TCP,    LOAD32,   TCP,    4,  0,  0xFFFFFFFF),
+    WINDIVERT_FILTER_FIELD(TCP,    LOAD32,   TCP,    8,  0,  0xFFFFFFFF),
+    WINDIVERT_FILTER_FIELD(TCP,    LOAD8,    TCP,    12, 4,  0x0F), // HdrLength
+    WINDIVERT_FILTER_FIELD(TCP,    LOAD8,    TCP,    13, 5,  0x01), // Urg
+    WINDIVERT_FILTER_FIELD(TCP,    LOAD8,    TCP,    13, 4,  0x01), // Ack
+    WINDIVERT_FILTER_FIELD(TCP,    LOAD8,    TCP,    13, 3,  0x01), // Psh
+    WINDIVERT_FILTER_FIELD(TCP,    LOAD8,    TCP,    13, 2,  0x01), // Rst
+    WINDIVERT_FILTER_FIELD(TCP,    LOAD8,    TCP,    13, 1,  0x01), // Syn
+    WINDIVERT_FILTER_FIELD(TCP,    LOAD8,    TCP,    13, 0,  0x01), // Fin
+    WINDIVERT_FILTER_FIELD(TCP,    LOAD16,   TCP,    14, 0,  0xFFFF),
+    WINDIVERT_FILTER_FIELD(TCP,    CHECKSUM, TCP,    16, 0,
+        WINDIVERT_TCP_CHECKSUM),
+    WINDIVERT_FILTER_FIELD(TCP,    LOAD16,   TCP,    18, 0,  0xFFFF),
+    WINDIVERT_FILTER_FIELD(TCP,    TCP_PAYLOADLENGTH, TCP, 0, 0, 0),
+    WINDIVERT_FILTER_FIELD(UDP,    LOAD16,   UDP,    0,  0,  0xFFFF),
+    WINDIVERT_FILTER_FIELD(UDP,    LOAD16,   UDP,    2,  0,  0xFFFF),
+    WINDIVERT_FILTER_FIELD(UDP,    LOAD16,   UDP,    4,  0,  0xFFFF),
+    WINDIVERT_FILTER_FIELD(UDP,    CHECKSUM, UDP,    6,  0,
+        WINDIVERT_UDP_CHECKSUM),
+    WINDIVERT_FILTER_FIELD(UDP,    UDP_PAYLOADLENGTH, UDP, 0, 0, 0),
+    WINDIVERT_FILTER_FIELD(TCP,    PAYLOAD8,  TCP,   0,  0,  0),    // Payload
+    WINDIVERT_FILTER_FIELD(TCP,    PAYLOAD16, TCP,   0,  0,  0),
+    WINDIVERT_FILTER_FIELD(TCP,    PAYLOAD32, TCP,   0,  0,  0),
+    WINDIVERT_FILTER_FIELD(UDP,    PAYLOAD8,  UDP,   0,  0,  0),    // Payload
+    WINDIVERT_FILTER_FIELD(UDP,    PAYLOAD16, UDP,   0,  0,  0),
+    WINDIVERT_FILTER_FIELD(UDP,    PAYLOAD32, UDP,   0,  0,  0),
+};
 
 /*
- * Zero the IP/TCP/UDP checksums and/or decrement the TTL (if required)
+ * Locate the headers of a packet.  Returns FALSE (and marks the result as
+ * invalid) for malformed packets, which no filter matches.
  */
-static NTSTATUS windivert_finalize_packet(void *header, size_t len,
-    BOOL hop, UINT8 checksums)
+static BOOL windivert_parse(PNET_BUFFER buffer, BOOL isipv4, meta_t meta)
 {
-    struct iphdr *ip_header = (struct iphdr *)header;
-    struct ipv6hdr *ipv6_header = (struct ipv6hdr *)header;
-    size_t ip_header_len, trans_len; 
-    void *trans_header;
-    struct tcphdr *tcp_header;
-    struct udphdr *udp_header;
+    size_t tot_len, ip_header_len, payload_off = 0, payload_len = 0;
+    struct iphdr *ip_header = NULL;
+    struct ipv6hdr *ipv6_header = NULL;
+    struct icmphdr *icmp_header = NULL;
+    struct icmpv6hdr *icmpv6_header = NULL;
+    struct tcphdr *tcp_header = NULL;
+    struct udphdr *udp_header = NULL;
     UINT8 proto;
-    NTSTATUS status = STATUS_SUCCESS;
+    NTSTATUS status;
 
-    if (checksums == WINDIVERT_ALL_CHECKSUMS && !hop)
+    meta->valid = FALSE;
+    meta->buffer = buffer;
+
+    // Parse the headers:
+    tot_len = NET_BUFFER_DATA_LENGTH(buffer);
+    if (tot_len < sizeof(struct iphdr))
     {
-        return status;
+        DEBUG("FILTER: REJECT (packet length too small)");
+        return FALSE;
     }
-    if (len < sizeof(struct iphdr))
+
+    // Get the IP header.
+    if (isipv4)
     {
-        return status;
+        // IPv4:
+        if (tot_len < sizeof(struct iphdr))
+        {
+            DEBUG("FILTER: REJECT (packet length too small)");
+            return FALSE;
+        }
+        ip_header = (struct iphdr *)NdisGetDataBuffer(buffer,
+            sizeof(struct iphdr), NULL, 1, 0);
+        if (ip_header == NULL)
+        {
+            DEBUG("FILTER: REJECT (failed to get IPv4 header)");
+            return FALSE;
+        }
+        ip_header_len = ip_header->HdrLength*sizeof(UINT32);
+        if (ip_header->Version != 4 ||
+            RtlUshortByteSwap(ip_header->Length) != tot_len ||
+            ip_header->HdrLength < 5 ||
+            ip_header_len > tot_len)
+        {
+            DEBUG("FILTER: REJECT (bad IPv4 packet)");
+            return FALSE;
+        }
+        proto = ip_header->Protocol;
+        NdisAdvanceNetBufferDataStart(buffer, ip_header_len, FALSE, NULL);
     }
-
-    switch (ip_header->Version)
+    else
     {
-        case 4:
-            ip_header_len = ip_header->HdrLength*sizeof(UINT32);
-            if (len < ip_header_len)
-            {
-                return status;
-            }
+        // IPv6:
+        if (tot_len < sizeof(struct ipv6hdr))
+        {
+            DEBUG("FILTER: REJECT (packet length too small)");
+            return FALSE;
+        }
+        ipv6_header = (struct ipv6hdr *)NdisGetDataBuffer(buffer,
+            sizeof(struct ipv6hdr), NULL, 1, 0);
+        if (ipv6_header == NULL)
+        {
+            DEBUG("FILTER: REJECT (failed to get IPv6 header)");
+            return FALSE;
+        }
+        ip_header_len = sizeof(struct ipv6hdr);
+        if (ipv6_header->Version != 6 ||
+            ip_header_len > tot_len ||
+            RtlUshortByteSwap(ipv6_header->Length) +
+                sizeof(struct ipv6hdr) != tot_len)
+        {
+            DEBUG("FILTER: REJECT (bad IPv6 packet)");
+            return FALSE;
+        }
+        proto = ipv6_header->NextHdr;
+        NdisAdvanceNetBufferDataStart(buffer, ip_header_len, FALSE, NULL);
 
-            if (hop)
-            {
-                if (ip_header->TTL <= 1)
-                {
-                    status = STATUS_HOPLIMIT_EXCEEDED;
-                }
-                if (ip_header->TTL != 0)
-                {
-                    ip_header->TTL--;
-                }
-            }
+        // Skip extension headers:
+        while (TRUE)
+        {
+            UINT8 *ext_header;
+            size_t ext_header_len;
+            BOOL isexthdr = TRUE;
 
-            if ((checksums & WINDIVERT_IP_CHECKSUM) != 0)
+            ext_header = (UINT8 *)NdisGetDataBuffer(buffer, 2, NULL, 1, 0);
+            if (ext_header == NULL)
             {
-                ip_header->Checksum = 0;
+                break;
             }
-            proto = ip_header->Protocol;
-            trans_len = len - ip_header_len;
-            trans_header = (UINT8 *)ip_header + ip_header_len;
-            break;
 
-        case 6:
-            if (len < sizeof(struct ipv6hdr))
+            ext_header_len = (size_t)ext_header[1];
+            switch (proto)
             {
-                return status;
+                case IPPROTO_FRAGMENT:
+                    ext_header_len = 8;
+                    break;
+                case IPPROTO_AH:
+                    ext_header_len += 2;
+                    ext_header_len *= 4;
+                    break;
+                case IPPROTO_HOPOPTS:
+                case IPPROTO_DSTOPTS:
+                case IPPROTO_ROUTING:
+                    ext_header_len++;
+                    ext_header_len *= 8;
+                    break;
+                default:
+                    isexthdr = FALSE;
+                    break;
             }
-            
-            if (hop)
+
+            if (!isexthdr)
             {
-                if (ipv6_header->HopLimit <= 1)
-                {
-                    status = STATUS_HOPLIMIT_EXCEEDED;
-                }
-                if (ipv6_header->HopLimit != 0)
-                {
-                    ipv6_header->HopLimit--;
-                }
+                break;
             }
 
-            trans_len = len - sizeof(struct ipv6hdr);
-            trans_header = (UINT8 *)(ipv6_header + 1);
+            proto = ext_header[0];
+            ip_header_len += ext_header_len;
+            NdisAdvanceNetBufferDataStart(buffer, ext_header_len, FALSE,
+                NULL);
+        }
+    }
 
-            // Skip extension headers:
-            proto = windivert_skip_headers(ipv6_header->NextHdr,
-                (UINT8 **)&trans_header, &trans_len);
+    switch (proto)
+    {
+        case IPPROTO_ICMP:
+            icmp_header = (struct icmphdr *)NdisGetDataBuffer(buffer,
+                sizeof(struct icmphdr), NULL, 1, 0);
+            break;
+        case IPPROTO_ICMPV6:
+            icmpv6_header = (struct icmpv6hdr *)NdisGetDataBuffer(buffer,
+                sizeof(struct icmpv6hdr), NULL, 1, 0);
+            break;
+        case IPPROTO_TCP:
+            tcp_header = (struct tcphdr *)NdisGetDataBuffer(buffer,
+                sizeof(struct tcphdr), NULL, 1, 0);
+            break;
+        case IPPROTO_UDP:
+            udp_header = (struct udphdr *)NdisGetDataBuffer(buffer,
+                sizeof(struct udphdr), NULL, 1, 0);
             break;
-
         default:
-            return status;
+            break;
+    }
+
+    status = NdisRetreatNetBufferDataStart(buffer, ip_header_len, 0, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        // Should never occur.
+        DEBUG("FILTER: REJECT (failed to retreat buffer)");
+        return FALSE;
+    }
+
+    // Locate the payload:
+    if (tcp_header != NULL && ip_header_len +
+            tcp_header->HdrLength*sizeof(UINT32) <= tot_len)
+    {
+        payload_off = ip_header_len + tcp_header->HdrLength*sizeof(UINT32);
+        payload_len = tot_len - payload_off;
+    }
+    else if (udp_header != NULL &&
+        ip_header_len + sizeof(struct udphdr) <= tot_len)
+    {
+        payload_off = ip_header_len + sizeof(struct udphdr);
+        payload_len = tot_len - payload_off;
+    }
+
+    meta->hdrs[WINDIVERT_FILTER_PROTOCOL_NONE] = (UINT8 *)buffer; // non-NULL
+    meta->hdrs[WINDIVERT_FILTER_PROTOCOL_IP] = (UINT8 *)ip_header;
+    meta->hdrs[WINDIVERT_FILTER_PROTOCOL_IPV6] = (UINT8 *)ipv6_header;
+    meta->hdrs[WINDIVERT_FILTER_PROTOCOL_ICMP] = (UINT8 *)icmp_header;
+    meta->hdrs[WINDIVERT_FILTER_PROTOCOL_ICMPV6] = (UINT8 *)icmpv6_header;
+    meta->hdrs[WINDIVERT_FILTER_PROTOCOL_TCP] = (UINT8 *)tcp_header;
+    meta->hdrs[WINDIVERT_FILTER_PROTOCOL_UDP] = (UINT8 *)udp_header;
+    meta->tot_len = tot_len;
+    meta->ip_header_len = ip_header_len;
+    meta->payload_off = payload_off;
+    meta->payload_len = payload_len;
+    meta->valid = TRUE;
+    return TRUE;
+}
+
+/*
+ * Checks if the given parsed packet is of interest.
+ */
+static BOOL windivert_filter_meta(meta_t meta, UINT32 if_idx,
+    UINT32 sub_if_idx, BOOL outbound, BOOL hop, UINT8 checksums,
+    filter_t filter, flow_cache_t cache)
+{
+    PNET_BUFFER buffer = meta->buffer;
+    size_t tot_len = meta->tot_len, ip_header_len = meta->ip_header_len;
+    size_t payload_off = meta->payload_off;
+    size_t payload_len = meta->payload_len;
+    UINT8 * const *hdrs = meta->hdrs;
+    struct iphdr *ip_header =
+        (struct iphdr *)hdrs[WINDIVERT_FILTER_PROTOCOL_IP];
+    struct ipv6hdr *ipv6_header =
+        (struct ipv6hdr *)hdrs[WINDIVERT_FILTER_PROTOCOL_IPV6];
+    struct tcphdr *tcp_header =
+        (struct tcphdr *)hdrs[WINDIVERT_FILTER_PROTOCOL_TCP];
+    struct udphdr *udp_header =
+        (struct udphdr *)hdrs[WINDIVERT_FILTER_PROTOCOL_UDP];
+    UINT32 key[WINDIVERT_FLOW_KEY_LEN];
+    UINT16 ip, ttl;
+    UINT8 i;
+    BOOL match;
+
+    if (!meta->valid)
+    {
+        return FALSE;
     }
 
-    switch (proto)
+    // Execute the filter:
+    if (cache != NULL)
     {
-        case IPPROTO_TCP:
-            if ((checksums & WINDIVERT_TCP_CHECKSUM) != 0)
+        // The flow key holds every value a flow-only filter can read:
+        RtlZeroMemory(key, sizeof(key));
+        if (ip_header != NULL)
+        {
+            key[0] = ip_header->SrcAddr;
+            key[4] = ip_header->DstAddr;
+            key[11] = (UINT32)ip_header->Protocol << 8;
+        }
+        else
+        {
+            RtlCopyMemory(key, ipv6_header->SrcAddr, 4 * sizeof(UINT32));
+            RtlCopyMemory(key + 4, ipv6_header->DstAddr, 4 * sizeof(UINT32));
+            key[11] = (UINT32)ipv6_header->NextHdr << 8;
+        }
+        if (tcp_header != NULL)
+        {
+            key[8] = *(UINT32 *)tcp_header;
+        }
+        else if (udp_header != NULL)
+        {
+            key[8] = *(UINT32 *)udp_header;
+        }
+        key[9] = if_idx;
+        key[10] = sub_if_idx;
+        for (i = 0; i <= WINDIVERT_FILTER_PROTOCOL_MAX; i++)
+        {
+            key[11] |= (hdrs[i] != NULL? 1 << i: 0) << 1;
+        }
+        key[11] |= (UINT32)outbound;
+        if (windivert_flow_cache_lookup(cache, key, &match))
+        {
+            return match;
+        }
+    }
+    ip = 0;
+    ttl = WINDIVERT_FILTER_MAXLEN+1;       // Additional safety
+    while (ttl-- != 0)
+    {
+        BOOL result;
+        int cmp;
+        UINT32 val, field[4], size;
+        UINT8 *hdr;
+        filter_t node = filter + ip;
+
+        result = (hdrs[node->protocol] != NULL);
+        if (result && node->op >= WINDIVERT_FILTER_OP_PAYLOAD8 &&
+            node->test != WINDIVERT_FILTER_TEST_CONTAINS &&
+            node->test != WINDIVERT_FILTER_TEST_PREFIX)
+        {
+            // Values beyond the end of the payload fail the test:
+            size = (UINT32)1 << (node->op - WINDIVERT_FILTER_OP_PAYLOAD8);
+            result = ((size_t)node->arg[1] + size <= payload_len &&
+                windivert_filter_payload_load(buffer,
+                    payload_off + node->arg[1], size, &val));
+        }
+        if (result)
+        {
+            hdr = hdrs[node->base] + node->offset;
+            switch (node->op)
             {
-                return status;
+                case WINDIVERT_FILTER_OP_INBOUND:
+                    val = (UINT32)(!outbound);
+                    break;
+                case WINDIVERT_FILTER_OP_OUTBOUND:
+                    val = (UINT32)outbound;
+                    break;
+                case WINDIVERT_FILTER_OP_IFIDX:
+                    val = (UINT32)if_idx;
+                    break;
+                case WINDIVERT_FILTER_OP_SUBIFIDX:
+                    val = (UINT32)sub_if_idx;
+                    break;
+                case WINDIVERT_FILTER_OP_PRESENT:
+                    val = (UINT32)(hdrs[node->base] != NULL);
+                    break;
+                case WINDIVERT_FILTER_OP_LOAD8:
+                    val = ((UINT32)*hdr >> node->shift) & node->mask;
+                    break;
+                case WINDIVERT_FILTER_OP_LOAD16:
+                    val = ((UINT32)RtlUshortByteSwap(*(UINT16 *)hdr) >>
+                        node->shift) & node->mask;
+                    break;
+                case WINDIVERT_FILTER_OP_LOAD32:
+                    val = (UINT32)RtlUlongByteSwap(*(UINT32 *)hdr);
+                    break;
+                case WINDIVERT_FILTER_OP_LOAD128:
+                    field[3] = (UINT32)RtlUlongByteSwap(((UINT32 *)hdr)[0]);
+                    field[2] = (UINT32)RtlUlongByteSwap(((UINT32 *)hdr)[1]);
+                    field[1] = (UINT32)RtlUlongByteSwap(((UINT32 *)hdr)[2]);
+                    field[0] = (UINT32)RtlUlongByteSwap(((UINT32 *)hdr)[3]);
+                    val = 0;
+                    break;
+                case WINDIVERT_FILTER_OP_HOPLIMIT:
+                    val = (UINT32)*hdr;
+                    if (hop)
+                    {
+                        val = (val == 0? 0: val-1);
+                    }
+                    break;
+                case WINDIVERT_FILTER_OP_CHECKSUM:
+                    val = ((checksums & node->mask) != 0?
+                        (UINT32)RtlUshortByteSwap(*(UINT16 *)hdr): 0);
+                    break;
+                case WINDIVERT_FILTER_OP_FLOWLABEL:
+                    val = (UINT32)RtlUlongByteSwap(
+                        IPV6HDR_GET_FLOWLABEL(ipv6_header));
+                    break;
+                case WINDIVERT_FILTER_OP_TCP_PAYLOADLENGTH:
+                    val = (UINT32)(tot_len - ip_header_len -
+                        tcp_header->HdrLength*sizeof(UINT32));
+                    break;
+                case WINDIVERT_FILTER_OP_UDP_PAYLOADLENGTH:
+                    val = (UINT32)(tot_len - ip_header_len -
+                        sizeof(struct udphdr));
+                    break;
+                case WINDIVERT_FILTER_OP_PAYLOAD8:
+                case WINDIVERT_FILTER_OP_PAYLOAD16:
+                case WINDIVERT_FILTER_OP_PAYLOAD32:
+                    break;                      // Loaded above.
+                default:
+                    val = 0;
+                    break;
             }
-            tcp_header = (struct tcphdr *)trans_header;
-            if (trans_len < sizeof(struct tcphdr))
+            if (node->op == WINDIVERT_FILTER_OP_LOAD128)
             {
-                return status;
+                cmp = windivert_big_num_compare(field, node->arg);
             }
-            tcp_header->Checksum = 0;
-            break;
-        
-        case IPPROTO_UDP:
-            if ((checksums & WINDIVERT_UDP_CHECKSUM) != 0)
+            else
             {
-                return status;
+                // arg[1..3] are zero for all other fields.
+                cmp = (val < node->arg[0]? -1: (val > node->arg[0]? 1: 0));
             }
-            udp_header = (struct udphdr *)trans_header;
-            if (trans_len < sizeof(struct udphdr))
+            switch (node->test)
             {
-                return status;
+                case WINDIVERT_FILTER_TEST_EQ:
+                    result = (cmp == 0);
+                    break;
+                case WINDIVERT_FILTER_TEST_NEQ:
+                    result = (cmp != 0);
+                    break;
+                case WINDIVERT_FILTER_TEST_LT:
+                    result = (cmp < 0);
+                    break;
+                case WINDIVERT_FILTER_TEST_LEQ:
+                    result = (cmp <= 0);
+                    break;
+                case WINDIVERT_FILTER_TEST_GT:
+                    result = (cmp > 0);
+                    break;
+                case WINDIVERT_FILTER_TEST_GEQ:
+                    result = (cmp >= 0);
+                    break;
+                case WINDIVERT_FILTER_TEST_IN:
+                    if (node->op != WINDIVERT_FILTER_OP_LOAD128)
+                    {
+                        field[0] = val;
+                        field[1] = field[2] = field[3] = 0;
+                    }
+                    result = windivert_filter_set_lookup(
+                        (filter_set_t)((UINT8 *)filter + node->arg[0]),
+                        field);
+                    break;
+                case WINDIVERT_FILTER_TEST_CONTAINS:
+                case WINDIVERT_FILTER_TEST_PREFIX:
+                    result = windivert_filter_ac_match(
+                        (filter_ac_t)((UINT8 *)filter + node->arg[0]),
+                        buffer, payload_off, payload_len,
+                        (node->test == WINDIVERT_FILTER_TEST_PREFIX));
+                    break;
+                default:
+                    result = FALSE;
+                    break;
             }
-            udp_header->Checksum = 0;
-            break;
+        }
+        ip = (result? node->success: node->failure);
+        if (ip == WINDIVERT_FILTER_RESULT_ACCEPT)
+        {
+            match = TRUE;
+            goto windivert_filter_exit;
+        }
+        if (ip == WINDIVERT_FILTER_RESULT_REJECT)
+        {
+            match = FALSE;
+            goto windivert_filter_exit;
+        }
     }
+    DEBUG("FILTER: REJECT (filter TTL exceeded)");
+    return FALSE;
 
-    return status;
+windivert_filter_exit:
+    if (cache != NULL)
+    {
+        windivert_flow_cache_insert(cache, key, match);
+    }
+    return match;
 }
 
 /*
- * Big number comparison.
+ * Checks if the filter's verdict only depends on the values in the flow key,
+ * i.e. the filter can be used with the flow cache.
  */
-static int windivert_big_num_compare(const UINT32 *a, const UINT32 *b)
+static BOOL windivert_filter_flow_only(filter_t filter)
 {
-    if (a[3] < b[3])
-    {
-        return -1;
-    }
-    if (a[3] > b[3])
-    {
-        return 1;
-    }
-    if (a[2] < b[2])
+    UINT16 i, last = 0;
+
+    // Successors always follow their node, so this visits every reachable
+    // node (and possibly some unreachable ones).
+    for (i = 0; i <= last && i < WINDIVERT_FILTER_MAXLEN; i++)
     {
-        return -1;
+        switch (filter[i].field)
+        {
+            case WINDIVERT_FILTER_FIELD_ZERO:
+            case WINDIVERT_FILTER_FIELD_INBOUND:
+            case WINDIVERT_FILTER_FIELD_OUTBOUND:
+            case WINDIVERT_FILTER_FIELD_IFIDX:
+            case WINDIVERT_FILTER_FIELD_SUBIFIDX:
+            case WINDIVERT_FILTER_FIELD_IP:
+            case WINDIVERT_FILTER_FIELD_IPV6:
+            case WINDIVERT_FILTER_FIELD_ICMP:
+            case WINDIVERT_FILTER_FIELD_TCP:
+            case WINDIVERT_FILTER_FIELD_UDP:
+            case WINDIVERT_FILTER_FIELD_ICMPV6:
+            case WINDIVERT_FILTER_FIELD_IP_PROTOCOL:
+            case WINDIVERT_FILTER_FIELD_IP_SRCADDR:
+            case WINDIVERT_FILTER_FIELD_IP_DSTADDR:
+            case WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR:
+            case WINDIVERT_FILTER_FIELD_IPV6_SRCADDR:
+            case WINDIVERT_FILTER_FIELD_IPV6_DSTADDR:
+            case WINDIVERT_FILTER_FIELD_TCP_SRCPORT:
+            case WINDIVERT_FILTER_FIELD_TCP_DSTPORT:
+            case WINDIVERT_FILTER_FIELD_UDP_SRCPORT:
+            case WINDIVERT_FILTER_FIELD_UDP_DSTPORT:
+                break;
+            default:
+                return FALSE;
+        }
+        if (filter[i].success < WINDIVERT_FILTER_MAXLEN &&
+            filter[i].success > last)
+        {
+            last = filter[i].success;
+        }
+        if (filter[i].failure < WINDIVERT_FILTER_MAXLEN &&
+            filter[i].failure > last)
+        {
+            last = filter[i].failure;
+        }
     }
-    if (a[2] > b[2])
+    return TRUE;
+}
+
+/*
+ * Flow cache entry for the given key.
+ */
+static flow_cache_entry_t windivert_flow_cache_entry(flow_cache_t cache,
+    const UINT32 *key)
+{
+    UINT32 hash = 0;
+    UINT i;
+
+    for (i = 0; i < WINDIVERT_FLOW_KEY_LEN; i++)
     {
-        return 1;
+        hash = (hash ^ key[i]) * 0x9E3779B1;
     }
-    if (a[1] < b[1])
+    hash ^= (hash >> 16);
+    return cache->entries + (hash & (WINDIVERT_FLOW_CACHE_SIZE - 1));
+}
+
+/*
+ * Look up a verdict in the flow cache.
+ */
+static BOOL windivert_flow_cache_lookup(flow_cache_t cache,
+    const UINT32 *key, BOOL *match)
+{
+    flow_cache_entry_t entry = windivert_flow_cache_entry(cache, key);
+    LONG seq;
+    BOOL result;
+
+    seq = entry->seq;
+    if (seq == 0 || (seq & 1) != 0)
     {
-        return -1;
+        return FALSE;                           // Empty or being updated.
     }
-    if (a[1] > b[1])
+    KeMemoryBarrier();
+    result = entry->match;
+    if (RtlCompareMemory(entry->key, key,
+            sizeof(entry->key)) != sizeof(entry->key))
     {
-        return 1;
+        return FALSE;
     }
-    if (a[0] < b[0])
+    KeMemoryBarrier();
+    if (entry->seq != seq)
     {
-        return -1;
+        return FALSE;
     }
-    if (a[0] > b[0])
+    *match = result;
+    return TRUE;
+}
+
+/*
+ * Insert a verdict into the flow cache.  The insert is skipped if another
+ * CPU is updating the same entry.
+ */
+static void windivert_flow_cache_insert(flow_cache_t cache,
+    const UINT32 *key, BOOL match)
+{
+    flow_cache_entry_t entry = windivert_flow_cache_entry(cache, key);
+    LONG seq;
+
+    seq = entry->seq;
+    if ((seq & 1) != 0 ||
+        InterlockedCompareExchange(&entry->seq, seq + 1, seq) != seq)
     {
-        return 1;
+        return;
     }
-    return 0;
+    RtlCopyMemory(entry->key, key, sizeof(entry->key));
+    entry->match = match;
+    KeMemoryBarrier();
+    InterlockedIncrement(&entry->seq);
 }
 
 /*
- * Checks if the given packet is of interest.
+ * Create the flow cache for a filter, if enabled.  The flow cache is only
+ * used if the filter's verdict is the same for every packet of a flow.  It
+ * is an optimization, so allocation failures are ignored.
  */
-static BOOL windivert_filter(PNET_BUFFER buffer, UINT32 if_idx,
-    UINT32 sub_if_idx, BOOL outbound, BOOL isipv4, BOOL hop, UINT8 checksums,
+static flow_cache_t windivert_flow_cache_create(context_t context,
     filter_t filter)
 {
-    size_t tot_len, ip_header_len;
-    struct iphdr *ip_header = NULL;
-    struct ipv6hdr *ipv6_header = NULL;
-    struct icmphdr *icmp_header = NULL;
-    struct icmpv6hdr *icmpv6_header = NULL;
-    struct tcphdr *tcp_header = NULL;
-    struct udphdr *udp_header = NULL;
-    UINT16 ip, ttl;
-    UINT8 proto;
-    NTSTATUS status;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    flow_cache_t flow_cache;
+    UINT64 flags;
 
-    // Parse the headers:
-    tot_len = NET_BUFFER_DATA_LENGTH(buffer);
-    if (tot_len < sizeof(struct iphdr))
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    flags = context->flags;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    if ((flags & WINDIVERT_FLAG_FLOW_CACHE) == 0 ||
+        !windivert_filter_flow_only(filter))
     {
-        DEBUG("FILTER: REJECT (packet length too small)");
-        return FALSE;
+        return NULL;
     }
-
-    // Get the IP header.
-    if (isipv4)
+    flow_cache = (flow_cache_t)windivert_malloc(sizeof(struct flow_cache_s),
+        FALSE);
+    if (flow_cache != NULL)
     {
-        // IPv4:
-        if (tot_len < sizeof(struct iphdr))
-        {
-            DEBUG("FILTER: REJECT (packet length too small)");
-            return FALSE;
-        }
-        ip_header = (struct iphdr *)NdisGetDataBuffer(buffer,
-            sizeof(struct iphdr), NULL, 1, 0);
-        if (ip_header == NULL)
-        {
-            DEBUG("FILTER: REJECT (failed to get IPv4 header)");
-            return FALSE;
-        }
-        ip_header_len = ip_header->HdrLength*sizeof(UINT32);
-        if (ip_header->Version != 4 ||
-            RtlUshortByteSwap(ip_header->Length) != tot_len ||
-            ip_header->HdrLength < 5 ||
-            ip_header_len > tot_len)
-        {
-            DEBUG("FILTER: REJECT (bad IPv4 packet)");
-            return FALSE;
-        }
-        proto = ip_header->Protocol;
-        NdisAdvanceNetBufferDataStart(buffer, ip_header_len, FALSE, NULL);
+        RtlZeroMemory(flow_cache, sizeof(struct flow_cache_s));
     }
-    else
+    return flow_cache;
+}
+
+/*
+ * Pin the current filter program.  A reader that loses a race with
+ * windivert_program_replace() drops its reference and retries, so it never
+ * uses a program that is about to be freed.
+ */
+static program_t windivert_program_acquire(context_t context)
+{
+    program_t program;
+    LONG curr;
+
+    while (TRUE)
     {
-        // IPv6:
-        if (tot_len < sizeof(struct ipv6hdr))
-        {
-            DEBUG("FILTER: REJECT (packet length too small)");
-            return FALSE;
-        }
-        ipv6_header = (struct ipv6hdr *)NdisGetDataBuffer(buffer,
-            sizeof(struct ipv6hdr), NULL, 1, 0);
-        if (ipv6_header == NULL)
+        curr = context->program_curr;
+        program = context->programs + curr;
+        InterlockedIncrement(&program->refs);
+        if (context->program_curr == curr)
         {
-            DEBUG("FILTER: REJECT (failed to get IPv6 header)");
-            return FALSE;
+            return program;
         }
-        ip_header_len = sizeof(struct ipv6hdr);
-        if (ipv6_header->Version != 6 ||
-            ip_header_len > tot_len ||
-            RtlUshortByteSwap(ipv6_header->Length) +
-                sizeof(struct ipv6hdr) != tot_len)
+        InterlockedDecrement(&program->refs);
+    }
+}
+
+/*
+ * Unpin a filter program.
+ */
+static void windivert_program_release(program_t program)
+{
+    InterlockedDecrement(&program->refs);
+}
+
+/*
+ * Make a new filter program current, and free the old program once its
+ * readers are done.  Readers hold a program for at most one work item, so
+ * this normally takes microseconds.  Must be called at PASSIVE_LEVEL by the
+ * thread that set context->replacing.
+ */
+static void windivert_program_replace(context_t context, filter_t filter,
+    flow_cache_t flow_cache)
+{
+    LARGE_INTEGER delay;
+    program_t old_program, new_program;
+    LONG curr;
+    UINT spins = 0;
+
+    curr = context->program_curr;
+    old_program = context->programs + curr;
+    new_program = context->programs + (1 - curr);
+    new_program->filter = filter;
+    new_program->flow_cache = flow_cache;
+    InterlockedExchange(&context->program_curr, 1 - curr);
+
+    delay.QuadPart = -10;                       // 1us
+    while (old_program->refs != 0)
+    {
+        if (spins++ < 1024)
         {
-            DEBUG("FILTER: REJECT (bad IPv6 packet)");
-            return FALSE;
+            YieldProcessor();
+            continue;
         }
-        proto = ipv6_header->NextHdr;
-        NdisAdvanceNetBufferDataStart(buffer, ip_header_len, FALSE, NULL);
+        KeDelayExecutionThread(KernelMode, FALSE, &delay);
+    }
+    windivert_free(old_program->filter);
+    windivert_free(old_program->flow_cache);
+    old_program->filter = NULL;
+    old_program->flow_cache = NULL;
+}
 
-        // Skip extension headers:
-        while (TRUE)
-        {
-            UINT8 *ext_header;
-            size_t ext_header_len;
-            BOOL isexthdr = TRUE;
+/*
+ * Analyze the given filter.
+ */
+static void windivert_filter_analyze(filter_t filter, BOOL *is_inbound,
+    BOOL *is_outbound, BOOL *is_ipv4, BOOL *is_ipv6)
+{
+    BOOL result;
 
-            ext_header = (UINT8 *)NdisGetDataBuffer(buffer, 2, NULL, 1, 0);
-            if (ext_header == NULL)
-            {
-                break;
-            }
+    // False filter?
+    result = windivert_filter_test(filter, 0, WINDIVERT_FILTER_PROTOCOL_NONE,
+        WINDIVERT_FILTER_FIELD_ZERO, 0);
+    if (!result)
+    {
+        *is_inbound  = FALSE;
+        *is_outbound = FALSE;
+        *is_ipv4     = FALSE;
+        *is_ipv6     = FALSE;
+        return;
+    }
 
-            ext_header_len = (size_t)ext_header[1];
-            switch (proto)
-            {
-                case IPPROTO_FRAGMENT:
-                    ext_header_len = 8;
-                    break;
-                case IPPROTO_AH:
-                    ext_header_len += 2;
-                    ext_header_len *= 4;
-                    break;
-                case IPPROTO_HOPOPTS:
-                case IPPROTO_DSTOPTS:
-                case IPPROTO_ROUTING:
-                    ext_header_len++;
-                    ext_header_len *= 8;
-                    break;
-                default:
-                    isexthdr = FALSE;
-                    break;
-            }
+    // Inbound?
+    result = windivert_filter_test(filter, 0, WINDIVERT_FILTER_PROTOCOL_NONE,
+        WINDIVERT_FILTER_FIELD_INBOUND, 1);
+    if (result)
+    {
+        result = windivert_filter_test(filter, 0,
+            WINDIVERT_FILTER_PROTOCOL_NONE, WINDIVERT_FILTER_FIELD_OUTBOUND,
+            0);
+    }
+    *is_inbound = result;
 
-            if (!isexthdr)
-            {
-                break;
-            }
+    // Outbound?
+    result = windivert_filter_test(filter, 0, WINDIVERT_FILTER_PROTOCOL_NONE,
+        WINDIVERT_FILTER_FIELD_OUTBOUND, 1);
+    if (result)
+    {
+        result = windivert_filter_test(filter, 0,
+            WINDIVERT_FILTER_PROTOCOL_NONE, WINDIVERT_FILTER_FIELD_INBOUND, 0);
+    }
+    *is_outbound = result;
 
-            proto = ext_header[0];
-            ip_header_len += ext_header_len;
-            NdisAdvanceNetBufferDataStart(buffer, ext_header_len, FALSE,
-                NULL);
-        }
+    // IPv4?
+    result = windivert_filter_test(filter, 0, WINDIVERT_FILTER_PROTOCOL_NONE,
+        WINDIVERT_FILTER_FIELD_IP, 1);
+    if (result)
+    {
+        result = windivert_filter_test(filter, 0,
+            WINDIVERT_FILTER_PROTOCOL_NONE, WINDIVERT_FILTER_FIELD_IPV6, 0);
     }
+    *is_ipv4 = result;
 
-    switch (proto)
+    // Ipv6?
+    result = windivert_filter_test(filter, 0, WINDIVERT_FILTER_PROTOCOL_NONE,
+        WINDIVERT_FILTER_FIELD_IPV6, 1);
+    if (result)
     {
-        case IPPROTO_ICMP:
-            icmp_header = (struct icmphdr *)NdisGetDataBuffer(buffer,
-                sizeof(struct icmphdr), NULL, 1, 0);
+        result = windivert_filter_test(filter, 0,
+            WINDIVERT_FILTER_PROTOCOL_NONE, WINDIVERT_FILTER_FIELD_IP, 0);
+    }
+    *is_ipv6 = result;
+}
+
+/*
+ * Add a WFP filter condition.
+ */
+static void windivert_condition_add(conditions_t conds, const GUID *key,
+    UINT8 test, BOOL ipv4, const UINT32 *val, UINT8 prefix)
+{
+    FWPM_FILTER_CONDITION0 *cond;
+    UINT i;
+
+    if (conds->len >= WINDIVERT_CONDITIONS_MAX)
+    {
+        return;
+    }
+    cond = conds->cond + conds->len;
+    RtlZeroMemory(cond, sizeof(FWPM_FILTER_CONDITION0));
+    cond->fieldKey = *key;
+    switch (test)
+    {
+        case WINDIVERT_FILTER_TEST_EQ: case WINDIVERT_FILTER_TEST_IN:
+            cond->matchType = FWP_MATCH_EQUAL;
             break;
-        case IPPROTO_ICMPV6:
-            icmpv6_header = (struct icmpv6hdr *)NdisGetDataBuffer(buffer,
-                sizeof(struct icmpv6hdr), NULL, 1, 0);
+        case WINDIVERT_FILTER_TEST_NEQ:
+            cond->matchType = FWP_MATCH_NOT_EQUAL;
             break;
-        case IPPROTO_TCP:
-            tcp_header = (struct tcphdr *)NdisGetDataBuffer(buffer,
-                sizeof(struct tcphdr), NULL, 1, 0);
+        case WINDIVERT_FILTER_TEST_LT:
+            cond->matchType = FWP_MATCH_LESS;
             break;
-        case IPPROTO_UDP:
-            udp_header = (struct udphdr *)NdisGetDataBuffer(buffer,
-                sizeof(struct udphdr), NULL, 1, 0);
+        case WINDIVERT_FILTER_TEST_LEQ:
+            cond->matchType = FWP_MATCH_LESS_OR_EQUAL;
             break;
-        default:
+        case WINDIVERT_FILTER_TEST_GT:
+            cond->matchType = FWP_MATCH_GREATER;
+            break;
+        case WINDIVERT_FILTER_TEST_GEQ:
+            cond->matchType = FWP_MATCH_GREATER_OR_EQUAL;
             break;
+        default:
+            return;
     }
-
-    status = NdisRetreatNetBufferDataStart(buffer, ip_header_len, 0, NULL);
-    if (!NT_SUCCESS(status))
+    if (ipv4 && prefix >= 32)
     {
-        // Should never occur.
-        DEBUG("FILTER: REJECT (failed to retreat buffer)");
-        return FALSE;
+        cond->conditionValue.type = FWP_UINT32;
+        cond->conditionValue.uint32 = val[0];
     }
-
-    // Execute the filter:
-    ip = 0;
-    ttl = WINDIVERT_FILTER_MAXLEN+1;       // Additional safety
-    while (ttl-- != 0)
+    else if (ipv4)
     {
-        BOOL result;
-        int cmp;
-        UINT32 field[4];
-        field[1] = 0;
-        field[2] = 0;
-        field[3] = 0;
-        switch (filter[ip].protocol)
-        {
-            case WINDIVERT_FILTER_PROTOCOL_NONE:
-                result = TRUE;
-                break;
-            case WINDIVERT_FILTER_PROTOCOL_IP:
-                result = (ip_header != NULL);
-                break;
-            case WINDIVERT_FILTER_PROTOCOL_IPV6:
-                result = (ipv6_header != NULL);
-                break;
-            case WINDIVERT_FILTER_PROTOCOL_ICMP:
-                result = (icmp_header != NULL);
-                break;
-            case WINDIVERT_FILTER_PROTOCOL_ICMPV6:
-                result = (icmpv6_header != NULL);
-                break;
-            case WINDIVERT_FILTER_PROTOCOL_TCP:
-                result = (tcp_header != NULL);
-                break;
-            case WINDIVERT_FILTER_PROTOCOL_UDP:
-                result = (udp_header != NULL);
-                break;
-            default:
-                result = FALSE;
-                break;
+        conds->v4[conds->len].addr = val[0];
+        conds->v4[conds->len].mask =
+            (prefix == 0? 0: 0xFFFFFFFF << (32 - prefix));
+        cond->conditionValue.type = FWP_V4_ADDR_MASK;
+        cond->conditionValue.v4AddrMask = conds->v4 + conds->len;
+    }
+    else
+    {
+        // IPv6 addresses (network byte order); val[3] is the most
+        // significant word.
+        for (i = 0; i < 4; i++)
+        {
+            conds->addr[conds->len].byteArray16[4*i+0] =
+                (UINT8)(val[3-i] >> 24);
+            conds->addr[conds->len].byteArray16[4*i+1] =
+                (UINT8)(val[3-i] >> 16);
+            conds->addr[conds->len].byteArray16[4*i+2] =
+                (UINT8)(val[3-i] >> 8);
+            conds->addr[conds->len].byteArray16[4*i+3] = (UINT8)val[3-i];
         }
-        if (result)
+        if (prefix >= 128)
         {
-            switch (filter[ip].field)
-            {
-                case WINDIVERT_FILTER_FIELD_ZERO:
-                    field[0] = 0;
-                    break;
-                case WINDIVERT_FILTER_FIELD_INBOUND:
-                    field[0] = (UINT32)(!outbound);
-                    break;
-                case WINDIVERT_FILTER_FIELD_OUTBOUND:
-                    field[0] = (UINT32)outbound;
-                    break;
-                case WINDIVERT_FILTER_FIELD_IFIDX:
-                    field[0] = (UINT32)if_idx;
-                    break;
-                case WINDIVERT_FILTER_FIELD_SUBIFIDX:
-                    field[0] = (UINT32)sub_if_idx;
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP:
-                    field[0] = (UINT32)(ip_header != NULL);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6:
-                    field[0] = (UINT32)(ipv6_header != NULL);
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMP:
-                    field[0] = (UINT32)(icmp_header != NULL);
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMPV6:
-                    field[0] = (UINT32)(icmpv6_header != NULL);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP:
-                    field[0] = (UINT32)(tcp_header != NULL);
-                    break;
-                case WINDIVERT_FILTER_FIELD_UDP:
-                    field[0] = (UINT32)(udp_header != NULL);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_HDRLENGTH:
-                    field[0] = (UINT32)ip_header->HdrLength;
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_TOS:
-                    field[0] = (UINT32)ip_header->TOS;
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_LENGTH:
-                    field[0] = (UINT32)RtlUshortByteSwap(ip_header->Length);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_ID:
-                    field[0] = (UINT32)RtlUshortByteSwap(ip_header->Id);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_DF:
-                    field[0] = (UINT32)IPHDR_GET_DF(ip_header);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_MF:
-                    field[0] = (UINT32)IPHDR_GET_MF(ip_header);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_FRAGOFF:
-                    field[0] = (UINT32)RtlUshortByteSwap(
-                        IPHDR_GET_FRAGOFF(ip_header));
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_TTL:
-                    field[0] = (UINT32)ip_header->TTL;
-                    if (hop)
-                    {
-                        field[0] = (field[0] == 0? 0: field[0]-1);
-                    }
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_PROTOCOL:
-                    field[0] = (UINT32)ip_header->Protocol;
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_CHECKSUM:
-                    if ((checksums & WINDIVERT_IP_CHECKSUM) != 0)
-                    {
-                        field[0] =
-                            (UINT32)RtlUshortByteSwap(ip_header->Checksum);
-                    }
-                    else
-                    {
-                        field[0] = 0;
-                    }
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_SRCADDR:
-                    field[0] = (UINT32)RtlUlongByteSwap(ip_header->SrcAddr);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_DSTADDR:
-                    field[0] = (UINT32)RtlUlongByteSwap(ip_header->DstAddr);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_TRAFFICCLASS:
-                    field[0] = (UINT32)IPV6HDR_GET_TRAFFICCLASS(ipv6_header);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_FLOWLABEL:
-                    field[0] = (UINT32)RtlUlongByteSwap(
-                        IPV6HDR_GET_FLOWLABEL(ipv6_header));
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_LENGTH:
-                    field[0] = (UINT32)RtlUshortByteSwap(ipv6_header->Length);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR:
-                    field[0] = (UINT32)ipv6_header->NextHdr;
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT:
-                    field[0] = (UINT32)ipv6_header->HopLimit;
-                    if (hop)
-                    {
-                        field[0] = (field[0] == 0? 0: field[0]-1);
-                    }
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_SRCADDR:
-                    field[3] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->SrcAddr[0]);
-                    field[2] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->SrcAddr[1]);
-                    field[1] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->SrcAddr[2]);
-                    field[0] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->SrcAddr[3]);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_DSTADDR:
-                    field[3] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->DstAddr[0]);
-                    field[2] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->DstAddr[1]);
-                    field[1] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->DstAddr[2]);
-                    field[0] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->DstAddr[3]);
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMP_TYPE:
-                    field[0] = (UINT32)icmp_header->Type;
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMP_CODE:
-                    field[0] = (UINT32)icmp_header->Code;
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMP_CHECKSUM:
-                    field[0] =
-                        (UINT32)RtlUshortByteSwap(icmp_header->Checksum);
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMP_BODY:
-                    field[0] = (UINT32)RtlUlongByteSwap(icmp_header->Body);
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMPV6_TYPE:
-                    field[0] = (UINT32)icmpv6_header->Type;
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMPV6_CODE:
-                    field[0] = (UINT32)icmpv6_header->Code;
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMPV6_CHECKSUM:
-                    field[0] =
-                        (UINT32)RtlUshortByteSwap(icmpv6_header->Checksum);
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMPV6_BODY:
-                    field[0] =
-                        (UINT32)RtlUlongByteSwap(icmpv6_header->Body);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_SRCPORT:
-                    field[0] = (UINT32)RtlUshortByteSwap(tcp_header->SrcPort);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_DSTPORT:
-                    field[0] = (UINT32)RtlUshortByteSwap(tcp_header->DstPort);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_SEQNUM:
-                    field[0] = (UINT32)RtlUlongByteSwap(tcp_header->SeqNum);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_ACKNUM:
-                    field[0] = (UINT32)RtlUlongByteSwap(tcp_header->AckNum);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_HDRLENGTH:
-                    field[0] = (UINT32)tcp_header->HdrLength;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_URG:
-                    field[0] = (UINT32)tcp_header->Urg;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_ACK:
-                    field[0] = (UINT32)tcp_header->Ack;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_PSH:
-                    field[0] = (UINT32)tcp_header->Psh;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_RST:
-                    field[0] = (UINT32)tcp_header->Rst;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_SYN:
-                    field[0] = (UINT32)tcp_header->Syn;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_FIN:
-                    field[0] = (UINT32)tcp_header->Fin;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_WINDOW:
-                    field[0] = (UINT32)RtlUshortByteSwap(tcp_header->Window);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_CHECKSUM:
-                    if ((checksums & WINDIVERT_TCP_CHECKSUM) != 0)
-                    {
-                        field[0] =
-                            (UINT32)RtlUshortByteSwap(tcp_header->Checksum);
-                    }
-                    else
-                    {
-                        field[0] = 0;
-                    }
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_URGPTR:
-                    field[0] = (UINT32)RtlUshortByteSwap(tcp_header->UrgPtr);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_PAYLOADLENGTH:
-                    field[0] = (UINT32)(tot_len - ip_header_len -
-                        tcp_header->HdrLength*sizeof(UINT32));
-                    break;
-                case WINDIVERT_FILTER_FIELD_UDP_SRCPORT:
-                    field[0] = (UINT32)RtlUshortByteSwap(udp_header->SrcPort);
-                    break;
-                case WINDIVERT_FILTER_FIELD_UDP_DSTPORT:
-                    field[0] = (UINT32)RtlUshortByteSwap(udp_header->DstPort);
-                    break;
-                case WINDIVERT_FILTER_FIELD_UDP_LENGTH:
-                    field[0] = (UINT32)RtlUshortByteSwap(udp_header->Length);
-                    break;
-                case WINDIVERT_FILTER_FIELD_UDP_CHECKSUM:
-                    if ((checksums & WINDIVERT_UDP_CHECKSUM) != 0)
-                    {
-                        field[0] =
-                            (UINT32)RtlUshortByteSwap(udp_header->Checksum);
-                    }
-                    else
-                    {
-                        field[0] = 0;
-                    }
-                    break;
-                case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
-                    field[0] = (UINT32)(tot_len - ip_header_len -
-                        sizeof(struct udphdr));
-                    break;
-                default:
-                    field[0] = 0;
-                    break;
-            }
-            cmp = windivert_big_num_compare(field, filter[ip].arg);
-            switch (filter[ip].test)
+            cond->conditionValue.type = FWP_BYTE_ARRAY16_TYPE;
+            cond->conditionValue.byteArray16 = conds->addr + conds->len;
+        }
+        else
+        {
+            RtlCopyMemory(conds->v6[conds->len].addr,
+                conds->addr[conds->len].byteArray16, 16);
+            conds->v6[conds->len].prefixLength = prefix;
+            cond->conditionValue.type = FWP_V6_ADDR_MASK;
+            cond->conditionValue.v6AddrMask = conds->v6 + conds->len;
+        }
+    }
+    conds->len++;
+}
+
+/*
+ * Extract the WFP filter conditions for the given layer.  Only predicates
+ * that every accepted packet must satisfy are extracted (the leading chain
+ * of nodes whose other branch is REJECT), so the conditions never exclude a
+ * packet the filter would accept.  WFP ORs conditions with the same key and
+ * ANDs different keys, hence at most one predicate is extracted per field.
+ * The filter itself is still evaluated by the callout.
+ */
+static void windivert_filter_conditions(filter_t filter, layer_t layer,
+    conditions_t conds)
+{
+    filter_t node;
+    filter_set_t set;
+    filter_set_entry_t entries;
+    const GUID *key;
+    UINT64 used = 0;
+    UINT32 j, count;
+    UINT16 ip = 0, ttl = WINDIVERT_FILTER_MAXLEN;
+    UINT8 test;
+    BOOL negate, ipv4;
+
+    conds->len = 0;
+    while (ttl-- != 0 && ip < WINDIVERT_FILTER_MAXLEN)
+    {
+        node = filter + ip;
+        if (node->failure == WINDIVERT_FILTER_RESULT_REJECT)
+        {
+            negate = FALSE;
+            ip = node->success;
+        }
+        else if (node->success == WINDIVERT_FILTER_RESULT_REJECT)
+        {
+            negate = TRUE;
+            ip = node->failure;
+        }
+        else
+        {
+            break;
+        }
+
+        ipv4 = layer->ipv4;
+        switch (node->field)
+        {
+            case WINDIVERT_FILTER_FIELD_IP_SRCADDR:
+                key = (layer->ipv4? layer->src_addr_key: NULL);
+                break;
+            case WINDIVERT_FILTER_FIELD_IP_DSTADDR:
+                key = (layer->ipv4? layer->dst_addr_key: NULL);
+                break;
+            case WINDIVERT_FILTER_FIELD_IPV6_SRCADDR:
+                key = (layer->ipv4? NULL: layer->src_addr_key);
+                break;
+            case WINDIVERT_FILTER_FIELD_IPV6_DSTADDR:
+                key = (layer->ipv4? NULL: layer->dst_addr_key);
+                break;
+            case WINDIVERT_FILTER_FIELD_IFIDX:
+                key = layer->if_idx_key;
+                ipv4 = TRUE;                    // (32-bit value)
+                break;
+            case WINDIVERT_FILTER_FIELD_SUBIFIDX:
+                key = layer->sub_if_idx_key;
+                ipv4 = TRUE;
+                break;
+            default:
+                key = NULL;
+                break;
+        }
+        if (key == NULL || (used & ((UINT64)1 << node->field)) != 0)
+        {
+            continue;
+        }
+
+        test = node->test;
+        if (negate)
+        {
+            switch (test)
             {
                 case WINDIVERT_FILTER_TEST_EQ:
-                    result = (cmp == 0);
+                    test = WINDIVERT_FILTER_TEST_NEQ;
                     break;
                 case WINDIVERT_FILTER_TEST_NEQ:
-                    result = (cmp != 0);
+                    test = WINDIVERT_FILTER_TEST_EQ;
                     break;
                 case WINDIVERT_FILTER_TEST_LT:
-                    result = (cmp < 0);
+                    test = WINDIVERT_FILTER_TEST_GEQ;
                     break;
                 case WINDIVERT_FILTER_TEST_LEQ:
-                    result = (cmp <= 0);
+                    test = WINDIVERT_FILTER_TEST_GT;
                     break;
                 case WINDIVERT_FILTER_TEST_GT:
-                    result = (cmp > 0);
+                    test = WINDIVERT_FILTER_TEST_LEQ;
                     break;
                 case WINDIVERT_FILTER_TEST_GEQ:
-                    result = (cmp >= 0);
+                    test = WINDIVERT_FILTER_TEST_LT;
                     break;
                 default:
-                    result = FALSE;
-                    break;
+                    continue;                   // Cannot negate a set.
             }
         }
-        ip = (result? filter[ip].success: filter[ip].failure);
-        if (ip == WINDIVERT_FILTER_RESULT_ACCEPT)
+        if (!ipv4 && test != WINDIVERT_FILTER_TEST_EQ &&
+            test != WINDIVERT_FILTER_TEST_IN)
         {
-            return TRUE;
+            continue;                           // IPv6: equality only.
         }
-        if (ip == WINDIVERT_FILTER_RESULT_REJECT)
+
+        if (test != WINDIVERT_FILTER_TEST_IN)
         {
-            return FALSE;
+            windivert_condition_add(conds, key, test, ipv4, node->arg,
+                (ipv4? 32: 128));
+            used |= ((UINT64)1 << node->field);
+            continue;
+        }
+
+        // Sets become one (OR'ed) condition per element, if they all fit:
+        set = (filter_set_t)((UINT8 *)filter + node->arg[0]);
+        entries = WINDIVERT_FILTER_SET_ENTRIES(set);
+        for (j = 0, count = 0; j <= set->mask; j++)
+        {
+            count += (entries[j].used? 1: 0);
+        }
+        if (count == 0 || conds->len + count > WINDIVERT_CONDITIONS_MAX)
+        {
+            continue;
+        }
+        for (j = 0; j <= set->mask; j++)
+        {
+            if (entries[j].used)
+            {
+                windivert_condition_add(conds, key, test, ipv4,
+                    entries[j].val, entries[j].prefix);
+            }
         }
+        used |= ((UINT64)1 << node->field);
     }
-    DEBUG("FILTER: REJECT (filter TTL exceeded)");
-    return FALSE;
 }
 
 /*
- * Analyze the given filter.
+ * Compare two sets of WFP filter conditions.
  */
-static void windivert_filter_analyze(filter_t filter, BOOL *is_inbound,
-    BOOL *is_outbound, BOOL *is_ipv4, BOOL *is_ipv6)
+static BOOL windivert_conditions_equal(conditions_t a, conditions_t b)
 {
-    BOOL result;
-
-    // False filter?
-    result = windivert_filter_test(filter, 0, WINDIVERT_FILTER_PROTOCOL_NONE,
-        WINDIVERT_FILTER_FIELD_ZERO, 0);
-    if (!result)
-    {
-        *is_inbound  = FALSE;
-        *is_outbound = FALSE;
-        *is_ipv4     = FALSE;
-        *is_ipv6     = FALSE;
-        return;
-    }
-
-    // Inbound?
-    result = windivert_filter_test(filter, 0, WINDIVERT_FILTER_PROTOCOL_NONE,
-        WINDIVERT_FILTER_FIELD_INBOUND, 1);
-    if (result)
-    {
-        result = windivert_filter_test(filter, 0,
-            WINDIVERT_FILTER_PROTOCOL_NONE, WINDIVERT_FILTER_FIELD_OUTBOUND,
-            0);
-    }
-    *is_inbound = result;
-
-    // Outbound?
-    result = windivert_filter_test(filter, 0, WINDIVERT_FILTER_PROTOCOL_NONE,
-        WINDIVERT_FILTER_FIELD_OUTBOUND, 1);
-    if (result)
-    {
-        result = windivert_filter_test(filter, 0,
-            WINDIVERT_FILTER_PROTOCOL_NONE, WINDIVERT_FILTER_FIELD_INBOUND, 0);
-    }
-    *is_outbound = result;
+    FWPM_FILTER_CONDITION0 *x, *y;
+    UINT32 i;
 
-    // IPv4?
-    result = windivert_filter_test(filter, 0, WINDIVERT_FILTER_PROTOCOL_NONE,
-        WINDIVERT_FILTER_FIELD_IP, 1);
-    if (result)
+    if (a->len != b->len)
     {
-        result = windivert_filter_test(filter, 0,
-            WINDIVERT_FILTER_PROTOCOL_NONE, WINDIVERT_FILTER_FIELD_IPV6, 0);
+        return FALSE;
     }
-    *is_ipv4 = result;
-
-    // Ipv6?
-    result = windivert_filter_test(filter, 0, WINDIVERT_FILTER_PROTOCOL_NONE,
-        WINDIVERT_FILTER_FIELD_IPV6, 1);
-    if (result)
+    for (i = 0; i < a->len; i++)
     {
-        result = windivert_filter_test(filter, 0,
-            WINDIVERT_FILTER_PROTOCOL_NONE, WINDIVERT_FILTER_FIELD_IP, 0);
+        x = a->cond + i;
+        y = b->cond + i;
+        if (!IsEqualGUID(&x->fieldKey, &y->fieldKey) ||
+            x->matchType != y->matchType ||
+            x->conditionValue.type != y->conditionValue.type)
+        {
+            return FALSE;
+        }
+        switch (x->conditionValue.type)
+        {
+            case FWP_UINT32:
+                if (x->conditionValue.uint32 != y->conditionValue.uint32)
+                {
+                    return FALSE;
+                }
+                break;
+            case FWP_V4_ADDR_MASK:
+                if (a->v4[i].addr != b->v4[i].addr ||
+                    a->v4[i].mask != b->v4[i].mask)
+                {
+                    return FALSE;
+                }
+                break;
+            case FWP_V6_ADDR_MASK:
+                if (RtlCompareMemory(&a->v6[i], &b->v6[i],
+                        sizeof(FWP_V6_ADDR_AND_MASK)) !=
+                            sizeof(FWP_V6_ADDR_AND_MASK))
+                {
+                    return FALSE;
+                }
+                break;
+            default:
+                if (RtlCompareMemory(&a->addr[i], &b->addr[i],
+                        sizeof(FWP_BYTE_ARRAY16)) != sizeof(FWP_BYTE_ARRAY16))
+                {
+                    return FALSE;
+                }
+                break;
+        }
     }
-    *is_ipv6 = result;
+    return TRUE;
 }
 
 /*
@@ -3788,7 +8571,10 @@ static BOOL windivert_filter_test(filter_t filter, UINT16 ip, UINT8 protocol,
     }
 
     if (filter[ip].protocol == protocol &&
-        filter[ip].field == field)
+        filter[ip].field == field &&
+        filter[ip].test != WINDIVERT_FILTER_TEST_IN &&
+        filter[ip].test != WINDIVERT_FILTER_TEST_CONTAINS &&
+        filter[ip].test != WINDIVERT_FILTER_TEST_PREFIX)
     {
         known = TRUE;
         switch (filter[ip].test)
@@ -3836,24 +8622,40 @@ static BOOL windivert_filter_test(filter_t filter, UINT16 ip, UINT8 protocol,
 }
 
 /*
- * Compile a WinDivert filter from an IOCTL.
+ * Compile a WinDivert filter from an IOCTL.  The IOCTL holds length filter
+ * objects followed by the set elements.
  */
 static filter_t windivert_filter_compile(windivert_ioctl_filter_t ioctl_filter,
-    size_t ioctl_filter_len)
+    size_t ioctl_filter_len, UINT64 length)
 {
     filter_t filter0 = NULL, result = NULL;
+    const struct filter_field_s *field;
+    windivert_ioctl_set_t ioctl_set;
+    filter_set_t set;
     UINT16 i;
-    size_t length;
+    UINT32 j, size, len, states;
+    UINT8 width;
+    BOOL payload;
+    size_t set_length, set_total = 0, alloc_len;
 
-    if (ioctl_filter_len % sizeof(struct windivert_ioctl_filter_s) != 0)
+    if (length >= WINDIVERT_FILTER_MAXLEN ||
+        ioctl_filter_len < length * sizeof(struct windivert_ioctl_filter_s))
+    {
+        goto windivert_filter_compile_exit;
+    }
+    ioctl_set = (windivert_ioctl_set_t)(ioctl_filter + length);
+    set_length = ioctl_filter_len -
+        (size_t)length * sizeof(struct windivert_ioctl_filter_s);
+    if (set_length % sizeof(struct windivert_ioctl_set_s) != 0)
     {
         goto windivert_filter_compile_exit;
     }
-    length = ioctl_filter_len / sizeof(struct windivert_ioctl_filter_s);
-    if (length >= WINDIVERT_FILTER_MAXLEN)
+    set_length /= sizeof(struct windivert_ioctl_set_s);
+    if (set_length > WINDIVERT_FILTER_SET_MAXLEN)
     {
         goto windivert_filter_compile_exit;
     }
+    alloc_len = (size_t)length * sizeof(struct filter_s);
 
     // Do NOT use the stack (size = 12Kb on x86) for filter0.
     filter0 = (filter_t)windivert_malloc(
@@ -3897,8 +8699,118 @@ static filter_t windivert_filter_compile(windivert_ioctl_filter_t ioctl_filter,
                 break;
         }
 
+        payload = (ioctl_filter[i].field >=
+                WINDIVERT_FILTER_FIELD_TCP_PAYLOAD &&
+            ioctl_filter[i].field <= WINDIVERT_FILTER_FIELD_UDP_PAYLOAD32);
+
+        // Pattern matchers are validated and sized here, and built after
+        // allocation:
+        if (ioctl_filter[i].test == WINDIVERT_FILTER_TEST_CONTAINS ||
+            ioctl_filter[i].test == WINDIVERT_FILTER_TEST_PREFIX)
+        {
+            if ((ioctl_filter[i].field != WINDIVERT_FILTER_FIELD_TCP_PAYLOAD &&
+                 ioctl_filter[i].field != WINDIVERT_FILTER_FIELD_UDP_PAYLOAD) ||
+                (UINT64)ioctl_filter[i].arg[0] +
+                    (UINT64)ioctl_filter[i].arg[1] > set_length ||
+                ioctl_filter[i].arg[2] != 0 || ioctl_filter[i].arg[3] != 0)
+            {
+                goto windivert_filter_compile_exit;
+            }
+            set_total += ioctl_filter[i].arg[1];
+            if (set_total > WINDIVERT_FILTER_SET_MAXLEN)
+            {
+                goto windivert_filter_compile_exit;
+            }
+            states = 1;
+            for (j = 0; j < ioctl_filter[i].arg[1];
+                    j += 1 + WINDIVERT_FILTER_PATTERN_ELEMS(len))
+            {
+                len = ioctl_set[ioctl_filter[i].arg[0] + j].val[0];
+                if (len == 0 || len > WINDIVERT_FILTER_PATTERN_MAXLEN ||
+                    j + 1 + WINDIVERT_FILTER_PATTERN_ELEMS(len) >
+                        ioctl_filter[i].arg[1])
+                {
+                    goto windivert_filter_compile_exit;
+                }
+                states += len;
+                if (states > WINDIVERT_FILTER_PATTERN_MAXSTATES)
+                {
+                    goto windivert_filter_compile_exit;
+                }
+            }
+            alloc_len = (alloc_len + 7) & ~(size_t)7;
+            filter0[i].field   = ioctl_filter[i].field;
+            filter0[i].test    = ioctl_filter[i].test;
+            filter0[i].success = ioctl_filter[i].success;
+            filter0[i].failure = ioctl_filter[i].failure;
+            filter0[i].arg[0]  = (UINT32)alloc_len;    // Matcher offset
+            filter0[i].arg[1]  = states;
+            filter0[i].arg[2]  = ioctl_filter[i].arg[0];
+            filter0[i].arg[3]  = ioctl_filter[i].arg[1];
+            alloc_len += sizeof(struct filter_ac_s) +
+                states * sizeof(struct filter_ac_state_s) +
+                WINDIVERT_FILTER_AC_DENSE_ROWS(states) * 256 * sizeof(UINT16);
+            goto windivert_filter_compile_lower;
+        }
+
+        // Sets are validated and sized here, and built after allocation:
+        if (ioctl_filter[i].test == WINDIVERT_FILTER_TEST_IN)
+        {
+            if (payload ||
+                (UINT64)ioctl_filter[i].arg[0] +
+                    (UINT64)ioctl_filter[i].arg[1] > set_length ||
+                ioctl_filter[i].arg[2] != 0 || ioctl_filter[i].arg[3] != 0)
+            {
+                goto windivert_filter_compile_exit;
+            }
+            set_total += ioctl_filter[i].arg[1];
+            if (set_total > WINDIVERT_FILTER_SET_MAXLEN)
+            {
+                goto windivert_filter_compile_exit;
+            }
+            width = (ioctl_filter[i].field ==
+                        WINDIVERT_FILTER_FIELD_IPV6_SRCADDR ||
+                     ioctl_filter[i].field ==
+                        WINDIVERT_FILTER_FIELD_IPV6_DSTADDR? 128: 32);
+            for (j = 0; j < ioctl_filter[i].arg[1]; j++)
+            {
+                windivert_ioctl_set_t elem =
+                    ioctl_set + ioctl_filter[i].arg[0] + j;
+                if (elem->prefix > width ||
+                    (width == 32 && (elem->val[1] != 0 ||
+                        elem->val[2] != 0 || elem->val[3] != 0)))
+                {
+                    goto windivert_filter_compile_exit;
+                }
+            }
+            alloc_len = (alloc_len + 7) & ~(size_t)7;
+            size = windivert_filter_set_size(ioctl_filter[i].arg[1]);
+            filter0[i].field   = ioctl_filter[i].field;
+            filter0[i].test    = ioctl_filter[i].test;
+            filter0[i].success = ioctl_filter[i].success;
+            filter0[i].failure = ioctl_filter[i].failure;
+            filter0[i].arg[0]  = (UINT32)alloc_len;    // Set offset
+            filter0[i].arg[1]  = size;
+            filter0[i].arg[2]  = ioctl_filter[i].arg[0];
+            filter0[i].arg[3]  = ioctl_filter[i].arg[1];
+            alloc_len += sizeof(struct filter_set_s) +
+                size * sizeof(struct filter_set_entry_s);
+            goto windivert_filter_compile_lower;
+        }
+
         // Enforce size limits:
-        if (ioctl_filter[i].field != WINDIVERT_FILTER_FIELD_IPV6_SRCADDR &&
+        if (payload)
+        {
+            // arg[1] is the payload offset:
+            if (ioctl_filter[i].arg[1] > WINDIVERT_FILTER_PAYLOAD_OFFSET_MAX ||
+                ioctl_filter[i].arg[2] != 0 ||
+                ioctl_filter[i].arg[3] != 0)
+            {
+                goto windivert_filter_compile_exit;
+            }
+        }
+        else if (ioctl_filter[i].field !=
+                WINDIVERT_FILTER_FIELD_IPV6_SRCADDR &&
             ioctl_filter[i].field != WINDIVERT_FILTER_FIELD_IPV6_DSTADDR)
         {
             if (ioctl_filter[i].arg[1] != 0 ||
@@ -3949,6 +8861,8 @@ static filter_t windivert_filter_compile(windivert_ioctl_filter_t ioctl_filter,
             case WINDIVERT_FILTER_FIELD_ICMP_CODE:
             case WINDIVERT_FILTER_FIELD_ICMPV6_TYPE:
             case WINDIVERT_FILTER_FIELD_ICMPV6_CODE:
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD:
                 if (ioctl_filter[i].arg[0] > UINT8_MAX)
                 {
                     goto windivert_filter_compile_exit;
@@ -3977,6 +8891,8 @@ static filter_t windivert_filter_compile(windivert_ioctl_filter_t ioctl_filter,
             case WINDIVERT_FILTER_FIELD_UDP_LENGTH:
             case WINDIVERT_FILTER_FIELD_UDP_CHECKSUM:
             case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD16:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD16:
                 if (ioctl_filter[i].arg[0] > UINT16_MAX)
                 {
                     goto windivert_filter_compile_exit;
@@ -4000,90 +8916,68 @@ static filter_t windivert_filter_compile(windivert_ioctl_filter_t ioctl_filter,
         filter0[i].arg[2]  = ioctl_filter[i].arg[2];
         filter0[i].arg[3]  = ioctl_filter[i].arg[3];
 
-        // Protocol selection:
-        switch (ioctl_filter[i].field)
-        {
-            case WINDIVERT_FILTER_FIELD_ZERO:
-            case WINDIVERT_FILTER_FIELD_INBOUND:
-            case WINDIVERT_FILTER_FIELD_OUTBOUND:
-            case WINDIVERT_FILTER_FIELD_IFIDX:
-            case WINDIVERT_FILTER_FIELD_SUBIFIDX:
-            case WINDIVERT_FILTER_FIELD_IP:
-            case WINDIVERT_FILTER_FIELD_IPV6:
-            case WINDIVERT_FILTER_FIELD_ICMP:
-            case WINDIVERT_FILTER_FIELD_ICMPV6:
-            case WINDIVERT_FILTER_FIELD_TCP:
-            case WINDIVERT_FILTER_FIELD_UDP:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_NONE;
-                break;
-            case WINDIVERT_FILTER_FIELD_IP_HDRLENGTH:
-            case WINDIVERT_FILTER_FIELD_IP_TOS:
-            case WINDIVERT_FILTER_FIELD_IP_LENGTH:
-            case WINDIVERT_FILTER_FIELD_IP_ID:
-            case WINDIVERT_FILTER_FIELD_IP_DF:
-            case WINDIVERT_FILTER_FIELD_IP_MF:
-            case WINDIVERT_FILTER_FIELD_IP_FRAGOFF:
-            case WINDIVERT_FILTER_FIELD_IP_TTL:
-            case WINDIVERT_FILTER_FIELD_IP_PROTOCOL:
-            case WINDIVERT_FILTER_FIELD_IP_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_IP_SRCADDR:
-            case WINDIVERT_FILTER_FIELD_IP_DSTADDR:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_IP;
-                break;
-            case WINDIVERT_FILTER_FIELD_IPV6_TRAFFICCLASS:
-            case WINDIVERT_FILTER_FIELD_IPV6_FLOWLABEL:
-            case WINDIVERT_FILTER_FIELD_IPV6_LENGTH:
-            case WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR:
-            case WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT:
-            case WINDIVERT_FILTER_FIELD_IPV6_SRCADDR:
-            case WINDIVERT_FILTER_FIELD_IPV6_DSTADDR:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_IPV6;
-                break;
-            case WINDIVERT_FILTER_FIELD_ICMP_TYPE:
-            case WINDIVERT_FILTER_FIELD_ICMP_CODE:
-            case WINDIVERT_FILTER_FIELD_ICMP_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_ICMP_BODY:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_ICMP;
-                break;
-            case WINDIVERT_FILTER_FIELD_ICMPV6_TYPE:
-            case WINDIVERT_FILTER_FIELD_ICMPV6_CODE:
-            case WINDIVERT_FILTER_FIELD_ICMPV6_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_ICMPV6_BODY:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_ICMPV6;
-                break;
-            case WINDIVERT_FILTER_FIELD_TCP_SRCPORT:
-            case WINDIVERT_FILTER_FIELD_TCP_DSTPORT:
-            case WINDIVERT_FILTER_FIELD_TCP_SEQNUM:
-            case WINDIVERT_FILTER_FIELD_TCP_ACKNUM:
-            case WINDIVERT_FILTER_FIELD_TCP_HDRLENGTH:
-            case WINDIVERT_FILTER_FIELD_TCP_URG:
-            case WINDIVERT_FILTER_FIELD_TCP_ACK:
-            case WINDIVERT_FILTER_FIELD_TCP_PSH:
-            case WINDIVERT_FILTER_FIELD_TCP_RST:
-            case WINDIVERT_FILTER_FIELD_TCP_SYN:
-            case WINDIVERT_FILTER_FIELD_TCP_FIN:
-            case WINDIVERT_FILTER_FIELD_TCP_WINDOW:
-            case WINDIVERT_FILTER_FIELD_TCP_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_TCP_URGPTR:
-            case WINDIVERT_FILTER_FIELD_TCP_PAYLOADLENGTH:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_TCP;
-                break;
-            case WINDIVERT_FILTER_FIELD_UDP_SRCPORT:
-            case WINDIVERT_FILTER_FIELD_UDP_DSTPORT:
-            case WINDIVERT_FILTER_FIELD_UDP_LENGTH:
-            case WINDIVERT_FILTER_FIELD_UDP_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_UDP;
-                break;
-            default:
-                goto windivert_filter_compile_exit;
-        }
+windivert_filter_compile_lower:
+
+        // Lower the field access:
+        field = filter_fields + ioctl_filter[i].field;
+        filter0[i].protocol = field->protocol;
+        filter0[i].op       = field->op;
+        filter0[i].base     = field->base;
+        filter0[i].offset   = field->offset;
+        filter0[i].shift    = field->shift;
+        filter0[i].mask     = field->mask;
     }
     
-    result = (filter_t)windivert_malloc(i*sizeof(struct filter_s), FALSE);
-    if (result != NULL)
+    result = (filter_t)windivert_malloc(alloc_len, FALSE);
+    if (result == NULL)
+    {
+        goto windivert_filter_compile_exit;
+    }
+    RtlZeroMemory(result, alloc_len);
+    RtlMoveMemory(result, filter0, i*sizeof(struct filter_s));
+
+    // Build the sets and automata.  Only the instructions were copied, so
+    // their sizes and element ranges come from the validated copy, but the
+    // set and pattern elements are still read from the IOCTL buffer.  That
+    // is user memory and may have changed since, so each element is read
+    // once and checked again while building:
+    for (i = 0; i < length; i++)
     {
-        RtlMoveMemory(result, filter0, i*sizeof(struct filter_s));
+        if (result[i].test == WINDIVERT_FILTER_TEST_CONTAINS ||
+            result[i].test == WINDIVERT_FILTER_TEST_PREFIX)
+        {
+            if (!windivert_filter_ac_build(
+                    (filter_ac_t)((UINT8 *)result + result[i].arg[0]),
+                    (UINT16)result[i].arg[1], ioctl_set + result[i].arg[2],
+                    result[i].arg[3]))
+            {
+                windivert_free(result);
+                result = NULL;
+                goto windivert_filter_compile_exit;
+            }
+            result[i].arg[1] = result[i].arg[2] = result[i].arg[3] = 0;
+            continue;
+        }
+        if (result[i].test != WINDIVERT_FILTER_TEST_IN)
+        {
+            continue;
+        }
+        set = (filter_set_t)((UINT8 *)result + result[i].arg[0]);
+        set->mask  = result[i].arg[1] - 1;
+        set->width = (result[i].field == WINDIVERT_FILTER_FIELD_IPV6_SRCADDR ||
+            result[i].field == WINDIVERT_FILTER_FIELD_IPV6_DSTADDR? 128: 32);
+        for (j = 0; j < result[i].arg[3]; j++)
+        {
+            windivert_ioctl_set_t elem = ioctl_set + result[i].arg[2] + j;
+            UINT32 val[4];
+            UINT8 prefix = elem->prefix;
+            RtlCopyMemory(val, elem->val, sizeof(val));     // (unaligned)
+            if (prefix <= set->width)
+            {
+                windivert_filter_set_insert(set, val, prefix);
+            }
+        }
+        result[i].arg[1] = result[i].arg[2] = result[i].arg[3] = 0;
     }
 
 windivert_filter_compile_exit:
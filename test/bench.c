@@ -0,0 +1,586 @@
+/*
+ * bench.c
+ * (C) 2016, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * WinDivert benchmarks.
+ *
+ * usage: bench.exe [seconds]
+ *
+ * Runs (1) filter evaluation micro-benchmarks in user mode and in the driver,
+ * (2) checksum and parse micro-benchmarks, and (3) end-to-end recv->send
+ * loops with 1, 2, 4 and N threads.  Like test.exe, this program diverts and
+ * drops ALL network traffic while it runs.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+
+#include "windivert.h"
+
+#define MAX_PACKET          2048
+#define BATCH_PACKETS       64
+#define BATCH_SIZE          (BATCH_PACKETS * (sizeof(WINDIVERT_BATCH_HDR) + \
+                                MAX_PACKET + 8))
+#define MAX_THREADS         64
+#define EVAL_ITERS          1000000
+#define CSUM_ITERS          1000000
+#define DRIVER_ITERS        2000
+#define LOOP_WINDOW         256
+#define LOOP_STALL          0.1         // Seconds without progress.
+
+/*
+ * Packet data.
+ */
+#include "test_data.c"
+
+/*
+ * Benchmark packet.
+ */
+struct packet
+{
+    unsigned char *packet;
+    size_t packet_len;
+    char *name;
+};
+
+/*
+ * Recv->send worker thread.
+ */
+struct worker
+{
+    HANDLE handle;
+    HANDLE thread;
+    volatile LONG64 count;
+};
+
+/*
+ * Prototypes.
+ */
+static double now(void);
+static UINT build_batch(UINT8 *batch, struct packet *packet);
+static void bench_eval(void);
+static void bench_eval_driver(HANDLE inject_handle);
+static void bench_checksum(void);
+static void bench_loop(HANDLE inject_handle, UINT threads, UINT seconds);
+static DWORD WINAPI loop_worker(LPVOID arg);
+static UINT percentile(const UINT64 *histogram, double p);
+
+/*
+ * Benchmark data.
+ */
+static struct packet packets[] =
+{
+    {echo_request,     sizeof(echo_request),     "ipv4_icmp_echo_req"},
+    {http_request,     sizeof(http_request),     "ipv4_tcp_http_req"},
+    {dns_request,      sizeof(dns_request),      "ipv4_udp_dns_req"},
+    {ipv6_tcp_syn,     sizeof(ipv6_tcp_syn),     "ipv6_tcp_syn"},
+    {ipv6_echo_reply,  sizeof(ipv6_echo_reply),  "ipv6_icmpv6_echo_rep"},
+    {ipv6_exthdrs_udp, sizeof(ipv6_exthdrs_udp), "ipv6_exthdrs_udp"},
+};
+#define NUM_PACKETS     (sizeof(packets) / sizeof(struct packet))
+
+static const char *filters[] =
+{
+    "true",
+    "outbound and icmp",
+    "tcp.DstPort == 80 or udp.DstPort == 53",
+    "(ip? ip.DstAddr >= 8.8.0.0 and ip.DstAddr <= 8.8.255.255: "
+        "ipv6.HopLimit > 1) and (tcp? tcp.Syn: true)",
+    "tcp.PayloadLength > 0 and tcp.DstPort == 80 and ip.TTL > 0 and "
+        "ip.Length > 40 and ip.Protocol == 6 and not ip.MF and outbound",
+};
+#define NUM_FILTERS     (sizeof(filters) / sizeof(const char *))
+
+static volatile LONG stop = 0;
+
+/*
+ * Main.
+ */
+int main(int argc, char **argv)
+{
+    HANDLE upper_handle, lower_handle;
+    SYSTEM_INFO info;
+    UINT seconds, nthreads, threads[] = {1, 2, 4, 0};
+    size_t i;
+
+    seconds = (argc > 1? (UINT)atoi(argv[1]): 5);
+    seconds = (seconds == 0? 1: seconds);
+    GetSystemInfo(&info);
+    nthreads = info.dwNumberOfProcessors;
+    nthreads = (nthreads > MAX_THREADS? MAX_THREADS: nthreads);
+    threads[3] = nthreads;
+
+    for (i = 0; i < NUM_PACKETS; i++)
+    {
+        WinDivertHelperCalcChecksums(packets[i].packet,
+            (UINT)packets[i].packet_len, 0);
+    }
+
+    printf("== filter evaluation (user mode) ==\n");
+    bench_eval();
+    printf("\n== checksum and parse ==\n");
+    bench_checksum();
+
+    // As with test.exe, open handles to:
+    // (1) stop normal traffic from interacting with the benchmarks; and
+    // (2) stop benchmark packets escaping to the Internet or TCP/IP stack.
+    upper_handle = WinDivertOpen("true", WINDIVERT_LAYER_NETWORK, -510,
+        WINDIVERT_FLAG_DROP);
+    lower_handle = WinDivertOpen("true", WINDIVERT_LAYER_NETWORK, 510,
+        WINDIVERT_FLAG_DROP);
+    if (upper_handle == INVALID_HANDLE_VALUE ||
+        lower_handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "error: failed to open WinDivert handle (err = %d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+
+    // Wait for existing packets to flush:
+    Sleep(100);
+
+    printf("\n== filter evaluation (driver) ==\n");
+    bench_eval_driver(upper_handle);
+
+    printf("\n== end-to-end recv->send (%us per run) ==\n", seconds);
+    printf("threads         pps   cpu/pkt  read p50/p99      "
+        "inject p50/p99    drops\n");
+    for (i = 0; i < sizeof(threads) / sizeof(UINT); i++)
+    {
+        if (i == 3 && nthreads <= 4)
+        {
+            break;
+        }
+        bench_loop(upper_handle, threads[i], seconds);
+    }
+
+    WinDivertClose(upper_handle);
+    WinDivertClose(lower_handle);
+
+    return 0;
+}
+
+/*
+ * Current time in seconds.
+ */
+static double now(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+
+    if (freq.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+}
+
+/*
+ * Build a batch of outbound packets, or of all test packets if packet is
+ * NULL.  Returns the batch length.
+ */
+static UINT build_batch(UINT8 *batch, struct packet *packet)
+{
+    PWINDIVERT_BATCH_HDR hdr = (PWINDIVERT_BATCH_HDR)batch;
+    struct packet *pkt;
+    UINT i;
+
+    for (i = 0; i < BATCH_PACKETS; i++)
+    {
+        pkt = (packet != NULL? packet: &packets[i % NUM_PACKETS]);
+        memset(hdr, 0, sizeof(WINDIVERT_BATCH_HDR));
+        hdr->Length = (UINT32)pkt->packet_len;
+        hdr->Addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+        memcpy(WINDIVERT_BATCH_PACKET(hdr), pkt->packet, pkt->packet_len);
+        hdr = WINDIVERT_BATCH_NEXT(hdr);
+    }
+    return (UINT)((UINT8 *)hdr - batch);
+}
+
+/*
+ * Filter evaluation in user mode: filter strings (parsed on each call) vs.
+ * compiled filter objects.
+ */
+static void bench_eval(void)
+{
+    WINDIVERT_HEADERS headers[NUM_PACKETS];
+    WINDIVERT_ADDRESS addr;
+    PWINDIVERT_FILTER filter;
+    double t0, t1, t2;
+    UINT i, j, match = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+    for (i = 0; i < NUM_PACKETS; i++)
+    {
+        memset(&headers[i], 0, sizeof(headers[i]));
+        WinDivertHelperParsePacket(packets[i].packet,
+            (UINT)packets[i].packet_len, &headers[i].IpHdr,
+            &headers[i].Ipv6Hdr, &headers[i].IcmpHdr, &headers[i].Icmpv6Hdr,
+            &headers[i].TcpHdr, &headers[i].UdpHdr, &headers[i].Data,
+            &headers[i].DataLen);
+    }
+
+    printf("string ns/pkt  compiled ns/pkt  filter\n");
+    for (i = 0; i < NUM_FILTERS; i++)
+    {
+        filter = WinDivertHelperCompileFilter(filters[i],
+            WINDIVERT_LAYER_NETWORK);
+        if (filter == NULL)
+        {
+            fprintf(stderr, "error: failed to compile filter \"%s\" "
+                "(err = %d)\n", filters[i], GetLastError());
+            continue;
+        }
+        t0 = now();
+        for (j = 0; j < EVAL_ITERS / 100; j++)
+        {
+            match += WinDivertHelperEvalFilter(filters[i],
+                WINDIVERT_LAYER_NETWORK, packets[j % NUM_PACKETS].packet,
+                (UINT)packets[j % NUM_PACKETS].packet_len, &addr);
+        }
+        t1 = now();
+        for (j = 0; j < EVAL_ITERS; j++)
+        {
+            match += WinDivertHelperEvalFilterHeaders(filter,
+                &headers[j % NUM_PACKETS], &addr);
+        }
+        t2 = now();
+        WinDivertHelperFreeFilter(filter);
+        printf("%13.1f  %15.1f  %s\n", (t1 - t0) * 1e9 / (EVAL_ITERS / 100),
+            (t2 - t1) * 1e9 / EVAL_ITERS, filters[i]);
+    }
+    if (match == 0)
+    {
+        fprintf(stderr, "warning: no filter matched\n");
+    }
+}
+
+/*
+ * Filter evaluation in the driver.  Batches are injected with no other
+ * handle below the injecting handle (the baseline), and again with a
+ * WINDIVERT_FLAG_DROP handle for each filter.  The difference estimates the
+ * per-packet cost of classifying against the filter.
+ */
+static void bench_eval_driver(HANDLE inject_handle)
+{
+    static UINT8 batch[BATCH_SIZE];
+    WINDIVERT_STATS stats;
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    UINT batch_len, i, j;
+    double t0, t1, base = 0.0, ns;
+
+    batch_len = build_batch(batch, NULL);
+    printf("ns/pkt  matched  filter\n");
+    for (i = 0; i <= NUM_FILTERS; i++)
+    {
+        if (i > 0)
+        {
+            handle = WinDivertOpen(filters[i-1], WINDIVERT_LAYER_NETWORK, 0,
+                WINDIVERT_FLAG_DROP);
+            if (handle == INVALID_HANDLE_VALUE)
+            {
+                fprintf(stderr, "error: failed to open WinDivert handle for "
+                    "filter \"%s\" (err = %d)\n", filters[i-1],
+                    GetLastError());
+                continue;
+            }
+        }
+        t0 = now();
+        for (j = 0; j < DRIVER_ITERS; j++)
+        {
+            if (!WinDivertSendBatch(inject_handle, batch, batch_len, NULL))
+            {
+                fprintf(stderr, "error: failed to inject batch (err = %d)\n",
+                    GetLastError());
+                break;
+            }
+        }
+        t1 = now();
+        ns = (t1 - t0) * 1e9 / ((double)DRIVER_ITERS * BATCH_PACKETS);
+        if (i == 0)
+        {
+            base = ns;
+            printf("%6.1f  %7s  (baseline: injection only)\n", ns, "-");
+            continue;
+        }
+        memset(&stats, 0, sizeof(stats));
+        WinDivertGetStats(handle, &stats);
+        WinDivertClose(handle);
+        printf("%6.1f  %7.1f%%  %s\n", ns - base,
+            (stats.Classified == 0? 0.0:
+                100.0 * (double)stats.Matched / (double)stats.Classified),
+            filters[i-1]);
+    }
+}
+
+/*
+ * Checksum calculation and packet parsing.
+ */
+static void bench_checksum(void)
+{
+    static UINT8 batch[BATCH_SIZE];
+    static WINDIVERT_PACKET_INFO info[BATCH_PACKETS];
+    PWINDIVERT_BATCH_HDR hdr;
+    UINT batch_len, i, j;
+    UINT64 bytes = 0;
+    double t0, t1;
+
+    printf("calc ns/pkt  calc MB/s  parse ns/pkt  packet\n");
+    for (i = 0; i < NUM_PACKETS; i++)
+    {
+        t0 = now();
+        for (j = 0; j < CSUM_ITERS; j++)
+        {
+            WinDivertHelperCalcChecksums(packets[i].packet,
+                (UINT)packets[i].packet_len, 0);
+        }
+        t1 = now();
+        printf("%11.1f  %9.1f", (t1 - t0) * 1e9 / CSUM_ITERS,
+            (double)packets[i].packet_len * CSUM_ITERS / (t1 - t0) / 1e6);
+        t0 = now();
+        for (j = 0; j < CSUM_ITERS; j++)
+        {
+            WinDivertHelperParsePacket(packets[i].packet,
+                (UINT)packets[i].packet_len, NULL, NULL, NULL, NULL, NULL,
+                NULL, NULL, NULL);
+        }
+        t1 = now();
+        printf("  %12.1f  %s\n", (t1 - t0) * 1e9 / CSUM_ITERS,
+            packets[i].name);
+    }
+
+    // Whole batches (all test packets mixed):
+    batch_len = build_batch(batch, NULL);
+    t0 = now();
+    for (j = 0; j < CSUM_ITERS / BATCH_PACKETS; j++)
+    {
+        for (hdr = (PWINDIVERT_BATCH_HDR)batch;
+             (UINT8 *)hdr < batch + batch_len; hdr = WINDIVERT_BATCH_NEXT(hdr))
+        {
+            WinDivertHelperCalcChecksums(WINDIVERT_BATCH_PACKET(hdr),
+                hdr->Length, 0);
+            bytes += hdr->Length;
+        }
+    }
+    t1 = now();
+    printf("%11.1f  %9.1f", (t1 - t0) * 1e9 / CSUM_ITERS,
+        (double)bytes / (t1 - t0) / 1e6);
+    t0 = now();
+    for (j = 0; j < CSUM_ITERS / BATCH_PACKETS; j++)
+    {
+        WinDivertHelperParsePackets(batch, batch_len, BATCH_PACKETS, info);
+    }
+    t1 = now();
+    printf("  %12.1f  batch (WinDivertHelperParsePackets)\n",
+        (t1 - t0) * 1e9 / CSUM_ITERS);
+}
+
+/*
+ * Total packets dropped by the driver.
+ */
+static UINT64 loop_drops(const WINDIVERT_STATS *stats)
+{
+    return stats->DropWorkQueue + stats->DropQueueFull + stats->DropTimeout +
+        stats->DropNoMemory + stats->DropReinject + stats->DropRingFull +
+        stats->DropVerdict + stats->DropHopLimit;
+}
+
+/*
+ * End-to-end recv->send loop.  The main thread injects packets from above,
+ * keeping at most LOOP_WINDOW packets per thread in flight, and the worker
+ * threads divert them and send them on to the dropping handle below.
+ * Packets dropped by the driver leave the window, and so does any other
+ * packet that has not arrived after LOOP_STALL seconds without progress.
+ */
+static void bench_loop(HANDLE inject_handle, UINT threads, UINT seconds)
+{
+    static UINT8 batch[BATCH_SIZE];
+    static struct worker workers[MAX_THREADS];
+    HANDLE handle, thread_handles[MAX_THREADS];
+    WINDIVERT_STATS stats;
+    FILETIME creation, exit_time, kernel, user;
+    UINT64 cpu = 0, sent = 0, forwarded, progress = 0, drops = 0, lost = 0;
+    INT64 in_flight;
+    UINT batch_len, i;
+    double t, t0, t1, t_progress, deadline;
+
+    handle = WinDivertOpen("udp.DstPort == 53", WINDIVERT_LAYER_NETWORK, 0,
+        0);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "error: failed to open WinDivert handle (err = %d)\n",
+            GetLastError());
+        return;
+    }
+    WinDivertSetParam(handle, WINDIVERT_PARAM_QUEUE_LEN, 16384);    // Max.
+    WinDivertSetParam(handle, WINDIVERT_PARAM_QUEUE_TIME, 8000);    // Max.
+
+    stop = 0;
+    for (i = 0; i < threads; i++)
+    {
+        workers[i].handle = handle;
+        workers[i].count = 0;
+        workers[i].thread = CreateThread(NULL, 0, loop_worker, &workers[i], 0,
+            NULL);
+        if (workers[i].thread == NULL)
+        {
+            fprintf(stderr, "error: failed to create thread (err = %d)\n",
+                GetLastError());
+            exit(EXIT_FAILURE);
+        }
+        thread_handles[i] = workers[i].thread;
+    }
+
+    batch_len = build_batch(batch, &packets[2]);    // ipv4_udp_dns_req
+    t0 = t_progress = now();
+    deadline = t0 + seconds;
+    while ((t = now()) < deadline)
+    {
+        forwarded = 0;
+        for (i = 0; i < threads; i++)
+        {
+            forwarded += (UINT64)workers[i].count;
+        }
+        if (forwarded != progress)
+        {
+            progress = forwarded;
+            t_progress = t;
+        }
+        in_flight = (INT64)(sent - forwarded - drops - lost);
+        if (in_flight >= (INT64)LOOP_WINDOW * threads)
+        {
+            memset(&stats, 0, sizeof(stats));
+            if (WinDivertGetStats(handle, &stats))
+            {
+                drops = loop_drops(&stats);
+            }
+            in_flight = (INT64)(sent - forwarded - drops - lost);
+            if (in_flight > 0 && t - t_progress > LOOP_STALL)
+            {
+                lost += (UINT64)in_flight;
+                t_progress = t;
+            }
+            SwitchToThread();
+            continue;
+        }
+        if (!WinDivertSendBatch(inject_handle, batch, batch_len, NULL))
+        {
+            fprintf(stderr, "error: failed to inject batch (err = %d)\n",
+                GetLastError());
+            break;
+        }
+        sent += BATCH_PACKETS;
+    }
+    t1 = now();
+
+    // Closing the handle cancels the workers' pending reads:
+    memset(&stats, 0, sizeof(stats));
+    WinDivertGetStats(handle, &stats);
+    InterlockedExchange(&stop, 1);
+    WinDivertClose(handle);
+    WaitForMultipleObjects(threads, thread_handles, TRUE, INFINITE);
+
+    forwarded = 0;
+    for (i = 0; i < threads; i++)
+    {
+        forwarded += (UINT64)workers[i].count;
+        if (GetThreadTimes(workers[i].thread, &creation, &exit_time,
+                &kernel, &user))
+        {
+            cpu += ((UINT64)kernel.dwHighDateTime << 32) +
+                kernel.dwLowDateTime;
+            cpu += ((UINT64)user.dwHighDateTime << 32) + user.dwLowDateTime;
+        }
+        CloseHandle(workers[i].thread);
+    }
+    drops = loop_drops(&stats);
+
+    // (GetThreadTimes() is in 100ns units.)
+    printf("%7u  %10.0f  %6.0fns  <=%5uus/<=%5uus  <=%5uus/<=%5uus  "
+        "%" PRIu64 "\n",
+        threads, (double)forwarded / (t1 - t0),
+        (forwarded == 0? 0.0: (double)cpu * 100.0 / (double)forwarded),
+        percentile(stats.ReadLatency, 0.50),
+        percentile(stats.ReadLatency, 0.99),
+        percentile(stats.InjectLatency, 0.50),
+        percentile(stats.InjectLatency, 0.99), drops);
+}
+
+/*
+ * Recv->send worker.
+ */
+static DWORD WINAPI loop_worker(LPVOID arg)
+{
+    struct worker *worker = (struct worker *)arg;
+    UINT8 *batch;
+    UINT count, batch_len;
+
+    batch = (UINT8 *)malloc(BATCH_SIZE);
+    if (batch == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate batch buffer\n");
+        return 0;
+    }
+    while (!stop)
+    {
+        if (!WinDivertRecvBatch(worker->handle, batch, BATCH_SIZE, &count,
+                &batch_len))
+        {
+            break;
+        }
+        if (!WinDivertSendBatch(worker->handle, batch, batch_len, NULL))
+        {
+            break;
+        }
+        InterlockedExchangeAdd64(&worker->count, count);
+    }
+    free(batch);
+    return 0;
+}
+
+/*
+ * Upper bound (in microseconds) of the latency histogram bucket holding the
+ * given percentile.
+ */
+static UINT percentile(const UINT64 *histogram, double p)
+{
+    UINT64 total = 0, sum = 0;
+    UINT i;
+
+    for (i = 0; i < WINDIVERT_LATENCY_BUCKETS; i++)
+    {
+        total += histogram[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+    for (i = 0; i < WINDIVERT_LATENCY_BUCKETS - 1; i++)
+    {
+        sum += histogram[i];
+        if ((double)sum >= p * (double)total)
+        {
+            break;
+        }
+    }
+    return 1u << i;
+}
@@ -21,6 +21,8 @@
 
 CC=x86_64-w64-mingw32-gcc
 
-$CC -s -O2 -I../include/ test.c -o test.exe -lWinDivert \
+$CC -s -O2 -I../include/ test.c -o test.exe -lWinDivert -lws2_32 \
     -L"../install/MINGW/amd64/"
 
+$CC -s -O2 -I../include/ bench.c -o bench.exe -lWinDivert \
+    -L"../install/MINGW/amd64/"
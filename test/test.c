@@ -20,6 +20,7 @@
  * WinDivert testing framework.
  */
 
+#include <winsock2.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <windows.h>
@@ -27,6 +28,16 @@
 #include "windivert.h"
 
 #define MAX_PACKET  2048
+#define MAX_STREAM_PACKET   0xFFFF
+#define STREAM_LEN  8192
+#define FLOW_SIZE   48
+#define FLOW_ROUNDS 64
+#define RATE_LIMIT  2
+#define RATE_FLOWS  4
+#define RATE_ROUNDS 4
+#define RATE_PORT   0xE045      // dns_request's UDP source port
+
+#define swap16(x)   ((UINT16)((((x) & 0xFF) << 8) | (((x) >> 8) & 0xFF)))
 
 /*
  * Packet data.
@@ -50,11 +61,61 @@ struct test
     BOOL match;
 };
 
+struct stream_test
+{
+    char *filter;
+    BOOL match;
+};
+
+struct dispatch_handle
+{
+    HANDLE handle;
+    OVERLAPPED overlapped;
+    char buf[MAX_PACKET];
+    UINT buf_len;
+    WINDIVERT_ADDRESS addr;
+    BOOL pending;
+};
+
+struct flow_test
+{
+    BOOL (*func)(PWINDIVERT_FLOW_TABLE table, INT64 t0, INT64 timeout);
+    char *name;
+};
+
+/*
+ * A TCP packet for the flow table tests.
+ */
+struct flow_packet
+{
+    WINDIVERT_IPHDR ip;
+    WINDIVERT_TCPHDR tcp;
+    WINDIVERT_HEADERS headers;
+};
+
+#define FLOW_SYN    0x01
+#define FLOW_ACK    0x02
+#define FLOW_FIN    0x04
+#define FLOW_RST    0x08
+
 /*
  * Prototypes.
  */
 static BOOL run_test(HANDLE inject_handle, const char *filter,
     const char *packet, const size_t packet_len, BOOL match);
+static BOOL run_stream_test(const char *filter, const char *data,
+    int data_len, BOOL match);
+static BOOL run_flow_test(const struct flow_test *test);
+static BOOL run_dispatch_test(HANDLE inject_handle);
+static BOOL run_rate_test(HANDLE inject_handle);
+static BOOL flow_test_insert(PWINDIVERT_FLOW_TABLE table, INT64 t0,
+    INT64 timeout);
+static BOOL flow_test_tcp(PWINDIVERT_FLOW_TABLE table, INT64 t0,
+    INT64 timeout);
+static BOOL flow_test_expire(PWINDIVERT_FLOW_TABLE table, INT64 t0,
+    INT64 timeout);
+static BOOL flow_test_deleted(PWINDIVERT_FLOW_TABLE table, INT64 t0,
+    INT64 timeout);
 
 /*
  * Test data.
@@ -223,6 +284,40 @@ static struct test tests[] =
         "false): false): false): false)",      &pkt_http_request, TRUE},
     {"(outbound? (ip? (tcp.DstPort == 80? (tcp.PayloadLength == 0? true: "
         "false): false): false): false)",      &pkt_http_request, FALSE},
+    {"tcp.Payload contains \"Host: www.example.com\\r\\n\"",
+                                               &pkt_http_request, TRUE},
+    {"tcp.Payload contains \"Host: www.example.org\"",
+                                               &pkt_http_request, FALSE},
+    {"tcp.Payload contains {\"POST \", \"HTTP/1.1\"}",
+                                               &pkt_http_request, TRUE},
+    {"tcp.Payload contains {\"POST \", \"HTTP/1.2\"}",
+                                               &pkt_http_request, FALSE},
+    {"tcp.Payload contains \"\\\"333333333\\\"\"",
+                                               &pkt_http_request, TRUE},
+    {"tcp.Payload contains \"\\x47\\x45\\x54\\x20/\"",
+                                               &pkt_http_request, TRUE},
+    {"tcp.Payload contains \"\\tAccept\"",     &pkt_http_request, FALSE},
+    {"tcp.Payload contains \"GMT\\r\\n\\r\\n\"",
+                                               &pkt_http_request, TRUE},
+    {"tcp.Payload contains \"GMT\\r\\n\\r\\n\\r\\n\"",
+                                               &pkt_http_request, FALSE},
+    {"not tcp.Payload contains \"keep-alive\"",
+                                               &pkt_http_request, FALSE},
+    {"tcp.Payload startswith \"GET / \"",      &pkt_http_request, TRUE},
+    {"tcp.Payload startswith {\"POST \", \"PUT \"}",
+                                               &pkt_http_request, FALSE},
+    {"tcp.Payload startswith \"HTTP/1.1\"",    &pkt_http_request, FALSE},
+    {"udp.Payload contains \"GET\"",           &pkt_http_request, FALSE},
+    {"tcp.Payload[0] == 0x47",                 &pkt_http_request, TRUE},
+    {"tcp.Payload16[0] == 0x4745",             &pkt_http_request, TRUE},
+    {"tcp.Payload32[0] == 0x47455420",         &pkt_http_request, TRUE},
+    {"tcp.Payload32[0] == 0x504F5354",         &pkt_http_request, FALSE},
+    {"tcp.Payload[468] == 0x0A",               &pkt_http_request, TRUE},
+    {"tcp.Payload32[465] == 0x0D0A0D0A",       &pkt_http_request, TRUE},
+    {"tcp.Payload[469] == 0x0A",               &pkt_http_request, FALSE},
+    {"tcp.Payload16[468] != 0x1234",           &pkt_http_request, FALSE},
+    {"tcp.Payload32[466] != 0",                &pkt_http_request, FALSE},
+    {"not tcp.Payload[500] == 0",              &pkt_http_request, TRUE},
     {"udp",                                    &pkt_dns_request, TRUE},
     {"udp && udp.SrcPort > 1 && ipv6",         &pkt_dns_request, FALSE},
     {"udp.DstPort == 53",                      &pkt_dns_request, TRUE},
@@ -236,6 +331,23 @@ static struct test tests[] =
     {"ip.SrcAddr < 10.0.0.0 or ip.SrcAddr > 10.255.255.255",
                                                &pkt_dns_request, FALSE},
     {"udp.PayloadLength == 29",                &pkt_dns_request, TRUE},
+    {"ip.DstAddr in {8.8.8.8, 8.8.4.4}",       &pkt_dns_request, TRUE},
+    {"ip.DstAddr in {8.8.8.8, 1.1.1.1}",       &pkt_dns_request, FALSE},
+    {"ip.DstAddr in {8.8.0.0/16}",             &pkt_dns_request, TRUE},
+    {"ip.SrcAddr in {192.168.0.0/16, 10.0.0.0/8}",
+                                               &pkt_dns_request, TRUE},
+    {"not udp.DstPort in {53, 5353}",          &pkt_dns_request, FALSE},
+    {"udp.DstPort in {}",                      &pkt_dns_request, FALSE},
+    {"tcp.DstPort in {53}",                    &pkt_dns_request, FALSE},
+    {"udp.Payload contains \"\\x07example\\x03com\\x00\"",
+                                               &pkt_dns_request, TRUE},
+    {"udp.Payload contains \"\\x07example\\x03org\\x00\"",
+                                               &pkt_dns_request, FALSE},
+    {"udp.Payload startswith \"\\x17\\x08\"",  &pkt_dns_request, TRUE},
+    {"tcp.Payload contains \"example\"",       &pkt_dns_request, FALSE},
+    {"udp.Payload16[0] == 0x1708",             &pkt_dns_request, TRUE},
+    {"udp.Payload[28] == 0x01",                &pkt_dns_request, TRUE},
+    {"udp.Payload[29] == 0x01",                &pkt_dns_request, FALSE},
     {"ipv6",                                   &pkt_ipv6_tcp_syn, TRUE},
     {"ip",                                     &pkt_ipv6_tcp_syn, FALSE},
     {"tcp.Syn",                                &pkt_ipv6_tcp_syn, TRUE},
@@ -247,6 +359,10 @@ static struct test tests[] =
     {"tcp.PayloadLength == 0",                 &pkt_ipv6_tcp_syn, TRUE},
     {"ipv6.SrcAddr == 1234:5678:1::aabb:ccdd", &pkt_ipv6_tcp_syn, TRUE},
     {"ipv6.SrcAddr == aabb:5678:1::1234:ccdd", &pkt_ipv6_tcp_syn, FALSE},
+    {"ipv6.SrcAddr in {::1, 1234:5678:1::1/48}",
+                                               &pkt_ipv6_tcp_syn, TRUE},
+    {"ipv6.SrcAddr in {::1, 1234:5678:2::1/48}",
+                                               &pkt_ipv6_tcp_syn, FALSE},
     {"tcp.SrcPort == 50046",                   &pkt_ipv6_tcp_syn, TRUE},
     {"tcp.SrcPort == 0x0000C37E",              &pkt_ipv6_tcp_syn, TRUE},
     {"icmpv6",                                 &pkt_ipv6_echo_reply, TRUE},
@@ -272,6 +388,11 @@ static struct test tests[] =
                                                &pkt_ipv6_exthdrs_udp, TRUE},
     {"udp.SrcPort == 4660 and udp.DstPort == 12345",
                                                &pkt_ipv6_exthdrs_udp, FALSE},
+    {"udp.Payload startswith \"Hello\"",       &pkt_ipv6_exthdrs_udp, TRUE},
+    {"udp.Payload contains \"World!\\x01\"",   &pkt_ipv6_exthdrs_udp, TRUE},
+    {"udp.Payload contains \"World!\\x02\"",   &pkt_ipv6_exthdrs_udp, FALSE},
+    {"udp.Payload32[9] == 0x6C642101",         &pkt_ipv6_exthdrs_udp, TRUE},
+    {"udp.Payload32[10] == 0x64210100",        &pkt_ipv6_exthdrs_udp, FALSE},
     {"(outbound and tcp? tcp.DstPort == 0xABAB: false) or "
      "(outbound and udp? udp.DstPort == 0xAAAA: false) or "
      "(inbound and tcp? tcp.SrcPort == 0xABAB: false) or "
@@ -279,6 +400,68 @@ static struct test tests[] =
                                                &pkt_ipv6_exthdrs_udp, TRUE},
 };
 
+/*
+ * Payload tests on loopback TCP data sent through the stack, rather than
+ * injected.  Stack-built packets normally keep the headers and the payload
+ * in separate MDLs, and the payload itself may span several MDLs.  The
+ * payload is STREAM_LEN bytes: "PING\r\n", filler, the pattern
+ * "WinDivert" across offset 4096, filler, and "END\r\n".
+ */
+static struct stream_test stream_tests[] =
+{
+    {"tcp.Payload startswith \"PING\\r\\n\"",    TRUE},
+    {"tcp.Payload startswith \"PONG\"",          FALSE},
+    {"tcp.Payload contains \"WinDivert\"",       TRUE},
+    {"tcp.Payload contains \"WinDiverts\"",      FALSE},
+    {"tcp.Payload contains {\"PONG\", \"END\\r\\n\"}",
+                                               TRUE},
+    {"tcp.Payload32[0] == 0x50494E47",         TRUE},
+    {"tcp.Payload16[4095] == 0x4469",          TRUE},
+    {"tcp.Payload[8191] == 0x0A",              TRUE},
+    {"tcp.Payload[8192] == 0x0A",              FALSE},
+    {"tcp.Payload32[8190] != 0",               FALSE},
+};
+
+static struct flow_test flow_tests[] =
+{
+    {flow_test_insert,                         "flow_insert_lookup"},
+    {flow_test_tcp,                            "flow_tcp_state"},
+    {flow_test_expire,                         "flow_expire"},
+    {flow_test_deleted,                        "flow_deleted_slots"},
+};
+
+/*
+ * Print a test result.
+ */
+static void print_result(HANDLE console, size_t i, BOOL res,
+    const char *name, const char *filter)
+{
+    printf("%.2u ", i);
+    if (res)
+    {
+        SetConsoleTextAttribute(console, FOREGROUND_GREEN);
+        printf("PASSED");
+    }
+    else
+    {
+        SetConsoleTextAttribute(console, FOREGROUND_RED);
+        printf("FAILED");
+    }
+    SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN |
+        FOREGROUND_BLUE);
+    printf(" p=[");
+    SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN);
+    printf("%s", name);
+    SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN |
+        FOREGROUND_BLUE);
+    printf("] f=[");
+    SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN);
+    printf("%s", filter);
+    SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN |
+        FOREGROUND_BLUE);
+    printf("]\n");
+}
+
 /*
  * Main.
  */
@@ -286,8 +469,41 @@ int main(void)
 {
     HANDLE upper_handle, lower_handle;
     HANDLE console;
+    WSADATA wsa_data;
+    static char stream[STREAM_LEN];
     size_t i;
 
+    console = GetStdHandle(STD_OUTPUT_HANDLE);
+
+    // Run the flow table tests (these do not need the driver):
+    size_t num_flow_tests = sizeof(flow_tests) / sizeof(struct flow_test);
+    for (i = 0; i < num_flow_tests; i++)
+    {
+        BOOL res = run_flow_test(&flow_tests[i]);
+        print_result(console, i, res, flow_tests[i].name, "");
+    }
+
+    // Run the stream tests (before the handles below drop all traffic):
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+    {
+        fprintf(stderr, "error: failed to start winsock\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(stream, 'x', sizeof(stream));
+    memcpy(stream, "PING\r\n", 6);
+    memcpy(stream + 4092, "WinDivert", 9);
+    memcpy(stream + STREAM_LEN - 5, "END\r\n", 5);
+    size_t num_stream_tests =
+        sizeof(stream_tests) / sizeof(struct stream_test);
+    for (i = 0; i < num_stream_tests; i++)
+    {
+        BOOL res = run_stream_test(stream_tests[i].filter, stream,
+            sizeof(stream), stream_tests[i].match);
+        print_result(console, i, res, "loopback_tcp_stream",
+            stream_tests[i].filter);
+    }
+    WSACleanup();
+
     // Open handles to:
     // (1) stop normal traffic from interacting with the tests; and
     // (2) stop test packets escaping to the Internet or TCP/IP stack.
@@ -303,8 +519,6 @@ int main(void)
         exit(EXIT_FAILURE);
     }
 
-    console = GetStdHandle(STD_OUTPUT_HANDLE);
-
     // Wait for existing packets to flush:
     Sleep(100);
 
@@ -323,33 +537,17 @@ int main(void)
 
         // Run the test:
         BOOL res = run_test(upper_handle, filter, packet, packet_len, match);
-
-        printf("%.2u ", i);
-        if (res)
-        {
-            SetConsoleTextAttribute(console, FOREGROUND_GREEN);
-            printf("PASSED");
-        }
-        else
-        {
-            SetConsoleTextAttribute(console, FOREGROUND_RED);
-            printf("FAILED");
-        }
-        SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN |
-            FOREGROUND_BLUE);
-        printf(" p=[");
-        SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN);
-        printf("%s", name);
-        SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN |
-            FOREGROUND_BLUE);
-        printf("] f=[");
-        SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN);
-        printf("%s", filter);
-        SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN |
-            FOREGROUND_BLUE);
-        printf("]\n");
+        print_result(console, i, res, name, filter);
     }
 
+    // Run the dispatcher priority test:
+    print_result(console, 0, run_dispatch_test(upper_handle),
+        "dispatch_priority", "outbound and udp.DstPort == 53");
+
+    // Run the rate limit test:
+    print_result(console, 0, run_rate_test(upper_handle), "rate_limit",
+        "outbound and udp.DstPort == 53");
+
     WinDivertClose(upper_handle);
     WinDivertClose(lower_handle);
 
@@ -528,3 +726,740 @@ failed:
     return FALSE;
 }
 
+
+/*
+ * Build a TCP packet from 10.0.0.<src> to 10.0.0.<dst>.
+ */
+static void flow_packet(struct flow_packet *pkt, UINT8 src, UINT16 src_port,
+    UINT8 dst, UINT16 dst_port, UINT flags)
+{
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->ip.Version   = 4;
+    pkt->ip.HdrLength = 5;
+    pkt->ip.Length    = swap16(sizeof(WINDIVERT_IPHDR) +
+        sizeof(WINDIVERT_TCPHDR));
+    pkt->ip.TTL       = 64;
+    pkt->ip.Protocol  = IPPROTO_TCP;
+    pkt->ip.SrcAddr   = 0x0000000A | ((UINT32)src << 24);
+    pkt->ip.DstAddr   = 0x0000000A | ((UINT32)dst << 24);
+    pkt->tcp.SrcPort  = swap16(src_port);
+    pkt->tcp.DstPort  = swap16(dst_port);
+    pkt->tcp.HdrLength = 5;
+    pkt->tcp.Syn      = ((flags & FLOW_SYN) != 0);
+    pkt->tcp.Ack      = ((flags & FLOW_ACK) != 0);
+    pkt->tcp.Fin      = ((flags & FLOW_FIN) != 0);
+    pkt->tcp.Rst      = ((flags & FLOW_RST) != 0);
+    pkt->headers.IpHdr  = &pkt->ip;
+    pkt->headers.TcpHdr = &pkt->tcp;
+}
+
+/*
+ * Run a flow table test on a new table.
+ */
+static BOOL run_flow_test(const struct flow_test *test)
+{
+    PWINDIVERT_FLOW_TABLE table;
+    LARGE_INTEGER freq, now;
+    BOOL res;
+
+    table = WinDivertHelperFlowTableCreate(FLOW_SIZE, 1000);
+    if (table == NULL)
+    {
+        fprintf(stderr, "error: failed to create flow table (err = %d)\n",
+            GetLastError());
+        return FALSE;
+    }
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    res = test->func(table, now.QuadPart, freq.QuadPart);
+    WinDivertHelperFlowTableFree(table);
+    return res;
+}
+
+/*
+ * A flow can be looked up from both directions once inserted.
+ */
+static BOOL flow_test_insert(PWINDIVERT_FLOW_TABLE table, INT64 t0,
+    INT64 timeout)
+{
+    struct flow_packet pkt;
+    WINDIVERT_FLOW flow;
+
+    flow_packet(&pkt, 1, 1234, 2, 80, FLOW_ACK);
+    if (WinDivertHelperFlowTableLookup(table, &pkt.headers, &flow) ||
+        GetLastError() != ERROR_NOT_FOUND)
+    {
+        fprintf(stderr, "error: found flow in empty table\n");
+        return FALSE;
+    }
+    if (!WinDivertHelperFlowTableUpdate(table, &pkt.headers, t0, &flow) ||
+        flow.SrcPort != 1234 || flow.DstPort != 80 || flow.Reply ||
+        flow.Packets[0] != 1 || flow.Packets[1] != 0)
+    {
+        fprintf(stderr, "error: failed to insert flow\n");
+        return FALSE;
+    }
+    if (!WinDivertHelperFlowTableSetData(table, &pkt.headers, 77))
+    {
+        fprintf(stderr, "error: failed to set flow data\n");
+        return FALSE;
+    }
+    flow_packet(&pkt, 2, 80, 1, 1234, FLOW_ACK);
+    if (!WinDivertHelperFlowTableLookup(table, &pkt.headers, &flow) ||
+        !flow.Reply || flow.SrcPort != 1234 || flow.Data != 77)
+    {
+        fprintf(stderr, "error: failed to look up reply flow\n");
+        return FALSE;
+    }
+    flow_packet(&pkt, 1, 1235, 2, 80, FLOW_ACK);
+    if (WinDivertHelperFlowTableLookup(table, &pkt.headers, &flow))
+    {
+        fprintf(stderr, "error: found flow with the wrong port\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * TCP state tracking, including a reopen by the original responder.
+ */
+static BOOL flow_test_tcp(PWINDIVERT_FLOW_TABLE table, INT64 t0,
+    INT64 timeout)
+{
+    static const struct
+    {
+        UINT8 src;
+        UINT flags;
+        UINT8 state;
+        UINT8 initiator;
+    } steps[] =
+    {
+        {1, FLOW_SYN,            WINDIVERT_FLOW_STATE_SYN_SENT,     1},
+        {2, FLOW_SYN | FLOW_ACK, WINDIVERT_FLOW_STATE_SYN_RECEIVED, 1},
+        {1, FLOW_ACK,            WINDIVERT_FLOW_STATE_ESTABLISHED,  1},
+        {1, FLOW_FIN | FLOW_ACK, WINDIVERT_FLOW_STATE_FIN_WAIT,     1},
+        {2, FLOW_FIN | FLOW_ACK, WINDIVERT_FLOW_STATE_TIME_WAIT,    1},
+        {2, FLOW_SYN,            WINDIVERT_FLOW_STATE_SYN_SENT,     2},
+        {1, FLOW_RST,            WINDIVERT_FLOW_STATE_CLOSED,       2},
+        {1, FLOW_SYN,            WINDIVERT_FLOW_STATE_SYN_SENT,     1},
+    };
+    struct flow_packet pkt;
+    WINDIVERT_FLOW flow;
+    UINT i;
+
+    for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
+    {
+        UINT8 dst = (steps[i].src == 1? 2: 1);
+
+        flow_packet(&pkt, steps[i].src, 5000 + steps[i].src, dst,
+            5000 + dst, steps[i].flags);
+        if (!WinDivertHelperFlowTableUpdate(table, &pkt.headers, t0 + i,
+                &flow) ||
+            flow.State != steps[i].state ||
+            flow.SrcPort != 5000 + steps[i].initiator)
+        {
+            fprintf(stderr, "error: TCP step %u: state (%u), initiator "
+                "port (%u)\n", i, flow.State, flow.SrcPort);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Idle flows expire; active flows do not.
+ */
+static BOOL flow_test_expire(PWINDIVERT_FLOW_TABLE table, INT64 t0,
+    INT64 timeout)
+{
+    struct flow_packet pkt1, pkt2;
+    WINDIVERT_FLOW flow;
+    UINT count;
+
+    flow_packet(&pkt1, 1, 1000, 2, 53, FLOW_ACK);
+    flow_packet(&pkt2, 1, 1001, 2, 53, FLOW_ACK);
+    if (!WinDivertHelperFlowTableUpdate(table, &pkt1.headers, t0, NULL) ||
+        !WinDivertHelperFlowTableUpdate(table, &pkt2.headers, t0, NULL))
+    {
+        fprintf(stderr, "error: failed to insert flows\n");
+        return FALSE;
+    }
+    if ((count = WinDivertHelperFlowTableExpire(table, t0 + timeout / 2))
+            != 0)
+    {
+        fprintf(stderr, "error: expired (%u) active flows\n", count);
+        return FALSE;
+    }
+    if (!WinDivertHelperFlowTableUpdate(table, &pkt2.headers, t0 + timeout,
+            NULL))
+    {
+        fprintf(stderr, "error: failed to update flow\n");
+        return FALSE;
+    }
+    if ((count = WinDivertHelperFlowTableExpire(table,
+            t0 + 3 * timeout / 2)) != 1 ||
+        WinDivertHelperFlowTableLookup(table, &pkt1.headers, &flow) ||
+        !WinDivertHelperFlowTableLookup(table, &pkt2.headers, &flow))
+    {
+        fprintf(stderr, "error: expected 1 idle flow, expired (%u)\n",
+            count);
+        return FALSE;
+    }
+    if ((count = WinDivertHelperFlowTableExpire(table, t0 + 3 * timeout))
+            != 1 ||
+        WinDivertHelperFlowTableLookup(table, &pkt2.headers, &flow))
+    {
+        fprintf(stderr, "error: expected 1 idle flow, expired (%u)\n",
+            count);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Repeatedly fill and expire the table, so that removed flows leave
+ * deleted slots behind.  The table must stay usable, and misses must still
+ * fail.
+ */
+static BOOL flow_test_deleted(PWINDIVERT_FLOW_TABLE table, INT64 t0,
+    INT64 timeout)
+{
+    struct flow_packet pkt;
+    WINDIVERT_FLOW flow;
+    INT64 t;
+    UINT i, j, count;
+
+    for (i = 0; i < FLOW_ROUNDS; i++)
+    {
+        t = t0 + 4 * (INT64)i * timeout;
+        for (j = 0; j < FLOW_SIZE; j++)
+        {
+            flow_packet(&pkt, 1, (UINT16)(i * FLOW_SIZE + j), 2, 443,
+                FLOW_ACK);
+            if (!WinDivertHelperFlowTableUpdate(table, &pkt.headers, t,
+                    NULL))
+            {
+                fprintf(stderr, "error: round %u: failed to insert flow "
+                    "%u (err = %d)\n", i, j, GetLastError());
+                return FALSE;
+            }
+        }
+        flow_packet(&pkt, 1, 0xFFFF, 2, 443, FLOW_ACK);
+        if (WinDivertHelperFlowTableUpdate(table, &pkt.headers, t, NULL))
+        {
+            fprintf(stderr, "error: round %u: inserted into full table\n",
+                i);
+            return FALSE;
+        }
+
+        // Expire every other flow first, so deleted slots are interleaved
+        // with live ones:
+        for (j = 1; j < FLOW_SIZE; j += 2)
+        {
+            flow_packet(&pkt, 1, (UINT16)(i * FLOW_SIZE + j), 2, 443,
+                FLOW_ACK);
+            WinDivertHelperFlowTableUpdate(table, &pkt.headers,
+                t + timeout, NULL);
+        }
+        count = WinDivertHelperFlowTableExpire(table, t + 3 * timeout / 2);
+        if (count != FLOW_SIZE / 2)
+        {
+            fprintf(stderr, "error: round %u: expired (%u) flows\n", i,
+                count);
+            return FALSE;
+        }
+        for (j = 0; j < FLOW_SIZE; j++)
+        {
+            flow_packet(&pkt, 1, (UINT16)(i * FLOW_SIZE + j), 2, 443,
+                FLOW_ACK);
+            if (WinDivertHelperFlowTableLookup(table, &pkt.headers, &flow)
+                    != ((j & 1) != 0))
+            {
+                fprintf(stderr, "error: round %u: wrong lookup for flow "
+                    "%u\n", i, j);
+                return FALSE;
+            }
+        }
+        count = WinDivertHelperFlowTableExpire(table, t + 3 * timeout);
+        if (count != FLOW_SIZE / 2)
+        {
+            fprintf(stderr, "error: round %u: expired (%u) flows\n", i,
+                count);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Run a payload test on data sent over a loopback TCP connection.
+ */
+static BOOL run_stream_test(const char *filter, const char *data,
+    int data_len, BOOL match)
+{
+    static char buf[MAX_STREAM_PACKET];
+    char filter0[1024];
+    UINT buf_len;
+    DWORD iolen;
+    WINDIVERT_ADDRESS addr;
+    OVERLAPPED overlapped;
+    struct sockaddr_in sin;
+    int sin_len = sizeof(sin);
+    SOCKET listener = INVALID_SOCKET, client = INVALID_SOCKET,
+        server = INVALID_SOCKET;
+    HANDLE handle = INVALID_HANDLE_VALUE, event = NULL;
+    BOOL result = FALSE;
+
+    // (1) Connect a client and server over loopback:
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET || client == INVALID_SOCKET ||
+        bind(listener, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+        listen(listener, 1) != 0 ||
+        getsockname(listener, (struct sockaddr *)&sin, &sin_len) != 0 ||
+        connect(client, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+        (server = accept(listener, NULL, NULL)) == INVALID_SOCKET)
+    {
+        fprintf(stderr, "error: failed to connect loopback sockets "
+            "(err = %d)\n", WSAGetLastError());
+        goto stream_exit;
+    }
+
+    // (2) Sniff the connection's data with the given filter:
+    _snprintf(filter0, sizeof(filter0) - 1, "tcp.DstPort == %u and (%s)",
+        ntohs(sin.sin_port), filter);
+    filter0[sizeof(filter0) - 1] = '\0';
+    handle = WinDivertOpen(filter0, WINDIVERT_LAYER_NETWORK, 0,
+        WINDIVERT_FLAG_SNIFF);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "error: failed to open WinDivert handle for filter "
+            "\"%s\" (err = %d)\n", filter0, GetLastError());
+        goto stream_exit;
+    }
+    memset(&overlapped, 0, sizeof(overlapped));
+    event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (event == NULL)
+    {
+        fprintf(stderr, "error: failed to create event (err = %d)\n",
+            GetLastError());
+        goto stream_exit;
+    }
+    overlapped.hEvent = event;
+    if (WinDivertRecvEx(handle, buf, sizeof(buf), 0, &addr, &buf_len,
+            &overlapped))
+    {
+        fprintf(stderr, "error: captured a packet before sending\n");
+        goto stream_exit;
+    }
+    if (GetLastError() != ERROR_IO_PENDING)
+    {
+        fprintf(stderr, "error: failed to read packet from WinDivert "
+            "handle (err = %d)\n", GetLastError());
+        goto stream_exit;
+    }
+
+    // (3) Send the data in one segment, and wait up to 250ms:
+    if (send(client, data, data_len, 0) != data_len)
+    {
+        fprintf(stderr, "error: failed to send data (err = %d)\n",
+            WSAGetLastError());
+        goto stream_exit;
+    }
+    switch (WaitForSingleObject(event, 250))
+    {
+        case WAIT_OBJECT_0:
+            if (!GetOverlappedResult(handle, &overlapped, &iolen, TRUE))
+            {
+                fprintf(stderr, "error: failed to get the overlapped "
+                    "result from WinDivert handle (err = %d)\n",
+                    GetLastError());
+                goto stream_exit;
+            }
+            result = match;
+            break;
+        case WAIT_TIMEOUT:
+            result = !match;
+            break;
+        default:
+            fprintf(stderr, "error: failed to wait for packet (err = %d)\n",
+                GetLastError());
+            goto stream_exit;
+    }
+    if (!result)
+    {
+        fprintf(stderr, "error: filter \"%s\" %s the stream\n", filter,
+            (match? "did not match": "matched"));
+    }
+
+stream_exit:
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+        WinDivertClose(handle);
+    }
+    if (event != NULL)
+    {
+        CloseHandle(event);
+    }
+    if (server != INVALID_SOCKET)
+    {
+        closesocket(server);
+    }
+    if (client != INVALID_SOCKET)
+    {
+        closesocket(client);
+    }
+    if (listener != INVALID_SOCKET)
+    {
+        closesocket(listener);
+    }
+    return result;
+}
+
+/*
+ * Start reading a packet from a dispatcher test handle.
+ */
+static BOOL dispatch_recv_start(struct dispatch_handle *h)
+{
+    memset(&h->overlapped, 0, sizeof(h->overlapped));
+    h->overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (h->overlapped.hEvent == NULL)
+    {
+        return FALSE;
+    }
+    if (WinDivertRecvEx(h->handle, h->buf, sizeof(h->buf), 0, &h->addr,
+            &h->buf_len, &h->overlapped))
+    {
+        SetEvent(h->overlapped.hEvent);
+    }
+    else if (GetLastError() != ERROR_IO_PENDING)
+    {
+        CloseHandle(h->overlapped.hEvent);
+        h->overlapped.hEvent = NULL;
+        return FALSE;
+    }
+    h->pending = TRUE;
+    return TRUE;
+}
+
+/*
+ * Wait for the packet read by a dispatcher test handle.
+ */
+static BOOL dispatch_recv_wait(struct dispatch_handle *h, DWORD timeout)
+{
+    DWORD iolen;
+
+    if (WaitForSingleObject(h->overlapped.hEvent, timeout) != WAIT_OBJECT_0 ||
+        !GetOverlappedResult(h->handle, &h->overlapped, &iolen, TRUE))
+    {
+        return FALSE;
+    }
+    h->buf_len = (UINT)iolen;
+    CloseHandle(h->overlapped.hEvent);
+    h->overlapped.hEvent = NULL;
+    h->pending = FALSE;
+    return TRUE;
+}
+
+/*
+ * Cancel any read of a dispatcher test handle.
+ */
+static void dispatch_recv_stop(struct dispatch_handle *h)
+{
+    DWORD iolen;
+
+    if (h->pending)
+    {
+        CancelIo(h->handle);
+        GetOverlappedResult(h->handle, &h->overlapped, &iolen, TRUE);
+        h->pending = FALSE;
+    }
+    if (h->overlapped.hEvent != NULL)
+    {
+        CloseHandle(h->overlapped.hEvent);
+        h->overlapped.hEvent = NULL;
+    }
+}
+
+/*
+ * Check that a packet reaches exactly the handle `expect' (index into hs),
+ * or none of the handles if expect < 0.
+ */
+static BOOL dispatch_expect(struct dispatch_handle *hs, int count,
+    int expect, const char *step)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (dispatch_recv_wait(&hs[i], (i == expect? 250: 50)) !=
+                (i == expect))
+        {
+            fprintf(stderr, "error: %s: handle #%d %s the packet\n", step,
+                i, (i == expect? "did not receive": "received"));
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Several handles at different priorities share one dispatcher.  A packet
+ * goes to the highest priority matching handle, and a packet (re)injected by
+ * a handle skips every handle at or above the injecting handle's priority.
+ */
+static BOOL run_dispatch_test(HANDLE inject_handle)
+{
+    static const INT16 priorities[] = {10, 20, 30};
+    static struct dispatch_handle hs[3];
+    const char *filter = "outbound and udp.DstPort == 53";
+    char packet[sizeof(dns_request)];
+    WINDIVERT_ADDRESS addr;
+    BOOL result = FALSE;
+    int i;
+
+    memset(hs, 0, sizeof(hs));
+    for (i = 0; i < 3; i++)
+    {
+        hs[i].handle = WinDivertOpen(filter, WINDIVERT_LAYER_NETWORK,
+            priorities[i], 0);
+        if (hs[i].handle == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "error: failed to open WinDivert handle "
+                "(err = %d)\n", GetLastError());
+            goto dispatch_exit;
+        }
+    }
+    memcpy(packet, dns_request, sizeof(packet));
+    WinDivertHelperCalcChecksums(packet, sizeof(packet), 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+
+    // (1) An injected packet goes to the highest priority handle only, and
+    //     each reinjection passes it to the next one:
+    for (i = 0; i < 3; i++)
+    {
+        if (!dispatch_recv_start(&hs[i]))
+        {
+            goto dispatch_read_failed;
+        }
+    }
+    if (!WinDivertSend(inject_handle, packet, sizeof(packet), &addr, NULL))
+    {
+        goto dispatch_send_failed;
+    }
+    if (!dispatch_expect(hs, 3, 0, "inject"))
+    {
+        goto dispatch_exit;
+    }
+    for (i = 0; i < 2; i++)
+    {
+        if (!dispatch_recv_start(&hs[i]))
+        {
+            goto dispatch_read_failed;
+        }
+        if (!WinDivertSend(hs[i].handle, hs[i].buf, hs[i].buf_len,
+                &hs[i].addr, NULL))
+        {
+            goto dispatch_send_failed;
+        }
+        if (!dispatch_expect(hs, 3, i + 1, "reinject"))
+        {
+            goto dispatch_exit;
+        }
+    }
+
+    // (2) A packet sent by the middle handle skips the handles at or above
+    //     its priority:
+    for (i = 0; i < 3; i++)
+    {
+        if (!hs[i].pending && !dispatch_recv_start(&hs[i]))
+        {
+            goto dispatch_read_failed;
+        }
+    }
+    if (!WinDivertSend(hs[1].handle, packet, sizeof(packet), &addr, NULL))
+    {
+        goto dispatch_send_failed;
+    }
+    result = dispatch_expect(hs, 3, 2, "send");
+    goto dispatch_exit;
+
+dispatch_read_failed:
+    fprintf(stderr, "error: failed to read packet from WinDivert handle "
+        "(err = %d)\n", GetLastError());
+    goto dispatch_exit;
+
+dispatch_send_failed:
+    fprintf(stderr, "error: failed to inject test packet (err = %d)\n",
+        GetLastError());
+
+dispatch_exit:
+    for (i = 0; i < 3; i++)
+    {
+        if (hs[i].handle != NULL && hs[i].handle != INVALID_HANDLE_VALUE)
+        {
+            dispatch_recv_stop(&hs[i]);
+            WinDivertClose(hs[i].handle);
+        }
+    }
+    return result;
+}
+
+/*
+ * Inject RATE_ROUNDS packets of each of RATE_FLOWS flows, which differ in the
+ * UDP source port, and count the packets of each flow that reach h.
+ */
+static BOOL rate_send(HANDLE inject_handle, struct dispatch_handle *h,
+    UINT *counts)
+{
+    char packet[sizeof(dns_request)];
+    PWINDIVERT_UDPHDR udp_header = NULL;
+    WINDIVERT_ADDRESS addr;
+    UINT i, j, port;
+
+    memset(counts, 0, RATE_FLOWS * sizeof(UINT));
+    memcpy(packet, dns_request, sizeof(packet));
+    memset(&addr, 0, sizeof(addr));
+    addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+    WinDivertHelperParsePacket(packet, sizeof(packet), NULL, NULL, NULL,
+        NULL, NULL, &udp_header, NULL, NULL);
+    for (i = 0; i < RATE_ROUNDS; i++)
+    {
+        for (j = 0; j < RATE_FLOWS; j++)
+        {
+            udp_header->SrcPort = swap16(RATE_PORT + j);
+            WinDivertHelperCalcChecksums(packet, sizeof(packet), 0);
+            if (!WinDivertSend(inject_handle, packet, sizeof(packet), &addr,
+                    NULL))
+            {
+                fprintf(stderr, "error: failed to inject test packet "
+                    "(err = %d)\n", GetLastError());
+                return FALSE;
+            }
+        }
+    }
+
+    // Read until no more packets arrive:
+    while (TRUE)
+    {
+        if (!dispatch_recv_start(h))
+        {
+            fprintf(stderr, "error: failed to read packet from WinDivert "
+                "handle (err = %d)\n", GetLastError());
+            return FALSE;
+        }
+        if (!dispatch_recv_wait(h, 100))
+        {
+            dispatch_recv_stop(h);
+            return TRUE;
+        }
+        udp_header = NULL;
+        WinDivertHelperParsePacket(h->buf, h->buf_len, NULL, NULL, NULL,
+            NULL, NULL, &udp_header, NULL, NULL);
+        port = (udp_header == NULL? 0: swap16(udp_header->SrcPort));
+        if (port < RATE_PORT || port >= RATE_PORT + RATE_FLOWS)
+        {
+            fprintf(stderr, "error: read an unexpected packet\n");
+            return FALSE;
+        }
+        counts[port - RATE_PORT]++;
+    }
+}
+
+/*
+ * A per-flow rate limit applies to each flow on its own, and a global rate
+ * limit to all flows together.  The test flows fall into different rate
+ * limit buckets.
+ */
+static BOOL run_rate_test(HANDLE inject_handle)
+{
+    const char *filter = "outbound and udp.DstPort == 53";
+    struct dispatch_handle h;
+    WINDIVERT_STATS stats;
+    UINT counts[RATE_FLOWS], total, i;
+    BOOL result = FALSE;
+
+    memset(&h, 0, sizeof(h));
+    h.handle = WinDivertOpen(filter, WINDIVERT_LAYER_NETWORK, 0,
+        WINDIVERT_FLAG_SNIFF);
+    if (h.handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "error: failed to open WinDivert handle "
+            "(err = %d)\n", GetLastError());
+        return FALSE;
+    }
+    if (!WinDivertSetParam(h.handle, WINDIVERT_PARAM_RATE_LIMIT,
+            RATE_LIMIT) ||
+        !WinDivertSetParam(h.handle, WINDIVERT_PARAM_RATE_MODE,
+            WINDIVERT_RATE_MODE_PER_FLOW))
+    {
+        goto rate_param_failed;
+    }
+
+    // (1) Per flow, RATE_LIMIT packets of each flow get through:
+    if (!rate_send(inject_handle, &h, counts))
+    {
+        goto rate_exit;
+    }
+    for (i = 0; i < RATE_FLOWS; i++)
+    {
+        if (counts[i] != RATE_LIMIT)
+        {
+            fprintf(stderr, "error: per-flow rate limit passed %u packets "
+                "of flow #%u, expected %u\n", counts[i], i, RATE_LIMIT);
+            goto rate_exit;
+        }
+    }
+
+    // (2) Globally, RATE_LIMIT packets get through in total:
+    if (!WinDivertSetParam(h.handle, WINDIVERT_PARAM_RATE_MODE,
+            WINDIVERT_RATE_MODE_GLOBAL))
+    {
+        goto rate_param_failed;
+    }
+    if (!rate_send(inject_handle, &h, counts))
+    {
+        goto rate_exit;
+    }
+    for (i = 0, total = 0; i < RATE_FLOWS; i++)
+    {
+        total += counts[i];
+    }
+    if (total != RATE_LIMIT)
+    {
+        fprintf(stderr, "error: global rate limit passed %u packets, "
+            "expected %u\n", total, RATE_LIMIT);
+        goto rate_exit;
+    }
+
+    // (3) Every other packet is counted as rate limited:
+    if (!WinDivertGetStats(h.handle, &stats))
+    {
+        fprintf(stderr, "error: failed to get WinDivert handle statistics "
+            "(err = %d)\n", GetLastError());
+        goto rate_exit;
+    }
+    if (stats.RateLimited !=
+            2 * RATE_FLOWS * RATE_ROUNDS - (RATE_FLOWS + 1) * RATE_LIMIT)
+    {
+        fprintf(stderr, "error: %u packets counted as rate limited, "
+            "expected %u\n", (UINT)stats.RateLimited,
+            2 * RATE_FLOWS * RATE_ROUNDS - (RATE_FLOWS + 1) * RATE_LIMIT);
+        goto rate_exit;
+    }
+    result = TRUE;
+    goto rate_exit;
+
+rate_param_failed:
+    fprintf(stderr, "error: failed to set WinDivert parameter (err = %d)\n",
+        GetLastError());
+
+rate_exit:
+    dispatch_recv_stop(&h);
+    WinDivertClose(h.handle);
+    return result;
+}